@@ -0,0 +1,845 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Benchmark suite for Subspace.  This starts its own Subspace server (two
+// for bridged benchmarks) and runs a sweep of channel configurations,
+// measuring the publish-to-read latency of every message and the message
+// rate.  The results are written as JSON, one benchmark per line.
+//
+// To compare against an earlier run, pass the earlier results with
+// --baseline.  The exit status is 1 if any benchmark's p99 latency or
+// message rate is worse than the baseline by more than --threshold.
+// Use --input to compare two result files without running anything.
+//
+// Example:
+//   bazel run -c opt //benchmarks -- --output=/tmp/new.json
+//       --baseline=/tmp/old.json
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "client/client.h"
+#include "coroutine.h"
+#include "server/server.h"
+#include "toolbelt/clock.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <inttypes.h>
+#include <memory>
+#include <poll.h>
+#include <sched.h>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+ABSL_FLAG(std::string, slot_sizes, "64,1024,16384,262144",
+          "Comma separated slot sizes to benchmark");
+ABSL_FLAG(std::string, num_slots, "16,256",
+          "Comma separated numbers of slots to benchmark");
+ABSL_FLAG(std::string, num_subscribers, "1,4",
+          "Comma separated numbers of subscribers to benchmark");
+ABSL_FLAG(std::string, reliability, "unreliable,reliable",
+          "Comma separated list of unreliable and/or reliable");
+ABSL_FLAG(std::string, modes, "same_process,cross_process",
+          "Comma separated list of same_process, cross_process and bridged");
+ABSL_FLAG(int, num_msgs, 10000, "Number of messages to measure");
+ABSL_FLAG(int, rate, 0,
+          "Messages per second to publish; 0 means as fast as possible");
+ABSL_FLAG(bool, pin_cpus, true,
+          "Pin the publisher and subscribers to separate CPUs");
+ABSL_FLAG(std::string, bridge_interface, "",
+          "Network interface for the discovery of bridged servers");
+ABSL_FLAG(int, bridge_port, 6520,
+          "First of two UDP discovery ports for bridged servers");
+ABSL_FLAG(std::string, label, "", "Label recorded in the results (a commit?)");
+ABSL_FLAG(std::string, output, "", "File for JSON results (default stdout)");
+ABSL_FLAG(std::string, baseline, "", "JSON results to compare against");
+ABSL_FLAG(std::string, input, "",
+          "JSON results to compare with the baseline instead of running");
+ABSL_FLAG(double, threshold, 0.1,
+          "Fractional change from the baseline counted as a regression");
+
+namespace {
+
+enum class Mode { kSameProcess, kCrossProcess, kBridged };
+
+struct Config {
+  Mode mode;
+  int slot_size;
+  int num_slots;
+  bool reliable;
+  int num_subscribers;
+
+  std::string Name() const {
+    const char *mode_name = mode == Mode::kSameProcess    ? "same_process"
+                            : mode == Mode::kCrossProcess ? "cross_process"
+                                                          : "bridged";
+    return absl::StrFormat("%s/%s/slot_size:%d/num_slots:%d/subs:%d",
+                           mode_name, reliable ? "reliable" : "unreliable",
+                           slot_size, num_slots, num_subscribers);
+  }
+};
+
+// What a subscriber measured.
+struct SubscriberResult {
+  std::vector<int64_t> latencies; // Nanoseconds, one per message read.
+  uint64_t last_read_time = 0;
+};
+
+struct Result {
+  std::string name;
+  int64_t num_msgs = 0;
+  int64_t num_received = 0; // Total over all subscribers.
+  double msgs_per_sec = 0;
+  int64_t p50_ns = 0;
+  int64_t p99_ns = 0;
+  int64_t p999_ns = 0;
+  int64_t max_ns = 0;
+};
+
+// Every message starts with this.  Negative sequence numbers are warmup
+// messages that are not measured.
+struct Header {
+  int64_t seq;
+};
+
+constexpr int kWarmupPeriodMs = 1;
+constexpr int kReadyTimeoutSecs = 10;
+constexpr int kReadTimeoutMs = 5000;
+
+absl::StatusOr<std::vector<int>> ParseInts(const std::string &s) {
+  std::vector<int> r;
+  for (absl::string_view v : absl::StrSplit(s, ',', absl::SkipEmpty())) {
+    int i;
+    if (!absl::SimpleAtoi(v, &i) || i <= 0) {
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Invalid number '%s' in '%s'", v, s));
+    }
+    r.push_back(i);
+  }
+  return r;
+}
+
+// The CPUs we are allowed to run on, in order.
+std::vector<int> AvailableCpus() {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &set)) {
+        cpus.push_back(i);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
+
+// Pin the calling thread to the index'th available CPU.  MacOS doesn't
+// support this so it does nothing.
+void PinToCpu(const std::vector<int> &cpus, int index) {
+#if defined(__linux__)
+  if (!absl::GetFlag(FLAGS_pin_cpus) || cpus.empty()) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpus[index % cpus.size()], &set);
+  (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+void Unpin(const std::vector<int> &cpus) {
+#if defined(__linux__)
+  if (cpus.empty()) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// Runs each Subspace server in its own child process so that the
+// benchmark process has no server threads when it forks subscriber
+// processes.
+class ServerProcess {
+public:
+  ~ServerProcess() { Stop(); }
+
+  // Start one server, or two connected by a bridge.  Returns the socket
+  // names of the servers.
+  absl::StatusOr<std::vector<std::string>> Start(bool bridged) {
+    std::vector<std::string> sockets = {"/tmp/subspace_bench_a"};
+    if (bridged) {
+      sockets.push_back("/tmp/subspace_bench_b");
+    }
+    int stop_pipe[2];
+    if (pipe(stop_pipe) == -1) {
+      return absl::InternalError(
+          absl::StrFormat("Failed to create pipe: %s", strerror(errno)));
+    }
+    stop_fd_ = stop_pipe[1];
+    std::string interface = absl::GetFlag(FLAGS_bridge_interface);
+    int port = absl::GetFlag(FLAGS_bridge_port);
+    for (size_t i = 0; i < sockets.size(); i++) {
+      int ready_pipe[2];
+      if (pipe(ready_pipe) == -1) {
+        return absl::InternalError(
+            absl::StrFormat("Failed to create pipe: %s", strerror(errno)));
+      }
+      pid_t pid = fork();
+      if (pid == -1) {
+        return absl::InternalError(
+            absl::StrFormat("Failed to fork server: %s", strerror(errno)));
+      }
+      if (pid == 0) {
+        close(ready_pipe[0]);
+        close(stop_pipe[1]);
+        // The bridged servers discover each other on a pair of ports.
+        int disc_port = bridged ? port + i : 0;
+        int peer_port = bridged ? port + 1 - i : 0;
+        RunServer(sockets[i], interface, disc_port, peer_port, !bridged,
+                  ready_pipe[1], stop_pipe[0]);
+        _exit(0);
+      }
+      pids_.push_back(pid);
+      close(ready_pipe[1]);
+      // The server writes to the ready pipe when it's running.
+      int64_t val;
+      bool ok = ::read(ready_pipe[0], &val, sizeof(val)) == sizeof(val);
+      close(ready_pipe[0]);
+      if (!ok) {
+        return absl::InternalError("Subspace server failed to start");
+      }
+    }
+    close(stop_pipe[0]);
+    return sockets;
+  }
+
+  void Stop() {
+    if (pids_.empty()) {
+      return;
+    }
+    close(stop_fd_);
+    for (pid_t pid : pids_) {
+      int status;
+      waitpid(pid, &status, 0);
+    }
+    pids_.clear();
+  }
+
+private:
+  static void RunServer(const std::string &socket,
+                        const std::string &interface, int disc_port,
+                        int peer_port, bool local, int ready_fd,
+                        int stop_fd) {
+    co::CoroutineScheduler scheduler;
+    subspace::Server server(scheduler, socket, interface, disc_port,
+                            peer_port, local, ready_fd);
+    std::thread thread([&server]() {
+      if (absl::Status s = server.Run(); !s.ok()) {
+        fprintf(stderr, "Error running Subspace server: %s\n",
+                s.ToString().c_str());
+        _exit(1);
+      }
+    });
+    // Wait for the benchmark to close the stop pipe.
+    char c;
+    (void)::read(stop_fd, &c, 1);
+    server.Stop();
+    thread.join();
+  }
+
+  std::vector<pid_t> pids_;
+  int stop_fd_ = -1;
+};
+
+// Read messages until the last one of the run has been seen.  The
+// subscriber writes a byte to ready_fd when it sees the first warmup
+// message.
+absl::StatusOr<SubscriberResult> RunSubscriber(const Config &config,
+                                               const std::string &socket,
+                                               int num_msgs, int ready_fd) {
+  subspace::Client client;
+  if (absl::Status s = client.Init(socket); !s.ok()) {
+    return s;
+  }
+  absl::StatusOr<subspace::Subscriber> sub = client.CreateSubscriber(
+      "bench", subspace::SubscriberOptions().SetReliable(config.reliable));
+  if (!sub.ok()) {
+    return sub.status();
+  }
+  SubscriberResult result;
+  result.latencies.reserve(num_msgs);
+  bool ready = false;
+  uint64_t ready_end = toolbelt::Now() + kReadyTimeoutSecs * 1000000000ULL;
+  for (;;) {
+    // Until the first message arrives the subscriber might be a
+    // placeholder waiting for a publisher (or a bridge), so poll for it.
+    struct pollfd fd = sub->GetPollFd();
+    int e = ::poll(&fd, 1, ready ? kReadTimeoutMs : kWarmupPeriodMs);
+    if (!ready && toolbelt::Now() > ready_end) {
+      return absl::DeadlineExceededError("No messages received");
+    }
+    if (e == 0 && ready) {
+      // The last message didn't come.  An unreliable subscriber might
+      // not see it if the channel is reloaded.
+      return result;
+    }
+    if (e == -1 && errno != EINTR) {
+      return absl::InternalError(
+          absl::StrFormat("Failed to poll subscriber: %s", strerror(errno)));
+    }
+    for (;;) {
+      absl::StatusOr<subspace::Message> msg = sub->ReadMessage();
+      if (!msg.ok()) {
+        return msg.status();
+      }
+      if (msg->length == 0) {
+        break;
+      }
+      uint64_t now = toolbelt::Now();
+      const Header *header = reinterpret_cast<const Header *>(msg->buffer);
+      if (header->seq < 0) {
+        if (!ready) {
+          char c = 1;
+          (void)::write(ready_fd, &c, 1);
+          ready = true;
+        }
+        continue;
+      }
+      result.latencies.push_back(now - msg->timestamp);
+      result.last_read_time = now;
+      if (header->seq == num_msgs - 1) {
+        return result;
+      }
+    }
+  }
+}
+
+// Publish warmup messages until all the subscribers are ready and then
+// publish the measured messages.  Returns the time the first measured
+// message was published.
+absl::StatusOr<uint64_t> RunPublisher(const Config &config,
+                                      const std::string &socket,
+                                      int num_msgs, int ready_fd) {
+  subspace::Client client;
+  if (absl::Status s = client.Init(socket); !s.ok()) {
+    return s;
+  }
+  absl::StatusOr<subspace::Publisher> pub = client.CreatePublisher(
+      "bench", config.slot_size, config.num_slots,
+      subspace::PublisherOptions()
+          .SetReliable(config.reliable)
+          .SetLocal(config.mode != Mode::kBridged));
+  if (!pub.ok()) {
+    return pub.status();
+  }
+
+  // Publish one message.  Returns false if a reliable publisher has no
+  // slot and block is false.
+  auto publish = [&pub, &config](int64_t seq,
+                                 bool block) -> absl::StatusOr<bool> {
+    for (;;) {
+      absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+      if (!buffer.ok()) {
+        return buffer.status();
+      }
+      if (*buffer == nullptr) {
+        if (!block) {
+          return false;
+        }
+        if (absl::Status s = pub->Wait(); !s.ok()) {
+          return s;
+        }
+        continue;
+      }
+      reinterpret_cast<Header *>(*buffer)->seq = seq;
+      absl::StatusOr<const subspace::Message> msg =
+          pub->PublishMessage(config.slot_size);
+      if (!msg.ok()) {
+        return msg.status();
+      }
+      return true;
+    }
+  };
+
+  int num_ready = 0;
+  uint64_t ready_end = toolbelt::Now() + kReadyTimeoutSecs * 1000000000ULL;
+  while (num_ready < config.num_subscribers) {
+    if (toolbelt::Now() > ready_end) {
+      return absl::DeadlineExceededError(
+          absl::StrFormat("Only %d of %d subscribers became ready", num_ready,
+                          config.num_subscribers));
+    }
+    if (absl::StatusOr<bool> ok = publish(-1, /*block=*/false); !ok.ok()) {
+      return ok.status();
+    }
+    struct pollfd fd = {ready_fd, POLLIN, 0};
+    if (::poll(&fd, 1, kWarmupPeriodMs) == 1) {
+      char buf[64];
+      ssize_t n = ::read(ready_fd, buf, sizeof(buf));
+      if (n > 0) {
+        num_ready += n;
+      }
+    }
+  }
+
+  uint64_t period = absl::GetFlag(FLAGS_rate) > 0
+                        ? 1000000000ULL / absl::GetFlag(FLAGS_rate)
+                        : 0;
+  uint64_t start = toolbelt::Now();
+  for (int i = 0; i < num_msgs; i++) {
+    if (period > 0) {
+      uint64_t due = start + i * period;
+      while (toolbelt::Now() < due) {
+      }
+    }
+    if (absl::StatusOr<bool> ok = publish(i, /*block=*/true); !ok.ok()) {
+      return ok.status();
+    }
+  }
+  return start;
+}
+
+// Subscriber results are passed back from a child process through a pipe.
+bool WriteAll(int fd, const void *buf, size_t len) {
+  const char *p = static_cast<const char *>(buf);
+  while (len > 0) {
+    ssize_t n = ::write(fd, p, len);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void *buf, size_t len) {
+  char *p = static_cast<char *>(buf);
+  while (len > 0) {
+    ssize_t n = ::read(fd, p, len);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+absl::StatusOr<Result> RunBenchmark(const Config &config,
+                                    const std::vector<std::string> &sockets,
+                                    const std::vector<int> &cpus) {
+  int num_msgs = absl::GetFlag(FLAGS_num_msgs);
+  // Bridged subscribers are on the second server.
+  const std::string &pub_socket = sockets[0];
+  const std::string &sub_socket = sockets.back();
+
+  int ready_pipe[2];
+  if (pipe(ready_pipe) == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to create pipe: %s", strerror(errno)));
+  }
+  std::vector<SubscriberResult> results(config.num_subscribers);
+  std::vector<absl::Status> statuses(config.num_subscribers);
+  std::vector<std::thread> threads;
+  std::vector<pid_t> pids;
+  std::vector<int> result_fds;
+
+  for (int i = 0; i < config.num_subscribers; i++) {
+    if (config.mode == Mode::kSameProcess) {
+      threads.emplace_back([&, i]() {
+        PinToCpu(cpus, i + 1);
+        absl::StatusOr<SubscriberResult> r =
+            RunSubscriber(config, sub_socket, num_msgs, ready_pipe[1]);
+        if (r.ok()) {
+          results[i] = std::move(*r);
+        } else {
+          statuses[i] = r.status();
+        }
+      });
+      continue;
+    }
+    int result_pipe[2];
+    if (pipe(result_pipe) == -1) {
+      return absl::InternalError(
+          absl::StrFormat("Failed to create pipe: %s", strerror(errno)));
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+      return absl::InternalError(
+          absl::StrFormat("Failed to fork subscriber: %s", strerror(errno)));
+    }
+    if (pid == 0) {
+      close(result_pipe[0]);
+      PinToCpu(cpus, i + 1);
+      absl::StatusOr<SubscriberResult> r =
+          RunSubscriber(config, sub_socket, num_msgs, ready_pipe[1]);
+      if (!r.ok()) {
+        fprintf(stderr, "Subscriber failed: %s\n",
+                r.status().ToString().c_str());
+        _exit(1);
+      }
+      int64_t n = r->latencies.size();
+      bool ok = WriteAll(result_pipe[1], &n, sizeof(n)) &&
+                WriteAll(result_pipe[1], &r->last_read_time,
+                         sizeof(r->last_read_time)) &&
+                WriteAll(result_pipe[1], r->latencies.data(),
+                         n * sizeof(int64_t));
+      _exit(ok ? 0 : 1);
+    }
+    close(result_pipe[1]);
+    pids.push_back(pid);
+    result_fds.push_back(result_pipe[0]);
+  }
+
+  PinToCpu(cpus, 0);
+  absl::StatusOr<uint64_t> start =
+      RunPublisher(config, pub_socket, num_msgs, ready_pipe[0]);
+  Unpin(cpus);
+  close(ready_pipe[0]);
+  close(ready_pipe[1]);
+
+  for (auto &t : threads) {
+    t.join();
+  }
+  bool child_failed = false;
+  for (size_t i = 0; i < pids.size(); i++) {
+    int64_t n = 0;
+    SubscriberResult &r = results[i];
+    if (ReadAll(result_fds[i], &n, sizeof(n)) &&
+        ReadAll(result_fds[i], &r.last_read_time, sizeof(r.last_read_time))) {
+      r.latencies.resize(n);
+      child_failed |=
+          !ReadAll(result_fds[i], r.latencies.data(), n * sizeof(int64_t));
+    } else {
+      child_failed = true;
+    }
+    close(result_fds[i]);
+    int status;
+    waitpid(pids[i], &status, 0);
+    child_failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  if (!start.ok()) {
+    return start.status();
+  }
+  if (child_failed) {
+    return absl::InternalError("Subscriber process failed");
+  }
+  for (const absl::Status &s : statuses) {
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  Result result;
+  result.name = config.Name();
+  result.num_msgs = num_msgs;
+  std::vector<int64_t> latencies;
+  uint64_t end = *start;
+  for (SubscriberResult &r : results) {
+    latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+    end = std::max(end, r.last_read_time);
+  }
+  result.num_received = latencies.size();
+  if (end > *start) {
+    result.msgs_per_sec = num_msgs * 1e9 / (end - *start);
+  }
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+      size_t i = static_cast<size_t>(p * latencies.size());
+      return latencies[std::min(i, latencies.size() - 1)];
+    };
+    result.p50_ns = percentile(0.5);
+    result.p99_ns = percentile(0.99);
+    result.p999_ns = percentile(0.999);
+    result.max_ns = latencies.back();
+  }
+  return result;
+}
+
+std::string ResultToJson(const Result &r) {
+  return absl::StrFormat(
+      "{\"name\": \"%s\", \"num_msgs\": %d, \"num_received\": %d, "
+      "\"msgs_per_sec\": %.1f, \"p50_ns\": %d, \"p99_ns\": %d, "
+      "\"p999_ns\": %d, \"max_ns\": %d}",
+      r.name, r.num_msgs, r.num_received, r.msgs_per_sec, r.p50_ns, r.p99_ns,
+      r.p999_ns, r.max_ns);
+}
+
+absl::Status WriteResults(const std::vector<Result> &results,
+                          const std::vector<int> &cpus) {
+  char hostname[256] = {};
+  (void)gethostname(hostname, sizeof(hostname) - 1);
+  time_t now = time(nullptr);
+  char date[64];
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+  std::string json = absl::StrFormat(
+      "{\n\"context\": {\"label\": \"%s\", \"host\": \"%s\", \"date\": "
+      "\"%s\", \"num_cpus\": %d, \"pinned\": %s, \"rate\": %d},\n"
+      "\"benchmarks\": [\n",
+      absl::GetFlag(FLAGS_label), hostname, date,
+      std::thread::hardware_concurrency(),
+      absl::GetFlag(FLAGS_pin_cpus) && !cpus.empty() ? "true" : "false",
+      absl::GetFlag(FLAGS_rate));
+  for (size_t i = 0; i < results.size(); i++) {
+    json += ResultToJson(results[i]);
+    json += i + 1 < results.size() ? ",\n" : "\n";
+  }
+  json += "]\n}\n";
+
+  std::string output = absl::GetFlag(FLAGS_output);
+  if (output.empty()) {
+    fputs(json.c_str(), stdout);
+    return absl::OkStatus();
+  }
+  std::ofstream out(output);
+  out << json;
+  if (!out) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to write results to %s", output));
+  }
+  return absl::OkStatus();
+}
+
+// Find the value of a field in a line of JSON written by ResultToJson.
+bool FindField(const std::string &line, const std::string &field,
+               std::string &value) {
+  std::string key = "\"" + field + "\": ";
+  size_t pos = line.find(key);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos += key.size();
+  if (line[pos] == '"') {
+    size_t end = line.find('"', pos + 1);
+    value = line.substr(pos + 1, end - pos - 1);
+  } else {
+    size_t end = line.find_first_of(",}", pos);
+    value = line.substr(pos, end - pos);
+  }
+  return true;
+}
+
+// Read results written by WriteResults.  This is not a general JSON
+// parser; it relies on there being one benchmark per line.
+absl::StatusOr<std::vector<Result>> ReadResults(const std::string &filename) {
+  std::ifstream in(filename);
+  if (!in) {
+    return absl::NotFoundError(
+        absl::StrFormat("Can't open results file %s", filename));
+  }
+  std::vector<Result> results;
+  std::string line;
+  while (std::getline(in, line)) {
+    Result r;
+    std::string msgs_per_sec, p50, p99, p999;
+    if (!FindField(line, "name", r.name) ||
+        !FindField(line, "msgs_per_sec", msgs_per_sec) ||
+        !FindField(line, "p50_ns", p50) || !FindField(line, "p99_ns", p99) ||
+        !FindField(line, "p999_ns", p999)) {
+      continue;
+    }
+    if (!absl::SimpleAtod(msgs_per_sec, &r.msgs_per_sec) ||
+        !absl::SimpleAtoi(p50, &r.p50_ns) ||
+        !absl::SimpleAtoi(p99, &r.p99_ns) ||
+        !absl::SimpleAtoi(p999, &r.p999_ns)) {
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Invalid benchmark in %s: %s", filename, line));
+    }
+    results.push_back(r);
+  }
+  return results;
+}
+
+// Print a comparison of the results with the baseline.  Returns the number
+// of regressions.
+int Compare(const std::vector<Result> &baseline,
+            const std::vector<Result> &results) {
+  double threshold = absl::GetFlag(FLAGS_threshold);
+  int num_regressions = 0;
+  fprintf(stderr, "%-60s %12s %12s %8s %12s %12s %8s\n", "Benchmark",
+          "old p99 ns", "new p99 ns", "change", "old msgs/s", "new msgs/s",
+          "change");
+  for (const Result &r : results) {
+    auto it = std::find_if(baseline.begin(), baseline.end(),
+                           [&r](const Result &b) { return b.name == r.name; });
+    if (it == baseline.end()) {
+      fprintf(stderr, "%-60s not in baseline\n", r.name.c_str());
+      continue;
+    }
+    double latency_change =
+        it->p99_ns == 0 ? 0 : double(r.p99_ns - it->p99_ns) / it->p99_ns;
+    double rate_change = it->msgs_per_sec == 0
+                             ? 0
+                             : (r.msgs_per_sec - it->msgs_per_sec) /
+                                   it->msgs_per_sec;
+    bool regressed = latency_change > threshold || rate_change < -threshold;
+    if (regressed) {
+      num_regressions++;
+    }
+    fprintf(stderr, "%-60s %12" PRId64 " %12" PRId64 " %+7.1f%% %12.0f %12.0f "
+            "%+7.1f%%%s\n",
+            r.name.c_str(), it->p99_ns, r.p99_ns, latency_change * 100,
+            it->msgs_per_sec, r.msgs_per_sec, rate_change * 100,
+            regressed ? "  REGRESSION" : "");
+  }
+  return num_regressions;
+}
+
+absl::StatusOr<std::vector<Config>> MakeConfigs() {
+  absl::StatusOr<std::vector<int>> slot_sizes =
+      ParseInts(absl::GetFlag(FLAGS_slot_sizes));
+  if (!slot_sizes.ok()) {
+    return slot_sizes.status();
+  }
+  absl::StatusOr<std::vector<int>> num_slots =
+      ParseInts(absl::GetFlag(FLAGS_num_slots));
+  if (!num_slots.ok()) {
+    return num_slots.status();
+  }
+  absl::StatusOr<std::vector<int>> num_subs =
+      ParseInts(absl::GetFlag(FLAGS_num_subscribers));
+  if (!num_subs.ok()) {
+    return num_subs.status();
+  }
+  std::vector<bool> reliability;
+  for (absl::string_view v : absl::StrSplit(
+           absl::GetFlag(FLAGS_reliability), ',', absl::SkipEmpty())) {
+    if (v != "reliable" && v != "unreliable") {
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Invalid reliability '%s'", v));
+    }
+    reliability.push_back(v == "reliable");
+  }
+  std::vector<Mode> modes;
+  for (absl::string_view v :
+       absl::StrSplit(absl::GetFlag(FLAGS_modes), ',', absl::SkipEmpty())) {
+    if (v == "same_process") {
+      modes.push_back(Mode::kSameProcess);
+    } else if (v == "cross_process") {
+      modes.push_back(Mode::kCrossProcess);
+    } else if (v == "bridged") {
+      modes.push_back(Mode::kBridged);
+    } else {
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Invalid mode '%s'", v));
+    }
+  }
+
+  std::vector<Config> configs;
+  for (Mode mode : modes) {
+    for (bool reliable : reliability) {
+      for (int slot_size : *slot_sizes) {
+        for (int n : *num_slots) {
+          for (int subs : *num_subs) {
+            configs.push_back({mode, slot_size, n, reliable, subs});
+          }
+        }
+      }
+    }
+  }
+  return configs;
+}
+
+absl::StatusOr<std::vector<Result>> RunAll(const std::vector<int> &cpus) {
+  absl::StatusOr<std::vector<Config>> configs = MakeConfigs();
+  if (!configs.ok()) {
+    return configs.status();
+  }
+  std::vector<Result> results;
+  // The local and bridged benchmarks need different servers.  Each
+  // benchmark uses a new server so that channels left by one benchmark
+  // don't affect the next.
+  for (const Config &config : *configs) {
+    bool bridged = config.mode == Mode::kBridged;
+    if (bridged && absl::GetFlag(FLAGS_bridge_interface).empty()) {
+      return absl::InvalidArgumentError(
+          "Bridged benchmarks need --bridge_interface");
+    }
+    ServerProcess servers;
+    absl::StatusOr<std::vector<std::string>> sockets = servers.Start(bridged);
+    if (!sockets.ok()) {
+      return sockets.status();
+    }
+    fprintf(stderr, "Running %s\n", config.Name().c_str());
+    absl::StatusOr<Result> result = RunBenchmark(config, *sockets, cpus);
+    if (!result.ok()) {
+      return absl::InternalError(absl::StrFormat(
+          "%s failed: %s", config.Name(), result.status().ToString()));
+    }
+    results.push_back(std::move(*result));
+  }
+  return results;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<int> cpus = AvailableCpus();
+  std::vector<Result> results;
+  if (std::string input = absl::GetFlag(FLAGS_input); !input.empty()) {
+    absl::StatusOr<std::vector<Result>> r = ReadResults(input);
+    if (!r.ok()) {
+      fprintf(stderr, "%s\n", r.status().ToString().c_str());
+      exit(1);
+    }
+    results = std::move(*r);
+  } else {
+    absl::StatusOr<std::vector<Result>> r = RunAll(cpus);
+    if (!r.ok()) {
+      fprintf(stderr, "%s\n", r.status().ToString().c_str());
+      exit(1);
+    }
+    results = std::move(*r);
+    if (absl::Status s = WriteResults(results, cpus); !s.ok()) {
+      fprintf(stderr, "%s\n", s.ToString().c_str());
+      exit(1);
+    }
+  }
+
+  if (std::string baseline = absl::GetFlag(FLAGS_baseline);
+      !baseline.empty()) {
+    absl::StatusOr<std::vector<Result>> old = ReadResults(baseline);
+    if (!old.ok()) {
+      fprintf(stderr, "%s\n", old.status().ToString().c_str());
+      exit(1);
+    }
+    int num_regressions = Compare(*old, results);
+    if (num_regressions > 0) {
+      fprintf(stderr, "%d benchmarks regressed by more than %g%%\n",
+              num_regressions, absl::GetFlag(FLAGS_threshold) * 100);
+      exit(1);
+    }
+  }
+}
@@ -5,11 +5,18 @@
 #include "client/client.h"
 #include "absl/strings/str_format.h"
 #include "proto/subspace.pb.h"
+#include "common/trace.h"
 #include "toolbelt/clock.h"
 #include "toolbelt/mutex.h"
 #include "toolbelt/sockets.h"
+#include "absl/container/flat_hash_map.h"
 #include <cerrno>
 #include <inttypes.h>
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace subspace {
 
@@ -17,6 +24,18 @@ using ClientChannel = details::ClientChannel;
 using SubscriberImpl = details::SubscriberImpl;
 using PublisherImpl = details::PublisherImpl;
 
+// The NUMA node the calling thread is running on, or -1 if it's not
+// known.
+static int CurrentNumaNode() {
+#if defined(__linux__)
+  unsigned int cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+    return static_cast<int>(node);
+  }
+#endif
+  return -1;
+}
+
 absl::Status Client::CheckConnected() const {
   if (!socket_.Connected()) {
     return absl::InternalError(
@@ -86,6 +105,40 @@ Client::UnregisterResizeCallback(PublisherImpl *publisher) {
   return absl::OkStatus();
 }
 
+// Tell the CPU we are in a spin loop.
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Spin for up to spin_ns nanoseconds until ready() returns true, or yield
+// to other coroutines if c is not nullptr.  The spinner is marked as such
+// in the channel while spinning.  The result of ready() after the mark is
+// removed is returned so that we see anything published by someone who
+// saw the mark and didn't trigger us.
+template <typename Ready>
+static bool SpinWait(ClientChannel *channel, bool publisher, int id,
+                     int64_t spin_ns, co::Coroutine *c, Ready ready) {
+  channel->SetSpinning(publisher, id, true);
+  uint64_t end = toolbelt::Now() + spin_ns;
+  for (int i = 1; !ready(); i++) {
+    if (c != nullptr) {
+      c->Yield();
+    } else {
+      CpuRelax();
+    }
+    // Don't look at the clock every time around.
+    if (i % 64 == 0 && toolbelt::Now() >= end) {
+      break;
+    }
+  }
+  channel->SetSpinning(publisher, id, false);
+  return ready();
+}
+
 static std::vector<SlotBuffer>
 CollectBuffers(const google::protobuf::RepeatedPtrField<BufferInfo> &buffers,
                const std::vector<toolbelt::FileDescriptor> &fds) {
@@ -112,6 +165,13 @@ Client::CreatePublisher(const std::string &channel_name, int slot_size,
   cmd->set_is_reliable(opts.IsReliable());
   cmd->set_is_bridge(opts.IsBridge());
   cmd->set_type(opts.Type());
+  cmd->set_is_lock_free(opts.IsLockFree());
+  cmd->set_use_huge_pages(opts.IsHugePages());
+  cmd->set_prefault(opts.IsPrefault());
+  cmd->set_numa_node(opts.NumaNode() == -1 ? CurrentNumaNode()
+                                           : opts.NumaNode());
+  cmd->set_size_classes(opts.HasSizeClasses());
+  cmd->set_bridge_codec(static_cast<int32_t>(opts.GetBridgeCodec()));
 
   // Send request to server and wait for response.
   Response resp;
@@ -146,8 +206,9 @@ Client::CreatePublisher(const std::string &channel_name, int slot_size,
 
   // Add all subscriber triggers fds to the publisher channel.
   channel->ClearSubscribers();
-  for (auto index : pub_resp.sub_trigger_fd_indexes()) {
-    channel->AddSubscriber(std::move(fds[index]));
+  for (auto &trigger : pub_resp.sub_triggers()) {
+    channel->AddSubscriber(trigger.serial(),
+                           std::move(fds[trigger.fd_index()]));
   }
 
   channel->SetNumUpdates(pub_resp.num_sub_updates());
@@ -188,6 +249,8 @@ Client::CreateSubscriber(const std::string &channel_name,
   cmd->set_is_bridge(opts.IsBridge());
   cmd->set_type(opts.Type());
   cmd->set_max_shared_ptrs(opts.MaxSharedPtrs());
+  cmd->set_bridge_latest_only(opts.IsBridgeLatestOnly());
+  cmd->set_bridge_max_rate(opts.BridgeMaxRate());
 
   // Send request to server and wait for response.
   Response resp;
@@ -224,8 +287,9 @@ Client::CreateSubscriber(const std::string &channel_name,
 
   // Add all publisher triggers fds to the subscriber channel.
   channel->ClearPublishers();
-  for (auto index : sub_resp.reliable_pub_trigger_fd_indexes()) {
-    channel->AddPublisher(std::move(fds[index]));
+  for (auto &trigger : sub_resp.reliable_pub_triggers()) {
+    channel->AddPublisher(trigger.serial(),
+                          std::move(fds[trigger.fd_index()]));
   }
 
   channel->SetNumUpdates(sub_resp.num_pub_updates());
@@ -244,6 +308,12 @@ absl::StatusOr<void *> Client::GetMessageBuffer(PublisherImpl *publisher,
                                                 int32_t max_size) {
   publisher->ClearPollFd();
 
+  // Pick up any new buffers first as the server might have shrunk the
+  // channel.
+  if (absl::Status status = ReloadBuffersIfNecessary(publisher); !status.ok()) {
+    return status;
+  }
+
   int32_t slot_size = publisher->SlotSize();
   if (max_size != -1 && max_size > slot_size) {
     int32_t new_slot_size = slot_size;
@@ -263,10 +333,6 @@ absl::StatusOr<void *> Client::GetMessageBuffer(PublisherImpl *publisher,
     return status;
   }
 
-  if (absl::Status status = ReloadBuffersIfNecessary(publisher); !status.ok()) {
-    return status;
-  }
-
   if (publisher->IsReliable() && publisher->CurrentSlot() == nullptr) {
     // We are a reliable publisher and don't have a slot yet.  Try to allocate
     // one now.  If we fail, we return nullptr so that the caller knows to try
@@ -274,20 +340,29 @@ absl::StatusOr<void *> Client::GetMessageBuffer(PublisherImpl *publisher,
     //
     // If there are no subscribers to the channel, don't allow a message to
     // be published yet.  This is because since there are no subscribers
-    // there are no slots with reliable_ref_count > 0 and therefore nothing
+    // there are no slots with reliable references and therefore nothing
     // to stop the publisher taking all the slots.  An incoming subscriber
     // would miss all those messages and that's not reliable.
     if (publisher->NumSubscribers() == 0) {
       return nullptr;
     }
+    // If we have to wait, a change in this will wake us up.
+    if (publisher->SpinBudget() > 0) {
+      publisher->last_num_wakeups_ = publisher->NumReliableWakeups();
+    }
     MessageSlot *slot =
         publisher->FindFreeSlot(true, publisher->GetPublisherId());
     if (slot == nullptr) {
+      publisher->AddReliableStall();
       return nullptr;
     }
     publisher->SetSlot(slot);
   }
 
+  if (publisher->HasSizeClasses()) {
+    publisher->SetSlotToBufferForSize(publisher->CurrentSlot(), max_size);
+  }
+
   void *buffer = publisher->GetCurrentBufferAddress();
   if (buffer == nullptr) {
     return absl::InternalError(
@@ -301,9 +376,129 @@ absl::StatusOr<const Message> Client::PublishMessage(PublisherImpl *publisher,
   return PublishMessageInternal(publisher, message_size, /*omit_prefix=*/false);
 }
 
+absl::StatusOr<std::vector<void *>>
+Client::GetMessageBuffers(PublisherImpl *publisher, int num_messages,
+                          int32_t max_size) {
+  if (num_messages < 1 || num_messages > publisher->NumSlots()) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Invalid number of messages %d for channel %s with %d slots",
+        num_messages, publisher->Name(), publisher->NumSlots()));
+  }
+  // The first buffer is the publisher's current slot.
+  absl::StatusOr<void *> buffer = GetMessageBuffer(publisher, max_size);
+  if (!buffer.ok()) {
+    return buffer.status();
+  }
+  std::vector<void *> buffers;
+  if (*buffer == nullptr) {
+    return buffers;
+  }
+  buffers.push_back(*buffer);
+
+  int needed = num_messages - publisher->NumUnpublishedMessages();
+  if (needed > 0) {
+    publisher->AddBatchSlots(publisher->FindFreeSlots(
+        needed, publisher->IsReliable(), publisher->GetPublisherId()));
+  }
+  for (MessageSlot *slot : publisher->BatchSlots()) {
+    if (publisher->HasSizeClasses()) {
+      publisher->SetSlotToBufferForSize(slot, max_size);
+    } else if (publisher->SlotSize(slot) != publisher->SlotSize()) {
+      // The channel might have been resized or shrunk since the slot was
+      // claimed.
+      publisher->SetSlotToBiggestBuffer(slot);
+    }
+    buffers.push_back(publisher->GetBufferAddress(slot));
+  }
+  return buffers;
+}
+
+absl::StatusOr<std::vector<Message>>
+Client::PublishMessages(PublisherImpl *publisher,
+                        const std::vector<int64_t> &message_sizes) {
+  return PublishMessagesInternal(publisher, message_sizes,
+                                 /*omit_prefix=*/false);
+}
+
+absl::StatusOr<std::vector<Message>>
+Client::PublishMessagesInternal(PublisherImpl *publisher,
+                                const std::vector<int64_t> &message_sizes,
+                                bool omit_prefix) {
+  if (message_sizes.size() != publisher->NumUnpublishedMessages()) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Channel %s has %d message buffers but %d message sizes were given",
+        publisher->Name(), publisher->NumUnpublishedMessages(),
+        message_sizes.size()));
+  }
+  std::vector<Message> messages;
+  if (message_sizes.empty()) {
+    return messages;
+  }
+
+  // Check if there are any new subscribers and if so, load their trigger fds.
+  if (absl::Status status = ReloadSubscribersIfNecessary(publisher);
+      !status.ok()) {
+    return status;
+  }
+
+  std::vector<MessageSlot *> slots;
+  slots.reserve(message_sizes.size());
+  slots.push_back(publisher->CurrentSlot());
+  for (MessageSlot *slot : publisher->BatchSlots()) {
+    slots.push_back(slot);
+  }
+  messages.reserve(message_sizes.size());
+  for (size_t i = 0; i < slots.size(); i++) {
+    slots[i]->message_size = message_sizes[i];
+    if (omit_prefix) {
+      // The ordinals and timestamps are already in the prefixes.  Get them
+      // now since the slots can be reused as soon as they are published.
+      const MessagePrefix *prefix = publisher->Prefix(slots[i]);
+      messages.emplace_back(message_sizes[i], nullptr, prefix->ordinal,
+                            prefix->timestamp);
+    }
+  }
+
+  bool notify = false;
+  Channel::PublishedMessage msg = publisher->ActivateSlotsAndGetAnother(
+      slots, publisher->IsReliable(), publisher->GetPublisherId(), omit_prefix,
+      &notify);
+  publisher->ClearBatchSlots();
+  publisher->SetSlot(msg.new_slot);
+
+  // Trigger the subscribers once for the whole batch.
+  if (notify) {
+    publisher->NotifySubscribers(msg.ordinal, msg.timestamp);
+    publisher->UnmapUnusedBuffers();
+  }
+
+  if (msg.new_slot == nullptr && !publisher->IsReliable()) {
+    return absl::InternalError(
+        absl::StrFormat("Out of slots for channel %s", publisher->Name()));
+  }
+
+  if (!omit_prefix) {
+    for (size_t i = 0; i < message_sizes.size(); i++) {
+      messages.emplace_back(message_sizes[i], nullptr, msg.ordinal + i,
+                            msg.timestamp);
+    }
+  }
+  for (const Message &m : messages) {
+    SUBSPACE_TRACE(kPublish, publisher->GetChannelId(), m.ordinal,
+                   m.timestamp);
+  }
+  return messages;
+}
+
 absl::StatusOr<const Message>
 Client::PublishMessageInternal(PublisherImpl *publisher, int64_t message_size,
                                bool omit_prefix) {
+  if (!publisher->BatchSlots().empty()) {
+    return absl::FailedPreconditionError(absl::StrFormat(
+        "Channel %s has message buffers from GetMessageBuffers; use "
+        "PublishMessages to publish them",
+        publisher->Name()));
+  }
   // Check if there are any new subscribers and if so, load their trigger fds.
   if (absl::Status status = ReloadSubscribersIfNecessary(publisher);
       !status.ok()) {
@@ -327,6 +522,8 @@ Client::PublishMessageInternal(PublisherImpl *publisher, int64_t message_size,
   old_slot = nullptr;
 
   publisher->SetSlot(msg.new_slot);
+  SUBSPACE_TRACE(kPublish, publisher->GetChannelId(), msg.ordinal,
+                 msg.timestamp);
 
   // Only trigger subscribers if we need to.
   // We could trigger for every message, but that is unnecessary and
@@ -334,7 +531,7 @@ Client::PublishMessageInternal(PublisherImpl *publisher, int64_t message_size,
   // message sent.  That's fast, but if we can avoid it, things
   // would be faster.
   if (notify) {
-    publisher->TriggerSubscribers();
+    publisher->NotifySubscribers(msg.ordinal, msg.timestamp);
     publisher->UnmapUnusedBuffers();
   }
 
@@ -367,6 +564,15 @@ absl::Status Client::WaitForReliablePublisher(PublisherImpl *publisher) {
       !status.ok()) {
     return status;
   }
+  // Spin until a subscriber has read all its messages.
+  if (publisher->SpinBudget() > 0 &&
+      SpinWait(publisher, /*publisher=*/true, publisher->GetPublisherId(),
+               publisher->SpinBudget(), co_, [publisher]() {
+                 return publisher->NumReliableWakeups() !=
+                        publisher->last_num_wakeups_;
+               })) {
+    return absl::OkStatus();
+  }
   if (co_ != nullptr) {
     // Coroutine aware.  Yield control back until the poll fd is triggered.
     co_->Wait(publisher->GetPollFd().Fd(), POLLIN);
@@ -389,6 +595,21 @@ absl::Status Client::WaitForSubscriber(SubscriberImpl *subscriber) {
   if (absl::Status status = CheckConnected(); !status.ok()) {
     return status;
   }
+  // The wait events carry the last message read.
+  SUBSPACE_TRACE(kWaitBegin, subscriber->GetChannelId(),
+                 subscriber->CurrentOrdinal(), subscriber->Timestamp());
+
+  // Spin until a message has been published since we last read.
+  if (subscriber->SpinBudget() > 0 && !subscriber->IsPlaceholder() &&
+      SpinWait(subscriber, /*publisher=*/false, subscriber->GetSubscriberId(),
+               subscriber->SpinBudget(), co_, [subscriber]() {
+                 return subscriber->NumMessagesPublished() !=
+                        subscriber->last_num_published_;
+               })) {
+    SUBSPACE_TRACE(kWaitEnd, subscriber->GetChannelId(),
+                   subscriber->CurrentOrdinal(), subscriber->Timestamp());
+    return absl::OkStatus();
+  }
 
   if (co_ != nullptr) {
     // Coroutine aware.  Yield control back until the poll fd is triggered.
@@ -404,6 +625,8 @@ absl::Status Client::WaitForSubscriber(SubscriberImpl *subscriber) {
           "Error from poll waiting for subscriber: %s", strerror(errno)));
     }
   }
+  SUBSPACE_TRACE(kWaitEnd, subscriber->GetChannelId(),
+                 subscriber->CurrentOrdinal(), subscriber->Timestamp());
   return absl::OkStatus();
 }
 
@@ -413,6 +636,10 @@ Client::ReadMessageInternal(SubscriberImpl *subscriber, ReadMode mode,
   if (clear_trigger) {
     subscriber->ClearPollFd();
   }
+  subscriber->ReleaseHeldSlots();
+  if (!subscriber->IsPlaceholder()) {
+    subscriber->last_num_published_ = subscriber->NumMessagesPublished();
+  }
 
   MessageSlot *new_slot = nullptr;
   MessageSlot *old_slot = subscriber->CurrentSlot();
@@ -452,6 +679,7 @@ Client::ReadMessageInternal(SubscriberImpl *subscriber, ReadMode mode,
   if (last_ordinal != -1 && new_slot->ordinal != (last_ordinal + 1)) {
     // We dropped a message.  If we have a callback registered for this
     // channel, call it with the number of dropped messages.
+    subscriber->AddDrops(new_slot->ordinal - last_ordinal - 1);
     auto it = dropped_message_callbacks_.find(subscriber);
     if (it != dropped_message_callbacks_.end()) {
       it->second(subscriber, new_slot->ordinal - last_ordinal);
@@ -465,8 +693,12 @@ Client::ReadMessageInternal(SubscriberImpl *subscriber, ReadMode mode,
                                    /* pass_activation=*/false,
                                    /* clear_trigger=*/false);
       }
+    } else {
+      subscriber->RecordLatency(prefix->timestamp, toolbelt::Now());
     }
   }
+  SUBSPACE_TRACE(kRead, subscriber->GetChannelId(), new_slot->ordinal,
+                 subscriber->Timestamp());
   return Message(new_slot->message_size, subscriber->GetCurrentBufferAddress(),
                  subscriber->CurrentOrdinal(), subscriber->Timestamp());
 }
@@ -501,14 +733,112 @@ absl::StatusOr<const Message> Client::ReadMessage(SubscriberImpl *subscriber,
                              /*clear_trigger=*/true);
 }
 
+absl::Status Client::ReadMessages(SubscriberImpl *subscriber,
+                                  int max_messages,
+                                  std::vector<Message> &messages) {
+  messages.clear();
+  std::vector<MessageSlot *> slots;
+  if (absl::Status status =
+          ReadMessagesInternal(subscriber, max_messages,
+                               /*pass_activation=*/false, slots);
+      !status.ok()) {
+    return status;
+  }
+  messages.reserve(slots.size());
+  for (MessageSlot *slot : slots) {
+    messages.push_back(SlotMessage(subscriber, slot));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status Client::ReadMessagesInternal(SubscriberImpl *subscriber,
+                                          int max_messages,
+                                          bool pass_activation,
+                                          std::vector<MessageSlot *> &slots) {
+  if (max_messages < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Invalid number of messages %d to read from %s",
+                        max_messages, subscriber->Name()));
+  }
+  if (subscriber->IsPlaceholder()) {
+    absl::Status status = ReloadSubscriber(subscriber);
+    if (!status.ok() || subscriber->IsPlaceholder()) {
+      subscriber->ClearPollFd();
+      return absl::OkStatus();
+    }
+  }
+
+  if (absl::Status status = ReloadBuffersIfNecessary(subscriber);
+      !status.ok()) {
+    return status;
+  }
+
+  absl::Status status = ReloadReliablePublishersIfNecessary(subscriber);
+  if (!status.ok()) {
+    return status;
+  }
+
+  subscriber->ClearPollFd();
+  subscriber->ReleaseHeldSlots();
+  subscriber->last_num_published_ = subscriber->NumMessagesPublished();
+
+  int64_t last_ordinal =
+      subscriber->CurrentSlot() == nullptr ? -1 : subscriber->CurrentOrdinal();
+  std::vector<MessageSlot *> read;
+  read.reserve(max_messages);
+  subscriber->NextSlots(max_messages, read);
+
+  int64_t num_dropped = 0;
+  int64_t num_missed = 0;
+  uint64_t now = read.empty() ? 0 : toolbelt::Now();
+  slots.reserve(read.size());
+  for (MessageSlot *slot : read) {
+    if (last_ordinal != -1 && slot->ordinal != (last_ordinal + 1)) {
+      num_dropped += slot->ordinal - last_ordinal;
+      num_missed += slot->ordinal - last_ordinal - 1;
+    }
+    last_ordinal = slot->ordinal;
+    const MessagePrefix *prefix = subscriber->Prefix(slot);
+    bool is_activation = (prefix->flags & kMessageActivate) != 0;
+    if (!is_activation) {
+      subscriber->RecordLatency(prefix->timestamp, now);
+    }
+    // Activation messages are not seen by the caller unless asked for.
+    if (pass_activation || !is_activation) {
+      SUBSPACE_TRACE(kRead, subscriber->GetChannelId(), slot->ordinal,
+                     prefix->timestamp);
+      slots.push_back(slot);
+    }
+  }
+
+  if (num_dropped > 0) {
+    subscriber->AddDrops(num_missed);
+    auto it = dropped_message_callbacks_.find(subscriber);
+    if (it != dropped_message_callbacks_.end()) {
+      it->second(subscriber, num_dropped);
+    }
+  }
+
+  if (static_cast<int>(read.size()) < max_messages) {
+    // We have read all the messages, trigger the publishers to give me
+    // some more.  This is only for reliable publishers.
+    subscriber->TriggerReliablePublishers();
+    subscriber->UnmapUnusedBuffers();
+  }
+  return absl::OkStatus();
+}
+
 absl::StatusOr<const Message>
 Client::FindMessageInternal(SubscriberImpl *subscriber, uint64_t timestamp) {
+  subscriber->ReleaseHeldSlots();
 
   MessageSlot *new_slot = subscriber->FindMessage(timestamp);
   if (new_slot == nullptr) {
     // Not found.
     return Message();
   }
+  SUBSPACE_TRACE(kRead, subscriber->GetChannelId(), new_slot->ordinal,
+                 subscriber->Timestamp());
   return Message(new_slot->message_size, subscriber->GetCurrentBufferAddress(),
                  subscriber->CurrentOrdinal(), subscriber->Timestamp());
 }
@@ -535,6 +865,65 @@ absl::StatusOr<const Message> Client::FindMessage(SubscriberImpl *subscriber,
   return FindMessageInternal(subscriber, timestamp);
 }
 
+absl::StatusOr<const Message> Client::ReadMessageAt(SubscriberImpl *subscriber,
+                                                    int64_t ordinal) {
+  std::vector<Message> messages;
+  if (absl::Status status = ReadRange(subscriber, ordinal, ordinal, messages);
+      !status.ok()) {
+    return status;
+  }
+  if (messages.empty()) {
+    return Message();
+  }
+  return messages[0];
+}
+
+absl::Status Client::ReadRange(SubscriberImpl *subscriber, int64_t first,
+                               int64_t last, std::vector<Message> &messages) {
+  messages.clear();
+  if (first > last) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Invalid ordinal range %d to %d for %s", first, last,
+                        subscriber->Name()));
+  }
+  if (subscriber->IsPlaceholder()) {
+    absl::Status status = ReloadSubscriber(subscriber);
+    if (!status.ok() || subscriber->IsPlaceholder()) {
+      subscriber->ClearPollFd();
+      return absl::OkStatus();
+    }
+  }
+
+  if (absl::Status status = ReloadBuffersIfNecessary(subscriber);
+      !status.ok()) {
+    return status;
+  }
+
+  absl::Status status = ReloadReliablePublishersIfNecessary(subscriber);
+  if (!status.ok()) {
+    return status;
+  }
+
+  std::vector<MessageSlot *> slots;
+  slots.reserve(std::min<int64_t>(last - first + 1, subscriber->NumSlots()));
+  subscriber->ReleaseHeldSlots();
+  subscriber->SlotsAt(first, last, slots);
+  if (slots.empty()) {
+    return absl::OkStatus();
+  }
+  messages.reserve(slots.size());
+  for (MessageSlot *slot : slots) {
+    // Activation messages are not seen by the caller.
+    if ((subscriber->Prefix(slot)->flags & kMessageActivate) == 0) {
+      messages.push_back(SlotMessage(subscriber, slot));
+    }
+  }
+  // We have moved on, which might let the reliable publishers have the
+  // slots we held before.
+  subscriber->TriggerReliablePublishers();
+  return absl::OkStatus();
+}
+
 struct pollfd Client::GetPollFd(SubscriberImpl *subscriber) const {
   struct pollfd fd = {.fd = subscriber->GetPollFd().Fd(), .events = POLLIN};
   return fd;
@@ -649,8 +1038,8 @@ absl::Status Client::ReloadSubscriber(SubscriberImpl *subscriber) {
 
   // Add all publisher trigger fds to the subscriber channel.
   subscriber->ClearPublishers();
-  for (auto index : sub_resp.reliable_pub_trigger_fd_indexes()) {
-    subscriber->AddPublisher(fds[index]);
+  for (auto &trigger : sub_resp.reliable_pub_triggers()) {
+    subscriber->AddPublisher(trigger.serial(), fds[trigger.fd_index()]);
   }
   // subscriber->Dump();
   return absl::OkStatus();
@@ -668,6 +1057,11 @@ absl::Status Client::ReloadSubscribersIfNecessary(PublisherImpl *publisher) {
   }
   publisher->SetNumUpdates(updates);
 
+  // Most of the time the trigger table has all we need.
+  if (RefreshTriggers(publisher, kTriggerSubscriber, publisher->subscribers_)) {
+    return absl::OkStatus();
+  }
+
   // We do have updates, get a new list of subscriber for
   // the channel.
   Request req;
@@ -686,8 +1080,8 @@ absl::Status Client::ReloadSubscribersIfNecessary(PublisherImpl *publisher) {
   auto &sub_resp = resp.get_triggers();
   // Add all subscriber triggers fds to the publisher channel.
   publisher->ClearSubscribers();
-  for (auto index : sub_resp.sub_trigger_fd_indexes()) {
-    publisher->AddSubscriber(fds[index]);
+  for (auto &trigger : sub_resp.sub_triggers()) {
+    publisher->AddSubscriber(trigger.serial(), fds[trigger.fd_index()]);
   }
   return absl::OkStatus();
 }
@@ -706,6 +1100,11 @@ Client::ReloadReliablePublishersIfNecessary(SubscriberImpl *subscriber) {
   }
   subscriber->SetNumUpdates(updates);
 
+  if (RefreshTriggers(subscriber, kTriggerReliablePublisher,
+                      subscriber->reliable_publishers_)) {
+    return absl::OkStatus();
+  }
+
   // We do have updates, get a new list of subscriber for
   // the channel.
   Request req;
@@ -724,12 +1123,100 @@ Client::ReloadReliablePublishersIfNecessary(SubscriberImpl *subscriber) {
   auto &sub_resp = resp.get_triggers();
   // Add all subscriber triggers fds to the publisher channel.
   subscriber->ClearPublishers();
-  for (auto index : sub_resp.reliable_pub_trigger_fd_indexes()) {
-    subscriber->AddPublisher(fds[index]);
+  for (auto &trigger : sub_resp.reliable_pub_triggers()) {
+    subscriber->AddPublisher(trigger.serial(), fds[trigger.fd_index()]);
   }
   return absl::OkStatus();
 }
 
+// Update the trigger fds for the users with the given flags from the
+// channel's trigger table.  The fds we already have are kept and the ones
+// for new users are copied from the server.  Returns false if the caller
+// needs to ask the server for them.
+bool Client::RefreshTriggers(ClientChannel *channel, uint32_t flags,
+                             std::vector<details::UserTrigger> &triggers) {
+  if (channel->TriggerTableSize() == 0 || server_fds_denied_) {
+    return false;
+  }
+  absl::flat_hash_map<uint64_t, toolbelt::FileDescriptor> existing;
+  for (auto &trigger : triggers) {
+    existing[trigger.serial] = trigger.fd.GetTriggerFd();
+  }
+  std::vector<TriggerTableEntry> entries;
+  std::vector<details::UserTrigger> updated;
+  // If the server changes the table while we are copying the fds we
+  // might have the wrong ones.  Try again.
+  constexpr int kMaxAttempts = 3;
+  for (int attempt = 0; attempt < kMaxAttempts; attempt++) {
+    uint64_t seq = channel->ReadTriggerTable(flags, entries);
+    updated.clear();
+    for (auto &entry : entries) {
+      toolbelt::FileDescriptor fd;
+      if (auto it = existing.find(entry.serial); it != existing.end()) {
+        fd = it->second;
+      } else {
+        absl::StatusOr<toolbelt::FileDescriptor> server_fd =
+            GetServerFd(entry.fd);
+        if (!server_fd.ok()) {
+          return false;
+        }
+        fd = std::move(*server_fd);
+        existing[entry.serial] = fd;
+      }
+      updated.push_back(
+          {entry.serial, TriggerFd(toolbelt::FileDescriptor(), std::move(fd))});
+    }
+    if (!channel->TriggerTableChanged(seq)) {
+      triggers = std::move(updated);
+      return true;
+    }
+    // The fds we copied for new users might be stale.
+    existing.clear();
+    for (auto &trigger : triggers) {
+      existing[trigger.serial] = trigger.fd.GetTriggerFd();
+    }
+  }
+  return false;
+}
+
+// Make a copy of one of the server's fds using pidfd_getfd.  This needs
+// permission to ptrace the server and Linux 5.6 or later.
+absl::StatusOr<toolbelt::FileDescriptor> Client::GetServerFd(int server_fd) {
+#if defined(__linux__) && defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+  if (!server_pidfd_.Valid()) {
+    // The peer credentials give the server's pid in our pid namespace.
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(socket_.GetFileDescriptor().Fd(), SOL_SOCKET, SO_PEERCRED,
+                   &cred, &len) == -1) {
+      server_fds_denied_ = true;
+      return absl::InternalError(absl::StrFormat(
+          "Failed to get server credentials: %s", strerror(errno)));
+    }
+    int pidfd = syscall(SYS_pidfd_open, cred.pid, 0);
+    if (pidfd == -1) {
+      server_fds_denied_ = true;
+      return absl::InternalError(
+          absl::StrFormat("Failed to open server pidfd: %s", strerror(errno)));
+    }
+    server_pidfd_.SetFd(pidfd);
+  }
+  int fd = syscall(SYS_pidfd_getfd, server_pidfd_.Fd(), server_fd, 0);
+  if (fd == -1) {
+    if (errno == EPERM || errno == ENOSYS) {
+      // Not allowed, don't try again.
+      server_fds_denied_ = true;
+    }
+    return absl::InternalError(
+        absl::StrFormat("Failed to get server fd: %s", strerror(errno)));
+  }
+  return toolbelt::FileDescriptor(fd);
+#else
+  server_fds_denied_ = true;
+  return absl::UnimplementedError("Can't get fds from the server");
+#endif
+}
+
 // A reliable publisher always sends a single activation message when it
 // is created.  This is to ensure that the reliable subscribers see
 // on message and thus keep a reference to it.
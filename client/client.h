@@ -15,9 +15,13 @@
 #include "coroutine.h"
 #include "toolbelt/fd.h"
 #include "toolbelt/sockets.h"
+#include <algorithm>
 #include <functional>
+#include <new>
 #include <string>
 #include <sys/poll.h>
+#include <type_traits>
+#include <utility>
 
 namespace subspace {
 
@@ -121,7 +125,7 @@ public:
   long use_count() const {
     return (sub_ == nullptr || slot_ == nullptr || msg_.length == 0)
                ? 0
-               : slot_->ref_count;
+               : slot_->RefCount();
   }
 
   const Message &GetMessage() const { return msg_; }
@@ -140,16 +144,18 @@ private:
         ordinal_(sub->CurrentOrdinal()) {
     IncRefCount(+1);
   }
+  shared_ptr(details::SubscriberImpl *sub, const Message &msg,
+             MessageSlot *slot)
+      : sub_(sub), msg_(msg), slot_(slot), ordinal_(slot->ordinal) {
+    IncRefCount(+1);
+  }
   template <typename M>
   friend bool operator==(const shared_ptr<M> &p1, const shared_ptr<M> &p2);
 
   friend class weak_ptr<T>;
 
   void IncRefCount(int inc) {
-    slot_->ref_count += inc;
-    if (sub_->IsReliable()) {
-      slot_->reliable_ref_count += inc;
-    }
+    sub_->IncDecRefCount(slot_, sub_->IsReliable(), inc);
     sub_->IncDecSharedPtrCount(inc);
   }
 
@@ -195,7 +201,7 @@ public:
     slot_ = nullptr;
   }
 
-  long use_count() const { return msg_.length == 0 ? 0 : slot_->ref_count; }
+  long use_count() const { return msg_.length == 0 ? 0 : slot_->RefCount(); }
 
   bool expired() const {
     return !(sub_->CurrentSlot() == slot_ &&
@@ -230,6 +236,8 @@ private:
 
 class Publisher;
 class Subscriber;
+template <typename T, int32_t kSlotSize = sizeof(T)> class TypedPublisher;
+template <typename T> class TypedSubscriber;
 
 template <typename T>
 inline shared_ptr<T>::shared_ptr(const weak_ptr<T> &p)
@@ -286,6 +294,20 @@ public:
   CreateSubscriber(const std::string &channel_name,
                    const SubscriberOptions &opts = SubscriberOptions());
 
+  // Create a publisher for messages of type T in a channel with slots of
+  // kSlotSize bytes.  The publisher is always fixed size.  See
+  // TypedPublisher.
+  template <typename T, int32_t kSlotSize = sizeof(T)>
+  absl::StatusOr<TypedPublisher<T, kSlotSize>>
+  CreateTypedPublisher(const std::string &channel_name, int num_slots,
+                       const PublisherOptions &opts = PublisherOptions());
+
+  // Create a subscriber for messages of type T.  See TypedSubscriber.
+  template <typename T>
+  absl::StatusOr<TypedSubscriber<T>>
+  CreateTypedSubscriber(const std::string &channel_name,
+                        const SubscriberOptions &opts = SubscriberOptions());
+
   // Call with true to turn on some debug information.  Kind of meaningless
   // information unless you know how this works in detail.
   void SetDebug(bool v) { debug_ = v; }
@@ -323,6 +345,15 @@ private:
   absl::StatusOr<const Message>
   PublishMessage(details::PublisherImpl *publisher, int64_t message_size);
 
+  // Batch versions of GetMessageBuffer and PublishMessage.  See the
+  // Publisher class for details.
+  absl::StatusOr<std::vector<void *>>
+  GetMessageBuffers(details::PublisherImpl *publisher, int num_messages,
+                    int32_t max_size);
+  absl::StatusOr<std::vector<Message>>
+  PublishMessages(details::PublisherImpl *publisher,
+                  const std::vector<int64_t> &message_sizes);
+
   // Wait until a reliable publisher can try again to send a message.  If the
   // client is coroutine-aware, the coroutine will wait.  If it's not,
   // the function will block on a poll until the publisher is triggered.
@@ -351,10 +382,28 @@ private:
   ReadMessage(details::SubscriberImpl *subscriber,
               ReadMode mode = ReadMode::kReadNext);
 
+  // Read up to max_messages messages from a subscriber with a single lock
+  // acquisition.  See Subscriber::ReadMessages.
+  absl::Status ReadMessages(details::SubscriberImpl *subscriber,
+                            int max_messages, std::vector<Message> &messages);
+
+  // As ReadMessages above but fills in shared_ptrs to the typed messages.
+  template <typename T>
+  absl::Status ReadMessages(details::SubscriberImpl *subscriber,
+                            int max_messages,
+                            std::vector<shared_ptr<T>> &messages);
+
   // Find a message given a timestamp.
   absl::StatusOr<const Message> FindMessage(details::SubscriberImpl *subscriber,
                                             uint64_t timestamp);
 
+  // Read messages given their ordinals.  See Subscriber::ReadMessageAt and
+  // Subscriber::ReadRange.
+  absl::StatusOr<const Message>
+  ReadMessageAt(details::SubscriberImpl *subscriber, int64_t ordinal);
+  absl::Status ReadRange(details::SubscriberImpl *subscriber, int64_t first,
+                         int64_t last, std::vector<Message> &messages);
+
   // AsFindMessage above but returns a shared_ptr to the typed message.
   // NOTE: this is subspace::shared_ptr, not std::shared_ptr.
   template <typename T>
@@ -407,16 +456,31 @@ private:
   absl::Status ReloadSubscribersIfNecessary(details::PublisherImpl *publisher);
   absl::Status
   ReloadReliablePublishersIfNecessary(details::SubscriberImpl *subscriber);
+  bool RefreshTriggers(details::ClientChannel *channel, uint32_t flags,
+                       std::vector<details::UserTrigger> &triggers);
+  absl::StatusOr<toolbelt::FileDescriptor> GetServerFd(int server_fd);
   absl::Status RemoveChannel(details::ClientChannel *channel);
   absl::Status ActivateReliableChannel(details::PublisherImpl *channel);
   absl::StatusOr<const Message>
   ReadMessageInternal(details::SubscriberImpl *subscriber, ReadMode mode,
                       bool pass_activation, bool clear_trigger);
+  absl::Status ReadMessagesInternal(details::SubscriberImpl *subscriber,
+                                    int max_messages, bool pass_activation,
+                                    std::vector<MessageSlot *> &slots);
   absl::StatusOr<const Message>
   FindMessageInternal(details::SubscriberImpl *subscriber, uint64_t timestamp);
+  static Message SlotMessage(details::SubscriberImpl *subscriber,
+                             MessageSlot *slot) {
+    return Message(slot->message_size, subscriber->GetBufferAddress(slot),
+                   slot->ordinal, subscriber->Prefix(slot)->timestamp);
+  }
   absl::StatusOr<const Message>
   PublishMessageInternal(details::PublisherImpl *publisher,
                          int64_t message_size, bool omit_prefix);
+  absl::StatusOr<std::vector<Message>>
+  PublishMessagesInternal(details::PublisherImpl *publisher,
+                          const std::vector<int64_t> &message_sizes,
+                          bool omit_prefix);
   absl::Status ResizeChannel(details::PublisherImpl *publisher,
                              int32_t new_slot_size);
   absl::Status ReloadBuffersIfNecessary(details::ClientChannel *channel);
@@ -431,6 +495,12 @@ private:
   toolbelt::FileDescriptor scb_fd_; // System control block memory fd.
   char buffer_[kMaxMessage];        // Buffer for comms with server over UDS.
 
+  // A pidfd for the server process, used to copy trigger fds out of the
+  // server without a request.  If that isn't allowed, server_fds_denied_
+  // is set and the client always asks the server.
+  toolbelt::FileDescriptor server_pidfd_;
+  bool server_fds_denied_ = false;
+
   // The client owns all the publishers and subscribers.
   absl::flat_hash_set<std::unique_ptr<details::ClientChannel>> channels_;
 
@@ -469,7 +539,8 @@ Client::ReadMessage(details::SubscriberImpl *subscriber, ReadMode mode) {
     return msg.status();
   }
   if (msg->length == 0) {
-    return ::subspace::shared_ptr<T>(subscriber, *msg);
+    // No message, so no slot to hold a reference to.
+    return ::subspace::shared_ptr<T>();
   }
   if (!subscriber->CheckSharedPtrCount()) {
     return absl::InternalError(
@@ -480,6 +551,37 @@ Client::ReadMessage(details::SubscriberImpl *subscriber, ReadMode mode) {
   return ::subspace::shared_ptr<T>(subscriber, *msg);
 }
 
+template <typename T>
+inline absl::Status
+Client::ReadMessages(details::SubscriberImpl *subscriber, int max_messages,
+                     std::vector<::subspace::shared_ptr<T>> &messages) {
+  messages.clear();
+  // Only read as many messages as there are shared_ptrs left for.  The
+  // read moves the subscriber past all the messages, so any that didn't
+  // get a shared_ptr would be lost.
+  if (!subscriber->CheckSharedPtrCount()) {
+    return absl::InternalError(
+        absl::StrFormat("Too many shared pointers for %s: current: %d, max: %d",
+                        subscriber->Name(), subscriber->NumSharedPtrs(),
+                        subscriber->MaxSharedPtrs()));
+  }
+  max_messages = std::min(max_messages, subscriber->MaxSharedPtrs() -
+                                            subscriber->NumSharedPtrs());
+  std::vector<MessageSlot *> slots;
+  if (absl::Status status =
+          ReadMessagesInternal(subscriber, max_messages,
+                               /*pass_activation=*/false, slots);
+      !status.ok()) {
+    return status;
+  }
+  messages.reserve(slots.size());
+  for (MessageSlot *slot : slots) {
+    messages.push_back(::subspace::shared_ptr<T>(
+        subscriber, SlotMessage(subscriber, slot), slot));
+  }
+  return absl::OkStatus();
+}
+
 template <typename T>
 inline absl::StatusOr<::subspace::shared_ptr<T>>
 Client::FindMessage(details::SubscriberImpl *subscriber, uint64_t timestamp) {
@@ -488,7 +590,8 @@ Client::FindMessage(details::SubscriberImpl *subscriber, uint64_t timestamp) {
     return msg.status();
   }
   if (msg->length == 0) {
-    return ::subspace::shared_ptr<T>(subscriber, *msg);
+    // No message, so no slot to hold a reference to.
+    return ::subspace::shared_ptr<T>();
   }
   if (!subscriber->CheckSharedPtrCount()) {
     return absl::InternalError(
@@ -551,6 +654,36 @@ public:
     return client_->PublishMessage(impl_, message_size);
   }
 
+  // Construct a T in place in the message buffer from the arguments (with
+  // braces, so aggregates work) and publish it, without an intermediate
+  // buffer.  T must be trivially
+  // copyable as the subscribers see its bytes and it is never destructed.
+  // If a reliable publisher can't get a buffer the Message returned has
+  // zero length and nothing is published.
+  template <typename T, typename... Args>
+  absl::StatusOr<Message> Emplace(Args &&...args);
+
+  // Get buffers for a batch of up to num_messages messages with a single
+  // lock acquisition.  The first is the buffer returned by
+  // GetMessageBuffer.  Fewer buffers than asked for are returned if
+  // there aren't enough slots available and a reliable publisher might
+  // get none.  If there are already more buffers from a previous call
+  // that haven't been published, all of them are returned.  The
+  // max_size argument is as for GetMessageBuffer.
+  absl::StatusOr<std::vector<void *>>
+  GetMessageBuffers(int num_messages, int32_t max_size = -1) {
+    return client_->GetMessageBuffers(impl_, num_messages, max_size);
+  }
+
+  // Publish all the messages in the buffers returned by GetMessageBuffers.
+  // There must be one size per buffer.  The messages are published in
+  // buffer order with contiguous ordinals in a single lock acquisition
+  // and the subscribers are triggered at most once.
+  absl::StatusOr<std::vector<Message>>
+  PublishMessages(const std::vector<int64_t> &message_sizes) {
+    return client_->PublishMessages(impl_, message_sizes);
+  }
+
   // Wait until a reliable publisher can try again to send a message.  If the
   // client is coroutine-aware, the coroutine will wait.  If it's not,
   // the function will block on a poll until the publisher is triggered.
@@ -569,6 +702,7 @@ public:
   }
 
   const std::string Type() const { return impl_->Type(); }
+  int ChannelId() const { return impl_->GetChannelId(); }
 
   bool IsReliable() const { return impl_->IsReliable(); }
   bool IsLocal() const { return impl_->IsLocal(); }
@@ -576,6 +710,12 @@ public:
 
   int32_t SlotSize() const { return impl_->SlotSize(); }
 
+  // The size of the buffer returned by GetMessageBuffer.  With size
+  // classes this can be smaller than SlotSize.
+  int32_t CurrentSlotSize() const {
+    return impl_->SlotSize(impl_->CurrentSlot());
+  }
+
   const std::vector<BufferSet> &GetBuffers() const {
     return client_->GetBuffers(impl_);
   }
@@ -607,6 +747,12 @@ private:
     return client_->PublishMessageInternal(impl_, message_size, omit_prefix);
   }
 
+  absl::StatusOr<std::vector<Message>>
+  PublishMessagesInternal(const std::vector<int64_t> &message_sizes,
+                          bool omit_prefix) {
+    return client_->PublishMessagesInternal(impl_, message_sizes, omit_prefix);
+  }
+
   Client *client_;
   details::PublisherImpl *impl_;
 };
@@ -662,6 +808,25 @@ public:
   absl::StatusOr<shared_ptr<T>>
   ReadMessage(ReadMode mode = ReadMode::kReadNext);
 
+  // Read up to max_messages of the next available messages into messages,
+  // oldest first, with a single lock acquisition.  The messages vector is
+  // empty if there are none.  All the messages stay valid until the next
+  // read from the subscriber.  Dropped messages are reported once for the
+  // whole batch and reliable publishers are triggered if all the
+  // available messages have been read.
+  absl::Status ReadMessages(int max_messages, std::vector<Message> &messages) {
+    return client_->ReadMessages(impl_, max_messages, messages);
+  }
+
+  // As ReadMessages above but fills in shared_ptrs to the typed messages.
+  // No more messages are read than there are shared_ptrs left for (see
+  // SubscriberOptions::SetMaxSharedPtrs).  It is an error if there are
+  // none left.
+  // NOTE: this is subspace::shared_ptr, not std::shared_ptr.
+  template <typename T>
+  absl::Status ReadMessages(int max_messages,
+                            std::vector<shared_ptr<T>> &messages);
+
   // Find a message given a timestamp.
   absl::StatusOr<const Message> FindMessage(uint64_t timestamp) {
     return client_->FindMessage(impl_, timestamp);
@@ -672,6 +837,24 @@ public:
   template <typename T>
   absl::StatusOr<shared_ptr<T>> FindMessage(uint64_t timestamp);
 
+  // Read the message with the given ordinal if it is still in the channel.
+  // If it isn't, the 'length' field of the returned Message will be zero and
+  // nothing changes.  Otherwise the subscriber moves to the message, so the
+  // next ReadMessage reads the one after it.
+  absl::StatusOr<const Message> ReadMessageAt(int64_t ordinal) {
+    return client_->ReadMessageAt(impl_, ordinal);
+  }
+
+  // Read the messages with ordinals first to last (inclusive) that are still
+  // in the channel into messages, oldest first, with a single lock
+  // acquisition.  Only the most recent messages, one per slot, can be read
+  // this way.  All the messages stay valid until the next read from the
+  // subscriber and the subscriber moves to the last of them.
+  absl::Status ReadRange(int64_t first, int64_t last,
+                         std::vector<Message> &messages) {
+    return client_->ReadRange(impl_, first, last, messages);
+  }
+
   struct pollfd GetPollFd() const {
     return client_->GetPollFd(impl_);
   }
@@ -689,6 +872,7 @@ public:
   }
 
   const std::string Type() const { return impl_->Type(); }
+  int ChannelId() const { return impl_->GetChannelId(); }
 
   // Register a function to be called when a subscriber drops a message.  The
   // function is called with the number of messages that have been missed
@@ -719,6 +903,7 @@ public:
 private:
   friend class Server;
   friend class Client;
+  friend class SubscriberSet;
 
   Subscriber(Client *client, details::SubscriberImpl *impl)
       : client_(client), impl_(impl) {}
@@ -729,6 +914,25 @@ private:
                                         clear_trigger);
   }
 
+  // Used by the bridge transmitter to read a batch of messages, including
+  // activations.  The subscriber holds references to the slots until the
+  // next read.
+  absl::Status ReadMessagesInternal(int max_messages, bool pass_activation,
+                                    std::vector<Message> &messages) {
+    messages.clear();
+    std::vector<MessageSlot *> slots;
+    if (absl::Status status = client_->ReadMessagesInternal(
+            impl_, max_messages, pass_activation, slots);
+        !status.ok()) {
+      return status;
+    }
+    messages.reserve(slots.size());
+    for (MessageSlot *slot : slots) {
+      messages.push_back(Client::SlotMessage(impl_, slot));
+    }
+    return absl::OkStatus();
+  }
+
   Client *client_;
   details::SubscriberImpl *impl_;
 };
@@ -739,12 +943,153 @@ Subscriber::ReadMessage(ReadMode mode) {
   return client_->ReadMessage<T>(impl_, mode);
 }
 
+template <typename T>
+inline absl::Status
+Subscriber::ReadMessages(int max_messages,
+                         std::vector<::subspace::shared_ptr<T>> &messages) {
+  return client_->ReadMessages<T>(impl_, max_messages, messages);
+}
+
 template <typename T>
 inline absl::StatusOr<::subspace::shared_ptr<T>>
 Subscriber::FindMessage(uint64_t timestamp) {
   return client_->FindMessage<T>(impl_, timestamp);
 }
 
+template <typename T, typename... Args>
+inline absl::StatusOr<Message> Publisher::Emplace(Args &&...args) {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Messages constructed in place must be trivially copyable");
+  static_assert(alignof(T) <= kMessageAlignment,
+                "Message alignment is greater than that of a slot");
+  absl::StatusOr<void *> buffer = GetMessageBuffer(sizeof(T));
+  if (!buffer.ok()) {
+    return buffer.status();
+  }
+  if (*buffer == nullptr) {
+    return Message();
+  }
+  new (*buffer) T{std::forward<Args>(args)...};
+  return PublishMessage(sizeof(T));
+}
+
+// A publisher of fixed layout messages of type T, constructed in place in
+// the channel's slots.  The slots are kSlotSize bytes and are never
+// resized, so a T is known to fit at compile time.  Use the same kSlotSize
+// for all the typed publishers on a channel.
+template <typename T, int32_t kSlotSize> class TypedPublisher {
+public:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Typed messages must be trivially copyable");
+  static_assert(sizeof(T) <= kSlotSize,
+                "Message is bigger than the channel's slots");
+  static_assert(alignof(T) <= kMessageAlignment,
+                "Message alignment is greater than that of a slot");
+
+  explicit TypedPublisher(Publisher pub) : pub_(std::move(pub)) {}
+
+  // Get the buffer for the next message, or nullptr if a reliable
+  // publisher can't get one.  The T in it is not constructed; assign to it
+  // and call Publish or use Emplace instead.
+  absl::StatusOr<T *> GetMessageBuffer() {
+    absl::StatusOr<void *> buffer = pub_.GetMessageBuffer(sizeof(T));
+    if (!buffer.ok()) {
+      return buffer.status();
+    }
+    return static_cast<T *>(*buffer);
+  }
+
+  // Publish the message in the buffer from GetMessageBuffer.
+  absl::StatusOr<Message> Publish() { return pub_.PublishMessage(sizeof(T)); }
+
+  // See Publisher::Emplace.
+  template <typename... Args> absl::StatusOr<Message> Emplace(Args &&...args) {
+    return pub_.Emplace<T>(std::forward<Args>(args)...);
+  }
+
+  absl::Status Wait() { return pub_.Wait(); }
+
+  // For everything else.
+  Publisher &Untyped() { return pub_; }
+
+private:
+  Publisher pub_;
+};
+
+// A subscriber for messages of type T.  The messages are read in place
+// and, unlike Subscriber::ReadMessage<T>, no shared_ptr is made and
+// nothing is checked about them, so all the publishers on the channel must
+// publish Ts (use TypedPublisher<T>).  The only check is that the
+// channel's slots can hold a T, made once at the first message read.
+template <typename T> class TypedSubscriber {
+public:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Typed messages must be trivially copyable");
+  static_assert(alignof(T) <= kMessageAlignment,
+                "Message alignment is greater than that of a slot");
+
+  explicit TypedSubscriber(Subscriber sub) : sub_(std::move(sub)) {}
+
+  // Read a message, which is nullptr if there isn't one.  It is valid until
+  // the next read.  Use Untyped().ReadMessage<T>() to hold on to messages.
+  absl::StatusOr<const T *> ReadMessage(ReadMode mode = ReadMode::kReadNext) {
+    absl::StatusOr<const Message> msg = sub_.ReadMessage(mode);
+    if (!msg.ok()) {
+      return msg.status();
+    }
+    if (!slot_size_checked_ && msg->length > 0) {
+      if (absl::Status status = CheckSlotSize(); !status.ok()) {
+        return status;
+      }
+    }
+    return static_cast<const T *>(msg->buffer);
+  }
+
+  absl::Status Wait() { return sub_.Wait(); }
+
+  // For everything else.
+  Subscriber &Untyped() { return sub_; }
+
+private:
+  absl::Status CheckSlotSize() {
+    if (sub_.SlotSize() < static_cast<int32_t>(sizeof(T))) {
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "Channel slots of %d bytes are too small for messages of %d bytes",
+          sub_.SlotSize(), sizeof(T)));
+    }
+    slot_size_checked_ = true;
+    return absl::OkStatus();
+  }
+
+  Subscriber sub_;
+  bool slot_size_checked_ = false;
+};
+
+template <typename T, int32_t kSlotSize>
+inline absl::StatusOr<TypedPublisher<T, kSlotSize>>
+Client::CreateTypedPublisher(const std::string &channel_name, int num_slots,
+                             const PublisherOptions &opts) {
+  PublisherOptions options = opts;
+  options.SetFixedSize(true);
+  absl::StatusOr<Publisher> pub =
+      CreatePublisher(channel_name, kSlotSize, num_slots, options);
+  if (!pub.ok()) {
+    return pub.status();
+  }
+  return TypedPublisher<T, kSlotSize>(std::move(*pub));
+}
+
+template <typename T>
+inline absl::StatusOr<TypedSubscriber<T>>
+Client::CreateTypedSubscriber(const std::string &channel_name,
+                              const SubscriberOptions &opts) {
+  absl::StatusOr<Subscriber> sub = CreateSubscriber(channel_name, opts);
+  if (!sub.ok()) {
+    return sub.status();
+  }
+  return TypedSubscriber<T>(std::move(*sub));
+}
+
 } // namespace subspace
 
 #endif // __CLIENT_CLIENT_H
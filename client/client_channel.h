@@ -7,6 +7,7 @@
 
 #include "client/options.h"
 #include "common/channel.h"
+#include "common/trace.h"
 #include "common/triggerfd.h"
 #include "coroutine.h"
 #include "proto/subspace.pb.h"
@@ -67,9 +68,17 @@
 namespace subspace {
 
 class Client;
+class SubscriberSet;
 
 namespace details {
 
+// The trigger fd of another user of a channel.  The serial number
+// identifies the user's entry in the channel's trigger table.
+struct UserTrigger {
+  uint64_t serial;
+  TriggerFd fd;
+};
+
 // This is a channel as seen by a client.  It's going to be either
 // a publisher or a subscriber, as defined as the subclasses.
 class ClientChannel : public Channel {
@@ -111,6 +120,7 @@ public:
   bool IsReliable() const { return options_.IsReliable(); }
   bool IsLocal() const { return options_.IsLocal(); }
   bool IsFixedSize() const { return options_.IsFixedSize(); }
+  int64_t SpinBudget() const { return options_.SpinBudget(); }
 
 private:
   friend class ::subspace::Client;
@@ -123,9 +133,21 @@ private:
     return Channel::ActivateSlotAndGetAnother(
         slot_, reliable, is_activation, publisher_id_, omit_prefix, notify);
   }
+
+  // Slots claimed by GetMessageBuffers in addition to the current slot.
+  // They are published after the current slot, in order.
+  const std::vector<MessageSlot *> &BatchSlots() const { return batch_; }
+  void AddBatchSlots(const std::vector<MessageSlot *> &slots) {
+    batch_.insert(batch_.end(), slots.begin(), slots.end());
+  }
+  void ClearBatchSlots() { batch_.clear(); }
+  size_t NumUnpublishedMessages() const {
+    return slot_ == nullptr ? 0 : 1 + batch_.size();
+  }
   void ClearSubscribers() { subscribers_.clear(); }
-  void AddSubscriber(toolbelt::FileDescriptor fd) {
-    subscribers_.emplace_back(toolbelt::FileDescriptor(), std::move(fd));
+  void AddSubscriber(uint64_t serial, toolbelt::FileDescriptor fd) {
+    subscribers_.push_back(
+        {serial, TriggerFd(toolbelt::FileDescriptor(), std::move(fd))});
   }
   size_t NumSubscribers() { return subscribers_.size(); }
 
@@ -139,18 +161,35 @@ private:
   toolbelt::FileDescriptor &GetPollFd() { return trigger_.GetPollFd(); }
 
   void TriggerSubscribers() {
-    for (auto &fd : subscribers_) {
-      fd.Trigger();
+    for (auto &sub : subscribers_) {
+      sub.fd.Trigger();
+    }
+  }
+
+  // Trigger the subscribers after publishing a message unless they are
+  // all spinning, in which case they will see it anyway.  The ordinal and
+  // timestamp of the message are for tracing.
+  void NotifySubscribers(int64_t ordinal, uint64_t timestamp) {
+    if (!AllSubscribersSpinning()) {
+      SUBSPACE_TRACE(kTriggerSubscribers, GetChannelId(), ordinal, timestamp);
+      AddTrigger();
+      TriggerSubscribers();
     }
   }
   int GetPublisherId() const { return publisher_id_; }
 
-  void ClearPollFd() { trigger_.Clear(); }
+  void ClearPollFd() {
+    SUBSPACE_TRACE(kClearTrigger, GetChannelId(), -1, 0);
+    trigger_.Clear();
+  }
 
   TriggerFd trigger_;
   int publisher_id_;
-  std::vector<TriggerFd> subscribers_;
+  std::vector<UserTrigger> subscribers_;
   PublisherOptions options_;
+  std::vector<MessageSlot *> batch_;
+  // Number of reliable wakeups when we last tried to get a slot.
+  int64_t last_num_wakeups_ = 0;
 };
 
 // A subscriber reads messages from a channel.  It maps the channel
@@ -170,6 +209,7 @@ public:
     return CurrentSlot() == nullptr ? 0 : Prefix(CurrentSlot())->timestamp;
   }
   bool IsReliable() const { return options_.IsReliable(); }
+  int64_t SpinBudget() const { return options_.SpinBudget(); }
 
   int32_t SlotSize() const { return Channel::SlotSize(CurrentSlot()); }
 
@@ -182,13 +222,14 @@ public:
 
 private:
   friend class ::subspace::Client;
+  friend class ::subspace::SubscriberSet;
 
   bool IsSubscriber() const override { return true; }
 
   void ClearPublishers() { reliable_publishers_.clear(); }
-  void AddPublisher(toolbelt::FileDescriptor fd) {
-    reliable_publishers_.emplace_back(toolbelt::FileDescriptor(),
-                                      std::move(fd));
+  void AddPublisher(uint64_t serial, toolbelt::FileDescriptor fd) {
+    reliable_publishers_.push_back(
+        {serial, TriggerFd(toolbelt::FileDescriptor(), std::move(fd))});
   }
   size_t NumReliablePublishers() { return reliable_publishers_.size(); }
 
@@ -200,8 +241,18 @@ private:
   }
   int GetSubscriberId() const { return subscriber_id_; }
   void TriggerReliablePublishers() {
-    for (auto &fd : reliable_publishers_) {
-      fd.Trigger();
+    if (reliable_publishers_.empty()) {
+      return;
+    }
+    // Spinning publishers watch for the wakeup.
+    AddReliableWakeup();
+    if (AllReliablePublishersSpinning()) {
+      return;
+    }
+    SUBSPACE_TRACE(kTriggerPublishers, GetChannelId(), CurrentOrdinal(),
+                   Timestamp());
+    for (auto &pub : reliable_publishers_) {
+      pub.fd.Trigger();
     }
   }
   void Trigger() { trigger_.Trigger(); }
@@ -214,8 +265,41 @@ private:
     return Channel::LastSlot(CurrentSlot(), IsReliable(), subscriber_id_);
   }
 
+  // Read up to max_slots slots after the current one.  The last becomes the
+  // current slot and the subscriber holds references to the others until
+  // ReleaseHeldSlots is called.
+  void NextSlots(int max_slots, std::vector<MessageSlot *> &slots) {
+    Channel::NextSlots(CurrentSlot(), max_slots, IsReliable(), subscriber_id_,
+                       slots);
+    if (!slots.empty()) {
+      SetSlot(slots.back());
+      held_slots_.assign(slots.begin(), slots.end() - 1);
+    }
+  }
+
+  // As NextSlots for the messages with ordinals first to last.
+  void SlotsAt(int64_t first, int64_t last, std::vector<MessageSlot *> &slots) {
+    Channel::SlotsAt(CurrentSlot(), first, last, IsReliable(), subscriber_id_,
+                     slots);
+    if (!slots.empty()) {
+      SetSlot(slots.back());
+      held_slots_.assign(slots.begin(), slots.end() - 1);
+    }
+  }
+
+  void ReleaseHeldSlots() {
+    for (MessageSlot *slot : held_slots_) {
+      ReleaseSlot(slot, IsReliable(), subscriber_id_);
+    }
+    held_slots_.clear();
+  }
+
   toolbelt::FileDescriptor &GetPollFd() { return trigger_.GetPollFd(); }
-  void ClearPollFd() { trigger_.Clear(); }
+  void ClearPollFd() {
+    SUBSPACE_TRACE(kClearTrigger, GetChannelId(), CurrentOrdinal(),
+                   Timestamp());
+    trigger_.Clear();
+  }
 
   MessageSlot *FindMessage(uint64_t timestamp) {
     MessageSlot *slot =
@@ -229,13 +313,21 @@ private:
 
   int subscriber_id_;
   TriggerFd trigger_;
-  std::vector<TriggerFd> reliable_publishers_;
+  std::vector<UserTrigger> reliable_publishers_;
   SubscriberOptions options_;
   int num_shared_ptrs_ = 0;
 
-  // It is rare that subscribers need to search for messges by timestamp.  This
-  // will keep the memory allocation to the first search on a subscriber.  Most
-  // subscribers won't use this.
+  // Slots read by ReadMessages before the current slot.
+  std::vector<MessageSlot *> held_slots_;
+
+  // Number of messages published when we last looked for a message.  Used
+  // to see if a message might be available without reading it.
+  int64_t last_num_published_ = 0;
+
+  // Searches by timestamp use the channel's timestamp index.  This is only
+  // used to search the active list for a timestamp older than everything in
+  // the index, which is rare.  It keeps the memory allocation to the first
+  // such search on a subscriber.  Most subscribers won't use this.
   std::vector<MessageSlot *> search_buffer_;
 };
 } // namespace details
@@ -5,13 +5,20 @@
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/hash/hash_testing.h"
+#include "absl/strings/str_format.h"
 #include "client/client.h"
+#include "client/recorder.h"
+#include "common/trace.h"
+#include "client/subscriber_set.h"
 #include "coroutine.h"
 #include "server/server.h"
 #include "toolbelt/hexdump.h"
+#include <fcntl.h>
 #include <gtest/gtest.h>
 #include <inttypes.h>
 #include <memory>
+#include <numeric>
+#include <poll.h>
 #include <signal.h>
 #include <sys/resource.h>
 #include <thread>
@@ -47,6 +54,10 @@ public:
     server_ =
         std::make_unique<subspace::Server>(scheduler_, socket_, "", 0, 0,
                                            /*local=*/true, server_pipe_[1]);
+    // Shrink resized channels after a second without big messages.
+    server_->SetBufferShrinkWindow(1000000000ULL);
+    // Handle the clients on a few threads.
+    server_->SetNumThreads(3);
 
     // Start server running in a thread.
     server_thread_ = std::thread([]() {
@@ -99,6 +110,61 @@ int ClientTest::server_pipe_[2];
 std::unique_ptr<subspace::Server> ClientTest::server_;
 std::thread ClientTest::server_thread_;
 
+// A server of its own for the tests that need one configured differently
+// from the shared one.  Configure it through Get() before calling Start.
+class TestServer {
+public:
+  TestServer(const std::string &interface = "", int disc_port = 0,
+             int peer_port = 0, bool local = true) {
+    char tmp[] = "/tmp/subspaceXXXXXX";
+    int fd = mkstemp(tmp);
+    EXPECT_NE(-1, fd);
+    close(fd);
+    socket_ = tmp;
+    EXPECT_EQ(0, pipe(pipe_));
+    server_ = std::make_unique<subspace::Server>(
+        scheduler_, socket_, interface, disc_port, peer_port, local,
+        pipe_[1]);
+  }
+
+  ~TestServer() {
+    if (thread_.joinable()) {
+      server_->Stop();
+      char buf[8];
+      (void)::read(pipe_[0], buf, 8);
+      thread_.join();
+    }
+    server_.reset();
+    close(pipe_[0]);
+    close(pipe_[1]);
+    remove(socket_.c_str());
+  }
+
+  subspace::Server &Get() { return *server_; }
+  const std::string &Socket() const { return socket_; }
+
+  void Start() {
+    thread_ = std::thread([this]() {
+      absl::Status s = server_->Run();
+      if (!s.ok()) {
+        fprintf(stderr, "Error running Subspace server: %s\n",
+                s.ToString().c_str());
+        exit(1);
+      }
+    });
+    // Wait for server to tell us that it's running.
+    char buf[8];
+    (void)::read(pipe_[0], buf, 8);
+  }
+
+private:
+  co::CoroutineScheduler scheduler_;
+  std::string socket_;
+  int pipe_[2];
+  std::unique_ptr<subspace::Server> server_;
+  std::thread thread_;
+};
+
 TEST_F(ClientTest, InetAddressSupportsAbslHash) {
   struct sockaddr_in addr = {
 #if defined(__APPLE__)
@@ -297,6 +363,23 @@ TEST_F(ClientTest, BadPublisherParameters) {
   ASSERT_FALSE(pub3.ok());
 }
 
+TEST_F(ClientTest, PublisherSlotsMismatchAfterPublishersGone) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber("slots_gone");
+  ASSERT_TRUE(sub.ok());
+  {
+    absl::StatusOr<Publisher> pub =
+        client.CreatePublisher("slots_gone", 256, 10);
+    ASSERT_TRUE(pub.ok());
+  }
+
+  // The subscriber keeps the channel, and its slots, after the publisher
+  // has gone.  A new publisher must use the same number of slots.
+  ASSERT_FALSE(client.CreatePublisher("slots_gone", 256, 4).ok());
+  ASSERT_TRUE(client.CreatePublisher("slots_gone", 256, 10).ok());
+}
+
 TEST_F(ClientTest, CreatePublisherThenSubscriber) {
   subspace::Client client;
   InitClient(client);
@@ -1088,6 +1171,35 @@ TEST_F(ClientTest, Publish2Message2AndReadSharedPtrs) {
   ASSERT_EQ(3, p2.use_count());
 }
 
+TEST_F(ClientTest, SharedPtrWithNoMessage) {
+  subspace::Client client;
+  ASSERT_TRUE(client.Init(Socket()).ok());
+  absl::StatusOr<Publisher> pub = client.CreatePublisher("dave6", 256, 4);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber(
+      "dave6", subspace::SubscriberOptions().SetMaxSharedPtrs(1));
+  ASSERT_TRUE(sub.ok());
+
+  // Reading an empty channel gives a null shared_ptr that doesn't count
+  // against the maximum.
+  auto read = [&sub](bool expect_message) {
+    absl::StatusOr<subspace::shared_ptr<const char>> p =
+        sub->ReadMessage<const char>();
+    ASSERT_TRUE(p.ok());
+    ASSERT_EQ(expect_message, static_cast<bool>(*p));
+  };
+  read(false);
+  read(false);
+
+  absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  memcpy(*buffer, "foobar", 6);
+  ASSERT_TRUE(pub->PublishMessage(6).ok());
+  read(true);
+  read(false);
+  read(false);
+}
+
 TEST_F(ClientTest, FindMessage) {
   subspace::Client pub_client;
   subspace::Client sub_client;
@@ -1164,6 +1276,110 @@ TEST_F(ClientTest, FindMessage) {
   }
 }
 
+TEST_F(ClientTest, FindMessageAfterWrap) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+
+  for (bool lock_free : {false, true}) {
+    std::string channel = lock_free ? "find_wrap_lf" : "find_wrap";
+    absl::StatusOr<Publisher> pub = pub_client.CreatePublisher(
+        channel, 256, 4, subspace::PublisherOptions().SetLockFree(lock_free));
+    ASSERT_TRUE(pub.ok());
+    absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber(channel);
+    ASSERT_TRUE(sub.ok());
+
+    // The timestamp index wraps around more than once.
+    std::vector<subspace::Message> msgs;
+    for (int i = 0; i < 10; i++) {
+      absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+      ASSERT_TRUE(buffer.ok());
+      int len = snprintf(reinterpret_cast<char *>(*buffer), 256, "wrap %d", i);
+      absl::StatusOr<const Message> pub_status = pub->PublishMessage(len + 1);
+      ASSERT_TRUE(pub_status.ok());
+      msgs.push_back(*pub_status);
+    }
+
+    // A message still in the channel.
+    absl::StatusOr<const Message> m = sub->FindMessage(msgs[8].timestamp);
+    ASSERT_TRUE(m.ok());
+    ASSERT_EQ(msgs[8].ordinal, m->ordinal);
+    ASSERT_STREQ("wrap 8", reinterpret_cast<const char *>(m->buffer));
+
+    // Between two messages finds the later one.
+    absl::StatusOr<const Message> next =
+        sub->FindMessage(msgs[8].timestamp + 1);
+    ASSERT_TRUE(next.ok());
+    ASSERT_EQ(msgs[9].ordinal, next->ordinal);
+
+    // A message that has gone.
+    absl::StatusOr<const Message> gone = sub->FindMessage(msgs[1].timestamp);
+    ASSERT_TRUE(gone.ok());
+    ASSERT_EQ(nullptr, gone->buffer);
+  }
+}
+
+TEST_F(ClientTest, ReadMessageAtAndRange) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+
+  for (bool lock_free : {false, true}) {
+    std::string channel = lock_free ? "read_at_lf" : "read_at";
+    absl::StatusOr<Publisher> pub = pub_client.CreatePublisher(
+        channel, 256, 8, subspace::PublisherOptions().SetLockFree(lock_free));
+    ASSERT_TRUE(pub.ok());
+    absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber(channel);
+    ASSERT_TRUE(sub.ok());
+
+    std::vector<subspace::Message> msgs;
+    for (int i = 0; i < 12; i++) {
+      absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+      ASSERT_TRUE(buffer.ok());
+      int len = snprintf(reinterpret_cast<char *>(*buffer), 256, "at %d", i);
+      absl::StatusOr<const Message> pub_status = pub->PublishMessage(len + 1);
+      ASSERT_TRUE(pub_status.ok());
+      msgs.push_back(*pub_status);
+    }
+
+    absl::StatusOr<const Message> m = sub->ReadMessageAt(msgs[9].ordinal);
+    ASSERT_TRUE(m.ok());
+    ASSERT_EQ(msgs[9].ordinal, m->ordinal);
+    ASSERT_STREQ("at 9", reinterpret_cast<const char *>(m->buffer));
+
+    // A message that has gone.
+    absl::StatusOr<const Message> gone = sub->ReadMessageAt(msgs[1].ordinal);
+    ASSERT_TRUE(gone.ok());
+    ASSERT_EQ(0, gone->length);
+
+    std::vector<subspace::Message> range;
+    ASSERT_TRUE(
+        sub->ReadRange(msgs[6].ordinal, msgs[8].ordinal, range).ok());
+    ASSERT_EQ(3, range.size());
+    for (int i = 0; i < 3; i++) {
+      ASSERT_EQ(msgs[6 + i].ordinal, range[i].ordinal);
+      ASSERT_EQ(absl::StrFormat("at %d", 6 + i),
+                reinterpret_cast<const char *>(range[i].buffer));
+    }
+
+    // The subscriber carries on after the range.
+    absl::StatusOr<const Message> next = sub->ReadMessage();
+    ASSERT_TRUE(next.ok());
+    ASSERT_EQ(msgs[9].ordinal, next->ordinal);
+
+    // Only the messages still in the channel are in the range.  The
+    // publisher holds one slot for its next message.
+    ASSERT_TRUE(sub->ReadRange(0, msgs[11].ordinal + 10, range).ok());
+    ASSERT_EQ(7, range.size());
+    ASSERT_EQ(msgs[5].ordinal, range.front().ordinal);
+    ASSERT_EQ(msgs[11].ordinal, range.back().ordinal);
+
+    ASSERT_FALSE(sub->ReadRange(5, 4, range).ok());
+  }
+}
+
 TEST_F(ClientTest, Mikael) {
   subspace::Client pub_client;
   subspace::Client sub_client;
@@ -1206,6 +1422,1794 @@ TEST_F(ClientTest, Mikael) {
   }
 }
 
+TEST_F(ClientTest, BatchPublish) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher("batch", 32, 20);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber("batch");
+  ASSERT_TRUE(sub.ok());
+
+  absl::StatusOr<std::vector<void *>> buffers = pub->GetMessageBuffers(10);
+  ASSERT_TRUE(buffers.ok());
+  ASSERT_EQ(10, buffers->size());
+  std::vector<int64_t> sizes;
+  for (int i = 0; i < 10; i++) {
+    snprintf(reinterpret_cast<char *>((*buffers)[i]), 32, "message %d", i);
+    sizes.push_back(32);
+  }
+
+  // Can't publish a single message or the wrong number of messages.
+  ASSERT_FALSE(pub->PublishMessage(32).ok());
+  ASSERT_FALSE(pub->PublishMessages({32}).ok());
+
+  absl::StatusOr<std::vector<Message>> msgs = pub->PublishMessages(sizes);
+  ASSERT_TRUE(msgs.ok());
+  ASSERT_EQ(10, msgs->size());
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(i + 1, (*msgs)[i].ordinal);
+  }
+
+  for (int i = 0; i < 10; i++) {
+    absl::StatusOr<Message> msg = sub->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(32, msg->length);
+    ASSERT_EQ(i + 1, msg->ordinal);
+    char expected[32];
+    snprintf(expected, sizeof(expected), "message %d", i);
+    ASSERT_STREQ(expected, reinterpret_cast<const char *>(msg->buffer));
+  }
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(0, msg->length);
+
+  // Single messages can be published after the batch.
+  absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  absl::StatusOr<const Message> pub_status = pub->PublishMessage(6);
+  ASSERT_TRUE(pub_status.ok());
+  ASSERT_EQ(11, pub_status->ordinal);
+
+  ASSERT_FALSE(pub->GetMessageBuffers(21).ok());
+}
+
+TEST_F(ClientTest, ReliableBatchPublish) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher(
+      "rel_batch", 32, 10, subspace::PublisherOptions().SetReliable(true));
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber(
+      "rel_batch", subspace::SubscriberOptions().SetReliable(true));
+  ASSERT_TRUE(sub.ok());
+
+  // The subscriber has seen nothing, so the publisher can't get slots past
+  // the activation message.
+  absl::StatusOr<std::vector<void *>> buffers = pub->GetMessageBuffers(10);
+  ASSERT_TRUE(buffers.ok());
+  size_t num_buffers = buffers->size();
+  ASSERT_LT(0, num_buffers);
+  ASSERT_GT(10, num_buffers);
+  std::vector<int64_t> sizes(num_buffers, 8);
+  absl::StatusOr<std::vector<Message>> msgs = pub->PublishMessages(sizes);
+  ASSERT_TRUE(msgs.ok());
+
+  // The subscriber gets all of them.  The first message is the activation.
+  for (size_t i = 0; i < num_buffers; i++) {
+    absl::StatusOr<Message> msg = sub->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(8, msg->length);
+    ASSERT_EQ(i + 2, msg->ordinal);
+  }
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(0, msg->length);
+}
+
+TEST_F(ClientTest, BatchRead) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher("batch_read", 32, 20);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber("batch_read");
+  ASSERT_TRUE(sub.ok());
+
+  for (int i = 0; i < 10; i++) {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    snprintf(reinterpret_cast<char *>(*buffer), 32, "message %d", i);
+    ASSERT_TRUE(pub->PublishMessage(32).ok());
+  }
+
+  std::vector<Message> msgs;
+  ASSERT_FALSE(sub->ReadMessages(0, msgs).ok());
+
+  // All the messages in a batch are valid at the same time.
+  ASSERT_TRUE(sub->ReadMessages(4, msgs).ok());
+  ASSERT_EQ(4, msgs.size());
+  for (int i = 0; i < 4; i++) {
+    ASSERT_EQ(i + 1, msgs[i].ordinal);
+    char expected[32];
+    snprintf(expected, sizeof(expected), "message %d", i);
+    ASSERT_STREQ(expected, reinterpret_cast<const char *>(msgs[i].buffer));
+  }
+  ASSERT_EQ(4, sub->CurrentOrdinal());
+
+  // Mix with a single read.
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(5, msg->ordinal);
+
+  ASSERT_TRUE(sub->ReadMessages(100, msgs).ok());
+  ASSERT_EQ(5, msgs.size());
+  ASSERT_EQ(6, msgs.front().ordinal);
+  ASSERT_EQ(10, msgs.back().ordinal);
+
+  ASSERT_TRUE(sub->ReadMessages(100, msgs).ok());
+  ASSERT_TRUE(msgs.empty());
+}
+
+TEST_F(ClientTest, BatchReadSharedPtrs) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher("batch_ptrs", 32, 10);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber(
+      "batch_ptrs", subspace::SubscriberOptions().SetMaxSharedPtrs(5));
+  ASSERT_TRUE(sub.ok());
+
+  for (int i = 0; i < 3; i++) {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    snprintf(reinterpret_cast<char *>(*buffer), 32, "message %d", i);
+    ASSERT_TRUE(pub->PublishMessage(32).ok());
+  }
+
+  std::vector<subspace::shared_ptr<const char>> ptrs;
+  ASSERT_TRUE(sub->ReadMessages<const char>(10, ptrs).ok());
+  ASSERT_EQ(3, ptrs.size());
+  for (int i = 0; i < 3; i++) {
+    char expected[32];
+    snprintf(expected, sizeof(expected), "message %d", i);
+    ASSERT_STREQ(expected, ptrs[i].get());
+    // The subscriber and the shared_ptr.
+    ASSERT_EQ(2, ptrs[i].use_count());
+  }
+
+  // Reading again drops the subscriber's references to the batch apart
+  // from the current message.
+  std::vector<subspace::shared_ptr<const char>> more;
+  ASSERT_TRUE(sub->ReadMessages<const char>(10, more).ok());
+  ASSERT_TRUE(more.empty());
+  ASSERT_EQ(1, ptrs[0].use_count());
+  ASSERT_EQ(1, ptrs[1].use_count());
+  ASSERT_EQ(2, ptrs[2].use_count());
+
+  // The batch is limited to the shared pointers that are left, so the
+  // messages that don't fit are read next time rather than lost.
+  for (int i = 3; i < 6; i++) {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    snprintf(reinterpret_cast<char *>(*buffer), 32, "message %d", i);
+    ASSERT_TRUE(pub->PublishMessage(32).ok());
+  }
+  ASSERT_TRUE(sub->ReadMessages<const char>(10, more).ok());
+  ASSERT_EQ(2, more.size());
+  ASSERT_STREQ("message 3", more[0].get());
+  ASSERT_STREQ("message 4", more[1].get());
+
+  // No shared pointers left.
+  std::vector<subspace::shared_ptr<const char>> last;
+  ASSERT_FALSE(sub->ReadMessages<const char>(10, last).ok());
+
+  ptrs.clear();
+  ASSERT_TRUE(sub->ReadMessages<const char>(10, last).ok());
+  ASSERT_EQ(1, last.size());
+  ASSERT_STREQ("message 5", last[0].get());
+}
+
+TEST_F(ClientTest, PublishWithPinnedSlots) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher("pinned", 32, 10);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber(
+      "pinned", subspace::SubscriberOptions().SetMaxSharedPtrs(5));
+  ASSERT_TRUE(sub.ok());
+
+  auto publish = [&pub](int i) {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    ASSERT_NE(nullptr, *buffer);
+    snprintf(reinterpret_cast<char *>(*buffer), 32, "message %d", i);
+    ASSERT_TRUE(pub->PublishMessage(32).ok());
+  };
+
+  // Keep references to the first 5 messages.
+  std::vector<subspace::shared_ptr<const char>> pinned;
+  for (int i = 0; i < 5; i++) {
+    publish(i);
+    absl::StatusOr<subspace::shared_ptr<const char>> p =
+        sub->ReadMessage<const char>();
+    ASSERT_TRUE(p.ok());
+    ASSERT_TRUE(*p);
+    pinned.push_back(std::move(*p));
+  }
+
+  // The publisher has to find slots around the pinned ones.
+  for (int i = 5; i < 100; i++) {
+    publish(i);
+  }
+
+  for (int i = 0; i < 5; i++) {
+    char expected[32];
+    snprintf(expected, sizeof(expected), "message %d", i);
+    ASSERT_STREQ(expected, pinned[i].get());
+  }
+  pinned.clear();
+
+  // The newest messages are in the channel, in order.
+  int64_t last_ordinal = 0;
+  int num_read = 0;
+  for (;;) {
+    absl::StatusOr<Message> msg = sub->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    if (msg->length == 0) {
+      break;
+    }
+    ASSERT_GT(msg->ordinal, last_ordinal);
+    last_ordinal = msg->ordinal;
+    num_read++;
+  }
+  ASSERT_EQ(100, last_ordinal);
+  ASSERT_LT(0, num_read);
+
+  // Once released, the pinned slots are reused so the channel holds the
+  // newest messages again.  The publisher holds one slot and the
+  // subscriber still holds message 100, leaving 8 slots.
+  for (int i = 100; i < 120; i++) {
+    publish(i);
+  }
+  for (int64_t ordinal = 113; ordinal <= 120; ordinal++) {
+    absl::StatusOr<Message> msg = sub->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(ordinal, msg->ordinal);
+  }
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(0, msg->length);
+}
+
+TEST_F(ClientTest, ManySubscribersOwnSlot) {
+  // More than 64 subscribers so that the slot owners take more than one
+  // word per slot.
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher("many_subs", 32, 100);
+  ASSERT_TRUE(pub.ok());
+
+  absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  memcpy(*buffer, "foobar", 6);
+  ASSERT_TRUE(pub->PublishMessage(6).ok());
+
+  std::vector<Subscriber> subs;
+  for (int i = 0; i < 80; i++) {
+    absl::StatusOr<Subscriber> sub = client.CreateSubscriber("many_subs");
+    ASSERT_TRUE(sub.ok());
+    absl::StatusOr<Message> msg = sub->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(6, msg->length);
+    subs.push_back(std::move(*sub));
+  }
+
+  // Removing the subscribers releases their references to the slot.  The
+  // only references are now the new subscriber and its shared pointer.
+  subs.clear();
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber(
+      "many_subs", subspace::SubscriberOptions().SetMaxSharedPtrs(1));
+  ASSERT_TRUE(sub.ok());
+  absl::StatusOr<subspace::shared_ptr<const char>> p =
+      sub->ReadMessage<const char>();
+  ASSERT_TRUE(p.ok());
+  ASSERT_TRUE(*p);
+  ASSERT_EQ(2, p->use_count());
+}
+
+TEST_F(ClientTest, LockFreePublishAndRead) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher(
+      "lock_free", 256, 10, subspace::PublisherOptions().SetLockFree(true));
+  ASSERT_TRUE(pub.ok());
+
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber("lock_free");
+  ASSERT_TRUE(sub.ok());
+
+  std::vector<subspace::Message> msgs;
+  for (int i = 0; i < 5; i++) {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    char *buf = reinterpret_cast<char *>(*buffer);
+    int len = snprintf(buf, 256, "foobar %d", i);
+
+    absl::StatusOr<const Message> pub_status = pub->PublishMessage(len + 1);
+    ASSERT_TRUE(pub_status.ok());
+    msgs.push_back(*pub_status);
+  }
+
+  for (int i = 0; i < 5; i++) {
+    absl::StatusOr<Message> msg = sub->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(msgs[i].ordinal, msg->ordinal);
+    char expected[32];
+    snprintf(expected, sizeof(expected), "foobar %d", i);
+    ASSERT_STREQ(expected, reinterpret_cast<const char *>(msg->buffer));
+  }
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(0, msg->length);
+
+  // Find a message by timestamp.
+  absl::StatusOr<const Message> m = sub->FindMessage(msgs[2].timestamp);
+  ASSERT_TRUE(m.ok());
+  ASSERT_EQ(msgs[2].ordinal, m->ordinal);
+
+  // Newest message.
+  msg = sub->ReadMessage(subspace::ReadMode::kReadNewest);
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(msgs[4].ordinal, msg->ordinal);
+}
+
+TEST_F(ClientTest, LockFreeSinglePublisher) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher(
+      "lock_free1", 256, 10, subspace::PublisherOptions().SetLockFree(true));
+  ASSERT_TRUE(pub.ok());
+
+  // Can't have another publisher, lock-free or not.
+  absl::StatusOr<Publisher> pub2 = client.CreatePublisher(
+      "lock_free1", 256, 10, subspace::PublisherOptions().SetLockFree(true));
+  ASSERT_FALSE(pub2.ok());
+  absl::StatusOr<Publisher> pub3 = client.CreatePublisher("lock_free1", 256, 10);
+  ASSERT_FALSE(pub3.ok());
+
+  // And the other way around.
+  absl::StatusOr<Publisher> pub4 = client.CreatePublisher("lock_free2", 256, 10);
+  ASSERT_TRUE(pub4.ok());
+  absl::StatusOr<Publisher> pub5 = client.CreatePublisher(
+      "lock_free2", 256, 10, subspace::PublisherOptions().SetLockFree(true));
+  ASSERT_FALSE(pub5.ok());
+}
+
+TEST_F(ClientTest, LockFreeReliablePublisher) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher(
+      "lock_free_rel", 32, 5,
+      subspace::PublisherOptions().SetReliable(true).SetLockFree(true));
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber(
+      "lock_free_rel", subspace::SubscriberOptions().SetReliable(true));
+  ASSERT_TRUE(sub.ok());
+
+  // The subscriber holds one slot, so we can publish 4 messages before
+  // running out of slots.
+  int64_t ordinal = 0;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 4; i++) {
+      absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+      ASSERT_TRUE(buffer.ok());
+      ASSERT_NE(nullptr, *buffer);
+      memcpy(*buffer, "foobar", 6);
+      absl::StatusOr<const Message> pub_status = pub->PublishMessage(6);
+      ASSERT_TRUE(pub_status.ok());
+    }
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    ASSERT_EQ(nullptr, *buffer);
+
+    // Read them all, none are dropped.
+    for (int i = 0; i < 4; i++) {
+      absl::StatusOr<Message> msg = sub->ReadMessage();
+      ASSERT_TRUE(msg.ok());
+      ASSERT_EQ(6, msg->length);
+      if (ordinal != 0) {
+        ASSERT_EQ(ordinal + 1, msg->ordinal);
+      }
+      ordinal = msg->ordinal;
+    }
+  }
+}
+
+TEST_F(ClientTest, LockFreeBatchPublish) {
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub = client.CreatePublisher(
+      "lf_batch", 32, 50, subspace::PublisherOptions().SetLockFree(true));
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber("lf_batch");
+  ASSERT_TRUE(sub.ok());
+
+  for (int batch = 0; batch < 10; batch++) {
+    absl::StatusOr<std::vector<void *>> buffers = pub->GetMessageBuffers(20);
+    ASSERT_TRUE(buffers.ok());
+    ASSERT_EQ(20, buffers->size());
+    std::vector<int64_t> sizes;
+    for (void *buffer : *buffers) {
+      snprintf(reinterpret_cast<char *>(buffer), 32, "batch %d", batch);
+      sizes.push_back(16);
+    }
+    ASSERT_TRUE(pub->PublishMessages(sizes).ok());
+
+    // Alternate between single and batch reads.
+    std::vector<Message> msgs;
+    if (batch % 2 == 0) {
+      for (int i = 0; i < 20; i++) {
+        absl::StatusOr<Message> msg = sub->ReadMessage();
+        ASSERT_TRUE(msg.ok());
+        msgs.push_back(*msg);
+      }
+    } else {
+      ASSERT_TRUE(sub->ReadMessages(50, msgs).ok());
+      ASSERT_EQ(20, msgs.size());
+    }
+    for (int i = 0; i < 20; i++) {
+      ASSERT_EQ(batch * 20 + i + 1, msgs[i].ordinal);
+      char expected[32];
+      snprintf(expected, sizeof(expected), "batch %d", batch);
+      ASSERT_STREQ(expected, reinterpret_cast<const char *>(msgs[i].buffer));
+    }
+  }
+}
+
+TEST_F(ClientTest, LockFreeThreads) {
+  constexpr int kNumMessages = 20000;
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher(
+      "lock_free_mt", 64, 8, subspace::PublisherOptions().SetLockFree(true));
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber("lock_free_mt");
+  ASSERT_TRUE(sub.ok());
+
+  std::thread publisher([&pub]() {
+    for (int i = 1; i <= kNumMessages; i++) {
+      absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+      ASSERT_TRUE(buffer.ok());
+      ASSERT_NE(nullptr, *buffer);
+      memcpy(*buffer, &i, sizeof(i));
+      absl::StatusOr<const Message> pub_status = pub->PublishMessage(sizeof(i));
+      ASSERT_TRUE(pub_status.ok());
+    }
+  });
+
+  // Messages may be dropped but must be in order and intact.
+  int last = 0;
+  while (last != kNumMessages) {
+    absl::StatusOr<Message> msg = sub->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    if (msg->length == 0) {
+      std::this_thread::yield();
+      continue;
+    }
+    int value;
+    memcpy(&value, msg->buffer, sizeof(value));
+    ASSERT_EQ(msg->ordinal, value);
+    ASSERT_GT(value, last);
+    last = value;
+  }
+  publisher.join();
+}
+
+TEST_F(ClientTest, SpinningSubscriber) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher("spin", 32, 8);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber(
+      "spin", subspace::SubscriberOptions().SetSpinBudget(5000000000));
+  ASSERT_TRUE(sub.ok());
+
+  // Nothing to read yet.  This clears the trigger.
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(0, msg->length);
+
+  std::thread publisher([&pub]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    memcpy(*buffer, "foobar", 6);
+    ASSERT_TRUE(pub->PublishMessage(6).ok());
+  });
+  ASSERT_TRUE(sub->Wait().ok());
+  publisher.join();
+
+  // The only subscriber was spinning so it wasn't triggered.
+  struct pollfd fd = sub->GetPollFd();
+  ASSERT_EQ(0, ::poll(&fd, 1, 0));
+
+  msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(6, msg->length);
+}
+
+TEST_F(ClientTest, SpinningSubscriberBlocks) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher("spin_block", 32, 8);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber(
+      "spin_block", subspace::SubscriberOptions().SetSpinBudget(1000));
+  ASSERT_TRUE(sub.ok());
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+
+  // The spin budget runs out before the message is published so the
+  // subscriber has to be triggered.
+  std::thread publisher([&pub]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    ASSERT_TRUE(pub->PublishMessage(6).ok());
+  });
+  ASSERT_TRUE(sub->Wait().ok());
+  publisher.join();
+
+  msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(6, msg->length);
+}
+
+TEST_F(ClientTest, SpinningReliablePublisher) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher(
+      "spin_rel", 32, 5,
+      subspace::PublisherOptions().SetReliable(true).SetSpinBudget(
+          5000000000));
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber(
+      "spin_rel", subspace::SubscriberOptions().SetReliable(true));
+  ASSERT_TRUE(sub.ok());
+
+  // Fill the channel.
+  int num_published = 0;
+  for (;;) {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    if (*buffer == nullptr) {
+      break;
+    }
+    ASSERT_TRUE(pub->PublishMessage(6).ok());
+    num_published++;
+  }
+  ASSERT_LT(0, num_published);
+
+  std::thread subscriber([&sub]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (;;) {
+      absl::StatusOr<Message> msg = sub->ReadMessage();
+      ASSERT_TRUE(msg.ok());
+      if (msg->length == 0) {
+        break;
+      }
+    }
+  });
+  ASSERT_TRUE(pub->Wait().ok());
+  subscriber.join();
+
+  absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  ASSERT_NE(nullptr, *buffer);
+}
+
+TEST_F(ClientTest, SubscriberSet) {
+  subspace::Client client;
+  InitClient(client);
+  std::vector<Publisher> pubs;
+  std::vector<Subscriber> subs;
+  for (int i = 0; i < 3; i++) {
+    std::string name = "set" + std::to_string(i);
+    absl::StatusOr<Publisher> pub = client.CreatePublisher(name, 32, 5);
+    ASSERT_TRUE(pub.ok());
+    pubs.push_back(std::move(*pub));
+    absl::StatusOr<Subscriber> sub = client.CreateSubscriber(name);
+    ASSERT_TRUE(sub.ok());
+    subs.push_back(std::move(*sub));
+  }
+
+  subspace::SubscriberSet set;
+  absl::StatusOr<std::vector<Subscriber *>> ready = set.Wait(0);
+  ASSERT_FALSE(ready.ok());
+  for (auto &sub : subs) {
+    ASSERT_TRUE(set.Add(&sub).ok());
+  }
+  ASSERT_FALSE(set.Add(&subs[0]).ok());
+  ASSERT_EQ(3, set.Size());
+
+  // The subscribers were triggered when they were created but there's
+  // nothing to read.
+  ready = set.Wait(1000000);
+  ASSERT_TRUE(ready.ok());
+  ASSERT_TRUE(ready->empty());
+
+  absl::StatusOr<void *> buffer = pubs[1].GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  ASSERT_TRUE(pubs[1].PublishMessage(6).ok());
+
+  ready = set.Wait();
+  ASSERT_TRUE(ready.ok());
+  ASSERT_EQ(1, ready->size());
+  ASSERT_EQ(&subs[1], (*ready)[0]);
+  absl::StatusOr<Message> msg = subs[1].ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(6, msg->length);
+  msg = subs[1].ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(0, msg->length);
+
+  // A new publisher triggers the subscriber without a message.
+  absl::StatusOr<Publisher> pub2 = client.CreatePublisher("set2", 32, 5);
+  ASSERT_TRUE(pub2.ok());
+  ready = set.Wait(1000000);
+  ASSERT_TRUE(ready.ok());
+  ASSERT_TRUE(ready->empty());
+
+  ASSERT_TRUE(set.Remove(&subs[1]).ok());
+  ASSERT_FALSE(set.Remove(&subs[1]).ok());
+  buffer = pubs[1].GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  ASSERT_TRUE(pubs[1].PublishMessage(6).ok());
+  ready = set.Wait(1000000);
+  ASSERT_TRUE(ready.ok());
+  ASSERT_TRUE(ready->empty());
+}
+
+TEST_F(ClientTest, SubscriberSetCoroutines) {
+  co::CoroutineScheduler machine;
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Publisher> pub1 = client.CreatePublisher("coset1", 32, 5);
+  ASSERT_TRUE(pub1.ok());
+  absl::StatusOr<Publisher> pub2 = client.CreatePublisher("coset2", 32, 5);
+  ASSERT_TRUE(pub2.ok());
+  absl::StatusOr<Subscriber> sub1 = client.CreateSubscriber("coset1");
+  ASSERT_TRUE(sub1.ok());
+  absl::StatusOr<Subscriber> sub2 = client.CreateSubscriber("coset2");
+  ASSERT_TRUE(sub2.ok());
+
+  int num_read = 0;
+  co::Coroutine receiver(machine, [&](co::Coroutine *c) {
+    subspace::SubscriberSet set(c);
+    ASSERT_TRUE(set.Add(&*sub1).ok());
+    ASSERT_TRUE(set.Add(&*sub2).ok());
+    while (num_read < 4) {
+      absl::StatusOr<std::vector<Subscriber *>> ready = set.Wait();
+      ASSERT_TRUE(ready.ok());
+      for (Subscriber *sub : *ready) {
+        for (;;) {
+          absl::StatusOr<Message> msg = sub->ReadMessage();
+          ASSERT_TRUE(msg.ok());
+          if (msg->length == 0) {
+            break;
+          }
+          num_read++;
+        }
+      }
+    }
+  });
+
+  co::Coroutine sender(machine, [&](co::Coroutine *c) {
+    for (int i = 0; i < 4; i++) {
+      Publisher &pub = i % 2 == 0 ? *pub1 : *pub2;
+      absl::StatusOr<void *> buffer = pub.GetMessageBuffer();
+      ASSERT_TRUE(buffer.ok());
+      ASSERT_TRUE(pub.PublishMessage(6).ok());
+      c->Nanosleep(1000000);
+    }
+  });
+  machine.Run();
+  ASSERT_EQ(4, num_read);
+}
+
+TEST_F(ClientTest, ChannelStatistics) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  subspace::Client stats_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+  ASSERT_TRUE(stats_client.Init(Socket()).ok());
+
+  absl::StatusOr<Subscriber> stats_sub =
+      stats_client.CreateSubscriber("/subspace/Statistics");
+  ASSERT_TRUE(stats_sub.ok());
+
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher("stats", 32, 4);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber("stats");
+  ASSERT_TRUE(sub.ok());
+
+  auto publish = [&pub]() {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    memcpy(*buffer, "foobar", 6);
+    ASSERT_TRUE(pub->PublishMessage(6).ok());
+  };
+  int num_read = 0;
+  auto read_all = [&sub, &num_read]() {
+    for (;;) {
+      absl::StatusOr<Message> msg = sub->ReadMessage();
+      ASSERT_TRUE(msg.ok());
+      if (msg->length == 0) {
+        break;
+      }
+      num_read++;
+    }
+  };
+
+  // Read one message and then publish more than will fit in the channel
+  // so that the subscriber drops some.
+  publish();
+  read_all();
+  for (int i = 0; i < 10; i++) {
+    publish();
+  }
+  read_all();
+  ASSERT_LT(num_read, 11);
+
+  // The server publishes the statistics every 2 seconds.  The first
+  // message might have been sent before we published.
+  bool found = false;
+  for (int i = 0; i < 3 && !found; i++) {
+    ASSERT_TRUE(stats_sub->Wait().ok());
+    absl::StatusOr<Message> msg = stats_sub->ReadMessage(
+        subspace::ReadMode::kReadNewest);
+    ASSERT_TRUE(msg.ok());
+    if (msg->length == 0) {
+      continue;
+    }
+    subspace::Statistics stats;
+    ASSERT_TRUE(stats.ParseFromArray(msg->buffer, msg->length));
+    for (auto &channel : stats.channels()) {
+      if (channel.channel_name() != "stats" ||
+          channel.total_messages() != 11) {
+        continue;
+      }
+      found = true;
+      int64_t num_latencies = 0;
+      for (int64_t count : channel.latency_buckets()) {
+        num_latencies += count;
+      }
+      ASSERT_EQ(num_read, num_latencies);
+      ASSERT_EQ(11 - num_read, channel.num_drops());
+      // Subscribers are only triggered when they have seen all the
+      // messages.
+      ASSERT_LT(0, channel.num_triggers());
+      ASSERT_GT(11, channel.num_triggers());
+      ASSERT_LT(0, channel.latency_p50_ns());
+      ASSERT_LE(channel.latency_p50_ns(), channel.latency_p999_ns());
+    }
+  }
+  ASSERT_TRUE(found);
+}
+
+TEST_F(ClientTest, ChannelStatisticsManyChannels) {
+  subspace::Client client;
+  ASSERT_TRUE(client.Init(Socket()).ok());
+  absl::StatusOr<Subscriber> stats_sub =
+      client.CreateSubscriber("/subspace/Statistics");
+  ASSERT_TRUE(stats_sub.ok());
+
+  // More channels than will fit in the statistics channel's initial slot.
+  constexpr int kNumChannels = 200;
+  std::vector<Publisher> pubs;
+  for (int i = 0; i < kNumChannels; i++) {
+    absl::StatusOr<Publisher> pub = client.CreatePublisher(
+        absl::StrFormat("many_stats_channel_%d", i), 32, 4);
+    ASSERT_TRUE(pub.ok());
+    pubs.push_back(std::move(*pub));
+  }
+
+  bool found = false;
+  for (int i = 0; i < 3 && !found; i++) {
+    ASSERT_TRUE(stats_sub->Wait().ok());
+    absl::StatusOr<Message> msg =
+        stats_sub->ReadMessage(subspace::ReadMode::kReadNewest);
+    ASSERT_TRUE(msg.ok());
+    if (msg->length == 0) {
+      continue;
+    }
+    subspace::Statistics stats;
+    ASSERT_TRUE(stats.ParseFromArray(msg->buffer, msg->length));
+    int num_channels = 0;
+    for (auto &channel : stats.channels()) {
+      if (channel.channel_name().rfind("many_stats_channel_", 0) == 0) {
+        num_channels++;
+      }
+    }
+    found = num_channels == kNumChannels;
+  }
+  ASSERT_TRUE(found);
+}
+
+TEST_F(ClientTest, PrefaultPublishAndResize) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher(
+      "prefault", 256, 10, subspace::PublisherOptions().SetPrefault(true));
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber("prefault");
+  ASSERT_TRUE(sub.ok());
+
+  absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  memcpy(*buffer, "foobar", 6);
+  ASSERT_TRUE(pub->PublishMessage(6).ok());
+
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(6, msg->length);
+
+  // The new buffers are faulted in too.
+  absl::StatusOr<void *> buffer2 = pub->GetMessageBuffer(4000);
+  ASSERT_TRUE(buffer2.ok());
+  ASSERT_EQ(4096, pub->SlotSize());
+  memcpy(*buffer2, "barfoofoobar", 12);
+  ASSERT_TRUE(pub->PublishMessage(12).ok());
+
+  absl::StatusOr<Message> msg2 = sub->ReadMessage();
+  ASSERT_TRUE(msg2.ok());
+  ASSERT_EQ(12, msg2->length);
+  ASSERT_EQ(0, memcmp(msg2->buffer, "barfoofoobar", 12));
+}
+
+TEST_F(ClientTest, HugePages) {
+#if defined(__linux__)
+  // Huge pages need to be configured by the system administrator.  If
+  // there are none we expect a clear error.
+  int64_t num_huge_pages = 0;
+  if (FILE *fp = fopen("/proc/sys/vm/nr_hugepages", "r"); fp != nullptr) {
+    if (fscanf(fp, "%" PRId64, &num_huge_pages) != 1) {
+      num_huge_pages = 0;
+    }
+    fclose(fp);
+  }
+  subspace::Client client;
+  ASSERT_TRUE(client.Init(Socket()).ok());
+  absl::StatusOr<Publisher> pub = client.CreatePublisher(
+      "huge", 1024, 16, subspace::PublisherOptions().SetHugePages(true));
+  if (num_huge_pages == 0) {
+    ASSERT_FALSE(pub.ok());
+    // The channels that failed don't use up the channel ids.
+    for (int i = 0; i < subspace::kMaxChannels; i++) {
+      ASSERT_FALSE(client
+                       .CreatePublisher("huge", 1024, 16,
+                                        subspace::PublisherOptions()
+                                            .SetHugePages(true))
+                       .ok());
+    }
+    ASSERT_TRUE(client.CreatePublisher("not_huge", 1024, 16).ok());
+    return;
+  }
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber("huge");
+  ASSERT_TRUE(sub.ok());
+  absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  memcpy(*buffer, "foobar", 6);
+  ASSERT_TRUE(pub->PublishMessage(6).ok());
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(6, msg->length);
+#endif
+}
+
+TEST_F(ClientTest, ChannelDirectoryNumaNode) {
+  subspace::Client pub_client;
+  subspace::Client dir_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(dir_client.Init(Socket()).ok());
+
+  absl::StatusOr<Subscriber> dir_sub =
+      dir_client.CreateSubscriber("/subspace/ChannelDirectory");
+  ASSERT_TRUE(dir_sub.ok());
+
+  // Node 0 always exists.
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher(
+      "numa", 256, 4, subspace::PublisherOptions().SetNumaNode(0));
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Publisher> pub2 = pub_client.CreatePublisher(
+      "no_numa", 256, 4,
+      subspace::PublisherOptions().SetNumaNode(subspace::kNoNumaNode));
+  ASSERT_TRUE(pub2.ok());
+
+  // A directory delta is sent when a channel is created.  The channels
+  // might be in different messages.
+  bool found_numa = false;
+  bool found_no_numa = false;
+  for (int i = 0; i < 10 && !(found_numa && found_no_numa); i++) {
+    ASSERT_TRUE(dir_sub->Wait().ok());
+    for (;;) {
+      absl::StatusOr<Message> msg = dir_sub->ReadMessage();
+      ASSERT_TRUE(msg.ok());
+      if (msg->length == 0) {
+        break;
+      }
+      subspace::ChannelDirectory dir;
+      ASSERT_TRUE(dir.ParseFromArray(msg->buffer, msg->length));
+      for (auto &channel : dir.channels()) {
+        if (channel.name() == "numa") {
+          ASSERT_EQ(0, channel.numa_node());
+          found_numa = true;
+        } else if (channel.name() == "no_numa") {
+          ASSERT_EQ(-1, channel.numa_node());
+          found_no_numa = true;
+        }
+      }
+    }
+  }
+  ASSERT_TRUE(found_numa);
+  ASSERT_TRUE(found_no_numa);
+}
+
+TEST_F(ClientTest, ChannelDirectoryDeltas) {
+  auto pub_client = std::make_unique<subspace::Client>();
+  subspace::Client dir_client;
+  ASSERT_TRUE(pub_client->Init(Socket()).ok());
+  ASSERT_TRUE(dir_client.Init(Socket()).ok());
+
+  absl::StatusOr<Subscriber> dir_sub =
+      dir_client.CreateSubscriber("/subspace/ChannelDirectory");
+  ASSERT_TRUE(dir_sub.ok());
+
+  // Read directory messages until one satisfies done.  Each of them
+  // follows on from the previous one.
+  uint64_t generation = 0;
+  auto read_until = [&](std::function<bool(const subspace::ChannelDirectory &)>
+                            done) {
+    bool found = false;
+    for (int i = 0; i < 20 && !found; i++) {
+      ASSERT_TRUE(dir_sub->Wait().ok());
+      for (;;) {
+        absl::StatusOr<Message> msg = dir_sub->ReadMessage();
+        ASSERT_TRUE(msg.ok());
+        if (msg->length == 0) {
+          break;
+        }
+        subspace::ChannelDirectory dir;
+        ASSERT_TRUE(dir.ParseFromArray(msg->buffer, msg->length));
+        if (generation != 0) {
+          ASSERT_EQ(generation + 1, dir.generation());
+        }
+        generation = dir.generation();
+        found |= done(dir);
+      }
+    }
+    ASSERT_TRUE(found);
+  };
+
+  // A new subscriber is sent a snapshot.
+  read_until([](const subspace::ChannelDirectory &dir) {
+    return !dir.is_delta();
+  });
+
+  // Creating a channel sends a delta with just that channel in it.
+  absl::StatusOr<Publisher> pub =
+      pub_client->CreatePublisher("delta", 256, 4);
+  ASSERT_TRUE(pub.ok());
+  read_until([](const subspace::ChannelDirectory &dir) {
+    return dir.is_delta() && dir.channels_size() == 1 &&
+           dir.channels(0).name() == "delta" &&
+           dir.channels(0).slot_size() == 256;
+  });
+
+  // The channel is removed when the client goes away.  This puts it in the
+  // removed channels.
+  pub = absl::InternalError("removed");
+  pub_client.reset();
+  read_until([](const subspace::ChannelDirectory &dir) {
+    return dir.is_delta() && dir.channels_size() == 0 &&
+           dir.removed_channels_size() == 1 &&
+           dir.removed_channels(0) == "delta";
+  });
+}
+
+TEST_F(ClientTest, PublishSizeClasses) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher(
+      "classes", 256, 10, subspace::PublisherOptions().SetSizeClasses(true));
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber("classes");
+  ASSERT_TRUE(sub.ok());
+
+  auto publish = [&pub](int32_t max_size, const char *s) {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer(max_size);
+    ASSERT_TRUE(buffer.ok());
+    ASSERT_EQ(max_size == 100 ? 256 : 4096, pub->CurrentSlotSize());
+    memcpy(*buffer, s, strlen(s));
+    ASSERT_TRUE(pub->PublishMessage(strlen(s)).ok());
+  };
+
+  // A big message adds a 4096 byte size class and then small messages go
+  // back into the 256 byte class.
+  publish(100, "small1");
+  publish(4000, "big");
+  publish(100, "small2");
+  publish(-1, "unsized");
+  ASSERT_EQ(4096, pub->SlotSize());
+
+  // Is the message in the given buffer?
+  auto in_buffer = [&sub](const Message &msg, int index) {
+    const subspace::BufferSet &buffer = sub->GetBuffers()[index];
+    const char *p = reinterpret_cast<const char *>(msg.buffer);
+    return buffer.buffer != nullptr && p > buffer.buffer &&
+           p < buffer.buffer + 10 * (buffer.slot_size + 64);
+  };
+  const char *expected[] = {"small1", "big", "small2", "unsized"};
+  int expected_buffer[] = {0, 1, 0, 1};
+  for (int i = 0; i < 4; i++) {
+    absl::StatusOr<Message> msg = sub->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(strlen(expected[i]), msg->length);
+    ASSERT_EQ(0, memcmp(msg->buffer, expected[i], msg->length));
+    ASSERT_EQ(2, sub->GetBuffers().size());
+    ASSERT_TRUE(in_buffer(*msg, expected_buffer[i]));
+  }
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(0, msg->length);
+
+  // The smaller class stays mapped.
+  publish(100, "small3");
+  ASSERT_NE(nullptr, pub->GetBuffers()[0].buffer);
+  ASSERT_NE(nullptr, sub->GetBuffers()[0].buffer);
+}
+
+TEST_F(ClientTest, PublishResizeAndShrink) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+  constexpr int kNumSlots = 10;
+  absl::StatusOr<Publisher> pub =
+      pub_client.CreatePublisher("shrink", 256, kNumSlots);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber("shrink");
+  ASSERT_TRUE(sub.ok());
+
+  // A big message resizes the channel.
+  absl::StatusOr<void *> buffer = pub->GetMessageBuffer(1000);
+  ASSERT_TRUE(buffer.ok());
+  ASSERT_EQ(1024, pub->SlotSize());
+  memset(*buffer, 'x', 1000);
+  ASSERT_TRUE(pub->PublishMessage(1000).ok());
+  absl::StatusOr<Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(1000, msg->length);
+
+  // Keep publishing small messages until the server shrinks the channel.
+  for (int i = 0; i < 50 && pub->SlotSize() != 256; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    memcpy(*buffer, "small", 5);
+    ASSERT_TRUE(pub->PublishMessage(5).ok());
+  }
+  ASSERT_EQ(256, pub->SlotSize());
+
+  auto read_all = [&sub]() {
+    for (;;) {
+      absl::StatusOr<Message> msg = sub->ReadMessage();
+      ASSERT_TRUE(msg.ok());
+      if (msg->length == 0) {
+        break;
+      }
+      ASSERT_EQ(5, msg->length);
+      ASSERT_EQ(0, memcmp(msg->buffer, "small", 5));
+    }
+  };
+  read_all();
+
+  // Once all the slots have moved to the smaller buffer, the big one is
+  // unmapped.  The subscriber picks up the new buffer.
+  for (int i = 0; i < kNumSlots * 2; i++) {
+    buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    memcpy(*buffer, "small", 5);
+    ASSERT_TRUE(pub->PublishMessage(5).ok());
+    read_all();
+  }
+  ASSERT_EQ(256, sub->SlotSize());
+  auto &pub_buffers = pub->GetBuffers();
+  ASSERT_EQ(3, pub_buffers.size());
+  ASSERT_EQ(nullptr, pub_buffers[1].buffer);
+  ASSERT_NE(nullptr, pub_buffers[2].buffer);
+
+  // Another big message grows it again.
+  buffer = pub->GetMessageBuffer(1000);
+  ASSERT_TRUE(buffer.ok());
+  ASSERT_EQ(1024, pub->SlotSize());
+  memset(*buffer, 'y', 1000);
+  ASSERT_TRUE(pub->PublishMessage(1000).ok());
+  msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(1000, msg->length);
+  ASSERT_EQ('y', reinterpret_cast<const char *>(msg->buffer)[999]);
+}
+
+TEST_F(ClientTest, TriggerTableChurn) {
+  subspace::Client pub_client;
+  subspace::Client sub_client;
+  ASSERT_TRUE(pub_client.Init(Socket()).ok());
+  ASSERT_TRUE(sub_client.Init(Socket()).ok());
+  absl::StatusOr<Publisher> pub = pub_client.CreatePublisher("churn", 256, 16);
+  ASSERT_TRUE(pub.ok());
+
+  auto publish = [&pub](const char *s) {
+    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ASSERT_TRUE(buffer.ok());
+    memcpy(*buffer, s, strlen(s));
+    ASSERT_TRUE(pub->PublishMessage(strlen(s)).ok());
+  };
+  auto check_triggered = [](std::vector<Subscriber> &subs, size_t length) {
+    for (auto &sub : subs) {
+      struct pollfd fd = sub.GetPollFd();
+      ASSERT_EQ(1, ::poll(&fd, 1, 0));
+      absl::StatusOr<Message> msg =
+          sub.ReadMessage(subspace::ReadMode::kReadNewest);
+      ASSERT_TRUE(msg.ok());
+      ASSERT_EQ(length, msg->length);
+    }
+  };
+
+  // The subscribers are created after the publisher, which picks up their
+  // trigger fds from the channel's trigger table.
+  std::vector<Subscriber> subs;
+  for (int i = 0; i < 4; i++) {
+    absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber("churn");
+    ASSERT_TRUE(sub.ok());
+    subs.push_back(std::move(*sub));
+  }
+  publish("foo");
+  check_triggered(subs, 3);
+
+  // Remove some and add another.  The new one reuses a user id.
+  subs.erase(subs.begin(), subs.begin() + 2);
+  absl::StatusOr<Subscriber> sub = sub_client.CreateSubscriber("churn");
+  ASSERT_TRUE(sub.ok());
+  subs.push_back(std::move(*sub));
+  publish("foobar");
+  check_triggered(subs, 6);
+}
+
+TEST_F(ClientTest, ConcurrentClients) {
+  // Handle the clients on a few threads.
+  TestServer server;
+  server.Get().SetNumThreads(3);
+  server.Start();
+  const std::string &socket = server.Socket();
+
+  // The clients are handled on different server threads.  Some of them
+  // share channels.
+  constexpr int kNumThreads = 8;
+  constexpr int kNumChannels = 4;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([i, &socket]() {
+      std::string channel = "concurrent" + std::to_string(i % kNumChannels);
+      for (int j = 0; j < 20; j++) {
+        subspace::Client client;
+        ASSERT_TRUE(client.Init(socket).ok());
+        absl::StatusOr<Publisher> pub = client.CreatePublisher(channel, 64, 8);
+        ASSERT_TRUE(pub.ok());
+        absl::StatusOr<Subscriber> sub = client.CreateSubscriber(channel);
+        ASSERT_TRUE(sub.ok());
+
+        absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+        ASSERT_TRUE(buffer.ok());
+        memcpy(*buffer, &i, sizeof(i));
+        ASSERT_TRUE(pub->PublishMessage(sizeof(i)).ok());
+        // Other threads might have published to the channel too.
+        absl::StatusOr<Message> msg =
+            sub->ReadMessage(subspace::ReadMode::kReadNewest);
+        ASSERT_TRUE(msg.ok());
+        ASSERT_EQ(sizeof(i), msg->length);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+TEST_F(ClientTest, ReconnectToMultiThreadedServer) {
+  TestServer server;
+  server.Get().SetNumThreads(3);
+  server.Start();
+
+  // Keep the server threads busy with other clients.
+  std::atomic<bool> done = false;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([i, &server, &done]() {
+      std::string channel = "busy" + std::to_string(i);
+      while (!done) {
+        subspace::Client client;
+        EXPECT_TRUE(client.Init(server.Socket()).ok());
+        for (int j = 0; j < 10; j++) {
+          EXPECT_TRUE(client.CreateSubscriber(channel).ok());
+        }
+      }
+    });
+  }
+
+  // Each client creates a channel and goes away without removing it, as
+  // if its process had crashed.  The next client connects straight
+  // afterwards and creates the channel again with a different number of
+  // slots.  The two clients might be handled on different server threads,
+  // but the second must never see the first one's publisher.
+  for (int i = 0; i < 400; i++) {
+    subspace::Client client;
+    ASSERT_TRUE(client.Init(server.Socket()).ok());
+    absl::StatusOr<Publisher> pub =
+        client.CreatePublisher("reconnect", 64, 4 + 4 * (i % 2));
+    EXPECT_TRUE(pub.ok()) << pub.status();
+    if (!pub.ok()) {
+      break;
+    }
+    // Leak the publisher so that it isn't removed.
+    (void)new Publisher(std::move(*pub));
+  }
+  done = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+TEST_F(ClientTest, PeeredServers) {
+  // Three servers on loopback that find each other through static peers.
+  // The publishers are on server a, with subscribers on b and c.
+  auto free_port = []() {
+    toolbelt::UDPSocket socket;
+    EXPECT_TRUE(socket.Bind(InetAddress("127.0.0.1", 0)).ok());
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    EXPECT_EQ(0, getsockname(socket.GetFileDescriptor().Fd(),
+                             reinterpret_cast<struct sockaddr *>(&addr),
+                             &length));
+    return static_cast<int>(ntohs(addr.sin_port));
+  };
+  int port_a = free_port();
+  int port_b = free_port();
+  int port_c = free_port();
+  TestServer a("lo", port_a, port_b, /*local=*/false);
+  TestServer b("lo", port_b, port_a, /*local=*/false);
+  TestServer c("lo", port_c, port_a, /*local=*/false);
+  a.Get().SetPeers({InetAddress("127.0.0.1", port_b),
+                    InetAddress("127.0.0.1", port_c)});
+  // Server b's queries never reach server a.  It only hears about a's
+  // channels from a's advertisements.
+  b.Get().SetPeers({InetAddress("127.0.0.1", port_c)});
+  c.Get().SetPeers({InetAddress("127.0.0.1", port_a)});
+  a.Start();
+  b.Start();
+  c.Start();
+
+  // A message is its id followed by a pattern that depends on it.  The
+  // messages are different sizes.
+  auto publish = [](Publisher &pub, int id, size_t length) {
+    for (;;) {
+      absl::StatusOr<void *> buffer = pub.GetMessageBuffer();
+      ASSERT_TRUE(buffer.ok());
+      if (*buffer == nullptr) {
+        ASSERT_TRUE(pub.Wait().ok());
+        continue;
+      }
+      char *p = reinterpret_cast<char *>(*buffer);
+      memcpy(p, &id, sizeof(id));
+      for (size_t i = sizeof(id); i < length; i++) {
+        p[i] = static_cast<char>(id + i);
+      }
+      ASSERT_TRUE(pub.PublishMessage(length).ok());
+      return;
+    }
+  };
+
+  // Read messages in a thread until the one with the last id arrives.  An
+  // id of -1 is a message that shows the bridge is working.
+  struct Received {
+    std::vector<int> ids;
+    std::atomic<bool> bridged = false;
+  };
+  auto read = [](Subscriber &sub, Received &received, int last) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+    while (std::chrono::steady_clock::now() < deadline) {
+      absl::StatusOr<Message> msg = sub.ReadMessage();
+      ASSERT_TRUE(msg.ok());
+      if (msg->length == 0) {
+        struct pollfd fd = sub.GetPollFd();
+        ::poll(&fd, 1, 100);
+        continue;
+      }
+      int id;
+      ASSERT_LE(sizeof(id), msg->length);
+      const char *p = reinterpret_cast<const char *>(msg->buffer);
+      memcpy(&id, p, sizeof(id));
+      if (id == -1) {
+        received.bridged = true;
+        continue;
+      }
+      for (size_t i = sizeof(id); i < msg->length; i++) {
+        ASSERT_EQ(static_cast<char>(id + i), p[i]);
+      }
+      received.ids.push_back(id);
+      if (id == last) {
+        return;
+      }
+    }
+    FAIL() << "Timed out waiting for message " << last;
+  };
+
+  constexpr int kNumReliable = 100;
+  constexpr int kNumUnreliable = 200;
+  constexpr double kMaxRate = 20;
+  auto reliable_size = [](int id) { return sizeof(int) + id * 37 % 4000; };
+  auto unreliable_size = [](int id) { return sizeof(int) + id % 200; };
+
+  // Subscribers on c before there are any publishers.  Their queries are
+  // unanswered and they are bridged when a's publishers advertise.
+  subspace::Client c_client1;
+  subspace::Client c_client2;
+  ASSERT_TRUE(c_client1.Init(c.Socket()).ok());
+  ASSERT_TRUE(c_client2.Init(c.Socket()).ok());
+  absl::StatusOr<Subscriber> c_reliable = c_client1.CreateSubscriber(
+      "/peered/reliable", subspace::SubscriberOptions().SetReliable(true));
+  ASSERT_TRUE(c_reliable.ok());
+  absl::StatusOr<Subscriber> c_decimated = c_client2.CreateSubscriber(
+      "/peered/unreliable", subspace::SubscriberOptions()
+                                .SetBridgeLatestOnly(true)
+                                .SetBridgeMaxRate(kMaxRate));
+  ASSERT_TRUE(c_decimated.ok());
+  Received c_reliable_received;
+  Received c_decimated_received;
+  std::vector<std::thread> readers;
+  readers.emplace_back(read, std::ref(*c_reliable),
+                       std::ref(c_reliable_received), kNumReliable - 1);
+  readers.emplace_back(read, std::ref(*c_decimated),
+                       std::ref(c_decimated_received), kNumUnreliable - 1);
+
+  subspace::Client a_client;
+  ASSERT_TRUE(a_client.Init(a.Socket()).ok());
+  absl::StatusOr<Publisher> reliable_pub = a_client.CreatePublisher(
+      "/peered/reliable", 4096, 16,
+      subspace::PublisherOptions().SetReliable(true));
+  ASSERT_TRUE(reliable_pub.ok());
+  absl::StatusOr<Publisher> unreliable_pub =
+      a_client.CreatePublisher("/peered/unreliable", 256, 16);
+  ASSERT_TRUE(unreliable_pub.ok());
+
+  auto wait_for_bridges = [&](std::vector<Received *> received) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    for (;;) {
+      bool bridged = true;
+      for (Received *r : received) {
+        bridged &= r->bridged;
+      }
+      if (bridged) {
+        return;
+      }
+      ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+      publish(*reliable_pub, -1, sizeof(int));
+      publish(*unreliable_pub, -1, sizeof(int));
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+  };
+  wait_for_bridges({&c_reliable_received, &c_decimated_received});
+
+  // Subscribers on b now.  Server b knows from the advertisements that a
+  // publishes the channels, so it doesn't need an answer to a query.  The
+  // bridges from a to b are added to the ones to c.
+  subspace::Client b_client1;
+  subspace::Client b_client2;
+  ASSERT_TRUE(b_client1.Init(b.Socket()).ok());
+  ASSERT_TRUE(b_client2.Init(b.Socket()).ok());
+  absl::StatusOr<Subscriber> b_reliable = b_client1.CreateSubscriber(
+      "/peered/reliable", subspace::SubscriberOptions().SetReliable(true));
+  ASSERT_TRUE(b_reliable.ok());
+  absl::StatusOr<Subscriber> b_unreliable =
+      b_client2.CreateSubscriber("/peered/unreliable");
+  ASSERT_TRUE(b_unreliable.ok());
+  Received b_reliable_received;
+  Received b_unreliable_received;
+  readers.emplace_back(read, std::ref(*b_reliable),
+                       std::ref(b_reliable_received), kNumReliable - 1);
+  readers.emplace_back(read, std::ref(*b_unreliable),
+                       std::ref(b_unreliable_received), kNumUnreliable - 1);
+  wait_for_bridges({&b_reliable_received, &b_unreliable_received});
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumUnreliable; i++) {
+    if (i < kNumReliable) {
+      publish(*reliable_pub, i, reliable_size(i));
+    }
+    publish(*unreliable_pub, i, unreliable_size(i));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  for (auto &t : readers) {
+    t.join();
+  }
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  // The reliable subscribers get every message.
+  std::vector<int> all(kNumReliable);
+  std::iota(all.begin(), all.end(), 0);
+  ASSERT_EQ(all, c_reliable_received.ids);
+  ASSERT_EQ(all, b_reliable_received.ids);
+
+  // The unreliable ones get them in order, ending with the last one, and
+  // the decimated one gets no more than the rate allows.
+  for (Received *r : {&b_unreliable_received, &c_decimated_received}) {
+    ASSERT_TRUE(std::is_sorted(r->ids.begin(), r->ids.end()));
+    ASSERT_EQ(r->ids.end(), std::adjacent_find(r->ids.begin(), r->ids.end()));
+  }
+  ASSERT_LE(c_decimated_received.ids.size(), elapsed * kMaxRate + 2);
+  ASSERT_LT(c_decimated_received.ids.size(), b_unreliable_received.ids.size());
+}
+
+TEST_F(ClientTest, RecordAndReplay) {
+  char filename[] = "/tmp/recordingXXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT_NE(-1, fd);
+  close(fd);
+
+  constexpr int kNumMessages = 100;
+  {
+    // The channels go away with the client so they can be replayed with
+    // a different number of slots.
+    subspace::Client client;
+    InitClient(client);
+    absl::StatusOr<Publisher> pub1 = client.CreatePublisher("rec1", 256, 8);
+    ASSERT_TRUE(pub1.ok());
+    absl::StatusOr<Publisher> pub2 = client.CreatePublisher("rec2", 256, 8);
+    ASSERT_TRUE(pub2.ok());
+
+    subspace::Recorder recorder(client);
+    ASSERT_TRUE(recorder.Open(filename).ok());
+    ASSERT_TRUE(recorder.AddChannel("rec1").ok());
+    ASSERT_TRUE(recorder.AddChannel("rec2").ok());
+
+    for (int i = 0; i < kNumMessages; i++) {
+      Publisher &pub = i % 2 == 0 ? *pub1 : *pub2;
+      absl::StatusOr<void *> buffer = pub.GetMessageBuffer();
+      ASSERT_TRUE(buffer.ok());
+      int len = snprintf(reinterpret_cast<char *>(*buffer), 64, "msg %d", i);
+      ASSERT_TRUE(pub.PublishMessage(len + 1 + i).ok());
+      if (i % 4 == 3) {
+        // Record often enough that no messages are dropped.
+        ASSERT_TRUE(recorder.Record(0).ok());
+      }
+    }
+    while (recorder.NumMessages() < kNumMessages) {
+      absl::StatusOr<int64_t> n = recorder.Record(1000000000);
+      ASSERT_TRUE(n.ok());
+      ASSERT_NE(0, *n);
+    }
+    ASSERT_TRUE(recorder.Close().ok());
+  }
+
+  auto check = [&](subspace::RecordingReader &reader) {
+    ASSERT_EQ(2, reader.Channels().size());
+    ASSERT_EQ("rec1", reader.Channels()[0].name);
+    ASSERT_EQ("rec2", reader.Channels()[1].name);
+    // The biggest message is "msg 99" padded by 99 bytes.
+    ASSERT_EQ(106, reader.Channels()[1].max_message_size);
+    int count[2] = {};
+    subspace::RecordedMessage msg;
+    uint64_t middle = 0;
+    while (reader.Next(msg)) {
+      int i = msg.channel + 2 * count[msg.channel]++;
+      ASSERT_EQ(count[msg.channel], msg.Ordinal());
+      int len = snprintf(nullptr, 0, "msg %d", i);
+      ASSERT_EQ(len + 1 + i, msg.length);
+      ASSERT_STREQ(absl::StrFormat("msg %d", i).c_str(),
+                   reinterpret_cast<const char *>(msg.data));
+      if (i == kNumMessages / 2) {
+        middle = msg.Timestamp();
+      }
+    }
+    ASSERT_EQ(kNumMessages / 2, count[0]);
+    ASSERT_EQ(kNumMessages / 2, count[1]);
+
+    msg = reader.Find(1, 10);
+    ASSERT_NE(nullptr, msg.prefix);
+    ASSERT_STREQ("msg 19", reinterpret_cast<const char *>(msg.data));
+    ASSERT_EQ(nullptr, reader.Find(1, kNumMessages).prefix);
+
+    reader.Seek(middle);
+    ASSERT_TRUE(reader.Next(msg));
+    ASSERT_GE(msg.Timestamp(), middle);
+  };
+
+  {
+    subspace::RecordingReader reader;
+    ASSERT_TRUE(reader.Open(filename).ok());
+    check(reader);
+  }
+
+  // Replay as fast as possible.
+  subspace::Client client;
+  InitClient(client);
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber("rec2");
+  ASSERT_TRUE(sub.ok());
+  subspace::Replayer replayer(client);
+  ASSERT_TRUE(replayer.Open(filename, kNumMessages).ok());
+  replayer.SetRate(0);
+  auto replay = [&]() {
+    absl::StatusOr<int64_t> n = replayer.Replay();
+    ASSERT_TRUE(n.ok());
+    ASSERT_EQ(kNumMessages, *n);
+    for (int i = 1; i < kNumMessages; i += 2) {
+      absl::StatusOr<Message> msg = sub->ReadMessage();
+      ASSERT_TRUE(msg.ok());
+      ASSERT_STREQ(absl::StrFormat("msg %d", i).c_str(),
+                   reinterpret_cast<const char *>(msg->buffer));
+    }
+  };
+  replay();
+
+  // Replaying again needs the reader to be rewound.
+  absl::StatusOr<int64_t> n = replayer.Replay();
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(0, *n);
+  replayer.Reader().Seek(0);
+  replay();
+
+  // A record whose size takes it past the end of its chunk makes the
+  // index invalid.
+  uint64_t chunk_offset;
+  {
+    subspace::RecordingReader reader;
+    ASSERT_TRUE(reader.Open(filename).ok());
+    chunk_offset = reader.Index()[0].offset;
+  }
+  off_t size_offset = chunk_offset + sizeof(subspace::RecordingChunkHeader) +
+                      offsetof(subspace::MessagePrefix, message_size);
+  int32_t message_size;
+  fd = open(filename, O_RDWR);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(sizeof(message_size),
+            pread(fd, &message_size, sizeof(message_size), size_offset));
+  for (int32_t bad_size : {1 << 30, -8}) {
+    ASSERT_EQ(sizeof(bad_size),
+              pwrite(fd, &bad_size, sizeof(bad_size), size_offset));
+    subspace::RecordingReader reader;
+    ASSERT_FALSE(reader.Open(filename).ok());
+  }
+  ASSERT_EQ(sizeof(message_size),
+            pwrite(fd, &message_size, sizeof(message_size), size_offset));
+
+  // So do offsets past the end of the file, including ones that wrap
+  // around.
+  subspace::RecordingTrailer trailer;
+  off_t size = lseek(fd, 0, SEEK_END);
+  ASSERT_EQ(sizeof(trailer),
+            pread(fd, &trailer, sizeof(trailer), size - sizeof(trailer)));
+  off_t index_offset_offset =
+      size - sizeof(trailer) + offsetof(subspace::RecordingTrailer, index_offset);
+  off_t entry_offset_offset = trailer.index_offset +
+                              sizeof(subspace::RecordingChunkHeader) +
+                              offsetof(subspace::RecordingIndexEntry, offset);
+  for (off_t field : {index_offset_offset, entry_offset_offset}) {
+    uint64_t offset;
+    ASSERT_EQ(sizeof(offset), pread(fd, &offset, sizeof(offset), field));
+    for (uint64_t bad_offset :
+         {UINT64_MAX - 8, UINT64_MAX, static_cast<uint64_t>(size)}) {
+      ASSERT_EQ(sizeof(bad_offset),
+                pwrite(fd, &bad_offset, sizeof(bad_offset), field));
+      subspace::RecordingReader reader;
+      ASSERT_FALSE(reader.Open(filename).ok());
+    }
+    ASSERT_EQ(sizeof(offset), pwrite(fd, &offset, sizeof(offset), field));
+  }
+  close(fd);
+
+  // A recording without its index, as if the recorder had crashed, is
+  // read by scanning it.
+  fd = open(filename, O_RDWR);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(0, ftruncate(fd, trailer.index_offset));
+  close(fd);
+  {
+    subspace::RecordingReader reader;
+    ASSERT_TRUE(reader.Open(filename).ok());
+    check(reader);
+  }
+  remove(filename);
+}
+
+TEST_F(ClientTest, SharedMappings) {
+  subspace::Client client1;
+  subspace::Client client2;
+  ASSERT_TRUE(client1.Init(Socket()).ok());
+  ASSERT_TRUE(client2.Init(Socket()).ok());
+  absl::StatusOr<Publisher> pub = client1.CreatePublisher("shared", 256, 10);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub2 = client2.CreateSubscriber("shared");
+  ASSERT_TRUE(sub2.ok());
+
+  auto publish = [&pub](const char *s) {
+    absl::StatusOr<void *> b = pub->GetMessageBuffer();
+    ASSERT_TRUE(b.ok());
+    memcpy(*b, s, strlen(s));
+    ASSERT_TRUE(pub->PublishMessage(strlen(s)).ok());
+  };
+
+  const char *buffer = pub->GetBuffers()[0].buffer;
+  ASSERT_NE(nullptr, buffer);
+  {
+    absl::StatusOr<Subscriber> sub1 = client1.CreateSubscriber("shared");
+    ASSERT_TRUE(sub1.ok());
+
+    // All of them, in both clients, use the same mapping of the buffers.
+    ASSERT_EQ(buffer, sub1->GetBuffers()[0].buffer);
+    ASSERT_EQ(buffer, sub2->GetBuffers()[0].buffer);
+
+    publish("foobar");
+    absl::StatusOr<Message> msg = sub1->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(6, msg->length);
+    ASSERT_EQ(0, memcmp(msg->buffer, "foobar", 6));
+  }
+
+  // Removing one subscriber leaves the mapping for the others.
+  publish("barfoo");
+  for (const char *expected : {"foobar", "barfoo"}) {
+    absl::StatusOr<Message> msg = sub2->ReadMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(strlen(expected), msg->length);
+    ASSERT_EQ(0, memcmp(msg->buffer, expected, msg->length));
+  }
+}
+
+TEST_F(ClientTest, TypedPublisherAndSubscriber) {
+  struct Pose {
+    double x;
+    double y;
+    double z;
+    int64_t seq;
+  };
+  subspace::Client client;
+  ASSERT_TRUE(client.Init(Socket()).ok());
+  absl::StatusOr<subspace::TypedPublisher<Pose>> pub =
+      client.CreateTypedPublisher<Pose>("pose", 4);
+  ASSERT_TRUE(pub.ok());
+  ASSERT_EQ(sizeof(Pose), pub->Untyped().SlotSize());
+  ASSERT_TRUE(pub->Untyped().IsFixedSize());
+  absl::StatusOr<subspace::TypedSubscriber<Pose>> sub =
+      client.CreateTypedSubscriber<Pose>("pose");
+  ASSERT_TRUE(sub.ok());
+
+  absl::StatusOr<Message> msg = pub->Emplace(1.0, 2.0, 3.0, 1);
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(sizeof(Pose), msg->length);
+
+  absl::StatusOr<Pose *> buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  **buffer = Pose{4.0, 5.0, 6.0, 2};
+  ASSERT_TRUE(pub->Publish().ok());
+
+  for (int64_t seq = 1; seq <= 2; seq++) {
+    absl::StatusOr<const Pose *> pose = sub->ReadMessage();
+    ASSERT_TRUE(pose.ok());
+    ASSERT_NE(nullptr, *pose);
+    ASSERT_EQ(seq, (*pose)->seq);
+    ASSERT_EQ(seq * 3 - 2, (*pose)->x);
+  }
+  absl::StatusOr<const Pose *> pose = sub->ReadMessage();
+  ASSERT_TRUE(pose.ok());
+  ASSERT_EQ(nullptr, *pose);
+
+  // A channel whose slots can't hold a Pose.  The subscriber finds out at
+  // the first message.
+  absl::StatusOr<subspace::TypedSubscriber<Pose>> small_sub =
+      client.CreateTypedSubscriber<Pose>("small_pose");
+  ASSERT_TRUE(small_sub.ok());
+  pose = small_sub->ReadMessage();
+  ASSERT_TRUE(pose.ok());
+  ASSERT_EQ(nullptr, *pose);
+  absl::StatusOr<Publisher> small_pub =
+      client.CreatePublisher("small_pose", sizeof(Pose) / 2, 4);
+  ASSERT_TRUE(small_pub.ok());
+  absl::StatusOr<void *> small_buffer = small_pub->GetMessageBuffer();
+  ASSERT_TRUE(small_buffer.ok());
+  ASSERT_TRUE(small_pub->PublishMessage(sizeof(Pose) / 2).ok());
+  ASSERT_FALSE(small_sub->ReadMessage().ok());
+}
+
+TEST_F(ClientTest, Tracing) {
+  subspace::Client client;
+  ASSERT_TRUE(client.Init(Socket()).ok());
+  absl::StatusOr<Publisher> pub = client.CreatePublisher("traced", 256, 4);
+  ASSERT_TRUE(pub.ok());
+  absl::StatusOr<Subscriber> sub = client.CreateSubscriber("traced");
+  ASSERT_TRUE(sub.ok());
+
+  subspace::ClearTraces();
+  subspace::EnableTracing(true);
+  absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  memcpy(*buffer, "foobar", 6);
+  absl::StatusOr<const Message> pub_msg = pub->PublishMessage(6);
+  ASSERT_TRUE(pub_msg.ok());
+  ASSERT_TRUE(sub->Wait().ok());
+  absl::StatusOr<const Message> msg = sub->ReadMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(6, msg->length);
+  subspace::EnableTracing(false);
+
+  // Not traced.
+  buffer = pub->GetMessageBuffer();
+  ASSERT_TRUE(buffer.ok());
+  ASSERT_TRUE(pub->PublishMessage(6).ok());
+
+  // The events for the message, in the order they happened on this thread.
+  std::vector<subspace::TraceEvent> events;
+  for (const subspace::ThreadTrace &trace : subspace::CollectTraces()) {
+    for (const subspace::TraceRecord &record : trace.records) {
+      if (record.channel_id != pub->ChannelId() ||
+          record.ordinal != pub_msg->ordinal) {
+        continue;
+      }
+      ASSERT_EQ(pub_msg->timestamp, record.timestamp);
+      events.push_back(record.event);
+    }
+  }
+  std::vector<subspace::TraceEvent> expected = {
+      subspace::TraceEvent::kPublish,
+      subspace::TraceEvent::kTriggerSubscribers,
+      subspace::TraceEvent::kRead};
+  ASSERT_EQ(expected, events);
+
+  char filename[] = "/tmp/traceXXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT_NE(-1, fd);
+  close(fd);
+  ASSERT_TRUE(subspace::WriteChromeTrace(filename).ok());
+  FILE *fp = fopen(filename, "r");
+  ASSERT_NE(nullptr, fp);
+  char line[256];
+  ASSERT_NE(nullptr, fgets(line, sizeof(line), fp));
+  ASSERT_EQ(std::string("{\"traceEvents\":[\n"), line);
+  fclose(fp);
+  remove(filename);
+  subspace::ClearTraces();
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   absl::ParseCommandLine(argc, argv);
@@ -5,8 +5,21 @@
 #ifndef __CLIENT_OPTIONS_H
 #define __CLIENT_OPTIONS_H
 
+#include <cstdint>
+
 namespace subspace {
 
+// Use with PublisherOptions::SetNumaNode to allocate a channel on no
+// particular NUMA node.
+constexpr int kNoNumaNode = -2;
+
+// How a channel's messages are compressed when they are sent over a bridge
+// to another server.
+enum class BridgeCodec {
+  kNone = 0,
+  kZlib = 1,
+};
+
 // Options when creating a publisher.
 class PublisherOptions {
 public:
@@ -39,9 +52,88 @@ public:
     return *this;
   }
 
+  // A lock-free channel has a single publisher and neither the publisher
+  // nor the subscribers take the channel's lock to send or receive
+  // messages.  This must be set before the channel's first publisher is
+  // created and no other publishers can be created while it exists.
+  PublisherOptions &SetLockFree(bool v) {
+    lock_free_ = v;
+    return *this;
+  }
+
+  // Back the channel's buffers with 2MB huge pages.  This avoids the
+  // TLB misses of large channels.  The system must have enough huge
+  // pages configured (see /proc/sys/vm/nr_hugepages).  Only supported
+  // on Linux and ignored elsewhere.  Like SetPrefault, this is set by the
+  // channel's first publisher.
+  PublisherOptions &SetHugePages(bool v) {
+    huge_pages_ = v;
+    return *this;
+  }
+
+  // Fault in the channel's buffers when they are mapped, rather than on
+  // first access, and have the server lock them into memory (subject to
+  // its RLIMIT_MEMLOCK).  This avoids page faults when the slots are
+  // first used, after the channel is created or resized.
+  PublisherOptions &SetPrefault(bool v) {
+    prefault_ = v;
+    return *this;
+  }
+
+  // Allocate the channel's shared memory on this NUMA node.  -1 (the
+  // default) means the node the publisher is running on when it is
+  // created and kNoNumaNode means let the OS decide.  This is a hint and
+  // is ignored if the node can't be used.  The channel directory reports
+  // the node so that subscribers can be placed near it.  Like
+  // SetPrefault, this is set by the channel's first publisher.
+  PublisherOptions &SetNumaNode(int node) {
+    numa_node_ = node;
+    return *this;
+  }
+
+  // Keep every buffer the channel has had as a size class.  Normally,
+  // after a resize all slots move to the new biggest buffer, so one big
+  // message makes every slot big.  With size classes GetMessageBuffer
+  // uses the smallest buffer big enough for max_size (the biggest if
+  // it's not given) and the memory used follows the sizes of the
+  // messages.  The buffers double in size and no more than max_size
+  // bytes can be written to the buffer.  Like SetPrefault, this is set
+  // by the channel's first publisher.
+  PublisherOptions &SetSizeClasses(bool v) {
+    size_classes_ = v;
+    return *this;
+  }
+
+  // A reliable publisher waiting for a free slot will spin for up to
+  // this many nanoseconds, watching the channel's shared memory, before
+  // blocking on its trigger fd.  This avoids the latency of the
+  // trigger at the cost of CPU time.  Subscribers don't need to write to
+  // the trigger fd of a publisher that is spinning.  Zero (the default)
+  // means don't spin.
+  PublisherOptions &SetSpinBudget(int64_t ns) {
+    spin_budget_ = ns;
+    return *this;
+  }
+
+  // Compress the channel's messages with this codec when they are sent
+  // over a bridge.  Small messages, and those of a channel whose messages
+  // don't compress, are sent as they are.  Like SetPrefault, this is set
+  // by the channel's first publisher that sets it.
+  PublisherOptions &SetBridgeCodec(BridgeCodec codec) {
+    bridge_codec_ = codec;
+    return *this;
+  }
+
   bool IsLocal() const { return local_; }
   bool IsReliable() const { return reliable_; }
   bool IsFixedSize() const { return fixed_size_; }
+  bool IsLockFree() const { return lock_free_; }
+  bool IsHugePages() const { return huge_pages_; }
+  bool IsPrefault() const { return prefault_; }
+  int NumaNode() const { return numa_node_; }
+  bool HasSizeClasses() const { return size_classes_; }
+  int64_t SpinBudget() const { return spin_budget_; }
+  BridgeCodec GetBridgeCodec() const { return bridge_codec_; }
   const std::string &Type() const { return type_; }
 
 private:
@@ -57,6 +149,13 @@ private:
   bool reliable_ = false;
   bool bridge_ = false;
   bool fixed_size_ = false;
+  bool lock_free_ = false;
+  bool huge_pages_ = false;
+  bool prefault_ = false;
+  int numa_node_ = -1;
+  bool size_classes_ = false;
+  int64_t spin_budget_ = 0;
+  BridgeCodec bridge_codec_ = BridgeCodec::kNone;
   std::string type_;
 };
 
@@ -83,9 +182,39 @@ public:
     return *this;
   }
 
+  // A subscriber waiting for a message will spin for up to this many
+  // nanoseconds, watching the channel's shared memory, before blocking
+  // on its trigger fd.  If all the subscribers to a channel are
+  // spinning, publishers don't need to write to their trigger fds.
+  // Zero (the default) means don't spin.
+  SubscriberOptions &SetSpinBudget(int64_t ns) {
+    spin_budget_ = ns;
+    return *this;
+  }
+
+  // When an unreliable channel is published on another server, ask that
+  // server to send only the newest message across the bridge rather than
+  // all of them.  The subscriber still reads every message that arrives.
+  // This is set by the channel's first subscriber that sets it or
+  // SetBridgeMaxRate.
+  SubscriberOptions &SetBridgeLatestOnly(bool v) {
+    bridge_latest_only_ = v;
+    return *this;
+  }
+
+  // As SetBridgeLatestOnly, but the other server also sends no more than
+  // this many messages a second.  Zero (the default) means no limit.
+  SubscriberOptions &SetBridgeMaxRate(double hz) {
+    bridge_max_rate_ = hz;
+    return *this;
+  }
+
   bool IsReliable() const { return reliable_; }
   const std::string &Type() const { return type_; }
   int MaxSharedPtrs() const { return max_shared_ptrs_; }
+  int64_t SpinBudget() const { return spin_budget_; }
+  bool IsBridgeLatestOnly() const { return bridge_latest_only_; }
+  double BridgeMaxRate() const { return bridge_max_rate_; }
 
 private:
   friend class Server;
@@ -100,6 +229,9 @@ private:
   bool bridge_ = false;
   std::string type_;
   int max_shared_ptrs_ = 0;
+  int64_t spin_budget_ = 0;
+  bool bridge_latest_only_ = false;
+  double bridge_max_rate_ = 0;
 };
 
 } // namespace subspace
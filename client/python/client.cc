@@ -2,14 +2,25 @@
 #include "client/client.h"
 
 #include "pybind11/pybind11.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <stdexcept>
-#include <string_view>
 
 namespace subspace {
 namespace python {
 
 namespace py = pybind11;
 
+// A message read by a subscriber without copying it.  It holds a
+// reference to the slot so that publishers can't reuse the slot until
+// Python releases the message.  It also refers to the Python Subscriber
+// object so the subscriber can't go away first.
+struct ReceivedMessage {
+  py::object subscriber;
+  shared_ptr<const char> msg;
+};
+
 PYBIND11_MODULE(subspace, m) {
 
   m.doc() = "This is a python module to pass messages over the Subspace inter-process communication protocol.";
@@ -18,19 +29,74 @@ PYBIND11_MODULE(subspace, m) {
 
   publisher_class.def(
     "publish_message",
-    [](Publisher* self, py::bytes message_data) {
-      auto msg_view = static_cast<std::string_view>(message_data);
-      absl::StatusOr<void *> dest_buffer = self->GetMessageBuffer(msg_view.size());
+    [](Publisher* self, py::buffer message_data) -> bool {
+      // The message is copied in one go so ask for it to be contiguous.
+      // Strided buffers, such as a slice of a NumPy array, raise a
+      // BufferError.
+      Py_buffer view;
+      if (PyObject_GetBuffer(message_data.ptr(), &view, PyBUF_C_CONTIGUOUS) !=
+          0) {
+        throw py::error_already_set();
+      }
+      std::unique_ptr<Py_buffer, void (*)(Py_buffer *)> release(
+          &view, PyBuffer_Release);
+      size_t size = view.len;
+      absl::StatusOr<void *> dest_buffer = self->GetMessageBuffer(size);
       if (!dest_buffer.ok()) {
         throw std::runtime_error(dest_buffer.status().ToString());
       }
-      std::memcpy(*dest_buffer, msg_view.data(), msg_view.size());
-      absl::StatusOr<Message> send_result = self->PublishMessage(msg_view.size());
+      if (*dest_buffer == nullptr) {
+        return false;
+      }
+      std::memcpy(*dest_buffer, view.buf, size);
+      absl::StatusOr<const Message> send_result = self->PublishMessage(size);
+      if (!send_result.ok()) {
+        throw std::runtime_error(send_result.status().ToString());
+      }
+      return true;
+    },
+    R"doc(Copy the message into the publisher's buffer and publish it.  The
+message can be bytes or anything else supporting the buffer protocol and
+C-contiguous, such as a contiguous NumPy array.  Returns False, without
+publishing, if a reliable publisher has no free slot; call wait() and try
+again.)doc");
+
+  publisher_class.def(
+    "get_message_buffer",
+    [](Publisher* self, int32_t size) -> py::object {
+      absl::StatusOr<void *> buffer = self->GetMessageBuffer(size);
+      if (!buffer.ok()) {
+        throw std::runtime_error(buffer.status().ToString());
+      }
+      if (*buffer == nullptr) {
+        return py::none();
+      }
+      // With size classes the slot's buffer can be smaller than the
+      // channel's slot size.
+      return py::memoryview::from_memory(*buffer, self->CurrentSlotSize(),
+                                         /*readonly=*/false);
+    },
+    R"doc(Get a writable memoryview over the slot the next message will be
+published from, so the message can be built in place.  The slot is resized
+if size (-1 means the current slot size) is bigger than it.  The memoryview
+covers the whole of the slot's buffer, which for a publisher with size
+classes is the smallest one that holds size bytes, and is only valid until
+the message is published.
+Returns None if a reliable publisher has no free slot; call wait() and try
+again.)doc",
+    py::arg("size") = -1);
+
+  publisher_class.def(
+    "publish",
+    [](Publisher* self, int64_t size) {
+      absl::StatusOr<const Message> send_result = self->PublishMessage(size);
       if (!send_result.ok()) {
         throw std::runtime_error(send_result.status().ToString());
       }
     },
-    "Publish the message in the publisher's buffer.");
+    R"doc(Publish the first size bytes of the buffer returned by
+get_message_buffer().)doc",
+    py::arg("size"));
 
   publisher_class.def(
     "wait",
@@ -67,6 +133,29 @@ it reads the next available message (oldest message not read yet).)doc",
     py::arg("skip_to_newest") = false,
     py::return_value_policy::copy);
 
+  subscriber_class.def(
+    "read_message_view",
+    [](py::object self, bool skip_to_newest) {
+      absl::StatusOr<shared_ptr<const char>> read_result =
+          self.cast<Subscriber*>()->ReadMessage<const char>(
+              skip_to_newest ? ReadMode::kReadNewest : ReadMode::kReadNext);
+      if (!read_result.ok()) {
+        throw std::runtime_error(read_result.status().ToString());
+      }
+      if (!*read_result) {
+        return py::memoryview(py::bytes());
+      }
+      return py::memoryview(py::cast(
+          ReceivedMessage{std::move(self), std::move(*read_result)}));
+    },
+    R"doc(As read_message but returns a read-only memoryview of the message in
+shared memory instead of a copy.  The message's slot can't be reused by a
+publisher until the memoryview (and anything made from it, such as a NumPy
+array from numpy.frombuffer) has been released, so don't hold on to it for
+longer than needed.  The subscriber must have been created with
+max_shared_ptrs set to the number of messages that can be held at once.)doc",
+    py::arg("skip_to_newest") = false);
+
   subscriber_class.def(
     "wait",
     [](Subscriber* self) {
@@ -81,6 +170,16 @@ it reads the next available message (oldest message not read yet).)doc",
   subscriber_class.def("is_reliable", &Subscriber::IsReliable);
   subscriber_class.def("slot_size", &Subscriber::SlotSize);
 
+  py::class_<ReceivedMessage>(m, "Message", py::buffer_protocol(),
+                              "A message returned by Subscriber.read_message_view.")
+      .def_buffer([](ReceivedMessage &self) {
+        return py::buffer_info(
+            const_cast<char *>(self.msg.get()), 1,
+            py::format_descriptor<uint8_t>::format(), 1,
+            {static_cast<py::ssize_t>(self.msg.GetMessage().length)}, {1},
+            /*readonly=*/true);
+      });
+
 
   py::class_<Client> client_class(m, "Client",
                                      R"doc(This is an Subspace client.
@@ -106,9 +205,11 @@ is listening on the same Unix Domain Socket.)doc");
   client_class.def(
     "create_publisher",
     [](Client* self, const std::string &channel_name, int slot_size, int num_slots,
-       bool local, bool reliable, bool fixed_size, const std::string& type) -> Publisher {
+       bool local, bool reliable, bool fixed_size, const std::string& type,
+       bool size_classes) -> Publisher {
       absl::StatusOr<Publisher> result = self->CreatePublisher(channel_name, slot_size, num_slots,
-        PublisherOptions().SetLocal(local).SetReliable(reliable).SetFixedSize(fixed_size).SetType(type));
+        PublisherOptions().SetLocal(local).SetReliable(reliable).SetFixedSize(fixed_size).SetType(type)
+          .SetSizeClasses(size_classes));
       if (!result.ok()) {
         throw std::runtime_error(result.status().ToString());
       }
@@ -116,27 +217,31 @@ is listening on the same Unix Domain Socket.)doc");
     },
     R"doc(Create a publisher for the given channel.  If the channel doesn't exit
 it will be created with num_slots slots, each of which is slot_size
-bytes long.)doc",
+bytes long.  With size_classes, each message gets the smallest buffer
+that holds it.)doc",
     py::arg("channel_name"), py::arg("slot_size"), py::arg("num_slots"),
     py::arg("local") = false, py::arg("reliable") = false,
     py::arg("fixed_size") = false, py::arg("type") = std::string(""),
+    py::arg("size_classes") = false,
     py::return_value_policy::move);
 
 
   client_class.def(
     "create_subscriber",
     [](Client* self, const std::string &channel_name,
-       bool reliable, const std::string& type) -> Subscriber {
+       bool reliable, const std::string& type, int max_shared_ptrs) -> Subscriber {
       absl::StatusOr<Subscriber> result = self->CreateSubscriber(channel_name,
-        SubscriberOptions().SetReliable(reliable).SetType(type));
+        SubscriberOptions().SetReliable(reliable).SetType(type).SetMaxSharedPtrs(max_shared_ptrs));
       if (!result.ok()) {
         throw std::runtime_error(result.status().ToString());
       }
       return std::move(*result);
     },
     R"doc(Create a subscriber for the given channel. This can be done before there
-are any publishers on the channel.)doc",
+are any publishers on the channel.  max_shared_ptrs is the number of messages
+from read_message_view that can be held at once.)doc",
     py::arg("channel_name"), py::arg("reliable") = false, py::arg("type") = std::string(""),
+    py::arg("max_shared_ptrs") = 0,
     py::return_value_policy::move);
 
 }
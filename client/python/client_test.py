@@ -105,6 +105,109 @@ class TestSubspaceClient(unittest.TestCase):
         pub = None
         sub = None
 
+    def test_zero_copy(self):
+        client = subspace.Client()
+        client.init(server_socket=self.socket_name, client_name="zero_copy_client")
+
+        pub = client.create_publisher(
+            channel_name="dave0", slot_size=256, num_slots=16)
+
+        sub = client.create_subscriber(
+            channel_name="dave0", max_shared_ptrs=2)
+
+        # Build the message in place in the slot.
+        buffer = pub.get_message_buffer(12)
+        self.assertGreaterEqual(len(buffer), 12)
+        buffer[:12] = b'Hello world!'
+        buffer = None
+        pub.publish(12)
+
+        sub.wait()
+
+        # The message is read in place too.
+        view = sub.read_message_view()
+        self.assertTrue(view.readonly)
+        self.assertEqual(view.tobytes(), b'Hello world!')
+
+        # Anything that supports the buffer protocol can be published.
+        pub.publish_message(bytearray(b'Hello again!'))
+
+        # The first message stays valid while we read the second.
+        view2 = sub.read_message_view()
+        self.assertEqual(view2.tobytes(), b'Hello again!')
+        self.assertEqual(view.tobytes(), b'Hello world!')
+
+        # Check that no other message exists:
+        self.assertEqual(len(sub.read_message_view()), 0)
+
+        view = None
+        view2 = None
+        pub = None
+        sub = None
+
+    def test_size_classes(self):
+        client = subspace.Client()
+        client.init(server_socket=self.socket_name, client_name="classes_client")
+
+        pub = client.create_publisher(
+            channel_name="classes", slot_size=256, num_slots=10,
+            size_classes=True)
+
+        sub = client.create_subscriber(channel_name="classes")
+
+        # A big message adds a 4096 byte size class and then a small one
+        # goes back into the 256 byte class.  The memoryview only covers
+        # the buffer that was picked.
+        buffer = pub.get_message_buffer(4000)
+        self.assertEqual(len(buffer), 4096)
+        buffer[:3] = b'big'
+        buffer = None
+        pub.publish(3)
+
+        buffer = pub.get_message_buffer(100)
+        self.assertEqual(len(buffer), 256)
+        buffer[:5] = b'small'
+        buffer = None
+        pub.publish(5)
+
+        sub.wait()
+        self.assertEqual(sub.read_message(), b'big')
+        self.assertEqual(sub.read_message(), b'small')
+
+        pub = None
+        sub = None
+
+    def test_publish_buffers(self):
+        client = subspace.Client()
+        client.init(server_socket=self.socket_name, client_name="buffers_client")
+
+        pub = client.create_publisher(
+            channel_name="dave0", slot_size=256, num_slots=5, reliable=True)
+
+        sub = client.create_subscriber(
+            channel_name="dave0", reliable=True)
+
+        # A strided buffer can't be copied in one go.
+        with self.assertRaises(BufferError):
+            pub.publish_message(memoryview(b'Hello world!')[::2])
+
+        self.assertTrue(pub.publish_message(b'Hello world!'))
+        sub.wait()
+        self.assertEqual(sub.read_message(), b'Hello world!')
+
+        # We have 5 slots and the subscriber has one.  We can publish
+        # another 4 and then there is no free slot.
+        for i in range(4):
+            self.assertTrue(pub.publish_message(b'foobar'))
+        self.assertFalse(pub.publish_message(b'foobar'))
+
+        # Reading the next message frees the slot of the one before.
+        self.assertEqual(sub.read_message(), b'foobar')
+        self.assertTrue(pub.publish_message(b'foobar'))
+
+        pub = None
+        sub = None
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,563 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "client/recorder.h"
+#include "absl/strings/str_format.h"
+#include "toolbelt/clock.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace subspace {
+
+// Records are padded to a multiple of this.
+static constexpr size_t kRecordAlignment = 8;
+static const char kZeros[kRecordAlignment] = {};
+
+static size_t RecordSize(size_t message_size) {
+  return (sizeof(MessagePrefix) + message_size + kRecordAlignment - 1) &
+         ~(kRecordAlignment - 1);
+}
+
+Recorder::~Recorder() {
+  if (fd_.Valid()) {
+    (void)Close();
+  }
+}
+
+absl::Status Recorder::Open(const std::string &filename) {
+  if (fd_.Valid()) {
+    return absl::FailedPreconditionError("Recording is already open");
+  }
+  int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to create recording %s: %s", filename, strerror(errno)));
+  }
+  fd_.SetFd(fd);
+  offset_ = 0;
+  RecordingFileHeader header = {};
+  memcpy(header.magic, kRecordingMagic, sizeof(header.magic));
+  header.version = kRecordingVersion;
+  std::vector<struct iovec> iovecs = {{&header, sizeof(header)}};
+  return Write(iovecs);
+}
+
+absl::Status Recorder::AddChannel(const std::string &channel_name,
+                                  const SubscriberOptions &options) {
+  if (!fd_.Valid()) {
+    return absl::FailedPreconditionError("Recording is not open");
+  }
+  absl::StatusOr<Subscriber> sub =
+      client_.CreateSubscriber(channel_name, options);
+  if (!sub.ok()) {
+    return sub.status();
+  }
+  int index = static_cast<int>(channels_.size());
+  std::string type = options.Type().empty() ? sub->Type() : options.Type();
+  channels_.push_back(
+      std::make_unique<Channel>(Channel{channel_name, std::move(*sub)}));
+  if (absl::Status status = subscribers_.Add(&channels_.back()->subscriber);
+      !status.ok()) {
+    channels_.pop_back();
+    return status;
+  }
+
+  uint32_t name_length = channel_name.size();
+  uint32_t type_length = type.size();
+  RecordingChunkHeader chunk = {kRecordingChunkMagic, kRecordingChannelChunk,
+                                index, 0,
+                                2 * sizeof(uint32_t) + name_length +
+                                    type_length};
+  index_.push_back({index, kRecordingChannelChunk, offset_});
+  std::vector<struct iovec> iovecs = {
+      {&chunk, sizeof(chunk)},
+      {&name_length, sizeof(name_length)},
+      {const_cast<char *>(channel_name.data()), name_length},
+      {&type_length, sizeof(type_length)},
+      {type.data(), type_length},
+  };
+  return Write(iovecs);
+}
+
+absl::StatusOr<int64_t> Recorder::Record(int64_t timeout_ns) {
+  if (!fd_.Valid()) {
+    return absl::FailedPreconditionError("Recording is not open");
+  }
+  absl::StatusOr<std::vector<Subscriber *>> ready =
+      subscribers_.Wait(timeout_ns);
+  if (!ready.ok()) {
+    return ready.status();
+  }
+  int64_t num_written = 0;
+  for (Subscriber *sub : *ready) {
+    for (size_t i = 0; i < channels_.size(); i++) {
+      if (&channels_[i]->subscriber != sub) {
+        continue;
+      }
+      absl::StatusOr<int64_t> n = RecordChannel(i);
+      if (!n.ok()) {
+        return n.status();
+      }
+      num_written += *n;
+      break;
+    }
+  }
+  return num_written;
+}
+
+// Write all the available messages on a channel, a chunk for each batch.
+absl::StatusOr<int64_t> Recorder::RecordChannel(int index) {
+  Channel &channel = *channels_[index];
+  int64_t num_written = 0;
+  for (;;) {
+    if (absl::Status status =
+            channel.subscriber.ReadMessages(kMaxBatch, msgs_);
+        !status.ok()) {
+      return status;
+    }
+    if (msgs_.empty()) {
+      return num_written;
+    }
+    RecordingChunkHeader chunk = {kRecordingChunkMagic, kRecordingMessageChunk,
+                                  index, static_cast<uint32_t>(msgs_.size()),
+                                  0};
+    RecordingIndexEntry entry = {index,
+                                 kRecordingMessageChunk,
+                                 offset_,
+                                 msgs_.front().ordinal,
+                                 msgs_.back().ordinal,
+                                 msgs_.front().timestamp,
+                                 msgs_.back().timestamp,
+                                 0,
+                                 chunk.num_records};
+    iovecs_.clear();
+    iovecs_.push_back({&chunk, sizeof(chunk)});
+    for (const Message &msg : msgs_) {
+      // The prefix is just before the message in the slot.
+      char *prefix = const_cast<char *>(
+          reinterpret_cast<const char *>(msg.buffer) - sizeof(MessagePrefix));
+      size_t length = sizeof(MessagePrefix) + msg.length;
+      size_t record_size = RecordSize(msg.length);
+      iovecs_.push_back({prefix, length});
+      if (record_size > length) {
+        iovecs_.push_back({const_cast<char *>(kZeros), record_size - length});
+      }
+      chunk.length += record_size;
+      entry.max_message_size =
+          std::max(entry.max_message_size, static_cast<int32_t>(msg.length));
+    }
+    if (absl::Status status = Write(iovecs_); !status.ok()) {
+      return status;
+    }
+    index_.push_back(entry);
+    num_written += msgs_.size();
+    num_messages_ += msgs_.size();
+  }
+}
+
+absl::Status Recorder::Close() {
+  if (!fd_.Valid()) {
+    return absl::FailedPreconditionError("Recording is not open");
+  }
+  RecordingChunkHeader chunk = {
+      kRecordingChunkMagic, kRecordingIndexChunk, -1, 0,
+      index_.size() * sizeof(RecordingIndexEntry)};
+  RecordingTrailer trailer = {offset_, index_.size(), {}};
+  memcpy(trailer.magic, kRecordingMagic, sizeof(trailer.magic));
+  std::vector<struct iovec> iovecs = {
+      {&chunk, sizeof(chunk)},
+      {index_.data(), chunk.length},
+      {&trailer, sizeof(trailer)},
+  };
+  absl::Status status = Write(iovecs);
+  fd_.Close();
+  index_.clear();
+  return status;
+}
+
+absl::Status Recorder::Write(std::vector<struct iovec> &iovecs) {
+  size_t first = 0;
+  while (first < iovecs.size()) {
+    int iovcnt = std::min<size_t>(iovecs.size() - first, IOV_MAX);
+    ssize_t n = ::pwritev(fd_.Fd(), &iovecs[first], iovcnt, offset_);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return absl::InternalError(
+          absl::StrFormat("Failed to write recording: %s", strerror(errno)));
+    }
+    offset_ += n;
+    // Skip over the iovecs that have been fully written and adjust the
+    // first one that was partially written.
+    size_t written = static_cast<size_t>(n);
+    while (first < iovecs.size() && written >= iovecs[first].iov_len) {
+      written -= iovecs[first].iov_len;
+      first++;
+    }
+    if (written > 0) {
+      iovecs[first].iov_base =
+          static_cast<char *>(iovecs[first].iov_base) + written;
+      iovecs[first].iov_len -= written;
+    }
+  }
+  return absl::OkStatus();
+}
+
+RecordingReader::~RecordingReader() {
+  if (base_ != nullptr) {
+    ::munmap(const_cast<char *>(base_), size_);
+  }
+}
+
+absl::Status RecordingReader::Open(const std::string &filename) {
+  if (base_ != nullptr) {
+    return absl::FailedPreconditionError("Recording is already open");
+  }
+  toolbelt::FileDescriptor fd(::open(filename.c_str(), O_RDONLY));
+  if (!fd.Valid()) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to open recording %s: %s", filename, strerror(errno)));
+  }
+  struct stat st;
+  if (::fstat(fd.Fd(), &st) == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to get size of recording %s: %s", filename, strerror(errno)));
+  }
+  size_t size = st.st_size;
+  if (size < sizeof(RecordingFileHeader)) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("%s is not a recording", filename));
+  }
+  void *p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.Fd(), 0);
+  if (p == MAP_FAILED) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to map recording %s: %s", filename, strerror(errno)));
+  }
+  base_ = static_cast<const char *>(p);
+  size_ = size;
+
+  const RecordingFileHeader *header =
+      reinterpret_cast<const RecordingFileHeader *>(base_);
+  if (memcmp(header->magic, kRecordingMagic, sizeof(header->magic)) != 0) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("%s is not a recording", filename));
+  }
+  if (header->version != kRecordingVersion) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Recording %s has unsupported version %d", filename,
+                        header->version));
+  }
+
+  absl::Status status;
+  RecordingTrailer trailer;
+  if (size_ >= sizeof(RecordingFileHeader) + sizeof(trailer)) {
+    memcpy(&trailer, base_ + size_ - sizeof(trailer), sizeof(trailer));
+  }
+  if (size_ >= sizeof(RecordingFileHeader) + sizeof(trailer) &&
+      memcmp(trailer.magic, kRecordingMagic, sizeof(trailer.magic)) == 0) {
+    status = ReadIndex(trailer);
+  } else {
+    status = ScanChunks();
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  for (const RecordingIndexEntry &entry : index_) {
+    int32_t &max_size = channels_[entry.channel].max_message_size;
+    max_size = std::max(max_size, entry.max_message_size);
+  }
+  return absl::OkStatus();
+}
+
+bool RecordingReader::ValidChunk(uint64_t offset) const {
+  // Careful not to overflow with offsets near UINT64_MAX.
+  if (offset < sizeof(RecordingFileHeader) || offset > size_ ||
+      size_ - offset < sizeof(RecordingChunkHeader)) {
+    return false;
+  }
+  const RecordingChunkHeader *chunk = ChunkAt(offset);
+  return chunk->magic == kRecordingChunkMagic &&
+         chunk->length <= size_ - offset - sizeof(RecordingChunkHeader);
+}
+
+absl::Status RecordingReader::ReadIndex(const RecordingTrailer &trailer) {
+  // Divide rather than multiply so that a huge num_entries can't wrap.
+  if (!ValidChunk(trailer.index_offset) ||
+      ChunkAt(trailer.index_offset)->length % sizeof(RecordingIndexEntry) !=
+          0 ||
+      ChunkAt(trailer.index_offset)->length / sizeof(RecordingIndexEntry) !=
+          trailer.num_entries) {
+    return absl::InvalidArgumentError("Recording has an invalid index");
+  }
+  const RecordingIndexEntry *entries =
+      reinterpret_cast<const RecordingIndexEntry *>(
+          base_ + trailer.index_offset + sizeof(RecordingChunkHeader));
+  for (uint64_t i = 0; i < trailer.num_entries; i++) {
+    const RecordingIndexEntry &entry = entries[i];
+    if (!ValidChunk(entry.offset) || entry.channel < 0) {
+      return absl::InvalidArgumentError("Recording has an invalid index");
+    }
+    if (entry.kind == kRecordingChannelChunk) {
+      if (absl::Status status = ReadChannel(entry.offset); !status.ok()) {
+        return status;
+      }
+    } else if (entry.kind == kRecordingMessageChunk) {
+      // Reading the messages relies on their sizes so check them now.
+      const RecordingChunkHeader *chunk = ChunkAt(entry.offset);
+      RecordingIndexEntry records = {entry.channel, entry.kind, entry.offset};
+      if (static_cast<size_t>(entry.channel) >= channels_.size() ||
+          chunk->kind != kRecordingMessageChunk ||
+          chunk->num_records != entry.num_records ||
+          !ScanRecords(entry.offset, records)) {
+        return absl::InvalidArgumentError("Recording has an invalid index");
+      }
+      index_.push_back(entry);
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status RecordingReader::ScanChunks() {
+  uint64_t offset = sizeof(RecordingFileHeader);
+  while (ValidChunk(offset)) {
+    const RecordingChunkHeader *chunk = ChunkAt(offset);
+    uint64_t end = offset + sizeof(RecordingChunkHeader) + chunk->length;
+    if (chunk->kind == kRecordingChannelChunk) {
+      if (absl::Status status = ReadChannel(offset); !status.ok()) {
+        return status;
+      }
+    } else if (chunk->kind == kRecordingMessageChunk) {
+      if (chunk->channel < 0 ||
+          static_cast<size_t>(chunk->channel) >= channels_.size() ||
+          chunk->num_records == 0) {
+        break;
+      }
+      RecordingIndexEntry entry = {chunk->channel, chunk->kind, offset};
+      if (!ScanRecords(offset, entry)) {
+        break;
+      }
+      index_.push_back(entry);
+    } else {
+      // The index, which must be incomplete if we are scanning.
+      break;
+    }
+    offset = end;
+  }
+  return absl::OkStatus();
+}
+
+bool RecordingReader::ScanRecords(uint64_t offset,
+                                  RecordingIndexEntry &entry) const {
+  const RecordingChunkHeader *chunk = ChunkAt(offset);
+  uint64_t end = offset + sizeof(RecordingChunkHeader) + chunk->length;
+  uint64_t record = offset + sizeof(RecordingChunkHeader);
+  entry.num_records = chunk->num_records;
+  for (uint32_t i = 0; i < chunk->num_records; i++) {
+    if (record + sizeof(MessagePrefix) > end) {
+      return false;
+    }
+    const MessagePrefix *prefix =
+        reinterpret_cast<const MessagePrefix *>(base_ + record);
+    if (prefix->message_size < 0) {
+      return false;
+    }
+    if (i == 0) {
+      entry.first_ordinal = prefix->ordinal;
+      entry.first_timestamp = prefix->timestamp;
+    }
+    entry.last_ordinal = prefix->ordinal;
+    entry.last_timestamp = prefix->timestamp;
+    entry.max_message_size =
+        std::max(entry.max_message_size, prefix->message_size);
+    record += RecordSize(prefix->message_size);
+    if (record > end) {
+      return false;
+    }
+  }
+  return true;
+}
+
+absl::Status RecordingReader::ReadChannel(uint64_t offset) {
+  const RecordingChunkHeader *chunk = ChunkAt(offset);
+  const char *data = base_ + offset + sizeof(RecordingChunkHeader);
+  const char *end = data + chunk->length;
+  std::string strings[2];
+  for (std::string &s : strings) {
+    uint32_t length;
+    if (end - data < static_cast<ptrdiff_t>(sizeof(length))) {
+      return absl::InvalidArgumentError("Recording has an invalid channel");
+    }
+    memcpy(&length, data, sizeof(length));
+    data += sizeof(length);
+    if (end - data < static_cast<ptrdiff_t>(length)) {
+      return absl::InvalidArgumentError("Recording has an invalid channel");
+    }
+    s.assign(data, length);
+    data += length;
+  }
+  if (chunk->channel < 0) {
+    return absl::InvalidArgumentError("Recording has an invalid channel");
+  }
+  if (static_cast<size_t>(chunk->channel) >= channels_.size()) {
+    channels_.resize(chunk->channel + 1);
+  }
+  RecordedChannel &channel = channels_[chunk->channel];
+  channel.name = std::move(strings[0]);
+  channel.type = std::move(strings[1]);
+  return absl::OkStatus();
+}
+
+RecordedMessage RecordingReader::RecordAt(int channel,
+                                          uint64_t &offset) const {
+  RecordedMessage msg;
+  msg.channel = channel;
+  msg.prefix = reinterpret_cast<const MessagePrefix *>(base_ + offset);
+  msg.data = msg.prefix + 1;
+  msg.length = msg.prefix->message_size;
+  offset += RecordSize(msg.length);
+  return msg;
+}
+
+bool RecordingReader::Next(RecordedMessage &msg) {
+  while (records_left_ == 0) {
+    if (next_chunk_ >= index_.size()) {
+      return false;
+    }
+    const RecordingIndexEntry &entry = index_[next_chunk_++];
+    next_channel_ = entry.channel;
+    next_offset_ = entry.offset + sizeof(RecordingChunkHeader);
+    records_left_ = entry.num_records;
+  }
+  msg = RecordAt(next_channel_, next_offset_);
+  records_left_--;
+  return true;
+}
+
+void RecordingReader::Seek(uint64_t timestamp) {
+  next_chunk_ = 0;
+  records_left_ = 0;
+  while (next_chunk_ < index_.size() &&
+         index_[next_chunk_].last_timestamp < timestamp) {
+    next_chunk_++;
+  }
+  if (next_chunk_ == index_.size()) {
+    return;
+  }
+  // Skip the earlier messages in the chunk.
+  const RecordingIndexEntry &entry = index_[next_chunk_++];
+  next_channel_ = entry.channel;
+  next_offset_ = entry.offset + sizeof(RecordingChunkHeader);
+  records_left_ = entry.num_records;
+  while (records_left_ > 0) {
+    uint64_t offset = next_offset_;
+    RecordedMessage msg = RecordAt(next_channel_, offset);
+    if (msg.Timestamp() >= timestamp) {
+      break;
+    }
+    next_offset_ = offset;
+    records_left_--;
+  }
+}
+
+RecordedMessage RecordingReader::Find(int channel, int64_t ordinal) const {
+  for (const RecordingIndexEntry &entry : index_) {
+    if (entry.channel != channel || ordinal < entry.first_ordinal ||
+        ordinal > entry.last_ordinal) {
+      continue;
+    }
+    uint64_t offset = entry.offset + sizeof(RecordingChunkHeader);
+    for (uint32_t i = 0; i < entry.num_records; i++) {
+      RecordedMessage msg = RecordAt(channel, offset);
+      if (msg.Ordinal() == ordinal) {
+        return msg;
+      }
+    }
+  }
+  return RecordedMessage();
+}
+
+absl::Status Replayer::Open(const std::string &filename, int num_slots,
+                            const PublisherOptions &options) {
+  if (absl::Status status = reader_.Open(filename); !status.ok()) {
+    return status;
+  }
+  publishers_.clear();
+  for (const RecordedChannel &channel : reader_.Channels()) {
+    PublisherOptions opts = options;
+    if (!channel.type.empty()) {
+      opts.SetType(channel.type);
+    }
+    absl::StatusOr<Publisher> pub = client_.CreatePublisher(
+        channel.name, std::max(1, channel.max_message_size), num_slots, opts);
+    if (!pub.ok()) {
+      return pub.status();
+    }
+    publishers_.push_back(std::move(*pub));
+  }
+  return absl::OkStatus();
+}
+
+void Replayer::SleepUntil(uint64_t time) {
+  uint64_t now = toolbelt::Now();
+  if (time <= now) {
+    return;
+  }
+  if (co_ != nullptr) {
+    co_->Nanosleep(time - now);
+  } else {
+    struct timespec ts = {static_cast<time_t>((time - now) / 1000000000),
+                          static_cast<long>((time - now) % 1000000000)};
+    ::nanosleep(&ts, nullptr);
+  }
+}
+
+absl::StatusOr<int64_t> Replayer::Replay() {
+  if (publishers_.size() != reader_.Channels().size()) {
+    return absl::FailedPreconditionError("Recording is not open");
+  }
+  int64_t num_published = 0;
+  uint64_t start = toolbelt::Now();
+  uint64_t first_timestamp = 0;
+  RecordedMessage msg;
+  while (reader_.Next(msg)) {
+    if (num_published == 0) {
+      first_timestamp = msg.Timestamp();
+    } else if (rate_ > 0 && msg.Timestamp() > first_timestamp) {
+      SleepUntil(start + static_cast<uint64_t>(
+                             (msg.Timestamp() - first_timestamp) / rate_));
+    }
+    Publisher &pub = publishers_[msg.channel];
+    for (;;) {
+      absl::StatusOr<void *> buffer = pub.GetMessageBuffer(msg.length);
+      if (!buffer.ok()) {
+        return buffer.status();
+      }
+      if (*buffer == nullptr) {
+        // A reliable publisher with no free slot.
+        if (absl::Status status = pub.Wait(); !status.ok()) {
+          return status;
+        }
+        continue;
+      }
+      memcpy(*buffer, msg.data, msg.length);
+      if (absl::StatusOr<Message> m = pub.PublishMessage(msg.length);
+          !m.ok()) {
+        return m.status();
+      }
+      break;
+    }
+    num_published++;
+  }
+  return num_published;
+}
+
+} // namespace subspace
@@ -0,0 +1,265 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __CLIENT_RECORDER_H
+#define __CLIENT_RECORDER_H
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "client/client.h"
+#include "client/subscriber_set.h"
+#include "common/channel.h"
+#include "coroutine.h"
+#include "toolbelt/fd.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+namespace subspace {
+
+// A recording is a log of the messages on a number of channels in a
+// single file that can be memory mapped to read it.  The file starts with
+// a RecordingFileHeader and is followed by chunks, each a
+// RecordingChunkHeader followed by its data:
+//
+// kRecordingChannelChunk: describes a channel.  The data is the channel's
+//   name and type, each a 4 byte length followed by the bytes.  The
+//   channel field is the index of the channel in the recording.
+// kRecordingMessageChunk: num_records messages read from the channel in
+//   one go.  Each record is the message's MessagePrefix, exactly as it
+//   is in the channel, followed by the message and padded to a multiple
+//   of 8 bytes.  The prefix's padding field is meaningless.
+// kRecordingIndexChunk: written when the recording is closed.  The data
+//   is a RecordingIndexEntry for each of the other chunks.  It is followed
+//   by a RecordingTrailer at the end of the file.
+//
+// A recording that wasn't closed (the recorder crashed, say) has no
+// index.  The reader builds one by scanning the chunks, stopping at the
+// first that is incomplete.  Everything is in host byte order.
+constexpr char kRecordingMagic[8] = {'S', 'U', 'B', 'S', 'P', 'R', 'E', 'C'};
+constexpr uint32_t kRecordingVersion = 1;
+constexpr uint32_t kRecordingChunkMagic = 0x4b4e4843; // CHNK
+
+constexpr uint32_t kRecordingChannelChunk = 1;
+constexpr uint32_t kRecordingMessageChunk = 2;
+constexpr uint32_t kRecordingIndexChunk = 3;
+
+struct RecordingFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct RecordingChunkHeader {
+  uint32_t magic;
+  uint32_t kind;
+  int32_t channel;
+  uint32_t num_records;
+  uint64_t length; // Bytes of data after the header.
+};
+
+// The ordinals, timestamps and sizes are only set for message chunks.
+struct RecordingIndexEntry {
+  int32_t channel;
+  uint32_t kind;
+  uint64_t offset; // Of the chunk header.
+  int64_t first_ordinal;
+  int64_t last_ordinal;
+  uint64_t first_timestamp;
+  uint64_t last_timestamp;
+  int32_t max_message_size;
+  uint32_t num_records;
+};
+
+struct RecordingTrailer {
+  uint64_t index_offset; // Of the index chunk header.
+  uint64_t num_entries;
+  char magic[8];
+};
+
+// Records messages from a number of channels to a file.  The messages
+// are written straight from the channels' slots, with one pwritev call
+// for each batch of messages read from a channel, so recording doesn't
+// copy or allocate anything for each message.  The subscribers hold on
+// to the slots of a batch while it is being written.
+//
+// The recorder subscribes to the channels with the client it is given.
+// Like the Client, it is not thread safe.
+class Recorder {
+public:
+  // If c is not nullptr, Record will yield to other coroutines while it
+  // is waiting for messages.
+  Recorder(Client &client, co::Coroutine *c = nullptr)
+      : client_(client), subscribers_(c) {}
+  ~Recorder();
+
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  // Create the recording file, replacing any that exists.
+  absl::Status Open(const std::string &filename);
+
+  // Record the messages on the channel from now on.  The channel doesn't
+  // need to have any publishers yet.
+  absl::Status AddChannel(const std::string &channel_name,
+                          const SubscriberOptions &options = {});
+
+  // Wait for up to timeout_ns nanoseconds (-1 means forever) for messages
+  // on any of the channels and write all that are available.  Returns the
+  // number of messages written.
+  absl::StatusOr<int64_t> Record(int64_t timeout_ns = -1);
+
+  // Write the index and close the file.  Recording a lot of messages
+  // should be done in a loop around Record, calling Close at the end.
+  absl::Status Close();
+
+  int64_t NumMessages() const { return num_messages_; }
+
+private:
+  static constexpr int kMaxBatch = 64;
+
+  struct Channel {
+    std::string name;
+    Subscriber subscriber;
+  };
+
+  // Write the iovecs at the end of the file.  They are modified.
+  absl::Status Write(std::vector<struct iovec> &iovecs);
+  absl::StatusOr<int64_t> RecordChannel(int index);
+
+  Client &client_;
+  toolbelt::FileDescriptor fd_;
+  uint64_t offset_ = 0;
+  std::vector<std::unique_ptr<Channel>> channels_;
+  SubscriberSet subscribers_;
+  std::vector<RecordingIndexEntry> index_;
+  int64_t num_messages_ = 0;
+  // Reused for every batch.
+  std::vector<Message> msgs_;
+  std::vector<struct iovec> iovecs_;
+};
+
+// A channel in a recording.
+struct RecordedChannel {
+  std::string name;
+  std::string type;
+  // The size of the biggest message recorded on the channel.
+  int32_t max_message_size = 0;
+};
+
+// A message in a recording.  The prefix and data point into the memory
+// mapped file so they stay valid as long as the reader is open.
+struct RecordedMessage {
+  int channel = -1; // Index into RecordingReader::Channels.
+  const MessagePrefix *prefix = nullptr;
+  const void *data = nullptr;
+  size_t length = 0;
+  int64_t Ordinal() const { return prefix->ordinal; }
+  uint64_t Timestamp() const { return prefix->timestamp; }
+};
+
+// Reads a recording by memory mapping the file.  Nothing is copied.
+class RecordingReader {
+public:
+  RecordingReader() = default;
+  ~RecordingReader();
+
+  RecordingReader(const RecordingReader &) = delete;
+  RecordingReader &operator=(const RecordingReader &) = delete;
+
+  absl::Status Open(const std::string &filename);
+
+  const std::vector<RecordedChannel> &Channels() const { return channels_; }
+  // The index entries of the message chunks, in the order they were
+  // written.
+  const std::vector<RecordingIndexEntry> &Index() const { return index_; }
+
+  // Read the next message, in the order they were written.  Returns
+  // false at the end of the recording.
+  bool Next(RecordedMessage &msg);
+
+  // Move to the first message published at or after the timestamp.
+  void Seek(uint64_t timestamp);
+
+  // Find the message on a channel with the given ordinal.  The returned
+  // message has no prefix if there isn't one.  This doesn't change where
+  // Next reads from.
+  RecordedMessage Find(int channel, int64_t ordinal) const;
+
+private:
+  absl::Status ReadIndex(const RecordingTrailer &trailer);
+  // Build the index by reading the chunks when the recording has no
+  // index.
+  absl::Status ScanChunks();
+  absl::Status ReadChannel(uint64_t offset);
+  // Whether the chunk at offset is complete.
+  bool ValidChunk(uint64_t offset) const;
+  const RecordingChunkHeader *ChunkAt(uint64_t offset) const {
+    return reinterpret_cast<const RecordingChunkHeader *>(base_ + offset);
+  }
+  // Check that the records of the message chunk at offset all lie inside
+  // it and fill in the entry's ordinals, timestamps and sizes from them.
+  bool ScanRecords(uint64_t offset, RecordingIndexEntry &entry) const;
+  // The message record at offset, which is updated to the next one.  The
+  // records were checked by ScanRecords when the recording was opened.
+  RecordedMessage RecordAt(int channel, uint64_t &offset) const;
+
+  const char *base_ = nullptr;
+  size_t size_ = 0;
+  std::vector<RecordedChannel> channels_;
+  std::vector<RecordingIndexEntry> index_;
+  // Where Next reads from: the index of the chunk and the offset of the
+  // next record and how many records are left in it.
+  size_t next_chunk_ = 0;
+  int next_channel_ = -1;
+  uint64_t next_offset_ = 0;
+  uint32_t records_left_ = 0;
+};
+
+// Publishes the messages in a recording back on their channels at the
+// rate they were recorded, or faster or slower.  The messages are copied
+// from the memory mapped file into buffers from GetMessageBuffer.
+class Replayer {
+public:
+  // If c is not nullptr, Replay will yield to other coroutines while it
+  // is waiting to publish the next message.
+  Replayer(Client &client, co::Coroutine *c = nullptr)
+      : client_(client), co_(c) {}
+
+  // Open the recording and create a publisher for each of its channels.
+  // The slot size is that of the channel's biggest message.  Recordings
+  // don't hold the channels' slot counts, so if a channel already exists
+  // num_slots must be its number of slots or the server will refuse the
+  // publisher.
+  absl::Status Open(const std::string &filename, int num_slots = 16,
+                    const PublisherOptions &options = {});
+
+  // Publish at rate times the recorded speed.  Zero means as fast as
+  // possible.  The default is 1.
+  void SetRate(double rate) { rate_ = rate; }
+
+  // Publish the messages in the recording from the reader's position, which
+  // is the start unless Reader().Seek has been called, to the end.
+  // Returns the number of messages published.  The reader is left at the
+  // end so call Reader().Seek(0) before replaying the recording again.
+  absl::StatusOr<int64_t> Replay();
+
+  RecordingReader &Reader() { return reader_; }
+
+private:
+  void SleepUntil(uint64_t time);
+
+  Client &client_;
+  co::Coroutine *co_;
+  double rate_ = 1.0;
+  RecordingReader reader_;
+  // One per channel, in the order of RecordingReader::Channels.
+  std::vector<Publisher> publishers_;
+};
+
+} // namespace subspace
+
+#endif // __CLIENT_RECORDER_H
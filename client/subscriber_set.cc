@@ -0,0 +1,165 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "client/subscriber_set.h"
+#include "absl/strings/str_format.h"
+#include "toolbelt/clock.h"
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+namespace subspace {
+
+absl::Status SubscriberSet::Open() {
+#if defined(__linux__)
+  int fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+  int fd = kqueue();
+#endif
+  if (fd == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to create subscriber set poll fd: %s", strerror(errno)));
+  }
+  poll_fd_.SetFd(fd);
+  return absl::OkStatus();
+}
+
+absl::Status SubscriberSet::Add(Subscriber *subscriber) {
+  if (!poll_fd_.Valid()) {
+    if (absl::Status status = Open(); !status.ok()) {
+      return status;
+    }
+  }
+  if (subscribers_.contains(subscriber)) {
+    return absl::InternalError(
+        absl::StrFormat("Subscriber to %s is already in the set",
+                        subscriber->impl_->Name()));
+  }
+  int fd = subscriber->impl_->GetPollFd().Fd();
+#if defined(__linux__)
+  struct epoll_event event = {.events = EPOLLIN, .data = {.ptr = subscriber}};
+  int e = epoll_ctl(poll_fd_.Fd(), EPOLL_CTL_ADD, fd, &event);
+#else
+  struct kevent event;
+  EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, subscriber);
+  int e = kevent(poll_fd_.Fd(), &event, 1, nullptr, 0, nullptr);
+#endif
+  if (e == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Unable to add subscriber to %s to set: %s",
+                        subscriber->impl_->Name(), strerror(errno)));
+  }
+  subscribers_.insert(subscriber);
+  return absl::OkStatus();
+}
+
+absl::Status SubscriberSet::Remove(Subscriber *subscriber) {
+  if (!subscribers_.contains(subscriber)) {
+    return absl::InternalError(absl::StrFormat(
+        "Subscriber to %s is not in the set", subscriber->impl_->Name()));
+  }
+  subscribers_.erase(subscriber);
+  int fd = subscriber->impl_->GetPollFd().Fd();
+#if defined(__linux__)
+  int e = epoll_ctl(poll_fd_.Fd(), EPOLL_CTL_DEL, fd, nullptr);
+#else
+  struct kevent event;
+  EV_SET(&event, fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+  int e = kevent(poll_fd_.Fd(), &event, 1, nullptr, 0, nullptr);
+#endif
+  if (e == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Unable to remove subscriber to %s from set: %s",
+                        subscriber->impl_->Name(), strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+bool SubscriberSet::HasMessages(Subscriber *subscriber) {
+  details::SubscriberImpl *impl = subscriber->impl_;
+  // Clear the trigger before looking at shared memory.  If a message is
+  // published after we look, the publisher will trigger us again.
+  impl->ClearPollFd();
+  if (impl->IsPlaceholder()) {
+    // A publisher might have been created.  Reading will find out.
+    return true;
+  }
+  return impl->NumMessagesPublished() != impl->last_num_published_;
+}
+
+absl::Status SubscriberSet::GetEvents(int64_t timeout_ns,
+                                      std::vector<Subscriber *> &ready) {
+  constexpr int kMaxEvents = 64;
+#if defined(__linux__)
+  struct epoll_event events[kMaxEvents];
+  // Round the timeout up to the next millisecond.
+  int timeout_ms = timeout_ns < 0 ? -1 : (timeout_ns + 999999) / 1000000;
+  int n = epoll_wait(poll_fd_.Fd(), events, kMaxEvents, timeout_ms);
+#else
+  struct kevent events[kMaxEvents];
+  struct timespec ts = {.tv_sec = timeout_ns / 1000000000,
+                        .tv_nsec = timeout_ns % 1000000000};
+  int n = kevent(poll_fd_.Fd(), nullptr, 0, events, kMaxEvents,
+                 timeout_ns < 0 ? nullptr : &ts);
+#endif
+  if (n == -1) {
+    if (errno == EINTR) {
+      return absl::OkStatus();
+    }
+    return absl::InternalError(absl::StrFormat(
+        "Error waiting for subscriber set: %s", strerror(errno)));
+  }
+  for (int i = 0; i < n; i++) {
+#if defined(__linux__)
+    Subscriber *subscriber = reinterpret_cast<Subscriber *>(events[i].data.ptr);
+#else
+    Subscriber *subscriber = reinterpret_cast<Subscriber *>(events[i].udata);
+#endif
+    if (HasMessages(subscriber)) {
+      ready.push_back(subscriber);
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::vector<Subscriber *>>
+SubscriberSet::Wait(int64_t timeout_ns) {
+  if (subscribers_.empty()) {
+    return absl::InternalError("No subscribers in set");
+  }
+  std::vector<Subscriber *> ready;
+  uint64_t end = timeout_ns < 0 ? 0 : toolbelt::Now() + timeout_ns;
+  for (;;) {
+    int64_t remaining = -1;
+    if (timeout_ns >= 0) {
+      uint64_t now = toolbelt::Now();
+      remaining = now >= end ? 0 : end - now;
+    }
+    if (co_ != nullptr) {
+      // The epoll/kqueue fd is readable when any of the trigger fds are.
+      // Wait for it in the coroutine and then collect the events without
+      // blocking.
+      if (co_->Wait(poll_fd_.Fd(), POLLIN, remaining) == -1) {
+        // Timeout.
+        return ready;
+      }
+      remaining = 0;
+    }
+    if (absl::Status status = GetEvents(remaining, ready); !status.ok()) {
+      return status;
+    }
+    if (!ready.empty() || remaining == 0) {
+      return ready;
+    }
+    // All the wakeups were spurious, wait again.
+  }
+}
+
+} // namespace subspace
@@ -0,0 +1,69 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __CLIENT_SUBSCRIBER_SET_H
+#define __CLIENT_SUBSCRIBER_SET_H
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "client/client.h"
+#include "coroutine.h"
+#include "toolbelt/fd.h"
+#include <vector>
+
+namespace subspace {
+
+// A SubscriberSet allows a program to wait for messages on many channels
+// at once.  The trigger fds of the subscribers in the set are registered
+// with a single epoll (kqueue on MacOS) file descriptor so only one wait
+// is needed no matter how many subscribers there are, and only the
+// subscribers that have messages are returned.
+//
+// A subscriber's trigger can fire without a message being available
+// (when a publisher is added, for example) so the shared memory of the
+// channel is checked to see if anything has been published since the
+// subscriber last read.  Subscribers that haven't got messages are not
+// returned.  Once Wait returns a subscriber you must read all its
+// available messages, as for Subscriber::Wait.
+//
+// The subscribers are held by pointer so they must not be moved or
+// destroyed while they are in the set.  Like the Client, this is not
+// thread safe.
+class SubscriberSet {
+public:
+  // If c is not nullptr, Wait will yield to other coroutines while it is
+  // waiting.
+  SubscriberSet(co::Coroutine *c = nullptr) : co_(c) {}
+  ~SubscriberSet() = default;
+
+  SubscriberSet(const SubscriberSet &) = delete;
+  SubscriberSet &operator=(const SubscriberSet &) = delete;
+
+  absl::Status Add(Subscriber *subscriber);
+  absl::Status Remove(Subscriber *subscriber);
+
+  size_t Size() const { return subscribers_.size(); }
+
+  // Wait until at least one of the subscribers has a message to read, or
+  // until timeout_ns nanoseconds have passed (-1 means wait forever).
+  // Returns the subscribers with messages, which is empty if the timeout
+  // expired.
+  absl::StatusOr<std::vector<Subscriber *>> Wait(int64_t timeout_ns = -1);
+
+private:
+  absl::Status Open();
+  // Wait for the events on the poll fd and append the subscribers
+  // whose trigger fds are ready to ready.
+  absl::Status GetEvents(int64_t timeout_ns, std::vector<Subscriber *> &ready);
+  static bool HasMessages(Subscriber *subscriber);
+
+  co::Coroutine *co_;
+  toolbelt::FileDescriptor poll_fd_; // epoll or kqueue.
+  absl::flat_hash_set<Subscriber *> subscribers_;
+};
+
+} // namespace subspace
+
+#endif // __CLIENT_SUBSCRIBER_SET_H
@@ -9,10 +9,19 @@
 #include "toolbelt/mutex.h"
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 #if defined(__APPLE__)
 #include <sys/posix_shm.h>
 #endif
+
+#if defined(__linux__) && !defined(MFD_HUGE_2MB)
+#define MFD_HUGE_2MB (21 << 26) // log2(2MB) << MFD_HUGE_SHIFT
+#endif
 #include "absl/container/flat_hash_map.h"
+#include <algorithm>
 #include <cassert>
 #include <inttypes.h>
 #include <mutex>
@@ -35,10 +44,31 @@ static absl::flat_hash_map<void *, size_t> *mapped_regions;
 static std::mutex *region_lock;
 #endif
 
+// Fault in the pages of mapped memory by touching each one.
+static void PrefaultMemory(void *p, size_t size) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset < size; offset += page_size) {
+    (void)reinterpret_cast<volatile char *>(p)[offset];
+  }
+}
 
-
-static void *MapMemory(int fd, size_t size, int prot, const char *purpose) {
-  void *p = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+// If prefault is true the pages are faulted in now rather than on first
+// access.
+static void *MapMemory(int fd, size_t size, int prot, const char *purpose,
+                       bool prefault = false) {
+  int flags = MAP_SHARED;
+#if defined(__linux__)
+  if (prefault) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+  void *p = mmap(NULL, size, prot, flags, fd, 0);
+#if !defined(__linux__)
+  if (prefault && p != MAP_FAILED) {
+    // No MAP_POPULATE, touch each page instead.
+    PrefaultMemory(p, size);
+  }
+#endif
 #if SHOW_MMAPS
   printf("mapping %s with size %zd: %p -> %p\n", purpose, size, p,
          reinterpret_cast<char *>(p) + size);
@@ -87,9 +117,190 @@ static void UnmapMemory(void *p, size_t size, const char *purpose) {
 #endif
 }
 
-static absl::StatusOr<void *> CreateSharedMemory(int id, const char *suffix,
-                                                 int64_t size, bool map,
-                                                 toolbelt::FileDescriptor &fd) {
+// Ask for the pages of mapped shared memory to be allocated on the given
+// NUMA node.  For shared memory the policy is held by the memory object,
+// not the mapping, so it applies to all processes that map it.  It must
+// be set before the pages are faulted in.  This is only a hint so errors
+// (from a kernel without NUMA support, for example) are ignored.
+static void BindMemory(void *p, size_t size, int numa_node) {
+#if defined(__linux__)
+  constexpr int kMpolPreferred = 1; // MPOL_PREFERRED in <numaif.h>.
+  unsigned long nodemask = 0;
+  if (numa_node < 0 || numa_node >= static_cast<int>(sizeof(nodemask) * 8)) {
+    return;
+  }
+  nodemask = 1UL << numa_node;
+  // The kernel ignores the last bit of maxnode.
+  (void)syscall(SYS_mbind, p, size, kMpolPreferred, &nodemask,
+                sizeof(nodemask) * 8 + 1, 0);
+#endif
+}
+
+// Map newly created shared memory.  If numa_node isn't -1 the memory
+// policy is set before the pages are faulted in.  If map is false the
+// memory is unmapped again (keeping the policy) and nullptr is returned.
+static void *MapNewMemory(int fd, int64_t size, const char *suffix, bool map,
+                          bool prefault, int numa_node) {
+  void *p = MapMemory(fd, size, PROT_READ | PROT_WRITE, suffix,
+                      prefault && numa_node < 0);
+  if (p == MAP_FAILED) {
+    return p;
+  }
+  if (numa_node >= 0) {
+    BindMemory(p, size, numa_node);
+    if (map && prefault) {
+      PrefaultMemory(p, size);
+    }
+  }
+  if (!map) {
+    UnmapMemory(p, size, suffix);
+    return nullptr;
+  }
+  return p;
+}
+
+// The clients in a process share the mappings of a channel's shared
+// memory.  All the publishers and subscribers for a channel (in any
+// Client) map the same SCB, CCB and buffers so the first one to map them
+// does the mmap and the others get the same address.  A mapping is
+// unmapped when the last of them unmaps it.
+//
+// The mappings are keyed by the identity of the file the fd refers to
+// rather than the channel id and buffer index since the server reuses
+// channel ids.  A file can't be replaced by another with the same inode
+// while we have it mapped.
+//
+// Like the mapped_regions above, these are allocated on first use and
+// never deleted.
+namespace {
+struct MappingKey {
+  dev_t dev;
+  ino_t ino;
+  size_t size;
+  int prot;
+
+  bool operator==(const MappingKey &k) const {
+    return dev == k.dev && ino == k.ino && size == k.size && prot == k.prot;
+  }
+  template <typename H> friend H AbslHashValue(H h, const MappingKey &k) {
+    return H::combine(std::move(h), k.dev, k.ino, k.size, k.prot);
+  }
+};
+
+struct SharedMapping {
+  void *addr;
+  int refs;
+};
+} // namespace
+
+static std::mutex *mapping_lock;
+static absl::flat_hash_map<MappingKey, SharedMapping> *shared_mappings;
+static absl::flat_hash_map<void *, MappingKey> *mapping_keys;
+
+static std::mutex &SharedMappingLock() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    mapping_lock = new std::mutex;
+    shared_mappings = new absl::flat_hash_map<MappingKey, SharedMapping>;
+    mapping_keys = new absl::flat_hash_map<void *, MappingKey>;
+  });
+  return *mapping_lock;
+}
+
+// Map the shared memory or add a reference to an existing mapping of it.
+// Returns MAP_FAILED with errno set on failure.
+static void *MapSharedMemory(int fd, size_t size, int prot,
+                             const char *purpose, bool prefault = false) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return MAP_FAILED;
+  }
+  MappingKey key = {st.st_dev, st.st_ino, size, prot};
+  std::unique_lock l(SharedMappingLock());
+  if (auto it = shared_mappings->find(key); it != shared_mappings->end()) {
+    it->second.refs++;
+    return it->second.addr;
+  }
+  void *p = MapMemory(fd, size, prot, purpose, prefault);
+  if (p == MAP_FAILED) {
+    return p;
+  }
+  (*shared_mappings)[key] = {p, 1};
+  (*mapping_keys)[p] = key;
+  return p;
+}
+
+// Remove a reference to a mapping made by MapSharedMemory, unmapping it
+// if it was the last.  Memory that wasn't mapped by MapSharedMemory (the
+// server's own mappings) is unmapped directly.
+static void UnmapSharedMemory(void *p, size_t size, const char *purpose) {
+  {
+    std::unique_lock l(SharedMappingLock());
+    if (auto it = mapping_keys->find(p); it != mapping_keys->end()) {
+      auto mapping = shared_mappings->find(it->second);
+      assert(mapping != shared_mappings->end());
+      assert(it->second.size == size);
+      if (--mapping->second.refs > 0) {
+        return;
+      }
+      shared_mappings->erase(mapping);
+      mapping_keys->erase(it);
+    }
+  }
+  UnmapMemory(p, size, purpose);
+}
+
+#if defined(__linux__)
+// Huge pages come from the hugetlbfs pool so the memory is created with
+// memfd_create rather than shm_open.  The size must be a multiple of
+// kHugePageSize.  The memory is always mapped here, even if map is false,
+// so that the huge pages are reserved and we get an error now if there
+// aren't enough of them rather than in the clients that map it.
+static absl::StatusOr<void *>
+CreateHugePageMemory(int id, const char *suffix, int64_t size, bool map,
+                     bool prefault, int numa_node,
+                     toolbelt::FileDescriptor &fd) {
+  char name[NAME_MAX];
+  snprintf(name, sizeof(name), "%d.%s", id, suffix);
+  int mem_fd = memfd_create(name, MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+  if (mem_fd == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to create huge page memory %s: %s", name,
+                        strerror(errno)));
+  }
+  if (ftruncate(mem_fd, size) == -1) {
+    close(mem_fd);
+    return absl::InternalError(
+        absl::StrFormat("Failed to set length of huge page memory %s: %s",
+                        name, strerror(errno)));
+  }
+  void *p = MapNewMemory(mem_fd, size, suffix, map, prefault, numa_node);
+  if (p == MAP_FAILED) {
+    close(mem_fd);
+    return absl::InternalError(absl::StrFormat(
+        "Failed to map huge page memory %s (are enough huge pages "
+        "configured in /proc/sys/vm/nr_hugepages?): %s",
+        name, strerror(errno)));
+  }
+  fd.SetFd(mem_fd);
+  return p;
+}
+#endif
+
+// If huge_pages is true the memory is backed by huge pages on Linux.  On
+// other operating systems it is ignored.  If prefault is true and the
+// memory is mapped, its pages are faulted in.  If numa_node isn't -1 the
+// pages are allocated on that NUMA node if possible.
+static absl::StatusOr<void *>
+CreateSharedMemory(int id, const char *suffix, int64_t size, bool map,
+                   toolbelt::FileDescriptor &fd, bool huge_pages = false,
+                   bool prefault = false, int numa_node = -1) {
+#if defined(__linux__)
+  if (huge_pages) {
+    return CreateHugePageMemory(id, suffix, size, map, prefault, numa_node,
+                                fd);
+  }
+#endif
   char shm_name[NAME_MAX];
   snprintf(shm_name, sizeof(shm_name), "/%d.%s.XXXXXX", id, suffix);
   close(mkstemp(shm_name));
@@ -113,10 +324,11 @@ static absl::StatusOr<void *> CreateSharedMemory(int id, const char *suffix,
                         shm_name, strerror(errno)));
   }
 
-  // Map it into memory if asked
+  // Map it into memory if asked.  It also needs to be mapped to set
+  // the NUMA node.
   void *p = nullptr;
-  if (map) {
-    p = MapMemory(shm_fd, size, PROT_READ | PROT_WRITE, suffix);
+  if (map || numa_node >= 0) {
+    p = MapNewMemory(shm_fd, size, suffix, map, prefault, numa_node);
     if (p == MAP_FAILED) {
       shm_unlink(shm_name);
       return absl::InternalError(absl::StrFormat(
@@ -162,7 +374,7 @@ Channel::Channel(const std::string &name, int num_slots, int channel_id,
 
 absl::StatusOr<SharedMemoryFds>
 Channel::Allocate(const toolbelt::FileDescriptor &scb_fd, int slot_size,
-                  int num_slots) {
+                  int num_slots, const AllocationOptions &options) {
   // Unmap existing memory.
   Unmap();
 
@@ -184,6 +396,7 @@ Channel::Allocate(const toolbelt::FileDescriptor &scb_fd, int slot_size,
   scb_ = reinterpret_cast<SystemControlBlock *>(MapMemory(
       scb_fd.Fd(), sizeof(SystemControlBlock), PROT_READ | PROT_WRITE, "SCB"));
   if (scb_ == MAP_FAILED) {
+    scb_ = nullptr;
     return absl::InternalError(absl::StrFormat(
         "Failed to map SystemControlBlock: %s", strerror(errno)));
   }
@@ -195,30 +408,39 @@ Channel::Allocate(const toolbelt::FileDescriptor &scb_fd, int slot_size,
   fds.buffers.emplace_back(slot_size);
 
   // Create CCB in shared memory and map into process memory.
-  int64_t ccb_size =
-      sizeof(ChannelControlBlock) + sizeof(MessageSlot) * num_slots_;
+  int64_t ccb_size = CcbSize(num_slots_);
   absl::StatusOr<void *> p =
-      CreateSharedMemory(channel_id_, "ccb", ccb_size, /*map=*/true, fds.ccb);
+      CreateSharedMemory(channel_id_, "ccb", ccb_size, /*map=*/true, fds.ccb,
+                         /*huge_pages=*/false, /*prefault=*/false,
+                         options.numa_node);
   if (!p.ok()) {
     UnmapMemory(scb_, sizeof(SystemControlBlock), "SCB");
+    scb_ = nullptr;
     return p.status();
   }
+  memset(*p, 0, ccb_size);
   ccb_ = reinterpret_cast<ChannelControlBlock *>(*p);
-  memset(ccb_, 0, ccb_size);
-
-  // Create a single buffer but don't map it in.  There is no need to
-  // map in the buffers in the server since they will never be used.
-  int64_t buffers_size =
-      sizeof(BufferHeader) +
-      num_slots_ * (Aligned<32>(slot_size) + sizeof(MessagePrefix));
+  ccb_->huge_pages = options.huge_pages;
+  ccb_->prefault = options.prefault;
+  ccb_->numa_node = options.numa_node;
+  ccb_->size_classes = options.size_classes;
+
+  // Create a single buffer.  There is no need to map in the buffers in
+  // the server since they will never be used, unless they are to be
+  // faulted in and locked.
+  int64_t buffers_size = BuffersSize(slot_size);
   if (buffers_size == 0) {
     buffers_size = 256;
   }
   p = CreateSharedMemory(channel_id_, "buffers0", buffers_size,
-                         /*map=*/false, fds.buffers[0].fd);
+                         /*map=*/options.prefault, fds.buffers[0].fd,
+                         options.huge_pages, options.prefault,
+                         options.numa_node);
   if (!p.ok()) {
     UnmapMemory(scb_, sizeof(SystemControlBlock), "SCB");
     UnmapMemory(ccb_, ccb_size, "CCB");
+    scb_ = nullptr;
+    ccb_ = nullptr;
     return p.status();
   }
   buffers_.emplace_back(slot_size, reinterpret_cast<char *>(*p));
@@ -233,6 +455,8 @@ Channel::Allocate(const toolbelt::FileDescriptor &scb_fd, int slot_size,
   strncpy(ccb_->channel_name, name_.c_str(), kMaxChannelName - 1);
   ccb_->num_slots = num_slots_;
   ccb_->next_ordinal = 1;
+  ccb_->lock_free = options.lock_free;
+  ccb_->remote_ordinals = false;
 
   ListInit(&ccb_->active_list);
   ListInit(&ccb_->busy_list);
@@ -243,11 +467,11 @@ Channel::Allocate(const toolbelt::FileDescriptor &scb_fd, int slot_size,
     MessageSlot *slot = &ccb_->slots[i];
     ListElementInit(&slot->element);
     slot->id = i;
-    slot->ref_count = 0;
-    slot->reliable_ref_count = 0;
+    slot->refs = 0;
     slot->buffer_index = -1; // No buffer in the free list.
-    slot->owners.Init();
     ListInsertAtEnd(&ccb_->free_list, &slot->element);
+    OrdinalRing()[i] = -1;
+    TimestampIndex()[i].seq = -1;
   }
 
   if (debug_) {
@@ -262,8 +486,8 @@ void Channel::PrintList(const SlotList *list) const {
   void *p = FromCCBOffset(list->first);
   while (p != FromCCBOffset(0)) {
     MessageSlot *slot = reinterpret_cast<MessageSlot *>(p);
-    printf("%d(%d/%d)@%d ", slot->id, slot->ref_count, slot->reliable_ref_count,
-           slot->buffer_index);
+    printf("%d(%d/%d)@%d ", slot->id, slot->RefCount(),
+           slot->ReliableRefCount(), slot->buffer_index);
     p = FromCCBOffset(slot->element.next);
   }
   printf("\n");
@@ -280,43 +504,37 @@ void Channel::PrintLists() const {
 
 absl::Status Channel::Map(SharedMemoryFds fds,
                           const toolbelt::FileDescriptor &scb_fd) {
-  scb_ = reinterpret_cast<SystemControlBlock *>(MapMemory(
+  scb_ = reinterpret_cast<SystemControlBlock *>(MapSharedMemory(
       scb_fd.Fd(), sizeof(SystemControlBlock), PROT_READ | PROT_WRITE, "SCB"));
   if (scb_ == MAP_FAILED) {
     return absl::InternalError(absl::StrFormat(
         "Failed to map SystemControlBlock: %s", strerror(errno)));
   }
 
-  int64_t ccb_size =
-      sizeof(ChannelControlBlock) + sizeof(MessageSlot) * num_slots_;
+  int64_t ccb_size = CcbSize(num_slots_);
   ccb_ = reinterpret_cast<ChannelControlBlock *>(
-      MapMemory(fds.ccb.Fd(), ccb_size, PROT_READ | PROT_WRITE, "CCB"));
+      MapSharedMemory(fds.ccb.Fd(), ccb_size, PROT_READ | PROT_WRITE, "CCB"));
   if (ccb_ == MAP_FAILED) {
-    UnmapMemory(scb_, sizeof(SystemControlBlock), "SCB");
+    UnmapSharedMemory(scb_, sizeof(SystemControlBlock), "SCB");
     return absl::InternalError(absl::StrFormat(
         "Failed to map ChannelControlBlock: %s", strerror(errno)));
   }
   int index = 0;
   for (const auto &buffer : fds.buffers) {
-    int64_t buffers_size =
-        sizeof(BufferHeader) +
-        num_slots_ * (Aligned<32>(buffer.slot_size) + sizeof(MessagePrefix));
+    int64_t buffers_size = BuffersSize(buffer.slot_size);
     if (buffers_size != 0) {
       char *mem = reinterpret_cast<char *>(
-          MapMemory(fds.buffers[index].fd.Fd(), buffers_size,
-                    PROT_READ | PROT_WRITE, "buffers"));
+          MapSharedMemory(fds.buffers[index].fd.Fd(), buffers_size,
+                          PROT_READ | PROT_WRITE, "buffers", IsPrefaulted()));
 
       if (mem == MAP_FAILED) {
-        UnmapMemory(scb_, sizeof(SystemControlBlock), "SCB");
-        UnmapMemory(ccb_, ccb_size, "CCB");
+        UnmapSharedMemory(scb_, sizeof(SystemControlBlock), "SCB");
+        UnmapSharedMemory(ccb_, ccb_size, "CCB");
         // Unmap any previously mapped buffers.
         for (int i = 0; i < index; i++) {
-          int64_t buffers_size =
-              sizeof(BufferHeader) +
-              num_slots_ *
-                  (Aligned<32>(buffers_[i].slot_size) + sizeof(MessagePrefix));
+          int64_t buffers_size = BuffersSize(buffers_[i].slot_size);
           if (buffers_size > 0 && buffers_[i].buffer != nullptr) {
-            UnmapMemory(buffers_[i].buffer, buffers_size, "buffers");
+            UnmapSharedMemory(buffers_[i].buffer, buffers_size, "buffers");
           }
         }
         return absl::InternalError(absl::StrFormat(
@@ -339,21 +557,17 @@ void Channel::Unmap() {
     // Not yet mapped.
     return;
   }
-  UnmapMemory(scb_, sizeof(SystemControlBlock), "SCB");
+  UnmapSharedMemory(scb_, sizeof(SystemControlBlock), "SCB");
 
   for (auto &buffer : buffers_) {
-    int64_t buffers_size =
-        sizeof(BufferHeader) +
-        num_slots_ * (Aligned<32>(buffer.slot_size) + sizeof(MessagePrefix));
+    int64_t buffers_size = BuffersSize(buffer.slot_size);
     if (buffers_size > 0 && buffer.buffer != nullptr) {
-      UnmapMemory(buffer.buffer, buffers_size, "buffers");
+      UnmapSharedMemory(buffer.buffer, buffers_size, "buffers");
     }
   }
   buffers_.clear();
 
-  int64_t ccb_size =
-      sizeof(ChannelControlBlock) + sizeof(MessageSlot) * num_slots_;
-  UnmapMemory(ccb_, ccb_size, "CCB");
+  UnmapSharedMemory(ccb_, CcbSize(num_slots_), "CCB");
 }
 
 // Called on server to extend the allocated buffers.
@@ -361,19 +575,20 @@ absl::StatusOr<toolbelt::FileDescriptor>
 Channel::ExtendBuffers(int32_t new_slot_size) {
   toolbelt::MutexLock lock(&ccb_->lock);
 
-  int64_t buffers_size =
-      sizeof(BufferHeader) +
-      num_slots_ * (Aligned<32>(new_slot_size) + sizeof(MessagePrefix));
+  int64_t buffers_size = BuffersSize(new_slot_size);
 
   char buffer_name[32];
   snprintf(buffer_name, sizeof(buffer_name), "buffers%d\n",
            ccb_->num_buffers - 1);
   toolbelt::FileDescriptor fd;
-  // Create the shared memory for the buffer but don't map it in.  This is
-  // in the server and it is not used here.  The result of a successful
-  // creation will be nullptr.
-  absl::StatusOr<void *> p = CreateSharedMemory(
-      channel_id_, buffer_name, buffers_size, /*map=*/false, fd);
+  // Create the shared memory for the buffer but don't map it in unless
+  // it is to be faulted in and locked.  This is in the server and it is
+  // not used here.  The result of a successful creation without mapping
+  // will be nullptr.
+  absl::StatusOr<void *> p =
+      CreateSharedMemory(channel_id_, buffer_name, buffers_size,
+                         /*map=*/IsPrefaulted(), fd, UsesHugePages(),
+                         IsPrefaulted(), NumaNode());
 
   if (!p.ok()) {
     return absl::InternalError(
@@ -393,22 +608,19 @@ absl::Status Channel::MapNewBuffers(std::vector<SlotBuffer> buffers) {
   for (size_t i = start; i < buffers.size(); i++) {
     const SlotBuffer &buffer = buffers[i];
 
-    int64_t buffers_size =
-        sizeof(BufferHeader) +
-        num_slots_ * (Aligned<32>(buffer.slot_size) + sizeof(MessagePrefix));
+    int64_t buffers_size = BuffersSize(buffer.slot_size);
     if (buffers_size != 0) {
-      char *mem = reinterpret_cast<char *>(MapMemory(
-          buffer.fd.Fd(), buffers_size, PROT_READ | PROT_WRITE, "new buffers"));
+      char *mem = reinterpret_cast<char *>(
+          MapSharedMemory(buffer.fd.Fd(), buffers_size,
+                          PROT_READ | PROT_WRITE, "new buffers",
+                          IsPrefaulted()));
 
       if (mem == MAP_FAILED) {
         // Unmap any newly mapped buffers.
         for (size_t i = start; i < buffers_.size(); i++) {
-          int64_t buffers_size =
-              sizeof(BufferHeader) +
-              num_slots_ *
-                  (Aligned<32>(buffers_[i].slot_size) + sizeof(MessagePrefix));
+          int64_t buffers_size = BuffersSize(buffers_[i].slot_size);
           if (buffers_size > 0 && buffers_[i].buffer != nullptr) {
-            UnmapMemory(buffers_[i].buffer, buffers_size, "buffers");
+            UnmapSharedMemory(buffers_[i].buffer, buffers_size, "buffers");
           }
         }
         return absl::InternalError(absl::StrFormat(
@@ -420,8 +632,35 @@ absl::Status Channel::MapNewBuffers(std::vector<SlotBuffer> buffers) {
   return absl::OkStatus();
 }
 
+int64_t Channel::BuffersSize(int32_t slot_size) const {
+  int64_t size = sizeof(BufferHeader) +
+                 num_slots_ * (Aligned<32>(slot_size) + sizeof(MessagePrefix));
+  if (UsesHugePages()) {
+    size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  }
+  return size;
+}
+
+absl::Status Channel::LockBuffers() {
+  for (auto &buffer : buffers_) {
+    if (buffer.buffer == nullptr) {
+      continue;
+    }
+    if (mlock(buffer.buffer, BuffersSize(buffer.slot_size)) == -1) {
+      return absl::InternalError(
+          absl::StrFormat("Failed to lock buffers for channel %s: %s", name_,
+                          strerror(errno)));
+    }
+  }
+  return absl::OkStatus();
+}
+
 void Channel::UnmapUnusedBuffers() {
-  for (size_t i = 0; i < buffers_.size(); i++) {
+  if (HasSizeClasses()) {
+    // Any of the buffers can be used for a slot at any time.
+    return;
+  }
+  for (size_t i = 0; i + 1 < buffers_.size(); i++) {
     if (buffers_[i].buffer == nullptr) {
       continue;
     }
@@ -429,14 +668,12 @@ void Channel::UnmapUnusedBuffers() {
                                                          sizeof(BufferHeader)) -
                         1;
     if (hdr->refs == 0) {
-      int64_t buffers_size = sizeof(BufferHeader) +
-                             num_slots_ * (Aligned<32>(buffers_[i].slot_size) +
-                                           sizeof(MessagePrefix));
+      int64_t buffers_size = BuffersSize(buffers_[i].slot_size);
       if (buffers_size > 0) {
         if (debug_) {
           printf("%p: Unmapping unused buffers at index %zd\n", this, i);
         }
-        UnmapMemory(buffers_[i].buffer, buffers_size, "buffers");
+        UnmapSharedMemory(buffers_[i].buffer, buffers_size, "buffers");
         buffers_[i].buffer = nullptr;
         buffers_[i].slot_size = 0;
       }
@@ -449,9 +686,7 @@ void Channel::Dump() const {
   toolbelt::Hexdump(scb_, 64);
 
   printf("CCB:\n");
-  int64_t ccb_size =
-      sizeof(ChannelControlBlock) + sizeof(MessageSlot) * num_slots_;
-  toolbelt::Hexdump(ccb_, ccb_size);
+  toolbelt::Hexdump(ccb_, CcbSize(num_slots_));
   PrintLists();
   printf("Buffers:\n");
   int index = 0;
@@ -463,7 +698,7 @@ void Channel::Dump() const {
 void Channel::ClaimPublisherSlot(MessageSlot *slot, int owner, SlotList &list) {
   ListRemove(&list, &slot->element);
   AddToBusyList(slot);
-  slot->owners.Set(owner);
+  SetSlotOwner(slot, owner);
   SetSlotToBiggestBuffer(slot);
 }
 
@@ -492,8 +727,8 @@ void Channel::IncrementBufferRefs(int buffer_index) {
   }
 }
 
-void Channel::SetSlotToBiggestBuffer(MessageSlot *slot) {
-  if (slot == nullptr) {
+void Channel::SetSlotBuffer(MessageSlot *slot, int buffer_index) {
+  if (slot->buffer_index == buffer_index) {
     return;
   }
   if (slot->buffer_index != -1) {
@@ -501,140 +736,476 @@ void Channel::SetSlotToBiggestBuffer(MessageSlot *slot) {
     // refs for the buffer.
     DecrementBufferRefs(slot->buffer_index);
   }
-  slot->buffer_index = buffers_.size() - 1; // Use biggest buffer.
+  slot->buffer_index = buffer_index;
   IncrementBufferRefs(slot->buffer_index);
 }
 
+void Channel::SetSlotToBiggestBuffer(MessageSlot *slot) {
+  if (slot == nullptr) {
+    return;
+  }
+  SetSlotBuffer(slot, buffers_.size() - 1); // Use biggest buffer.
+}
+
+void Channel::SetSlotToBufferForSize(MessageSlot *slot, int32_t size) {
+  if (slot == nullptr) {
+    return;
+  }
+  // The buffers are in increasing order of slot size.
+  int index = buffers_.size() - 1;
+  if (size >= 0) {
+    for (int i = 0; i < index; i++) {
+      if (buffers_[i].buffer != nullptr && buffers_[i].slot_size >= size) {
+        index = i;
+        break;
+      }
+    }
+  }
+  SetSlotBuffer(slot, index);
+}
+
+void SharedBitmap::Clear(int b) {
+  std::atomic<uint64_t> &word = words_[b / 64];
+  uint64_t bit = uint64_t(1) << (b % 64);
+  if ((word.fetch_and(~bit, std::memory_order_seq_cst) & ~bit) != 0) {
+    return;
+  }
+  // The word is now empty, clear its summary bit.  Another process might
+  // set a bit in the word before we get here so check again after
+  // clearing the summary.
+  std::atomic<uint64_t> &summary = summary_[b / 4096];
+  uint64_t summary_bit = uint64_t(1) << ((b / 64) % 64);
+  summary.fetch_and(~summary_bit, std::memory_order_seq_cst);
+  if (word.load(std::memory_order_seq_cst) != 0) {
+    summary.fetch_or(summary_bit, std::memory_order_seq_cst);
+  }
+}
+
+int SharedBitmap::Next(int from, int to) const {
+  while (from < to) {
+    int word = from / 64;
+    uint64_t bits = words_[word].load(std::memory_order_seq_cst) &
+                    (~uint64_t(0) << (from % 64));
+    if (bits != 0) {
+      int b = word * 64 + __builtin_ctzll(bits);
+      return b < to ? b : -1;
+    }
+    // Use the summary to find the next word with a bit set.
+    int next_word = word + 1;
+    for (;;) {
+      if (next_word >= num_words_) {
+        return -1;
+      }
+      uint64_t summary =
+          summary_[next_word / 64].load(std::memory_order_seq_cst) &
+          (~uint64_t(0) << (next_word % 64));
+      if (summary != 0) {
+        next_word = (next_word / 64) * 64 + __builtin_ctzll(summary);
+        break;
+      }
+      next_word = (next_word / 64 + 1) * 64;
+    }
+    from = next_word * 64;
+  }
+  return -1;
+}
+
+bool Channel::ClaimUnreferencedSlot(MessageSlot *slot) {
+  MessagePrefix *prefix = Prefix(slot);
+  if ((__atomic_load_n(&prefix->flags, __ATOMIC_ACQUIRE) &
+       (kMessageActivate | kMessageSeen)) == kMessageActivate) {
+    // An activation message that hasn't been seen.  It will be put
+    // back in an index when the subscriber that sees it moves on.
+    return false;
+  }
+  uint32_t refs = 0;
+  if (!slot->refs.compare_exchange_strong(refs, kSlotClaimed,
+                                          std::memory_order_acq_rel)) {
+    // Referenced or already claimed.
+    return false;
+  }
+  __atomic_store_n(&prefix->flags, 0, __ATOMIC_RELAXED);
+  return true;
+}
+
+MessageSlot *Channel::ClaimReclaimableSlot() {
+  // In both indexes the bit is cleared before looking at the slot.  If a
+  // subscriber drops its reference after we look, it will set it again.
+
+  // Orphaned slots are older than anything in the ordinal ring.
+  SharedBitmap orphans = OrphanIndex();
+  for (int id = orphans.Next(0, num_slots_); id != -1;
+       id = orphans.Next(id + 1, num_slots_)) {
+    orphans.Clear(id);
+    MessageSlot *slot = &ccb_->slots[id];
+    if (OrdinalRing()[slot->ordinal % num_slots_].load(
+            std::memory_order_acquire) == id) {
+      // Slot has been reused and is in the ring again.
+      continue;
+    }
+    if (ClaimUnreferencedSlot(slot)) {
+      return slot;
+    }
+  }
+
+  // The ring entries are searched in ordinal order starting with the
+  // oldest possible ordinal (next_ordinal - num_slots), which has the same
+  // entry as next_ordinal.
+  SharedBitmap index = ReclaimIndex();
+  int start = ccb_->next_ordinal.load(std::memory_order_relaxed) % num_slots_;
+  std::pair<int, int> ranges[2] = {{start, num_slots_}, {0, start}};
+  for (auto &range : ranges) {
+    for (int pos = index.Next(range.first, range.second); pos != -1;
+         pos = index.Next(pos + 1, range.second)) {
+      index.Clear(pos);
+      int32_t id = OrdinalRing()[pos].load(std::memory_order_acquire);
+      if (id < 0) {
+        continue;
+      }
+      MessageSlot *slot = &ccb_->slots[id];
+      if (slot->ordinal % num_slots_ != pos) {
+        // Slot has been reused for a message elsewhere in the ring.
+        continue;
+      }
+      if (ClaimUnreferencedSlot(slot)) {
+        return slot;
+      }
+    }
+  }
+  return nullptr;
+}
+
 MessageSlot *Channel::FindFreeSlotLocked(bool reliable, int owner) {
   // Check if there is a free slot and if so, take it.
   if (ccb_->free_list.first != 0) {
     MessageSlot *slot =
         reinterpret_cast<MessageSlot *>(FromCCBOffset(ccb_->free_list.first));
+    slot->refs.store(kSlotClaimed, std::memory_order_relaxed);
     ClaimPublisherSlot(slot, owner, ccb_->free_list);
     return slot;
   }
 
-  // No free slot, search for first slot with no references in the
-  // active list.
-  // If reliable is set, don't go past a slot with a reliable_ref_count
-  // or an activation message that hasn't been seen by a subscriber.
+  // No free slot.  An unreliable publisher can take any unreferenced slot
+  // and gets the oldest one from the reclaim indexes, unless the channel
+  // has messages with remote ordinals.
+  if (!reliable && !ccb_->remote_ordinals) {
+    if (MessageSlot *slot = ClaimReclaimableSlot(); slot != nullptr) {
+      ClaimPublisherSlot(slot, owner, ccb_->active_list);
+      return slot;
+    }
+  }
+
+  // Search for first slot with no references in the active list.  A
+  // reliable publisher must do this since it can't go past a slot with a
+  // reliable reference.
+  //
+  // Don't go past an activation message that hasn't been seen by a
+  // subscriber.
+  MessageSlot *found = nullptr;
+  int64_t num_scanned = 0;
   void *p = FromCCBOffset(ccb_->active_list.first);
   while (p != FromCCBOffset(0)) {
     MessageSlot *slot = reinterpret_cast<MessageSlot *>(p);
-    if (reliable && slot->reliable_ref_count != 0) {
+    num_scanned++;
+    uint32_t refs = slot->refs.load(std::memory_order_acquire);
+    if (reliable && (refs >> kReliableRefCountShift) != 0) {
       // Don't go past slot with reliable reference.
-      return nullptr;
+      break;
     }
     MessagePrefix *prefix = Prefix(slot);
-    if ((prefix->flags & (kMessageActivate | kMessageSeen)) ==
-        kMessageActivate) {
+    if ((__atomic_load_n(&prefix->flags, __ATOMIC_ACQUIRE) &
+         (kMessageActivate | kMessageSeen)) == kMessageActivate) {
       // An activation message that hasn't been seen.
-      return nullptr;
+      break;
     }
-    if (slot->ref_count == 0) {
-      prefix->flags = 0;
-      ClaimPublisherSlot(slot, owner, ccb_->active_list);
-      return slot;
+    if ((refs & kRefCountMask) == 0) {
+      // Subscribers can take references without the lock (lock-free
+      // channels and shared pointers) so the claim must be atomic.
+      if (slot->refs.compare_exchange_strong(refs, kSlotClaimed,
+                                             std::memory_order_acq_rel)) {
+        __atomic_store_n(&prefix->flags, 0, __ATOMIC_RELAXED);
+        ClaimPublisherSlot(slot, owner, ccb_->active_list);
+        found = slot;
+        break;
+      }
+      // A subscriber got there first.  The refs now hold the current
+      // value so check again for a reliable reference.
+      if (reliable && (refs >> kReliableRefCountShift) != 0) {
+        break;
+      }
     }
     p = FromCCBOffset(slot->element.next);
   }
-  return nullptr;
+  ccb_->stats.num_slot_scans.fetch_add(1, std::memory_order_relaxed);
+  ccb_->stats.num_slots_scanned.fetch_add(num_scanned,
+                                          std::memory_order_relaxed);
+  return found;
 }
 
 MessageSlot *Channel::FindFreeSlot(bool reliable, int owner) {
+  if (IsLockFree()) {
+    return FindFreeSlotLocked(reliable, owner);
+  }
   toolbelt::MutexLock lock(&ccb_->lock);
   return FindFreeSlotLocked(reliable, owner);
 }
 
+void Channel::SetTriggerTableEntry(int user_id, int fd, uint32_t flags,
+                                   uint64_t serial) {
+  if (user_id < 0 || user_id >= TriggerTableSize()) {
+    return;
+  }
+  // Only the server writes the table so this is a simple sequence lock.
+  ccb_->trigger_seq.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  TriggerTableEntry &entry = TriggerTable()[user_id];
+  entry.fd = fd;
+  entry.flags = flags;
+  entry.serial = serial;
+  ccb_->trigger_seq.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t
+Channel::ReadTriggerTable(uint32_t flags,
+                          std::vector<TriggerTableEntry> &entries) const {
+  const TriggerTableEntry *table = TriggerTable();
+  int size = TriggerTableSize();
+  for (;;) {
+    uint64_t seq = ccb_->trigger_seq.load(std::memory_order_acquire);
+    if ((seq & 1) != 0) {
+      // The server is in the middle of an update.
+      continue;
+    }
+    entries.clear();
+    for (int i = 0; i < size; i++) {
+      if ((table[i].flags & flags) != 0) {
+        entries.push_back(table[i]);
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (ccb_->trigger_seq.load(std::memory_order_relaxed) == seq) {
+      return seq;
+    }
+  }
+}
+
 void Channel::GetStatsCounters(int64_t &total_bytes, int64_t &total_messages) {
-  toolbelt::MutexLock lock(&ccb_->lock);
-  total_bytes = ccb_->total_bytes;
-  total_messages = ccb_->total_messages;
+  total_bytes = ccb_->total_bytes.load(std::memory_order_relaxed);
+  total_messages = ccb_->total_messages.load(std::memory_order_relaxed);
+}
+
+void Channel::GetStatsCounters(ChannelStatsSnapshot &stats) {
+  GetStatsCounters(stats.total_bytes, stats.total_messages);
+  stats.num_reliable_wakeups =
+      ccb_->num_reliable_wakeups.load(std::memory_order_relaxed);
+  for (int i = 0; i < kNumLatencyBuckets; i++) {
+    stats.latency_buckets[i] =
+        ccb_->stats.latency_buckets[i].load(std::memory_order_relaxed);
+  }
+  stats.num_drops = ccb_->stats.num_drops.load(std::memory_order_relaxed);
+  stats.num_reliable_stalls =
+      ccb_->stats.num_reliable_stalls.load(std::memory_order_relaxed);
+  stats.num_slot_scans =
+      ccb_->stats.num_slot_scans.load(std::memory_order_relaxed);
+  stats.num_slots_scanned =
+      ccb_->stats.num_slots_scanned.load(std::memory_order_relaxed);
+  stats.num_triggers = ccb_->stats.num_triggers.load(std::memory_order_relaxed);
 }
 
 Channel::PublishedMessage
 Channel::ActivateSlotAndGetAnother(MessageSlot *slot, bool reliable,
                                    bool is_activation, int owner,
                                    bool omit_prefix, bool *notify) {
+  if (IsLockFree()) {
+    return ActivateSlotLocked(slot, reliable, is_activation, owner,
+                              omit_prefix, notify);
+  }
+  toolbelt::MutexLock lock(&ccb_->lock);
+  return ActivateSlotLocked(slot, reliable, is_activation, owner, omit_prefix,
+                            notify);
+}
+
+Channel::PublishedMessage
+Channel::ActivateSlotLocked(MessageSlot *slot, bool reliable,
+                            bool is_activation, int owner, bool omit_prefix,
+                            bool *notify) {
+  PublishedMessage msg = PublishSlotLocked(slot, is_activation, owner,
+                                           omit_prefix, toolbelt::Now(), notify);
+
+  // A reliable publisher doesn't allocate a slot until it is asked for.
+  if (!reliable) {
+    // Find a new slot.
+    msg.new_slot = FindFreeSlotLocked(reliable, owner);
+  }
+  return msg;
+}
+
+std::vector<MessageSlot *> Channel::FindFreeSlots(int num_slots, bool reliable,
+                                                  int owner) {
+  std::vector<MessageSlot *> slots;
+  slots.reserve(num_slots);
+  auto find = [&]() {
+    while (slots.size() < static_cast<size_t>(num_slots)) {
+      MessageSlot *slot = FindFreeSlotLocked(reliable, owner);
+      if (slot == nullptr) {
+        break;
+      }
+      slots.push_back(slot);
+    }
+  };
+  if (IsLockFree()) {
+    find();
+  } else {
+    toolbelt::MutexLock lock(&ccb_->lock);
+    find();
+  }
+  return slots;
+}
+
+Channel::PublishedMessage
+Channel::ActivateSlotsAndGetAnother(const std::vector<MessageSlot *> &slots,
+                                    bool reliable, int owner, bool omit_prefix,
+                                    bool *notify) {
+  auto activate = [&]() -> PublishedMessage {
+    // All messages in the batch get the same timestamp.
+    uint64_t timestamp = toolbelt::Now();
+    PublishedMessage first = {nullptr, -1, timestamp};
+    for (MessageSlot *slot : slots) {
+      PublishedMessage msg = PublishSlotLocked(
+          slot, /*is_activation=*/false, owner, omit_prefix, timestamp, notify);
+      if (first.ordinal == -1) {
+        first.ordinal = msg.ordinal;
+      }
+    }
+    if (!reliable) {
+      first.new_slot = FindFreeSlotLocked(reliable, owner);
+    }
+    return first;
+  };
+  if (IsLockFree()) {
+    return activate();
+  }
   toolbelt::MutexLock lock(&ccb_->lock);
+  return activate();
+}
 
+Channel::PublishedMessage
+Channel::PublishSlotLocked(MessageSlot *slot, bool is_activation, int owner,
+                           bool omit_prefix, uint64_t timestamp, bool *notify) {
   // Move slot from busy list to active list.
   ListRemove(&ccb_->busy_list, &slot->element);
-  slot->owners.Clear(owner);
+  ClearSlotOwner(slot, owner);
   AddToActiveList(slot);
 
-  // If the previously last element in the active list has been seen by a
-  // subscriber we need to notify the subscribers that we've added a new
-  // message.  If hasn't been seen, we've already notified the subscribers when
-  // we added the slot to the active list.
-  MessageSlot *prev =
-      reinterpret_cast<MessageSlot *>(FromCCBOffset(slot->element.prev));
-  if (notify != nullptr) {
-    if (prev == FromCCBOffset(0) || (Prefix(prev)->flags & kMessageSeen) != 0) {
-      *notify = true;
-    }
-  }
   void *buffer = GetBufferAddress(slot);
   MessagePrefix *prefix = reinterpret_cast<MessagePrefix *>(buffer) - 1;
 
   // Copy message parameters into message prefix in buffer.
   if (omit_prefix) {
     slot->ordinal = prefix->ordinal; // Copy ordinal from prefix.
+    ccb_->remote_ordinals = true;
   } else {
-    slot->ordinal = ccb_->next_ordinal++;
+    slot->ordinal = ccb_->next_ordinal.load(std::memory_order_relaxed);
     prefix->message_size = slot->message_size;
     prefix->ordinal = slot->ordinal;
-    prefix->timestamp = toolbelt::Now();
-    prefix->flags = 0;
-    if (is_activation) {
-      prefix->flags |= kMessageActivate;
-    }
+    prefix->timestamp = timestamp;
+    prefix->flags = is_activation ? kMessageActivate : 0;
+  }
+  int64_t ordinal = slot->ordinal;
+  timestamp = prefix->timestamp;
+
+  // Update counters.  For a lock-free channel these are only written by
+  // the publisher.  The server reads them for statistics and doesn't need
+  // them to be exact.
+  ccb_->total_bytes.store(ccb_->total_bytes.load(std::memory_order_relaxed) +
+                             slot->message_size,
+                         std::memory_order_relaxed);
+  if (slot->message_size >
+      ccb_->max_message_size.load(std::memory_order_relaxed)) {
+    ccb_->max_message_size.store(slot->message_size,
+                                 std::memory_order_relaxed);
   }
 
-  // Update counters.
-  ccb_->total_messages++;
-  ccb_->total_bytes += slot->message_size;
+  AddToTimestampIndex(slot, timestamp);
+
+  // Make the message visible to subscribers.  The ring entry is written
+  // before the claim is released and next_ordinal is advanced last, so a
+  // lock-free subscriber that sees the new next_ordinal will find the slot.
+  int pos = ordinal % num_slots_;
+  int32_t prev_id =
+      OrdinalRing()[pos].exchange(slot->id, std::memory_order_acq_rel);
+  slot->refs.store(0, std::memory_order_release);
+  if (!omit_prefix) {
+    ccb_->next_ordinal.store(ordinal + 1, std::memory_order_seq_cst);
+  }
+  // This wakes up spinning subscribers.
+  ccb_->total_messages.fetch_add(1, std::memory_order_seq_cst);
+  ReclaimIndex().Set(pos);
+
+  // If the ring entry was for an active message that is still referenced,
+  // that slot is now an orphan.
+  if (prev_id >= 0 && prev_id != slot->id) {
+    MessageSlot *prev_slot = &ccb_->slots[prev_id];
+    if (prev_slot->ordinal % num_slots_ == pos &&
+        (prev_slot->refs.load(std::memory_order_acquire) & kSlotClaimed) ==
+            0) {
+      OrphanIndex().Set(prev_id);
+    }
+  }
 
-  // A reliable publisher doesn't allocate a slot until it is asked for.
-  if (reliable) {
-    return {nullptr, prefix->ordinal, prefix->timestamp};
+  // If the previously last element in the active list has been seen by a
+  // subscriber we need to notify the subscribers that we've added a new
+  // message.  If hasn't been seen, we've already notified the subscribers when
+  // we added the slot to the active list.  A lock-free subscriber marks a
+  // message as seen before it looks for the next one so one of us will see
+  // the other's update.
+  MessageSlot *prev =
+      reinterpret_cast<MessageSlot *>(FromCCBOffset(slot->element.prev));
+  if (notify != nullptr) {
+    if (prev == FromCCBOffset(0) || MessageSeen(Prefix(prev))) {
+      *notify = true;
+    }
   }
-  // Find a new slot.
-  return {FindFreeSlotLocked(reliable, owner), prefix->ordinal,
-          prefix->timestamp};
+  return {nullptr, ordinal, timestamp};
 }
 
-inline void IncDecRefCount(MessageSlot *slot, bool reliable, int inc) {
-  slot->ref_count += inc;
-  if (reliable) {
-    slot->reliable_ref_count += inc;
+int Channel::NumSpinners(bool publishers) const {
+  std::atomic<uint64_t> *words = Spinners(publishers);
+  int n = 0;
+  for (int i = 0; i < OwnerWords(num_slots_); i++) {
+    n += __builtin_popcountll(words[i].load(std::memory_order_seq_cst));
   }
+  return n;
 }
 
-void Channel::CleanupSlots(int owner, bool reliable) {
+void Channel::CleanupSlots(int owner, bool reliable, bool is_publisher) {
   toolbelt::MutexLock lock(&ccb_->lock);
-  // Clean up active list.  Remove references for any slot owned by the
-  // owner.
-  void *p = FromCCBOffset(ccb_->active_list.first);
-  while (p != FromCCBOffset(0)) {
-    MessageSlot *slot = reinterpret_cast<MessageSlot *>(p);
-    if (slot->owners.IsSet(owner)) {
-      slot->owners.Clear(owner);
-      IncDecRefCount(slot, reliable, -1);
+  // The user might have gone away while spinning.
+  SetSpinning(is_publisher, owner, false);
+  if (!is_publisher) {
+    // Remove references for any slot owned by the subscriber.  These are
+    // only ever in the active list, but we look at all slots rather than
+    // walking the list because the publisher of a lock-free channel can
+    // be modifying the list without holding the lock.
+    for (int i = 0; i < num_slots_; i++) {
+      MessageSlot *slot = &ccb_->slots[i];
+      if (IsSlotOwner(slot, owner)) {
+        ClearSlotOwner(slot, owner);
+        IncDecRefCount(slot, reliable, -1);
+      }
     }
-
-    p = FromCCBOffset(slot->element.next);
+    return;
   }
 
   // Remove any publishers from the busy list.
-  p = FromCCBOffset(ccb_->busy_list.first);
+  void *p = FromCCBOffset(ccb_->busy_list.first);
   while (p != FromCCBOffset(0)) {
     MessageSlot *slot = reinterpret_cast<MessageSlot *>(p);
     p = FromCCBOffset(slot->element.next);
 
-    if (slot->owners.IsSet(owner)) {
+    if (IsSlotOwner(slot, owner)) {
       slot->buffer_index = -1;
-      slot->owners.Clear(owner);
+      ClearSlotOwner(slot, owner);
       // Move the slot to the free list.
       ListRemove(&ccb_->busy_list, &slot->element);
       ListInsertAtEnd(&ccb_->free_list, &slot->element);
@@ -642,58 +1213,303 @@ void Channel::CleanupSlots(int owner, bool reliable) {
   }
 }
 
-MessageSlot *Channel::NextSlot(MessageSlot *slot, bool reliable, int owner) {
-  toolbelt::MutexLock lock(&ccb_->lock);
-  if (slot == nullptr) {
-    // No current slot, first in list.
-    if (ccb_->active_list.first == 0) {
+void Channel::MoveOwnership(MessageSlot *old_slot, MessageSlot *new_slot,
+                            bool reliable, int owner) {
+  if (old_slot != nullptr) {
+    IncDecRefCount(old_slot, reliable, -1);
+    ClearSlotOwner(old_slot, owner);
+  }
+  SetMessageSeen(Prefix(new_slot));
+  SetSlotOwner(new_slot, owner);
+}
+
+MessageSlot *Channel::AcquireSlot(int64_t ordinal, bool reliable) {
+  int32_t id =
+      OrdinalRing()[ordinal % num_slots_].load(std::memory_order_acquire);
+  if (id < 0) {
+    return nullptr;
+  }
+  return AcquireSlot(id, ordinal, reliable);
+}
+
+MessageSlot *Channel::AcquireSlot(int32_t slot_id, int64_t ordinal,
+                                  bool reliable) {
+  MessageSlot *slot = &ccb_->slots[slot_id];
+  uint32_t delta = RefCountDelta(reliable);
+  uint32_t refs = slot->refs.load(std::memory_order_relaxed);
+  do {
+    if ((refs & kSlotClaimed) != 0) {
+      // Publisher is reusing the slot.
       return nullptr;
     }
-    // Take first slot in active list.
-    slot =
-        reinterpret_cast<MessageSlot *>(FromCCBOffset(ccb_->active_list.first));
-    slot->owners.Set(owner);
-    IncDecRefCount(slot, reliable, +1);
-    Prefix(slot)->flags |= kMessageSeen;
-    return slot;
+  } while (!slot->refs.compare_exchange_weak(refs, refs + delta,
+                                             std::memory_order_acquire,
+                                             std::memory_order_relaxed));
+  // The publisher can't reuse the slot now, but it might have done so
+  // before we got the reference.
+  if (slot->ordinal != ordinal) {
+    IncDecRefCount(slot, reliable, -1);
+    return nullptr;
+  }
+  return slot;
+}
+
+MessageSlot *Channel::NextSlot(MessageSlot *slot, bool reliable, int owner) {
+  if (IsLockFree()) {
+    return NextSlotLockFree(slot, reliable, owner);
   }
-  if (slot->element.next == 0) {
+  toolbelt::MutexLock lock(&ccb_->lock);
+  MessageSlot *next_slot = AcquireNextSlotLocked(slot, reliable);
+  if (next_slot == nullptr) {
     // No more active slots, keep current slot active.
     return nullptr;
   }
-  // Going to move to another slot.  Decrement refs on current slot.
+  MoveOwnership(slot, next_slot, reliable, owner);
+  return next_slot;
+}
+
+void Channel::NextSlots(MessageSlot *slot, int max_slots, bool reliable,
+                        int owner, std::vector<MessageSlot *> &slots) {
+  auto next = [&]() {
+    MessageSlot *last = slot;
+    while (static_cast<int>(slots.size()) < max_slots) {
+      MessageSlot *next_slot = IsLockFree()
+                                   ? AcquireNextSlotLockFree(last, reliable)
+                                   : AcquireNextSlotLocked(last, reliable);
+      if (next_slot == nullptr) {
+        break;
+      }
+      // The reference to the slot we started from is released once we
+      // have a reference to the one after it.  The others are kept.
+      MoveOwnership(last == slot ? slot : nullptr, next_slot, reliable, owner);
+      slots.push_back(next_slot);
+      last = next_slot;
+    }
+  };
+  if (IsLockFree()) {
+    next();
+    return;
+  }
+  toolbelt::MutexLock lock(&ccb_->lock);
+  next();
+}
+
+void Channel::SlotsAt(MessageSlot *slot, int64_t first, int64_t last,
+                      bool reliable, int owner,
+                      std::vector<MessageSlot *> &slots) {
+  auto acquire = [&]() {
+    // Only the last num_slots ordinals can be in the ring.
+    last = std::min(last, NewestOrdinal());
+    first = std::max({first, last - num_slots_ + 1, int64_t(1)});
+    for (int64_t ordinal = first; ordinal <= last; ordinal++) {
+      MessageSlot *new_slot = AcquireSlot(ordinal, reliable);
+      if (new_slot == nullptr) {
+        continue;
+      }
+      MoveOwnership(slots.empty() ? slot : nullptr, new_slot, reliable, owner);
+      slots.push_back(new_slot);
+    }
+  };
+  if (num_slots_ == 0) {
+    return;
+  }
+  if (IsLockFree()) {
+    acquire();
+    return;
+  }
+  toolbelt::MutexLock lock(&ccb_->lock);
+  acquire();
+}
+
+int64_t Channel::NewestOrdinal() const {
+  // The timestamp index has the messages in the order they were published.
+  // Unlike next_ordinal this includes messages published with their own
+  // ordinals by a bridge.
+  int64_t ordinal;
+  uint64_t timestamp;
+  int32_t slot_id;
+  for (;;) {
+    int64_t end = ccb_->timestamp_index_next.load(std::memory_order_acquire);
+    if (end == 0) {
+      return 0;
+    }
+    if (ReadTimestampIndex(end - 1, ordinal, timestamp, slot_id)) {
+      return ordinal;
+    }
+  }
+}
+
+void Channel::ReleaseSlot(MessageSlot *slot, bool reliable, int owner) {
+  ClearSlotOwner(slot, owner);
   IncDecRefCount(slot, reliable, -1);
-  slot->owners.Clear(owner);
+}
 
-  slot = reinterpret_cast<MessageSlot *>(FromCCBOffset(slot->element.next));
-  IncDecRefCount(slot, reliable, +1);
-  Prefix(slot)->flags |= kMessageSeen;
-  slot->owners.Set(owner);
-  return slot;
+MessageSlot *Channel::AcquireNextSlotLocked(MessageSlot *slot, bool reliable) {
+  // With no current slot, take the first in the active list.
+  int32_t next = slot == nullptr ? ccb_->active_list.first : slot->element.next;
+  if (next == 0) {
+    return nullptr;
+  }
+  MessageSlot *next_slot =
+      reinterpret_cast<MessageSlot *>(FromCCBOffset(next));
+  IncDecRefCount(next_slot, reliable, +1);
+  return next_slot;
+}
+
+MessageSlot *Channel::NextSlotLockFree(MessageSlot *slot, bool reliable,
+                                       int owner) {
+  MessageSlot *new_slot = AcquireNextSlotLockFree(slot, reliable);
+  if (new_slot != nullptr) {
+    // Take the new reference before dropping the old one so that a
+    // reliable publisher can't get past us.
+    MoveOwnership(slot, new_slot, reliable, owner);
+  }
+  return new_slot;
+}
+
+MessageSlot *Channel::AcquireNextSlotLockFree(MessageSlot *slot,
+                                              bool reliable) {
+  int64_t next_ordinal = ccb_->next_ordinal.load(std::memory_order_seq_cst);
+
+  // Messages older than num_slots ordinals have been overwritten.  Those
+  // newer than that might have been too if the publisher has reused their
+  // slots, in which case we skip them.  A reliable publisher can't
+  // reuse a slot after one referenced by a reliable subscriber.
+  int64_t ordinal = slot == nullptr ? 1 : slot->ordinal + 1;
+  ordinal = std::max(ordinal, next_ordinal - num_slots_);
+  for (; ordinal < next_ordinal; ordinal++) {
+    MessageSlot *new_slot = AcquireSlot(ordinal, reliable);
+    if (new_slot != nullptr) {
+      return new_slot;
+    }
+  }
+  return nullptr;
 }
 
 MessageSlot *Channel::LastSlot(MessageSlot *slot, bool reliable, int owner) {
+  if (IsLockFree()) {
+    return LastSlotLockFree(slot, reliable, owner);
+  }
   toolbelt::MutexLock lock(&ccb_->lock);
   if (ccb_->active_list.last == 0) {
     return nullptr;
   }
-  if (slot != nullptr) {
-    IncDecRefCount(slot, reliable, -1);
-    slot->owners.Clear(owner);
+  MessageSlot *last_slot =
+      reinterpret_cast<MessageSlot *>(FromCCBOffset(ccb_->active_list.last));
+  IncDecRefCount(last_slot, reliable, +1);
+  MoveOwnership(slot, last_slot, reliable, owner);
+  return last_slot;
+}
+
+MessageSlot *Channel::LastSlotLockFree(MessageSlot *slot, bool reliable,
+                                       int owner) {
+  int64_t next_ordinal = ccb_->next_ordinal.load(std::memory_order_seq_cst);
+  int64_t oldest = std::max<int64_t>(1, next_ordinal - num_slots_);
+
+  // The newest message might have had its slot reused if all the
+  // others are referenced, so work backwards until we find one.
+  for (int64_t ordinal = next_ordinal - 1; ordinal >= oldest; ordinal--) {
+    MessageSlot *new_slot = AcquireSlot(ordinal, reliable);
+    if (new_slot != nullptr) {
+      MoveOwnership(slot, new_slot, reliable, owner);
+      return new_slot;
+    }
   }
-  slot = reinterpret_cast<MessageSlot *>(FromCCBOffset(ccb_->active_list.last));
-  IncDecRefCount(slot, reliable, +1);
-  Prefix(slot)->flags |= kMessageSeen;
-  slot->owners.Set(owner);
-  return slot;
+  return nullptr;
+}
+
+void Channel::AddToTimestampIndex(MessageSlot *slot, uint64_t timestamp) {
+  int64_t seq = ccb_->timestamp_index_next.load(std::memory_order_relaxed);
+  TimestampIndexEntry &entry = TimestampIndex()[seq % num_slots_];
+  entry.seq.store(-1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  entry.ordinal.store(slot->ordinal, std::memory_order_relaxed);
+  entry.timestamp.store(timestamp, std::memory_order_relaxed);
+  entry.slot_id.store(slot->id, std::memory_order_relaxed);
+  entry.seq.store(seq, std::memory_order_release);
+  ccb_->timestamp_index_next.store(seq + 1, std::memory_order_release);
+}
+
+bool Channel::ReadTimestampIndex(int64_t seq, int64_t &ordinal,
+                                 uint64_t &timestamp, int32_t &slot_id) const {
+  const TimestampIndexEntry &entry = TimestampIndex()[seq % num_slots_];
+  if (entry.seq.load(std::memory_order_acquire) != seq) {
+    return false;
+  }
+  ordinal = entry.ordinal.load(std::memory_order_relaxed);
+  timestamp = entry.timestamp.load(std::memory_order_relaxed);
+  slot_id = entry.slot_id.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return entry.seq.load(std::memory_order_relaxed) == seq;
 }
 
 MessageSlot *
 Channel::FindActiveSlotByTimestamp(MessageSlot *old_slot, uint64_t timestamp,
                                    bool reliable, int owner,
                                    std::vector<MessageSlot *> &buffer) {
+  if (num_slots_ == 0) {
+    return nullptr;
+  }
+  int64_t end = ccb_->timestamp_index_next.load(std::memory_order_acquire);
+  int64_t ordinal;
+  uint64_t ts;
+  int32_t slot_id;
+
+  // Binary search the index for the first message at or after the
+  // timestamp.  Entries that have been reused are for the oldest messages
+  // so they are treated as being before the timestamp.
+  int64_t first = std::max<int64_t>(0, end - num_slots_);
+  int64_t lo = first;
+  int64_t hi = end;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (!ReadTimestampIndex(mid, ordinal, ts, slot_id) || ts < timestamp) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == end) {
+    // Not found, nothing changes.
+    return nullptr;
+  }
+  bool before_index = lo == first &&
+                      ReadTimestampIndex(first, ordinal, ts, slot_id) &&
+                      timestamp < ts;
+
+  auto find = [&]() -> MessageSlot * {
+    // The message found might have gone since it was indexed.  Publishers
+    // reuse the oldest slots first so look for the next one still there.
+    for (int64_t seq = lo; seq < end; seq++) {
+      if (!ReadTimestampIndex(seq, ordinal, ts, slot_id)) {
+        continue;
+      }
+      MessageSlot *new_slot = AcquireSlot(slot_id, ordinal, reliable);
+      if (new_slot != nullptr) {
+        MoveOwnership(old_slot, new_slot, reliable, owner);
+        return new_slot;
+      }
+    }
+    return nullptr;
+  };
+  if (IsLockFree()) {
+    if (before_index) {
+      return nullptr;
+    }
+    return find();
+  }
   toolbelt::MutexLock lock(&ccb_->lock);
+  if (before_index) {
+    // There might be older messages in the active list.
+    return FindActiveSlotInListLocked(old_slot, timestamp, reliable, owner,
+                                      buffer);
+  }
+  return find();
+}
 
+MessageSlot *Channel::FindActiveSlotInListLocked(
+    MessageSlot *old_slot, uint64_t timestamp, bool reliable, int owner,
+    std::vector<MessageSlot *> &buffer) {
   // Copy pointers to active list slots into search buffer.  They are already
   // in timestamp order.
   buffer.clear();
@@ -718,14 +1534,9 @@ Channel::FindActiveSlotByTimestamp(MessageSlot *old_slot, uint64_t timestamp,
     // Not found, nothing changes.
     return nullptr;
   }
-  if (old_slot != nullptr) {
-    IncDecRefCount(old_slot, reliable, -1);
-    old_slot->owners.Clear(owner);
-  }
   MessageSlot *new_slot = *it;
   IncDecRefCount(new_slot, reliable, +1);
-  Prefix(new_slot)->flags |= kMessageSeen;
-  new_slot->owners.Set(owner);
+  MoveOwnership(old_slot, new_slot, reliable, owner);
   return new_slot;
 }
 
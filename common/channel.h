@@ -10,11 +10,13 @@
 
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
-#include "toolbelt/bitset.h"
 #include "toolbelt/fd.h"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <pthread.h>
 #include <string>
+#include <vector>
 
 namespace subspace {
 
@@ -25,20 +27,16 @@ static constexpr size_t kMaxMessage = 4096;
 // memory.  It is transferred intact across the TCP bridges.
 // 32 bytes long.
 //
-// Since this is used primarily for channel bridging, we
-// include 4 bytes of padding at offset 0 so that that the
-// Socket::SendMessage function has somewhere to put the
-// length of the message and avoid 2 sends to the socket.
-//
-// Note that this precludes us mapping the subscriber's
-// channel in read-only memory since the bridge will need
-// to write to the padding address when it calls
-// Socket::SendMessage.
+// There are 4 bytes of padding at offset 0.  This used to hold
+// the length of the message for Socket::SendMessage when sending
+// over a bridge.  The bridge transmitter now sends the lengths
+// from its own memory, but the padding is still not sent so that
+// the wire format is unchanged.
 //
 // On the receiving end of the bridge, the padding is
 // not received and will not be written to.
 struct MessagePrefix {
-  int32_t padding; // Padding for Socket::SendMessage.
+  int32_t padding; // Not sent over bridges.
   int32_t message_size;
   int64_t ordinal;
   uint64_t timestamp;
@@ -49,14 +47,26 @@ struct MessagePrefix {
 constexpr int kMessageActivate = 1; // This is a reliable activation message.
 constexpr int kMessageBridged = 2;  // This message came from the bridge.
 constexpr int kMessageSeen = 4;     // Message has been seen.
+constexpr int kMessageCompressed = 8; // Compressed, only on a bridge.
+
+// Subscribers can mark a message as seen while other subscribers are
+// doing the same, so the flag is set atomically.
+inline void SetMessageSeen(MessagePrefix *prefix) {
+  __atomic_fetch_or(&prefix->flags, kMessageSeen, __ATOMIC_SEQ_CST);
+}
+
+inline bool MessageSeen(const MessagePrefix *prefix) {
+  return (__atomic_load_n(&prefix->flags, __ATOMIC_SEQ_CST) & kMessageSeen) !=
+         0;
+}
 
 // We need a max channels number because the size of things in
 // shared memory needs to be fixed.
 constexpr int kMaxChannels = 1024;
 
-// Maximum number of owners for a lot.  One per subscriber reference
-// and publisher reference.  Best if it's a multiple of 64 because
-// it's used as the size in a toolbelt::BitSet.
+// Maximum number of owners for a slot.  One per subscriber reference
+// and publisher reference.  Must be a multiple of 64 because
+// the owners are held in 64 bit words (see ChannelControlBlock).
 constexpr int kMaxSlotOwners = 1024;
 
 // Max length of a channel name in shared memory.  A name longer
@@ -64,6 +74,10 @@ constexpr int kMaxSlotOwners = 1024;
 // in process memory.
 constexpr size_t kMaxChannelName = 64;
 
+// Size of the huge pages used for the buffers of a channel that asks for
+// them.  The buffers are a multiple of this size.
+constexpr int64_t kHugePageSize = 2 * 1024 * 1024;
+
 // This is a global (to a server) structure in shared memory that holds
 // counts for the number of updates to publishers and subscribers on
 // that server.  The server updates these counts when a publisher or
@@ -83,6 +97,37 @@ struct ChannelCounters {
   uint16_t num_reliable_subs; // Current number of reliable subscribers.
 };
 
+// Flags for the entries in the trigger table of a channel.
+constexpr uint32_t kTriggerSubscriber = 1;
+constexpr uint32_t kTriggerReliablePublisher = 2;
+
+// The trigger table in the CCB has one entry per user id.  It describes the
+// trigger fd of each subscriber and reliable publisher so that clients can
+// update their lists of trigger fds without asking the server.  The fd is
+// the server's fd number (a client makes its own copy with pidfd_getfd) and
+// the serial number is unique to each user of the channel, so a client can
+// keep the fds it already has when the table changes.  The table is only
+// written by the server.
+struct TriggerTableEntry {
+  int32_t fd;     // -1 if there is no user with a trigger fd.
+  uint32_t flags; // kTriggerSubscriber or kTriggerReliablePublisher.
+  uint64_t serial;
+};
+
+// The timestamp index in the CCB holds the last num_slots messages
+// published, in the order they were published, which is timestamp order.
+// Entry seq % num_slots describes the seq'th message published.  An entry
+// is written by the publisher holding the lock (or the single publisher of
+// a lock-free channel) and can be read without the lock: the seq is set
+// to -1 while the entry is written, so a reader that sees the same seq
+// before and after reading the rest has a consistent copy.
+struct TimestampIndexEntry {
+  std::atomic<int64_t> seq;
+  std::atomic<int64_t> ordinal;
+  std::atomic<uint64_t> timestamp;
+  std::atomic<int32_t> slot_id;
+};
+
 struct SystemControlBlock {
   ChannelCounters counters[kMaxChannels];
 };
@@ -104,18 +149,49 @@ struct SlotList {
   int32_t last;
 };
 
+// The reference counts for a slot are packed into a single 32 bit word
+// so that they can be changed together atomically:
+//
+// bits 0-14: number of subscribers referring to this slot.
+// bit 15: the slot has been claimed by a publisher.
+// bits 16-31: number of reliable subscriber references.
+//
+// A claimed slot cannot be referenced by a subscriber.  A publisher claims
+// a slot by atomically changing its refs from 0 to kSlotClaimed and
+// releases the claim when it puts the slot into the active list.
+constexpr uint32_t kRefCountMask = 0x7fff;
+constexpr uint32_t kSlotClaimed = 0x8000;
+constexpr int kReliableRefCountShift = 16;
+
 // This is the meta data for a slot.  It is always in a linked list.
-struct MessageSlot {
+// It only contains the fields used when searching the lists and is
+// 32 bytes long so that two slots fit in a cache line.  The slot owners
+// are held in a separate table in the CCB.
+struct alignas(32) MessageSlot {
   SlotListElement element;
   int32_t id;                 // Unique ID for slot (0...num_slots-1).
-  int16_t ref_count;          // Number of subscribers referring to this slot.
-  int16_t reliable_ref_count; // Number of reliable subscriber references.
+  std::atomic<uint32_t> refs; // Reference counts (see above).
   int64_t ordinal;            // Message ordinal held currently in slot.
-  int64_t message_size;       // Size of message held in slot.
+  int32_t message_size;       // Size of message held in slot.
   int32_t buffer_index;       // Index of buffer.
-  toolbelt::BitSet<kMaxSlotOwners> owners; // One bit per publisher/subscriber.
+
+  // Number of subscribers referring to this slot.
+  int RefCount() const {
+    return refs.load(std::memory_order_relaxed) & kRefCountMask;
+  }
+
+  // Number of reliable subscriber references.
+  int ReliableRefCount() const {
+    return refs.load(std::memory_order_relaxed) >> kReliableRefCountShift;
+  }
 };
 
+static_assert(sizeof(MessageSlot) == 32, "MessageSlot must be 32 bytes");
+
+constexpr uint32_t RefCountDelta(bool reliable) {
+  return reliable ? (1 | (1 << kReliableRefCountShift)) : 1;
+}
+
 // This is located just before the prefix of the first slot's buffer.  It
 // is 64 bits long to align the prefix to 64 bits.
 struct BufferHeader {
@@ -123,6 +199,44 @@ struct BufferHeader {
   int32_t padding; // Align to 64 bits.
 };
 
+// The message payloads in a buffer follow the BufferHeader and a
+// MessagePrefix at multiples of 32 bytes, so this is their alignment.
+constexpr size_t kMessageAlignment = sizeof(BufferHeader);
+
+// Number of buckets in the latency histogram in ChannelStatsCounters.
+constexpr int kNumLatencyBuckets = 32;
+
+// Per-channel statistics in the CCB.  These are updated by the publishers
+// and subscribers on the publish and read paths without taking the CCB lock
+// and read by the server for the /subspace/Statistics channel.  They are
+// on their own cache lines so that they don't slow down the other members
+// of the CCB.
+struct alignas(64) ChannelStatsCounters {
+  // Histogram of publish-to-read latency in nanoseconds, from the message
+  // timestamp to the time a subscriber read it.  Bucket 0 counts latencies
+  // of 0 and bucket i counts latencies in [2^(i-1), 2^i).  The last bucket
+  // also counts all longer latencies.
+  std::atomic<int64_t> latency_buckets[kNumLatencyBuckets];
+  std::atomic<int64_t> num_drops;           // Messages missed by subscribers.
+  std::atomic<int64_t> num_reliable_stalls; // Reliable publisher had no slot.
+  std::atomic<int64_t> num_slot_scans;      // Searches of the active list...
+  std::atomic<int64_t> num_slots_scanned;   // ...and the slots they looked at.
+  std::atomic<int64_t> num_triggers;        // Publishes that triggered subs.
+};
+
+// A copy of the statistics for a channel.
+struct ChannelStatsSnapshot {
+  int64_t total_bytes;
+  int64_t total_messages;
+  int64_t num_reliable_wakeups;
+  int64_t latency_buckets[kNumLatencyBuckets];
+  int64_t num_drops;
+  int64_t num_reliable_stalls;
+  int64_t num_slot_scans;
+  int64_t num_slots_scanned;
+  int64_t num_triggers;
+};
+
 // The control data for a channel.  This memory is
 // allocated by the server and mapped into the process
 // for all publishers and subscribers.  Each mapped CCB is mapped
@@ -133,13 +247,56 @@ struct ChannelControlBlock {          // a.k.a CCB
   char channel_name[kMaxChannelName]; // So that you can see the name in a
                                       // debugger or hexdump.
   int num_slots;
-  int64_t next_ordinal; // Next ordinal to use.
-  int buffer_index;     // Which buffer in buffers array to use.
-  int num_buffers;      // Size of buffers array in shared memory.
-
-  // Statistics counters.
-  int64_t total_bytes;
-  int64_t total_messages;
+  std::atomic<int64_t> next_ordinal; // Next ordinal to use.
+  int buffer_index; // Which buffer in buffers array to use.
+  int num_buffers;  // Size of buffers array in shared memory.
+
+  // A lock-free channel has a single publisher and neither it nor the
+  // subscribers take the lock to publish or read messages.  This is
+  // set when the channel is allocated and never changes.
+  bool lock_free;
+
+  // If huge_pages is set the buffers are backed by huge pages (Linux
+  // only).  If prefault is set the buffers are faulted in when they
+  // are mapped and the server locks them into memory.  These are set
+  // by the first publisher when the channel is allocated.
+  bool huge_pages;
+  bool prefault;
+
+  // The NUMA node the CCB and buffers are allocated on, or -1 for no
+  // particular node.  This is only a hint to the OS.
+  int numa_node;
+
+  // If size_classes is set each buffer is a size class.  A publisher's
+  // slot uses the smallest buffer big enough for the message being
+  // published and the smaller buffers are kept after a resize.
+  // Otherwise all slots move to the biggest buffer and the others are
+  // unmapped when they are no longer used.
+  bool size_classes;
+
+  // Set when a message is published with the ordinal it had on another
+  // server (by a bridge).  Those ordinals can be sparse, so the ordinal
+  // ring no longer says which message is the oldest and unreliable
+  // publishers look for a slot to reuse in the active list instead.
+  // Like the slot lists, only used by a publisher holding the lock.
+  bool remote_ordinals;
+
+  // Statistics counters.  The number of messages is also watched by
+  // subscribers that spin waiting for a message.  These are only written
+  // by a publisher holding the lock (or the single publisher of a lock-free
+  // channel) but the server reads them without the lock.
+  std::atomic<int64_t> total_bytes;
+  std::atomic<int64_t> total_messages;
+
+  // The biggest message published since the server last looked.  The
+  // server uses this to decide when a resized channel can go back to
+  // smaller buffers.
+  std::atomic<int32_t> max_message_size;
+
+  // Incremented when a subscriber has read all the available messages and
+  // wakes up the reliable publishers.  Watched by reliable publishers that
+  // spin waiting for a slot.
+  std::atomic<int64_t> num_reliable_wakeups;
 
   // Slot lists.
   // Active list: slots with active messages in them.
@@ -151,8 +308,87 @@ struct ChannelControlBlock {          // a.k.a CCB
 
   pthread_mutex_t lock; // Lock for this channel only.
 
-  // Variable number of MessageSlot structs (num_slots long).
-  MessageSlot slots[0];
+  ChannelStatsCounters stats;
+
+  // Sequence number for the trigger table.  This is odd while the server
+  // is updating it.
+  std::atomic<uint64_t> trigger_seq;
+
+  // Number of messages added to the timestamp index.
+  std::atomic<int64_t> timestamp_index_next;
+
+  // Variable number of MessageSlot structs (num_slots long), starting
+  // on a cache line boundary.
+  alignas(64) MessageSlot slots[0];
+
+  // The slots are followed by the ordinal ring: num_slots slot ids
+  // (std::atomic<int32_t>) indexed by ordinal % num_slots.  The entry
+  // for an ordinal holds the id of the slot the message was published
+  // in, or -1.  The slot may since have been reused for a later message
+  // so its ordinal must be checked.
+  //
+  // After the ring, aligned to 64 bytes, is the slot owners table.  This
+  // has one bit per publisher/subscriber ID for each slot, held in
+  // std::atomic<uint64_t> words.  The server doesn't allow more users of
+  // a channel than it has slots so the number of bits per slot is the
+  // number of slots, rounded up to a multiple of 64 and limited to
+  // kMaxSlotOwners.  The bits are set and cleared atomically so that
+  // subscribers to a lock-free channel can change ownership without
+  // holding the lock.
+  //
+  // Last are the reclaim indexes, each a SharedBitmap with num_slots bits.
+  // The first has one bit per ordinal ring entry which is set when the
+  // message at that entry becomes unreferenced, so a publisher can find
+  // the oldest reusable slot without walking the active list.  The second
+  // has one bit per slot id for slots that are still active but have lost
+  // their ring entry to a later message because they were referenced for
+  // a long time.  These are the oldest messages in the channel.  The bits
+  // are only hints and are checked against the slot when found.
+  //
+  // Finally there are two bitmaps with one bit per publisher/subscriber ID,
+  // the same size as the owners for a slot.  The first has a bit set for
+  // each subscriber spinning waiting for a message and the second for each
+  // reliable publisher spinning waiting for a slot.  If everyone is
+  // spinning, there is no need to write to their trigger fds.
+  //
+  // Then there is the trigger table with one TriggerTableEntry per
+  // publisher/subscriber ID.
+  //
+  // The very end is the timestamp index, num_slots TimestampIndexEntry
+  // structs.
+};
+
+// A bitmap in shared memory that can be searched for a set bit quickly.
+// It is made up of the bits followed by a summary with one bit per word
+// of bits that is set if the word might have a bit set.  The bits can be
+// set by any process but only one at a time can clear them.
+class SharedBitmap {
+public:
+  SharedBitmap(std::atomic<uint64_t> *words, int num_bits)
+      : words_(words), num_words_((num_bits + 63) / 64),
+        summary_(words + num_words_) {}
+
+  // Memory needed for a bitmap of the given size.
+  static int64_t Size(int num_bits) {
+    int num_words = (num_bits + 63) / 64;
+    return sizeof(std::atomic<uint64_t>) * (num_words + (num_words + 63) / 64);
+  }
+
+  void Set(int b) {
+    words_[b / 64].fetch_or(uint64_t(1) << (b % 64), std::memory_order_seq_cst);
+    summary_[b / 4096].fetch_or(uint64_t(1) << ((b / 64) % 64),
+                                std::memory_order_seq_cst);
+  }
+  void Clear(int b);
+
+  // Find the first set bit at or after from and before to.  Returns -1 if
+  // there isn't one.
+  int Next(int from, int to) const;
+
+private:
+  std::atomic<uint64_t> *words_;
+  int num_words_;
+  std::atomic<uint64_t> *summary_;
 };
 
 absl::StatusOr<SystemControlBlock *>
@@ -166,6 +402,23 @@ struct SlotBuffer {
   toolbelt::FileDescriptor fd;
 };
 
+// Options for the shared memory of a channel.  These are given by the
+// channel's first publisher and can't be changed once it's allocated.
+struct AllocationOptions {
+  // A single publisher that never takes the CCB lock.
+  bool lock_free = false;
+  // Back the buffers with huge pages (Linux only).
+  bool huge_pages = false;
+  // Fault the buffers in when they are mapped and lock them into the
+  // server's memory (see Channel::LockBuffers).
+  bool prefault = false;
+  // NUMA node for the CCB and buffers, or -1 for no particular node.
+  int numa_node = -1;
+  // Keep all the buffers as size classes rather than moving every slot
+  // to the biggest buffer after a resize.
+  bool size_classes = false;
+};
+
 // This holds the shared memory file descriptors for a channel.
 // ccb: Channel Control Block
 // buffers: message buffer memory.
@@ -215,9 +468,11 @@ struct BufferSet {
 // keeps the file descriptors for the POSIX shared memory,
 // which it distributes to the clients upon request.  Clients
 // use mmap to map the shared memory into their address
-// space.  If there are multiple publishers or subscribers in the
-// same process, each of them maps in the shared memory. No attempt
-// is made to share the Channel objects.
+// space.  If there are multiple publishers or subscribers for a channel
+// in the same process (in any number of Clients), each has its own
+// Channel object but they share one mapping of each part of the shared
+// memory.  The mappings are reference counted and unmapped when the last
+// Channel using them unmaps them.
 class Channel {
 public:
   struct PublishedMessage {
@@ -236,10 +491,16 @@ public:
   // size parameters.  Unless there's an error, it returns the
   // file descriptors for the allocated CCB and buffers.  The
   // SCB has already been allocated and will be mapped in for
-  // this channel.  This is only used in the server.
+  // this channel.  The options say how the memory is allocated
+  // and used (see AllocationOptions).  This is only used in the server.
   absl::StatusOr<SharedMemoryFds>
   Allocate(const toolbelt::FileDescriptor &scb_fd, int slot_size,
-           int num_slots);
+           int num_slots, const AllocationOptions &options = {});
+
+  // Lock the buffers that are mapped into this process into memory.
+  // The server does this for prefaulted channels so that their pages
+  // stay resident.  This is subject to the RLIMIT_MEMLOCK limit.
+  absl::Status LockBuffers();
 
   // Client-side channel mapping.  The SharedMemoryFds contains the
   // file descriptors for the CCB and buffers.  The num_slots_
@@ -258,6 +519,21 @@ public:
   // no publishers and thus the shared memory is not yet valid.
   bool IsPlaceholder() const { return NumSlots() == 0; }
 
+  // Is this a lock-free (single publisher) channel?
+  bool IsLockFree() const { return ccb_ != nullptr && ccb_->lock_free; }
+
+  // Are the buffers backed by huge pages and faulted in when mapped?
+  bool UsesHugePages() const { return ccb_ != nullptr && ccb_->huge_pages; }
+  bool IsPrefaulted() const { return ccb_ != nullptr && ccb_->prefault; }
+
+  // The NUMA node the channel's memory was allocated on, or -1.
+  int NumaNode() const { return ccb_ == nullptr ? -1 : ccb_->numa_node; }
+
+  // Are the buffers size classes?
+  bool HasSizeClasses() const {
+    return ccb_ != nullptr && ccb_->size_classes;
+  }
+
   // What is the address of the message buffer (after the MessagePrefix)
   // for the slot given a slot id.
   void *GetBufferAddress(int slot_id) const {
@@ -277,10 +553,10 @@ public:
   // Find a free slot to use.  This will come from the free list if there
   // is a free slot.  Otherwise it will search for the first unreferenced slot
   // in the active list.  If reliable is true, the search will not go past
-  // a slot with a reliable_ref_count > 0.  The owner is the ID of the
+  // a slot with a reliable reference.  The owner is the ID of the
   // subscriber or publisher, allocated by the server.
   //
-  // This locks the CCB.
+  // This locks the CCB unless the channel is lock-free.
   MessageSlot *FindFreeSlot(bool reliable, int owner);
 
   // A publisher is done with its busy slot (it now contains a message).  The
@@ -298,23 +574,61 @@ public:
   //              is read from the bridge)
   // notify: set to true if we should notify the subscribers.
   //
-  // Locks the CCB.
+  // Locks the CCB unless the channel is lock-free.
   PublishedMessage ActivateSlotAndGetAnother(MessageSlot *slot, bool reliable,
                                              bool is_activation, int owner,
                                              bool omit_prefix, bool *notify);
 
+  // Batch versions of FindFreeSlot and ActivateSlotAndGetAnother that do
+  // all their work with one lock acquisition.  FindFreeSlots claims up to
+  // num_slots slots and returns them; there might be fewer than asked
+  // for.  ActivateSlotsAndGetAnother publishes the messages in the slots
+  // in order with contiguous ordinals and the same timestamp.  The
+  // ordinal of the first message is returned.  If omit_prefix is true the
+  // ordinals and timestamps already in the slots' prefixes are used, as
+  // for ActivateSlotAndGetAnother.
+  std::vector<MessageSlot *> FindFreeSlots(int num_slots, bool reliable,
+                                           int owner);
+  PublishedMessage
+  ActivateSlotsAndGetAnother(const std::vector<MessageSlot *> &slots,
+                             bool reliable, int owner, bool omit_prefix,
+                             bool *notify);
+
   // A subscriber wants to find a slot with a message in it.  There are
   // two ways to get this:
   // NextSlot: gets the next slot in the active list
   // LastSlot: gets the last slot in the active list.
   // Can return nullptr if there is no slot.
-  // If reliable is true, the reliable_ref_count in the MessageSlot will
-  // be manipulated.  The owner is the subscriber ID.
+  // If reliable is true, the reliable reference count in the MessageSlot
+  // will be manipulated.  The owner is the subscriber ID.
   //
-  // Locks the CCB.
+  // Locks the CCB unless the channel is lock-free, in which case the
+  // ordinal ring is used to find the slot.
   MessageSlot *NextSlot(MessageSlot *slot, bool reliable, int owner);
   MessageSlot *LastSlot(MessageSlot *slot, bool reliable, int owner);
 
+  // Batch version of NextSlot.  Takes references to up to max_slots
+  // consecutive messages after slot with one lock acquisition and appends
+  // their slots to slots, oldest first.  The reference to slot is dropped
+  // if any are found.  The caller owns all the new references and
+  // releases them with ReleaseSlot, apart from the last, which becomes
+  // the current slot.
+  void NextSlots(MessageSlot *slot, int max_slots, bool reliable, int owner,
+                 std::vector<MessageSlot *> &slots);
+
+  // As NextSlots but for the messages with ordinals first to last
+  // (inclusive) that are still in the ordinal ring.  The ring maps an
+  // ordinal straight to its slot so there is no list walk.
+  void SlotsAt(MessageSlot *slot, int64_t first, int64_t last, bool reliable,
+               int owner, std::vector<MessageSlot *> &slots);
+
+  // The ordinal of the most recently published message, or 0 if there
+  // isn't one.
+  int64_t NewestOrdinal() const;
+
+  // Drop a subscriber's reference to a slot.  Doesn't lock the CCB.
+  void ReleaseSlot(MessageSlot *slot, bool reliable, int owner);
+
   // Get a pointer to the MessagePrefix for a given slot.
   MessagePrefix *Prefix(MessageSlot *slot) const {
     MessagePrefix *p = reinterpret_cast<MessagePrefix *>(
@@ -347,13 +661,68 @@ public:
                ? 0
                : buffers_[ccb_->slots[slot->id].buffer_index].slot_size;
   }
-  // Get the biggest slot size for the channel.
+  // Get the current slot size for the channel.  This is the slot size of
+  // the most recently added buffer.  It is usually the biggest but the
+  // server can add a smaller buffer to shrink the channel.
   int SlotSize() const {
     return buffers_.empty() ? 0 : buffers_.back().slot_size;
   }
 
   // Get the number of slots in the channel (can't be changed)
   int NumSlots() const { return num_slots_; }
+
+  // Support for spin waiting.  A subscriber spins until the number of
+  // messages published changes and a reliable publisher spins until the
+  // number of wakeups from subscribers changes.  While spinning they are
+  // marked as spinners so that they don't need to be triggered.  Checking
+  // for spinners must be done after the counter has been changed so that
+  // a spinner that stops will either see the change or be triggered.
+  int64_t NumMessagesPublished() const {
+    return ccb_->total_messages.load(std::memory_order_seq_cst);
+  }
+  int64_t NumReliableWakeups() const {
+    return ccb_->num_reliable_wakeups.load(std::memory_order_seq_cst);
+  }
+  void AddReliableWakeup() {
+    ccb_->num_reliable_wakeups.fetch_add(1, std::memory_order_seq_cst);
+  }
+  void SetSpinning(bool publisher, int id, bool spinning) {
+    std::atomic<uint64_t> &word = Spinners(publisher)[id / 64];
+    uint64_t bit = uint64_t(1) << (id % 64);
+    if (spinning) {
+      word.fetch_or(bit, std::memory_order_seq_cst);
+    } else {
+      word.fetch_and(~bit, std::memory_order_seq_cst);
+    }
+  }
+  // Are all the subscribers (or reliable publishers) spinning?
+  bool AllSubscribersSpinning() const {
+    return NumSpinners(false) >= GetScb()->counters[channel_id_].num_subs;
+  }
+  bool AllReliablePublishersSpinning() const {
+    return NumSpinners(true) >=
+           GetScb()->counters[channel_id_].num_reliable_pubs;
+  }
+
+  // Add inc (+1 or -1) to the reference counts of the slot.  This is
+  // atomic and does not need the CCB lock.  When the last reference
+  // goes the slot is added to the reclaim index.
+  void IncDecRefCount(MessageSlot *slot, bool reliable, int inc) {
+    uint32_t delta = RefCountDelta(reliable);
+    if (inc > 0) {
+      slot->refs.fetch_add(delta, std::memory_order_acq_rel);
+      return;
+    }
+    // The slot can't be reused until we drop our reference so the
+    // ordinal is valid here.
+    int64_t ordinal = slot->ordinal;
+    if (slot->refs.fetch_sub(delta, std::memory_order_seq_cst) == delta) {
+      MarkReclaimable(slot, ordinal);
+    }
+  }
+
+  // Publisher and subscriber IDs must be less than this.
+  int MaxSlotOwners() const { return OwnerWords(num_slots_) * 64; }
   void SetNumSlots(int n) { num_slots_ = n; }
 
   // Get the buffer associated with the given slot id.  The first buffer
@@ -364,7 +733,12 @@ public:
                : (buffers_[ccb_->slots[slot_id].buffer_index].buffer +
                   sizeof(BufferHeader));
   }
-  void CleanupSlots(int owner, bool reliable);
+  // Remove the references held by the given owner (a publisher or
+  // subscriber that is going away).  Locks the CCB.
+  void CleanupSlots(int owner, bool reliable, bool is_publisher);
+
+  // Unmap the buffers no slot refers to.  The most recently added buffer
+  // is always kept as it is the one new slots will use.
   void UnmapUnusedBuffers();
 
   int GetChannelId() const { return channel_id_; }
@@ -374,18 +748,54 @@ public:
 
   SystemControlBlock *GetScb() const { return scb_; }
 
-  // Gets the statistics counters.  Locks the CCB.
+  // Gets the statistics counters.  Doesn't lock the CCB so the counters
+  // might not be consistent with each other.
   void GetStatsCounters(int64_t &total_bytes, int64_t &total_messages);
+  void GetStatsCounters(ChannelStatsSnapshot &stats);
+
+  // Get the biggest message size published since the last call and reset
+  // it.  Used by the server.
+  int32_t TakeMaxMessageSize() {
+    return ccb_->max_message_size.exchange(0, std::memory_order_relaxed);
+  }
+
+  // Update the statistics counters.  These don't lock the CCB.
+  // RecordLatency adds a message read at now that was published at
+  // publish_time to the latency histogram.
+  void RecordLatency(uint64_t publish_time, uint64_t now) {
+    int bucket = LatencyBucket(now > publish_time ? now - publish_time : 0);
+    ccb_->stats.latency_buckets[bucket].fetch_add(1,
+                                                  std::memory_order_relaxed);
+  }
+  void AddDrops(int64_t num_dropped) {
+    ccb_->stats.num_drops.fetch_add(num_dropped, std::memory_order_relaxed);
+  }
+  void AddReliableStall() {
+    ccb_->stats.num_reliable_stalls.fetch_add(1, std::memory_order_relaxed);
+  }
+  void AddTrigger() {
+    ccb_->stats.num_triggers.fetch_add(1, std::memory_order_relaxed);
+  }
+  static int LatencyBucket(uint64_t latency) {
+    int bucket = latency == 0 ? 0 : 64 - __builtin_clzll(latency);
+    return std::min(bucket, kNumLatencyBuckets - 1);
+  }
 
   void SetDebug(bool v) { debug_ = v; }
 
-  // Search the active list for a message with the given timestamp.  If found,
-  // move the owner to the slot found.  Return nullptr if nothing found in which
-  // no slot ownership changes are done.  This uses the memory inside buffer
-  // to perform a fast search of the slots.  The caller keeps onership of the
+  // Search the channel for the first message with a timestamp at or after
+  // the given timestamp.  If found, move the owner to the slot found.  Return
+  // nullptr if nothing found in which no slot ownership changes are done.
+  // This does a binary search of the timestamp index without the lock.  A
+  // channel that isn't lock-free takes the lock to move the owner.
+  //
+  // Messages that have been referenced for a long time can be older than
+  // the messages in the index.  If the timestamp is before everything in
+  // the index, a channel that isn't lock-free searches the active list
+  // using the memory inside buffer.  The caller keeps onership of the
   // buffer, but this function will modify it.  This is to avoid memory
-  // allocation for every search or buffer allocation for every subscriber when
-  // searches are rare.
+  // allocation for every search or buffer allocation for every subscriber
+  // when searches are rare.
   MessageSlot *FindActiveSlotByTimestamp(MessageSlot *old_slot,
                                          uint64_t timestamp, bool reliable,
                                          int owner,
@@ -400,11 +810,146 @@ public:
 
   absl::Status MapNewBuffers(std::vector<SlotBuffer> buffers);
 
+  // Use the most recently added buffer for the slot.  Unless the server
+  // has shrunk the channel this is the biggest buffer.
   void SetSlotToBiggestBuffer(MessageSlot *slot);
 
+  // For a channel with size classes, use the smallest buffer with
+  // slots of at least size bytes for the slot.  A size of -1 means the
+  // biggest buffer.  Only a publisher holding the slot may do this.
+  void SetSlotToBufferForSize(MessageSlot *slot, int32_t size);
+
   const std::vector<BufferSet> &GetBuffers() const { return buffers_; }
 
+  // The trigger table (see TriggerTableEntry).  The server sets and clears
+  // the entries for its users.  A client reads a consistent copy of the
+  // entries with any of the given flags and gets a sequence number to
+  // check later with TriggerTableChanged.  A placeholder channel has no
+  // trigger table.
+  int TriggerTableSize() const {
+    return ccb_ == nullptr ? 0 : MaxSlotOwners();
+  }
+  void SetTriggerTableEntry(int user_id, int fd, uint32_t flags,
+                            uint64_t serial);
+  void ClearTriggerTableEntry(int user_id) {
+    SetTriggerTableEntry(user_id, -1, 0, 0);
+  }
+  uint64_t ReadTriggerTable(uint32_t flags,
+                            std::vector<TriggerTableEntry> &entries) const;
+  bool TriggerTableChanged(uint64_t seq) const {
+    return ccb_->trigger_seq.load(std::memory_order_acquire) != seq;
+  }
+
 private:
+  // Layout of the CCB for a channel with the given number of slots.
+  static int OwnerWords(int num_slots) {
+    return (std::min(num_slots, kMaxSlotOwners) + 63) / 64;
+  }
+  static int64_t OwnersOffset(int num_slots) {
+    return Aligned<64>(sizeof(ChannelControlBlock) +
+                       sizeof(MessageSlot) * num_slots +
+                       sizeof(std::atomic<int32_t>) * num_slots);
+  }
+  static int64_t ReclaimOffset(int num_slots) {
+    return OwnersOffset(num_slots) +
+           sizeof(std::atomic<uint64_t>) * OwnerWords(num_slots) * num_slots;
+  }
+  static int64_t SpinnersOffset(int num_slots) {
+    return ReclaimOffset(num_slots) + 2 * SharedBitmap::Size(num_slots);
+  }
+  static int64_t TriggersOffset(int num_slots) {
+    return SpinnersOffset(num_slots) +
+           2 * sizeof(std::atomic<uint64_t>) * OwnerWords(num_slots);
+  }
+  static int64_t TimestampIndexOffset(int num_slots) {
+    return TriggersOffset(num_slots) +
+           sizeof(TriggerTableEntry) * OwnerWords(num_slots) * 64;
+  }
+  static int64_t CcbSize(int num_slots) {
+    return TimestampIndexOffset(num_slots) +
+           sizeof(TimestampIndexEntry) * num_slots;
+  }
+
+  TimestampIndexEntry *TimestampIndex() const {
+    return reinterpret_cast<TimestampIndexEntry *>(
+        reinterpret_cast<char *>(ccb_) + TimestampIndexOffset(num_slots_));
+  }
+  // Add a published message to the timestamp index.
+  void AddToTimestampIndex(MessageSlot *slot, uint64_t timestamp);
+  // Get a consistent copy of the timestamp index entry for seq.  Returns
+  // false if the entry has been reused for a later message.
+  bool ReadTimestampIndex(int64_t seq, int64_t &ordinal, uint64_t &timestamp,
+                          int32_t &slot_id) const;
+
+  TriggerTableEntry *TriggerTable() const {
+    return reinterpret_cast<TriggerTableEntry *>(
+        reinterpret_cast<char *>(ccb_) + TriggersOffset(num_slots_));
+  }
+
+  // Size of the shared memory for a buffer holding num_slots_ slots of
+  // the given size.
+  int64_t BuffersSize(int32_t slot_size) const;
+
+  std::atomic<uint64_t> *Spinners(bool publishers) const {
+    return reinterpret_cast<std::atomic<uint64_t> *>(
+               reinterpret_cast<char *>(ccb_) + SpinnersOffset(num_slots_)) +
+           (publishers ? OwnerWords(num_slots_) : 0);
+  }
+  int NumSpinners(bool publishers) const;
+
+  SharedBitmap ReclaimIndex() const {
+    return SharedBitmap(reinterpret_cast<std::atomic<uint64_t> *>(
+                            reinterpret_cast<char *>(ccb_) +
+                            ReclaimOffset(num_slots_)),
+                        num_slots_);
+  }
+  SharedBitmap OrphanIndex() const {
+    return SharedBitmap(reinterpret_cast<std::atomic<uint64_t> *>(
+                            reinterpret_cast<char *>(ccb_) +
+                            ReclaimOffset(num_slots_) +
+                            SharedBitmap::Size(num_slots_)),
+                        num_slots_);
+  }
+
+  // Add an unreferenced slot to the appropriate reclaim index.
+  void MarkReclaimable(MessageSlot *slot, int64_t ordinal) {
+    int pos = ordinal % num_slots_;
+    if (OrdinalRing()[pos].load(std::memory_order_seq_cst) == slot->id) {
+      ReclaimIndex().Set(pos);
+    } else {
+      OrphanIndex().Set(slot->id);
+    }
+  }
+
+  // Find and claim the oldest unreferenced slot in the active list using
+  // the reclaim indexes.  Returns nullptr if they have nothing.
+  MessageSlot *ClaimReclaimableSlot();
+  bool ClaimUnreferencedSlot(MessageSlot *slot);
+
+  std::atomic<int32_t> *OrdinalRing() const {
+    return reinterpret_cast<std::atomic<int32_t> *>(&ccb_->slots[num_slots_]);
+  }
+
+  // Owner words for the given slot.
+  std::atomic<uint64_t> *SlotOwners(const MessageSlot *slot) const {
+    return reinterpret_cast<std::atomic<uint64_t> *>(
+               reinterpret_cast<char *>(ccb_) + OwnersOffset(num_slots_)) +
+           slot->id * OwnerWords(num_slots_);
+  }
+
+  void SetSlotOwner(MessageSlot *slot, int owner) {
+    SlotOwners(slot)[owner / 64].fetch_or(uint64_t(1) << (owner % 64),
+                                          std::memory_order_relaxed);
+  }
+  void ClearSlotOwner(MessageSlot *slot, int owner) {
+    SlotOwners(slot)[owner / 64].fetch_and(~(uint64_t(1) << (owner % 64)),
+                                           std::memory_order_relaxed);
+  }
+  bool IsSlotOwner(const MessageSlot *slot, int owner) const {
+    return (SlotOwners(slot)[owner / 64].load(std::memory_order_relaxed) &
+            (uint64_t(1) << (owner % 64))) != 0;
+  }
+
   int32_t ToCCBOffset(void *addr) const {
     return (int32_t)(reinterpret_cast<char *>(addr) -
                      reinterpret_cast<char *>(ccb_));
@@ -457,12 +1002,50 @@ private:
   void AddToActiveList(MessageSlot *slot) {
     ListInsertAtEnd(&ccb_->active_list, &slot->element);
   }
+  // These are called with the CCB locked, or for a lock-free channel
+  // without the lock since only its single publisher modifies the slot
+  // lists.
   MessageSlot *FindFreeSlotLocked(bool reliable, int owner);
+  PublishedMessage ActivateSlotLocked(MessageSlot *slot, bool reliable,
+                                      bool is_activation, int owner,
+                                      bool omit_prefix, bool *notify);
+  // Move a slot to the active list and make its message visible to
+  // subscribers.  Doesn't get a new slot for the publisher.
+  PublishedMessage PublishSlotLocked(MessageSlot *slot, bool is_activation,
+                                     int owner, bool omit_prefix,
+                                     uint64_t timestamp, bool *notify);
+
+  // Lock-free channel subscribers use the ordinal ring to find slots and
+  // take references to them using AcquireSlot.
+  MessageSlot *NextSlotLockFree(MessageSlot *slot, bool reliable, int owner);
+
+  // Take a reference to the message after slot (or the first one if slot
+  // is nullptr) without changing the owner of any slot.
+  MessageSlot *AcquireNextSlotLocked(MessageSlot *slot, bool reliable);
+  MessageSlot *AcquireNextSlotLockFree(MessageSlot *slot, bool reliable);
+  MessageSlot *LastSlotLockFree(MessageSlot *slot, bool reliable, int owner);
+  MessageSlot *FindActiveSlotInListLocked(MessageSlot *old_slot,
+                                          uint64_t timestamp, bool reliable,
+                                          int owner,
+                                          std::vector<MessageSlot *> &buffer);
+
+  // Take a reference to the slot holding the message with the given
+  // ordinal.  Returns nullptr if the message is no longer in the channel.
+  MessageSlot *AcquireSlot(int64_t ordinal, bool reliable);
+  // As AcquireSlot for a message known to have been published in the slot
+  // with the given id.
+  MessageSlot *AcquireSlot(int32_t slot_id, int64_t ordinal, bool reliable);
+
+  // Move the owner's reference from old_slot (which may be nullptr) to
+  // new_slot, which has already been acquired, and mark the message seen.
+  void MoveOwnership(MessageSlot *old_slot, MessageSlot *new_slot,
+                     bool reliable, int owner);
 
   void ClaimPublisherSlot(MessageSlot *slot, int owner, SlotList &list);
 
   void DecrementBufferRefs(int buffer_index);
   void IncrementBufferRefs(int buffer_index);
+  void SetSlotBuffer(MessageSlot *slot, int buffer_index);
 
   std::string name_;
   int num_slots_;
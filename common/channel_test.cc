@@ -0,0 +1,73 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "common/channel.h"
+#include "toolbelt/fd.h"
+#include <gtest/gtest.h>
+#include <vector>
+
+using Channel = subspace::Channel;
+using MessageSlot = subspace::MessageSlot;
+
+class ChannelTest : public ::testing::Test {
+public:
+  void SetUp() override {
+    absl::StatusOr<subspace::SystemControlBlock *> scb =
+        subspace::CreateSystemControlBlock(scb_fd_);
+    ASSERT_TRUE(scb.ok());
+  }
+
+  // Publish a message that carries its own ordinal in its prefix, as a
+  // bridge does, and return the slot the publisher gets for the next one.
+  MessageSlot *PublishRemote(Channel &channel, MessageSlot *slot,
+                             int64_t ordinal) {
+    slot->message_size = 8;
+    subspace::MessagePrefix *prefix = channel.Prefix(slot);
+    prefix->message_size = 8;
+    prefix->ordinal = ordinal;
+    prefix->timestamp = ordinal * 1000;
+    prefix->flags = 0;
+    bool notify = false;
+    return channel
+        .ActivateSlotAndGetAnother(slot, /*reliable=*/false,
+                                   /*is_activation=*/false, kOwner,
+                                   /*omit_prefix=*/true, &notify)
+        .new_slot;
+  }
+
+protected:
+  static constexpr int kOwner = 0;
+  toolbelt::FileDescriptor scb_fd_;
+};
+
+TEST_F(ChannelTest, ReclaimOldestRemoteOrdinal) {
+  constexpr int kNumSlots = 4;
+  // The server allocates the channel and the publisher maps it.
+  Channel server_channel("remote", kNumSlots, 0, "");
+  absl::StatusOr<subspace::SharedMemoryFds> fds =
+      server_channel.Allocate(scb_fd_, 64, kNumSlots);
+  ASSERT_TRUE(fds.ok());
+  Channel channel("remote", kNumSlots, 0, "");
+  ASSERT_TRUE(channel.Map(std::move(*fds), scb_fd_).ok());
+
+  // Messages from a bridge keep the ordinals they had on the remote
+  // channel.  These are sparse, as they are for a subscription that only
+  // gets some of the messages.
+  MessageSlot *slot = channel.FindFreeSlot(/*reliable=*/false, kOwner);
+  ASSERT_NE(nullptr, slot);
+  std::vector<int> published; // Slot ids in the order published.
+  for (int64_t ordinal = 101; ordinal < 101 + 9 * kNumSlots; ordinal += 3) {
+    published.push_back(slot->id);
+    slot = PublishRemote(channel, slot, ordinal);
+    ASSERT_NE(nullptr, slot);
+    ASSERT_EQ(ordinal, channel.NewestOrdinal());
+
+    // The publisher holds one slot and the others have the newest
+    // messages.  Once the free slots are used up, the publisher gets the
+    // slot with the oldest message.
+    if (published.size() >= kNumSlots) {
+      ASSERT_EQ(published[published.size() - kNumSlots], slot->id) << ordinal;
+    }
+  }
+}
@@ -0,0 +1,184 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "common/trace.h"
+#include "absl/strings/str_format.h"
+#include "toolbelt/clock.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+namespace subspace {
+
+// Number of events in each thread's ring buffer.
+static constexpr uint64_t kTraceBufferSize = 1 << 15;
+
+namespace {
+struct TraceBuffer {
+  int64_t thread_id;
+  // Total number of events recorded.  Only the thread that owns the buffer
+  // writes it.
+  std::atomic<uint64_t> num_records{0};
+  TraceRecord records[kTraceBufferSize];
+};
+} // namespace
+
+// NOTE: like the mapped regions in channel.cc these can't be actual
+// instances because of C++'s undefined destruction order; threads might
+// still be recording while the program exits.  They are allocated on
+// first use and not deleted.
+static std::mutex *trace_buffers_lock;
+static std::vector<TraceBuffer *> *trace_buffers;
+static thread_local TraceBuffer *thread_trace_buffer;
+
+static std::mutex &TraceBuffersLock() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    trace_buffers_lock = new std::mutex;
+    trace_buffers = new std::vector<TraceBuffer *>;
+  });
+  return *trace_buffers_lock;
+}
+
+static int64_t ThreadId() {
+#if defined(__linux__)
+  return syscall(SYS_gettid);
+#else
+  static std::atomic<int64_t> next_thread_id = 1;
+  return next_thread_id++;
+#endif
+}
+
+// Called the first time a thread records an event.
+static TraceBuffer *NewTraceBuffer() {
+  TraceBuffer *buffer = new TraceBuffer;
+  buffer->thread_id = ThreadId();
+  std::unique_lock l(TraceBuffersLock());
+  trace_buffers->push_back(buffer);
+  return buffer;
+}
+
+const char *TraceEventName(TraceEvent event) {
+  switch (event) {
+  case TraceEvent::kPublish:
+    return "Publish";
+  case TraceEvent::kRead:
+    return "Read";
+  case TraceEvent::kWaitBegin:
+    return "WaitBegin";
+  case TraceEvent::kWaitEnd:
+    return "WaitEnd";
+  case TraceEvent::kTriggerSubscribers:
+    return "TriggerSubscribers";
+  case TraceEvent::kTriggerPublishers:
+    return "TriggerPublishers";
+  case TraceEvent::kClearTrigger:
+    return "ClearTrigger";
+  case TraceEvent::kBridgeSend:
+    return "BridgeSend";
+  case TraceEvent::kBridgeReceive:
+    return "BridgeReceive";
+  }
+  return "Unknown";
+}
+
+void EnableTracing(bool enable) {
+  tracing_enabled.store(enable, std::memory_order_relaxed);
+}
+
+void RecordTraceEvent(TraceEvent event, int32_t channel_id, int64_t ordinal,
+                      uint64_t timestamp) {
+  TraceBuffer *buffer = thread_trace_buffer;
+  if (buffer == nullptr) {
+    buffer = thread_trace_buffer = NewTraceBuffer();
+  }
+  uint64_t n = buffer->num_records.load(std::memory_order_relaxed);
+  buffer->records[n % kTraceBufferSize] = {toolbelt::Now(), ordinal, timestamp,
+                                           channel_id, event, 0};
+  buffer->num_records.store(n + 1, std::memory_order_release);
+}
+
+std::vector<ThreadTrace> CollectTraces() {
+  std::vector<ThreadTrace> traces;
+  std::unique_lock l(TraceBuffersLock());
+  traces.reserve(trace_buffers->size());
+  for (TraceBuffer *buffer : *trace_buffers) {
+    uint64_t n = buffer->num_records.load(std::memory_order_acquire);
+    uint64_t count = std::min(n, kTraceBufferSize);
+    ThreadTrace &trace = traces.emplace_back();
+    trace.thread_id = buffer->thread_id;
+    trace.num_lost = n - count;
+    trace.records.reserve(count);
+    for (uint64_t i = n - count; i < n; i++) {
+      trace.records.push_back(buffer->records[i % kTraceBufferSize]);
+    }
+  }
+  return traces;
+}
+
+void ClearTraces() {
+  std::unique_lock l(TraceBuffersLock());
+  for (TraceBuffer *buffer : *trace_buffers) {
+    buffer->num_records.store(0, std::memory_order_relaxed);
+  }
+}
+
+absl::Status WriteChromeTrace(const std::string &filename) {
+  FILE *fp = fopen(filename.c_str(), "w");
+  if (fp == nullptr) {
+    return absl::InternalError(absl::StrFormat(
+        "Failed to open trace file %s: %s", filename, strerror(errno)));
+  }
+  int pid = getpid();
+  const char *sep = "";
+  absl::FPrintF(fp, "{\"traceEvents\":[");
+  for (const ThreadTrace &trace : CollectTraces()) {
+    for (const TraceRecord &record : trace.records) {
+      // Instant events with times in microseconds.
+      absl::FPrintF(fp,
+                    "%s\n{\"name\":\"%s\",\"cat\":\"subspace\",\"ph\":\"i\","
+                    "\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"channel_id\":%d,\"ordinal\":%d,"
+                    "\"timestamp\":%d}}",
+                    sep, TraceEventName(record.event), record.time / 1000.0,
+                    pid, trace.thread_id, record.channel_id, record.ordinal,
+                    record.timestamp);
+      sep = ",";
+    }
+  }
+  absl::FPrintF(fp, "\n]}\n");
+  if (fclose(fp) != 0) {
+    return absl::InternalError(absl::StrFormat(
+        "Failed to write trace file %s: %s", filename, strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+// If SUBSPACE_TRACE_FILE is set in the environment, tracing is on from
+// the start and the trace is written to the file when the program exits.
+static void WriteTraceAtExit() {
+  EnableTracing(false);
+  const char *filename = getenv("SUBSPACE_TRACE_FILE");
+  if (absl::Status status = WriteChromeTrace(filename); !status.ok()) {
+    fprintf(stderr, "%s\n", status.ToString().c_str());
+  }
+}
+
+[[maybe_unused]] static bool trace_at_exit = []() {
+  if (getenv("SUBSPACE_TRACE_FILE") == nullptr) {
+    return false;
+  }
+  EnableTracing(true);
+  atexit(WriteTraceAtExit);
+  return true;
+}();
+
+} // namespace subspace
@@ -0,0 +1,109 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __COMMON_TRACE_H
+#define __COMMON_TRACE_H
+
+#include "absl/status/status.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Per-message tracing
+// -------------------
+// Trace points on the publish and read paths, the waits, the trigger fds
+// and the bridges record an event each time they are passed.  Each event
+// has the time it happened, the channel id and the ordinal and timestamp
+// of the message (the timestamp is the one in its MessagePrefix, so the
+// events for a message can be matched up across processes).
+//
+// The events go to a ring buffer for each thread.  Only that thread
+// writes to it, so no locks or atomic read-modify-writes are needed.
+// When a ring buffer is full, the oldest events are overwritten.
+//
+// Tracing is off until EnableTracing(true) is called, or if the
+// SUBSPACE_TRACE_FILE environment variable is set, in which case the
+// trace is written to that file when the program exits.  When tracing is
+// off a trace point is one predictable branch.  Building with
+// SUBSPACE_NO_TRACING defined removes the trace points altogether.
+//
+// The traces are written in the JSON trace event format, which can be
+// loaded into Perfetto (ui.perfetto.dev) or chrome://tracing.  Events use
+// the process id as pid and thread id as tid so the trace files from the
+// processes in a pipeline can be merged by concatenating their
+// traceEvents arrays.
+namespace subspace {
+
+enum class TraceEvent : uint16_t {
+  kPublish = 1,        // A message was published.
+  kRead,               // A message was read by a subscriber.
+  kWaitBegin,          // A subscriber started waiting for a message.
+  kWaitEnd,            // A subscriber finished waiting.
+  kTriggerSubscribers, // A publisher triggered the subscribers.
+  kTriggerPublishers,  // A subscriber triggered the reliable publishers.
+  kClearTrigger,       // A publisher or subscriber cleared its trigger.
+  kBridgeSend,         // A message was sent over a bridge.
+  kBridgeReceive,      // A message was received from a bridge.
+};
+
+const char *TraceEventName(TraceEvent event);
+
+struct TraceRecord {
+  uint64_t time;      // Nanosecond monotonic time of the event.
+  int64_t ordinal;    // -1 if there is no message.
+  uint64_t timestamp; // From the MessagePrefix, 0 if there is no message.
+  int32_t channel_id;
+  TraceEvent event;
+  uint16_t padding;
+};
+
+// The events recorded by one thread, oldest first.
+struct ThreadTrace {
+  int64_t thread_id;
+  std::vector<TraceRecord> records;
+  // Number of events overwritten because the ring buffer was full.
+  uint64_t num_lost;
+};
+
+// Don't use this directly, use the SUBSPACE_TRACE macro.
+inline std::atomic<bool> tracing_enabled;
+
+void EnableTracing(bool enable);
+inline bool TracingEnabled() {
+  return tracing_enabled.load(std::memory_order_relaxed);
+}
+
+// Record an event in the calling thread's ring buffer.
+void RecordTraceEvent(TraceEvent event, int32_t channel_id, int64_t ordinal,
+                      uint64_t timestamp);
+
+// Copy the events recorded by all the threads.  Events being recorded
+// while this runs might not be copied correctly, so stop tracing first
+// for a consistent copy.
+std::vector<ThreadTrace> CollectTraces();
+
+// Discard all the recorded events.  Tracing must be off.
+void ClearTraces();
+
+// Write all the recorded events to a file in the JSON trace event format.
+absl::Status WriteChromeTrace(const std::string &filename);
+
+} // namespace subspace
+
+#if defined(SUBSPACE_NO_TRACING)
+#define SUBSPACE_TRACE(event, channel_id, ordinal, timestamp)                 \
+  do {                                                                         \
+  } while (0)
+#else
+#define SUBSPACE_TRACE(event, channel_id, ordinal, timestamp)                 \
+  do {                                                                         \
+    if (__builtin_expect(::subspace::TracingEnabled(), 0)) {                   \
+      ::subspace::RecordTraceEvent(::subspace::TraceEvent::event, channel_id, \
+                                   ordinal, timestamp);                        \
+    }                                                                          \
+  } while (0)
+#endif
+
+#endif // __COMMON_TRACE_H
@@ -1,7 +1,8 @@
 #!/bin/bash
 
+# Raw TCP reference numbers.  Use //benchmarks for Subspace itself.
+
 ipaddr=
-subspace=true
 localhost=true
 net=true
 
@@ -15,9 +16,6 @@ fi
 
 for arg in "$*"; do
   case "$arg" in
-  --no-subspace)
-    subspace=false
-    ;;
   --no-localhost)
     localhost=false
     ;;
@@ -32,14 +30,6 @@ if [[ $(uname) == "Darwin" ]]; then
   RUN_FAST="taskpolicy -c utility"
 fi
 
-function run_subspace() {
-  size=$1
-  num=$2
-  $RUN_FAST bazel-bin/manual_tests/perf_subspace_pub --reliable --num_msgs=$num --slot_size=$size &
-  $RUN_FAST bazel-bin/manual_tests/perf_subspace_sub --reliable --num_msgs=$num --slot_size=$size --csv &
-  wait
-}
-
 function run_tcp() {
   size=$1
   host=$2
@@ -57,22 +47,9 @@ function run_tcp() {
 
 
 DIR=${HOME}/Documents
-subspace_out=${DIR}/subspace.csv
 tcp_localhost_out=${DIR}/localhost.csv
 tcp_net_out=${DIR}/net.csv
-rm -f $subspace_out $tcp_localhost_out $tcp_net_out
-
-if [[ $subspace == true ]]; then
-  echo Subspace
-  size=1000
-  num=1000000
-  max=100000000
-  while (( size < $max )); do
-    echo $size
-    run_subspace $size $num >> $subspace_out
-    size=$((size*2))
-  done
-fi
+rm -f $tcp_localhost_out $tcp_net_out
 
 if [[ $localhost == true ]]; then
   echo TCP localhost
@@ -0,0 +1,72 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "server/bridge_codec.h"
+#include "absl/strings/str_format.h"
+#include <zlib.h>
+
+namespace subspace {
+
+bool BridgeCompressor::Compress(const void *data, size_t length,
+                                std::vector<char> &out) {
+  if (codec_ == BridgeCodec::kNone || length < kMinBridgeCompressSize) {
+    return false;
+  }
+  if (num_bypassed_ > 0) {
+    num_bypassed_--;
+    return false;
+  }
+  size_t start = out.size();
+  uLongf compressed_length = compressBound(length);
+  out.resize(start + compressed_length);
+  // Speed matters more than size on a bridge.
+  int e = compress2(reinterpret_cast<Bytef *>(out.data() + start),
+                    &compressed_length, reinterpret_cast<const Bytef *>(data),
+                    length, Z_BEST_SPEED);
+  if (e != Z_OK || compressed_length > length - length / 8) {
+    out.resize(start);
+    if (++num_incompressible_ >= kMaxIncompressible) {
+      num_incompressible_ = 0;
+      num_bypassed_ = kBypassCount;
+    }
+    return false;
+  }
+  num_incompressible_ = 0;
+  out.resize(start + compressed_length);
+  return true;
+}
+
+absl::Status BridgeDecompress(BridgeCodec codec, const void *data,
+                              size_t length, void *out, size_t out_length) {
+  if (codec != BridgeCodec::kZlib) {
+    return absl::InternalError(
+        absl::StrFormat("Unknown bridge codec %d", static_cast<int>(codec)));
+  }
+  uLongf decompressed_length = out_length;
+  int e = uncompress(reinterpret_cast<Bytef *>(out), &decompressed_length,
+                     reinterpret_cast<const Bytef *>(data), length);
+  if (e != Z_OK || decompressed_length != out_length) {
+    return absl::InternalError(absl::StrFormat(
+        "Failed to decompress bridge message: zlib error %d, %d of %d bytes",
+        e, decompressed_length, out_length));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<int32_t> BridgeMessageSize(bool compressed,
+                                          int32_t message_size,
+                                          size_t payload_length,
+                                          int32_t slot_size) {
+  if (!compressed) {
+    message_size = static_cast<int32_t>(payload_length);
+  }
+  if (message_size < 0 || message_size > slot_size) {
+    return absl::InternalError(absl::StrFormat(
+        "Invalid bridge message size %d for slot size %d", message_size,
+        slot_size));
+  }
+  return message_size;
+}
+
+} // namespace subspace
@@ -0,0 +1,60 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __SERVER_BRIDGE_CODEC_H
+#define __SERVER_BRIDGE_CODEC_H
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "client/options.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace subspace {
+
+// Messages smaller than this aren't worth compressing.
+constexpr size_t kMinBridgeCompressSize = 256;
+
+// Compresses the messages a bridge transmitter sends.  If the messages of
+// a channel turn out not to compress, the compressor stops trying for a
+// while so that we don't waste CPU time on them.
+class BridgeCompressor {
+public:
+  explicit BridgeCompressor(BridgeCodec codec) : codec_(codec) {}
+
+  // Compress length bytes at data and append them to out.  Returns false,
+  // with out unchanged, if the message should be sent uncompressed.
+  bool Compress(const void *data, size_t length, std::vector<char> &out);
+
+private:
+  // A message is incompressible if it doesn't shrink by at least 1/8.
+  // After this many incompressible messages in a row, we send this many
+  // without trying before trying again.
+  static constexpr int kMaxIncompressible = 8;
+  static constexpr int kBypassCount = 256;
+
+  BridgeCodec codec_;
+  int num_incompressible_ = 0;
+  int num_bypassed_ = 0;
+};
+
+// Decompress a message compressed by a BridgeCompressor into exactly
+// out_length bytes at out.
+absl::Status BridgeDecompress(BridgeCodec codec, const void *data,
+                              size_t length, void *out, size_t out_length);
+
+// The size of a bridged message in its slot.  A compressed frame's prefix
+// holds the size of the message once it has been decompressed.  Otherwise
+// it's the payload_length bytes that follow the prefix.  The size comes
+// from the peer so it's an error if it won't fit in a slot of slot_size
+// bytes.
+absl::StatusOr<int32_t> BridgeMessageSize(bool compressed,
+                                          int32_t message_size,
+                                          size_t payload_length,
+                                          int32_t slot_size);
+
+} // namespace subspace
+
+#endif // __SERVER_BRIDGE_CODEC_H
@@ -0,0 +1,171 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "server/bridge_codec.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+using BridgeCodec = subspace::BridgeCodec;
+using BridgeCompressor = subspace::BridgeCompressor;
+
+static std::string Compressible(size_t length) {
+  std::string s;
+  while (s.size() < length) {
+    s += "the quick brown fox jumps over the lazy dog ";
+  }
+  s.resize(length);
+  return s;
+}
+
+static std::string Random(size_t length) {
+  std::mt19937 rng(1234);
+  std::string s(length, '\0');
+  for (auto &ch : s) {
+    ch = static_cast<char>(rng());
+  }
+  return s;
+}
+
+TEST(BridgeCodecTest, RoundTrip) {
+  BridgeCompressor compressor(BridgeCodec::kZlib);
+  std::string message = Compressible(4096);
+
+  // The compressed message is appended to what is already in the buffer.
+  std::vector<char> out = {'h', 'd', 'r'};
+  ASSERT_TRUE(compressor.Compress(message.data(), message.size(), out));
+  ASSERT_EQ("hdr", std::string(out.data(), 3));
+  ASSERT_LT(out.size() - 3, message.size() - message.size() / 8);
+
+  std::string decompressed(message.size(), '\0');
+  absl::Status status =
+      subspace::BridgeDecompress(BridgeCodec::kZlib, out.data() + 3,
+                                 out.size() - 3, decompressed.data(),
+                                 decompressed.size());
+  ASSERT_TRUE(status.ok()) << status;
+  ASSERT_EQ(message, decompressed);
+}
+
+TEST(BridgeCodecTest, NotCompressed) {
+  std::vector<char> out;
+
+  // No codec.
+  BridgeCompressor none(BridgeCodec::kNone);
+  std::string message = Compressible(4096);
+  ASSERT_FALSE(none.Compress(message.data(), message.size(), out));
+  ASSERT_TRUE(out.empty());
+
+  // Too small to bother.
+  BridgeCompressor compressor(BridgeCodec::kZlib);
+  std::string small = Compressible(subspace::kMinBridgeCompressSize - 1);
+  ASSERT_FALSE(compressor.Compress(small.data(), small.size(), out));
+  ASSERT_TRUE(out.empty());
+
+  // Random data doesn't get smaller.  The buffer is left as it was.
+  out = {'h', 'd', 'r'};
+  std::string random = Random(4096);
+  ASSERT_FALSE(compressor.Compress(random.data(), random.size(), out));
+  ASSERT_EQ(3, out.size());
+}
+
+TEST(BridgeCodecTest, BypassIncompressible) {
+  BridgeCompressor compressor(BridgeCodec::kZlib);
+  std::string random = Random(4096);
+  std::string message = Compressible(4096);
+  std::vector<char> out;
+
+  // A run of incompressible messages makes the compressor stop trying for
+  // a while, even for messages that would compress.
+  for (int i = 0; i < 8; i++) {
+    ASSERT_FALSE(compressor.Compress(random.data(), random.size(), out));
+  }
+  int num_bypassed = 0;
+  while (!compressor.Compress(message.data(), message.size(), out)) {
+    num_bypassed++;
+    ASSERT_LE(num_bypassed, 1000);
+  }
+  ASSERT_EQ(256, num_bypassed);
+  ASSERT_FALSE(out.empty());
+
+  // A compressible message resets the run.
+  for (int i = 0; i < 7; i++) {
+    ASSERT_FALSE(compressor.Compress(random.data(), random.size(), out));
+  }
+  out.clear();
+  ASSERT_TRUE(compressor.Compress(message.data(), message.size(), out));
+  for (int i = 0; i < 7; i++) {
+    ASSERT_FALSE(compressor.Compress(random.data(), random.size(), out));
+  }
+  out.clear();
+  ASSERT_TRUE(compressor.Compress(message.data(), message.size(), out));
+}
+
+TEST(BridgeCodecTest, BadFrames) {
+  BridgeCompressor compressor(BridgeCodec::kZlib);
+  std::string message = Compressible(4096);
+  std::vector<char> out;
+  ASSERT_TRUE(compressor.Compress(message.data(), message.size(), out));
+  std::string decompressed(message.size() + 1, '\0');
+
+  // The message size doesn't match what the frame holds, either way.
+  ASSERT_FALSE(subspace::BridgeDecompress(BridgeCodec::kZlib, out.data(),
+                                          out.size(), decompressed.data(),
+                                          message.size() - 1)
+                   .ok());
+  ASSERT_FALSE(subspace::BridgeDecompress(BridgeCodec::kZlib, out.data(),
+                                          out.size(), decompressed.data(),
+                                          message.size() + 1)
+                   .ok());
+
+  // Truncated frame.
+  ASSERT_FALSE(subspace::BridgeDecompress(BridgeCodec::kZlib, out.data(),
+                                          out.size() / 2, decompressed.data(),
+                                          message.size())
+                   .ok());
+
+  // Corrupt frame.
+  std::vector<char> corrupt = out;
+  for (size_t i = 2; i < corrupt.size(); i += 7) {
+    corrupt[i] ^= 0x5a;
+  }
+  ASSERT_FALSE(subspace::BridgeDecompress(BridgeCodec::kZlib, corrupt.data(),
+                                          corrupt.size(), decompressed.data(),
+                                          message.size())
+                   .ok());
+
+  // Not compressed at all.
+  ASSERT_FALSE(subspace::BridgeDecompress(BridgeCodec::kZlib, message.data(),
+                                          message.size(), decompressed.data(),
+                                          message.size())
+                   .ok());
+
+  // Not a codec that compresses.
+  ASSERT_FALSE(subspace::BridgeDecompress(BridgeCodec::kNone, out.data(),
+                                          out.size(), decompressed.data(),
+                                          message.size())
+                   .ok());
+}
+
+TEST(BridgeCodecTest, MessageSize) {
+  // An uncompressed message is the rest of the frame.
+  absl::StatusOr<int32_t> size =
+      subspace::BridgeMessageSize(false, 1234, 100, 256);
+  ASSERT_TRUE(size.ok()) << size.status();
+  ASSERT_EQ(100, *size);
+
+  // A compressed one is the size in the prefix.
+  size = subspace::BridgeMessageSize(true, 200, 100, 256);
+  ASSERT_TRUE(size.ok()) << size.status();
+  ASSERT_EQ(200, *size);
+  size = subspace::BridgeMessageSize(true, 256, 100, 256);
+  ASSERT_TRUE(size.ok()) << size.status();
+  ASSERT_EQ(256, *size);
+
+  // Sizes that don't fit in a slot.
+  ASSERT_FALSE(subspace::BridgeMessageSize(true, 257, 100, 256).ok());
+  ASSERT_FALSE(subspace::BridgeMessageSize(true, 0x7fffffff, 100, 256).ok());
+  ASSERT_FALSE(subspace::BridgeMessageSize(true, -1, 100, 256).ok());
+  ASSERT_FALSE(subspace::BridgeMessageSize(false, 0, 300, 256).ok());
+}
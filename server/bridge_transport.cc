@@ -0,0 +1,292 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "server/bridge_transport.h"
+#include "absl/strings/str_format.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace subspace {
+
+// Wait for the fd to be ready, yielding the coroutine if there is one.
+static void WaitForFd(int fd, short events, co::Coroutine *c) {
+  if (c != nullptr) {
+    c->Wait(fd, events);
+  } else {
+    struct pollfd pfd = {fd, events, 0};
+    ::poll(&pfd, 1, -1);
+  }
+}
+
+static bool FdWritable(int fd) {
+  struct pollfd pfd = {fd, POLLOUT, 0};
+  return ::poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT) != 0;
+}
+
+// Send all the data described by the iovecs to the socket using as few
+// sendmsg calls as possible.  The socket is nonblocking so if the TCP
+// buffers are full we yield the coroutine until POLLOUT.
+absl::Status TCPBridgeTransmitter::Send(std::vector<struct iovec> &iovecs,
+                                        co::Coroutine *c) {
+  int fd = socket_.GetFileDescriptor().Fd();
+  size_t first = 0;
+  while (first < iovecs.size()) {
+    struct msghdr msg = {};
+    msg.msg_iov = &iovecs[first];
+    msg.msg_iovlen = iovecs.size() - first;
+#if defined(__linux__)
+    ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
+    ssize_t n = ::sendmsg(fd, &msg, 0);
+#endif
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        WaitForFd(fd, POLLOUT, c);
+        continue;
+      }
+      return absl::InternalError(
+          absl::StrFormat("Failed to send to bridge: %s", strerror(errno)));
+    }
+    // Skip over the iovecs that have been fully sent and adjust the
+    // first one that was partially sent.
+    size_t sent = static_cast<size_t>(n);
+    while (first < iovecs.size() && sent >= iovecs[first].iov_len) {
+      sent -= iovecs[first].iov_len;
+      first++;
+    }
+    if (sent > 0) {
+      iovecs[first].iov_base =
+          static_cast<char *>(iovecs[first].iov_base) + sent;
+      iovecs[first].iov_len -= sent;
+    }
+  }
+  return absl::OkStatus();
+}
+
+bool TCPBridgeTransmitter::Ready() const {
+  return FdWritable(socket_.GetFileDescriptor().Fd());
+}
+
+// The receiver's socket is blocking so we use MSG_DONTWAIT to avoid
+// blocking the server if there is nothing to read.
+absl::StatusOr<size_t> TCPBridgeReceiver::Receive(char *buffer, size_t buflen,
+                                                  co::Coroutine *c) {
+  int fd = socket_.GetFileDescriptor().Fd();
+  for (;;) {
+    ssize_t n = ::recv(fd, buffer, buflen, MSG_DONTWAIT);
+    if (n == 0) {
+      return absl::InternalError("Bridge connection closed");
+    }
+    if (n > 0) {
+      return static_cast<size_t>(n);
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return absl::InternalError(absl::StrFormat(
+          "Failed to receive from bridge: %s", strerror(errno)));
+    }
+    WaitForFd(fd, POLLIN, c);
+  }
+}
+
+// Nothing but the Subscribed message is sent over the control connection
+// so if it's readable it has been closed.
+static bool ControlClosed(toolbelt::TCPSocket &control) {
+  char c;
+  ssize_t n = ::recv(control.GetFileDescriptor().Fd(), &c, 1,
+                     MSG_DONTWAIT | MSG_PEEK);
+  return n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR);
+}
+
+static void EncodeDatagramHeader(uint64_t sequence, uint32_t num_frames,
+                                 char *header) {
+  uint32_t words[3] = {htonl(static_cast<uint32_t>(sequence >> 32)),
+                       htonl(static_cast<uint32_t>(sequence)),
+                       htonl(num_frames)};
+  memcpy(header, words, kBridgeDatagramHeaderSize);
+}
+
+static void DecodeDatagramHeader(const char *header, uint64_t &sequence,
+                                 uint32_t &num_frames) {
+  uint32_t words[3];
+  memcpy(words, header, kBridgeDatagramHeaderSize);
+  sequence = (uint64_t(ntohl(words[0])) << 32) | ntohl(words[1]);
+  num_frames = ntohl(words[2]);
+}
+
+absl::Status UDPBridgeTransmitter::Open(const toolbelt::InetAddress &receiver) {
+  int fd = socket_.GetFileDescriptor().Fd();
+  // A connected UDP socket reports an error if no one is listening.
+  if (::connect(fd, reinterpret_cast<const struct sockaddr *>(
+                        &receiver.GetAddress()),
+                receiver.GetLength()) == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to connect bridge datagram socket to %s: %s",
+                        receiver.ToString(), strerror(errno)));
+  }
+  if (absl::Status status = socket_.SetNonBlocking(); !status.ok()) {
+    return status;
+  }
+  return absl::OkStatus();
+}
+
+// Pack the frames into as few datagrams as possible.
+absl::Status UDPBridgeTransmitter::Send(std::vector<struct iovec> &iovecs,
+                                        co::Coroutine *c) {
+  if (ControlClosed(control_)) {
+    return absl::InternalError("Bridge connection closed");
+  }
+  char header[kBridgeDatagramHeaderSize];
+  datagram_.clear();
+  datagram_.push_back({header, sizeof(header)});
+  size_t size = sizeof(header);
+  uint64_t first_sequence = sequence_;
+
+  auto flush = [&]() -> absl::Status {
+    if (datagram_.size() == 1) {
+      return absl::OkStatus();
+    }
+    EncodeDatagramHeader(first_sequence, (datagram_.size() - 1) / 2, header);
+    absl::Status status = SendDatagram(datagram_, c);
+    datagram_.resize(1);
+    size = sizeof(header);
+    first_sequence = sequence_;
+    return status;
+  };
+
+  for (size_t i = 0; i + 1 < iovecs.size(); i += 2) {
+    size_t frame_size = iovecs[i].iov_len + iovecs[i + 1].iov_len;
+    if (sizeof(header) + frame_size > kMaxBridgeDatagramSize) {
+      // Too big to send.  The receiver will see the gap in the sequence
+      // numbers.
+      if (absl::Status status = flush(); !status.ok()) {
+        return status;
+      }
+      sequence_++;
+      first_sequence = sequence_;
+      continue;
+    }
+    if (size + frame_size > kMaxBridgeDatagramSize) {
+      if (absl::Status status = flush(); !status.ok()) {
+        return status;
+      }
+    }
+    datagram_.push_back(iovecs[i]);
+    datagram_.push_back(iovecs[i + 1]);
+    size += frame_size;
+    sequence_++;
+  }
+  return flush();
+}
+
+bool UDPBridgeTransmitter::Ready() const {
+  return FdWritable(socket_.GetFileDescriptor().Fd());
+}
+
+absl::Status
+UDPBridgeTransmitter::SendDatagram(std::vector<struct iovec> &iovecs,
+                                   co::Coroutine *c) {
+  int fd = socket_.GetFileDescriptor().Fd();
+  struct msghdr msg = {};
+  msg.msg_iov = iovecs.data();
+  msg.msg_iovlen = iovecs.size();
+  for (;;) {
+    ssize_t n = ::sendmsg(fd, &msg, 0);
+    if (n >= 0) {
+      return absl::OkStatus();
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      WaitForFd(fd, POLLOUT, c);
+      continue;
+    }
+    return absl::InternalError(absl::StrFormat(
+        "Failed to send datagram to bridge: %s", strerror(errno)));
+  }
+}
+
+absl::StatusOr<toolbelt::InetAddress>
+BindBridgeDatagramSocket(toolbelt::UDPSocket &socket,
+                         const toolbelt::InetAddress &addr) {
+  toolbelt::InetAddress bind_addr = addr;
+  bind_addr.SetPort(0);
+  if (absl::Status status = socket.Bind(bind_addr); !status.ok()) {
+    return status;
+  }
+  struct sockaddr_in bound;
+  socklen_t length = sizeof(bound);
+  if (::getsockname(socket.GetFileDescriptor().Fd(),
+                    reinterpret_cast<struct sockaddr *>(&bound),
+                    &length) == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Failed to get bridge datagram socket address: %s", strerror(errno)));
+  }
+  bind_addr.SetPort(ntohs(bound.sin_port));
+  return bind_addr;
+}
+
+absl::StatusOr<size_t> UDPBridgeReceiver::Receive(char *buffer, size_t buflen,
+                                                  co::Coroutine *c) {
+  int fd = socket_.GetFileDescriptor().Fd();
+  int control_fd = control_.GetFileDescriptor().Fd();
+  char header[kBridgeDatagramHeaderSize];
+  for (;;) {
+    struct iovec iov[2] = {{header, sizeof(header)}, {buffer, buflen}};
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ssize_t n = ::recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (n >= static_cast<ssize_t>(sizeof(header))) {
+      uint64_t sequence;
+      uint32_t num_frames;
+      DecodeDatagramHeader(header, sequence, num_frames);
+      if (sequence < next_sequence_) {
+        // Late arrival.  Its messages are older than ones we have already
+        // published.
+        continue;
+      }
+      num_dropped_ += sequence - next_sequence_;
+      next_sequence_ = sequence + num_frames;
+      if ((msg.msg_flags & MSG_TRUNC) != 0) {
+        num_dropped_ += num_frames;
+        continue;
+      }
+      return static_cast<size_t>(n) - sizeof(header);
+    }
+    if (n >= 0) {
+      // Runt datagram, ignore it.
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return absl::InternalError(absl::StrFormat(
+          "Failed to receive datagram from bridge: %s", strerror(errno)));
+    }
+    if (ControlClosed(control_)) {
+      return absl::InternalError("Bridge connection closed");
+    }
+    // Wait for a datagram or for the control connection to close.
+    if (c != nullptr) {
+      c->Wait({fd, control_fd}, POLLIN);
+    } else {
+      struct pollfd pfds[2] = {{fd, POLLIN, 0}, {control_fd, POLLIN, 0}};
+      ::poll(pfds, 2, -1);
+    }
+  }
+}
+
+} // namespace subspace
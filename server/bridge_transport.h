@@ -0,0 +1,147 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __SERVER_BRIDGE_TRANSPORT_H
+#define __SERVER_BRIDGE_TRANSPORT_H
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "coroutine.h"
+#include "toolbelt/sockets.h"
+#include <cstdint>
+#include <sys/uio.h>
+#include <vector>
+
+namespace subspace {
+
+// The transports that carry messages across a bridge between servers.
+//
+// A bridge always starts with a TCP connection from the transmitter to the
+// receiver.  It carries the Subscribed message and the bridge lasts as long
+// as the connection.  The messages are sent as frames, each a 4 byte length
+// in network byte order followed by the data.  By default the frames are
+// sent over the TCP connection too.  For unreliable channels the receiver
+// can ask for them to be sent over UDP instead so that a lost packet drops
+// a few messages rather than holding up all the ones behind it.
+
+// Sends frames across a bridge.
+class BridgeTransmitter {
+public:
+  virtual ~BridgeTransmitter() = default;
+
+  // Send the frames in the iovecs, two iovecs (length and data) per frame.
+  // The iovecs are modified as they are sent.  If the transport can't take
+  // any more data the coroutine yields until it can.
+  virtual absl::Status Send(std::vector<struct iovec> &iovecs,
+                            co::Coroutine *c) = 0;
+
+  // True if the transport can take more data now.  Messages for an
+  // unreliable bridge that isn't ready are skipped rather than holding up
+  // the other bridges for the channel.
+  virtual bool Ready() const = 0;
+};
+
+// Receives frames from a bridge.
+class BridgeReceiver {
+public:
+  virtual ~BridgeReceiver() = default;
+
+  // Receive whatever data is available, up to buflen bytes, waiting for
+  // some to arrive if there is none.  A closed bridge is an error.
+  virtual absl::StatusOr<size_t> Receive(char *buffer, size_t buflen,
+                                         co::Coroutine *c) = 0;
+
+  // The number of messages the transport knows were lost.
+  virtual int64_t NumDropped() const { return 0; }
+};
+
+// Frames sent over the bridge's TCP connection.
+class TCPBridgeTransmitter : public BridgeTransmitter {
+public:
+  // The socket must be nonblocking.
+  explicit TCPBridgeTransmitter(toolbelt::TCPSocket &socket)
+      : socket_(socket) {}
+
+  absl::Status Send(std::vector<struct iovec> &iovecs,
+                    co::Coroutine *c) override;
+  bool Ready() const override;
+
+private:
+  toolbelt::TCPSocket &socket_;
+};
+
+class TCPBridgeReceiver : public BridgeReceiver {
+public:
+  explicit TCPBridgeReceiver(toolbelt::TCPSocket &socket) : socket_(socket) {}
+
+  absl::StatusOr<size_t> Receive(char *buffer, size_t buflen,
+                                 co::Coroutine *c) override;
+
+private:
+  toolbelt::TCPSocket &socket_;
+};
+
+// Frames sent as UDP datagrams.  Each datagram holds whole frames after a
+// header with the sequence number of the first frame and the number of
+// frames.  The receiver uses the sequence numbers to count the lost
+// messages and drops datagrams that arrive out of order.
+//
+// The maximum size of a datagram, including the header.  Frames that
+// don't fit in a datagram are not sent.
+constexpr size_t kMaxBridgeDatagramSize = 65000;
+constexpr size_t kBridgeDatagramHeaderSize =
+    sizeof(uint64_t) + sizeof(uint32_t);
+
+class UDPBridgeTransmitter : public BridgeTransmitter {
+public:
+  // The control socket is the bridge's TCP connection.  When the receiver
+  // closes it, Send fails.
+  explicit UDPBridgeTransmitter(toolbelt::TCPSocket &control)
+      : control_(control) {}
+
+  // Connect the datagram socket to the receiver's address.
+  absl::Status Open(const toolbelt::InetAddress &receiver);
+
+  absl::Status Send(std::vector<struct iovec> &iovecs,
+                    co::Coroutine *c) override;
+  bool Ready() const override;
+
+private:
+  absl::Status SendDatagram(std::vector<struct iovec> &iovecs,
+                            co::Coroutine *c);
+
+  toolbelt::TCPSocket &control_;
+  toolbelt::UDPSocket socket_;
+  uint64_t sequence_ = 0;
+  std::vector<struct iovec> datagram_;
+};
+
+// Bind a socket for a UDPBridgeReceiver to a free port at the given IP
+// address and return the address it's bound to.
+absl::StatusOr<toolbelt::InetAddress>
+BindBridgeDatagramSocket(toolbelt::UDPSocket &socket,
+                         const toolbelt::InetAddress &addr);
+
+class UDPBridgeReceiver : public BridgeReceiver {
+public:
+  // The socket is bound to the address the transmitter sends to.  The
+  // control socket is the bridge's TCP connection.
+  UDPBridgeReceiver(toolbelt::UDPSocket &socket, toolbelt::TCPSocket &control)
+      : socket_(socket), control_(control) {}
+
+  absl::StatusOr<size_t> Receive(char *buffer, size_t buflen,
+                                 co::Coroutine *c) override;
+
+  int64_t NumDropped() const override { return num_dropped_; }
+
+private:
+  toolbelt::UDPSocket &socket_;
+  toolbelt::TCPSocket &control_;
+  uint64_t next_sequence_ = 0;
+  int64_t num_dropped_ = 0;
+};
+
+} // namespace subspace
+
+#endif // __SERVER_BRIDGE_TRANSPORT_H
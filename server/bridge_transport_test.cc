@@ -0,0 +1,284 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "server/bridge_transport.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+using BridgeFrames = std::vector<struct iovec>;
+
+// A bridge's TCP connection over loopback.
+class BridgeTransportTest : public ::testing::Test {
+public:
+  void SetUp() override {
+    toolbelt::TCPSocket listener;
+    ASSERT_TRUE(
+        listener.Bind(toolbelt::InetAddress("localhost", 0), true).ok());
+    ASSERT_TRUE(transmitter_socket_.Connect(listener.BoundAddress()).ok());
+    absl::StatusOr<toolbelt::TCPSocket> s = listener.Accept();
+    ASSERT_TRUE(s.ok());
+    receiver_socket_ = std::move(*s);
+    ASSERT_TRUE(transmitter_socket_.SetNonBlocking().ok());
+  }
+
+  // Add the iovecs for a frame holding the given data.
+  void AddFrame(BridgeFrames &iovecs, std::string &data) {
+    lengths_.push_back(htonl(static_cast<uint32_t>(data.size())));
+    iovecs.push_back({&lengths_.back(), sizeof(uint32_t)});
+    iovecs.push_back({data.data(), data.size()});
+  }
+
+  // Receive exactly length bytes from a stream receiver.
+  std::string ReceiveAll(subspace::BridgeReceiver &receiver, size_t length) {
+    std::string data(length, '\0');
+    size_t offset = 0;
+    while (offset < length) {
+      absl::StatusOr<size_t> n =
+          receiver.Receive(&data[offset], length - offset, nullptr);
+      EXPECT_TRUE(n.ok()) << n.status();
+      if (!n.ok()) {
+        break;
+      }
+      offset += *n;
+    }
+    return data;
+  }
+
+  // A frame as it appears on the wire.
+  static std::string Frame(const std::string &data) {
+    uint32_t length = htonl(static_cast<uint32_t>(data.size()));
+    return std::string(reinterpret_cast<char *>(&length), sizeof(length)) +
+           data;
+  }
+
+  static std::string Datagram(uint64_t sequence, uint32_t num_frames,
+                              const std::string &frames) {
+    uint32_t words[3] = {htonl(static_cast<uint32_t>(sequence >> 32)),
+                         htonl(static_cast<uint32_t>(sequence)),
+                         htonl(num_frames)};
+    return std::string(reinterpret_cast<char *>(words), sizeof(words)) +
+           frames;
+  }
+
+protected:
+  toolbelt::TCPSocket transmitter_socket_;
+  toolbelt::TCPSocket receiver_socket_;
+  // The frame lengths that the iovecs point to.
+  std::deque<uint32_t> lengths_;
+};
+
+TEST_F(BridgeTransportTest, TCPPartialWrite) {
+  // Shrink the socket buffers so that the frames can't all be sent at once
+  // and sendmsg stops part way through an iovec.
+  int bufsize = 16 * 1024;
+  ASSERT_EQ(0, setsockopt(transmitter_socket_.GetFileDescriptor().Fd(),
+                          SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)));
+  ASSERT_EQ(0, setsockopt(receiver_socket_.GetFileDescriptor().Fd(),
+                          SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)));
+
+  constexpr int kNumFrames = 8;
+  std::vector<std::string> messages;
+  std::string expected;
+  for (int i = 0; i < kNumFrames; i++) {
+    std::string data(65537 + i * 1001, '\0');
+    for (size_t j = 0; j < data.size(); j++) {
+      data[j] = static_cast<char>(i * 31 + j);
+    }
+    messages.push_back(std::move(data));
+  }
+  BridgeFrames iovecs;
+  for (auto &data : messages) {
+    AddFrame(iovecs, data);
+    expected += Frame(data);
+  }
+
+  subspace::TCPBridgeTransmitter transmitter(transmitter_socket_);
+  subspace::TCPBridgeReceiver receiver(receiver_socket_);
+  ASSERT_TRUE(transmitter.Ready());
+
+  absl::Status send_status;
+  std::thread sender(
+      [&]() { send_status = transmitter.Send(iovecs, nullptr); });
+
+  // Nothing is being read so the sender fills the buffers and waits.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(transmitter.Ready());
+
+  std::string received = ReceiveAll(receiver, expected.size());
+  sender.join();
+  ASSERT_TRUE(send_status.ok()) << send_status;
+  ASSERT_EQ(expected.size(), received.size());
+  ASSERT_TRUE(expected == received);
+  EXPECT_TRUE(transmitter.Ready());
+}
+
+TEST_F(BridgeTransportTest, TCPClosed) {
+  subspace::TCPBridgeReceiver receiver(receiver_socket_);
+  transmitter_socket_.Close();
+  char buffer[16];
+  absl::StatusOr<size_t> n = receiver.Receive(buffer, sizeof(buffer), nullptr);
+  ASSERT_FALSE(n.ok());
+}
+
+TEST_F(BridgeTransportTest, UDPPacking) {
+  toolbelt::UDPSocket receiver_datagrams;
+  absl::StatusOr<toolbelt::InetAddress> addr =
+      subspace::BindBridgeDatagramSocket(receiver_datagrams,
+                                         toolbelt::InetAddress("localhost", 0));
+  ASSERT_TRUE(addr.ok()) << addr.status();
+
+  subspace::UDPBridgeTransmitter transmitter(transmitter_socket_);
+  ASSERT_TRUE(transmitter.Open(*addr).ok());
+  ASSERT_TRUE(transmitter.Ready());
+
+  std::string one = "one";
+  std::string two = "two";
+  std::string three = "three";
+  BridgeFrames iovecs;
+  AddFrame(iovecs, one);
+  AddFrame(iovecs, two);
+  AddFrame(iovecs, three);
+  ASSERT_TRUE(transmitter.Send(iovecs, nullptr).ok());
+
+  // All three frames are in one datagram after a header with the
+  // sequence number of the first frame.
+  char buffer[subspace::kMaxBridgeDatagramSize];
+  ssize_t n = ::recv(receiver_datagrams.GetFileDescriptor().Fd(), buffer,
+                     sizeof(buffer), 0);
+  ASSERT_EQ(Datagram(0, 3, Frame(one) + Frame(two) + Frame(three)),
+            std::string(buffer, n));
+
+  // The next datagram carries on from the sequence number after the last
+  // frame.
+  std::string four = "four";
+  iovecs.clear();
+  AddFrame(iovecs, four);
+  ASSERT_TRUE(transmitter.Send(iovecs, nullptr).ok());
+  n = ::recv(receiver_datagrams.GetFileDescriptor().Fd(), buffer,
+             sizeof(buffer), 0);
+  ASSERT_EQ(Datagram(3, 1, Frame(four)), std::string(buffer, n));
+}
+
+TEST_F(BridgeTransportTest, UDPLargeFrames) {
+  toolbelt::UDPSocket receiver_datagrams;
+  absl::StatusOr<toolbelt::InetAddress> addr =
+      subspace::BindBridgeDatagramSocket(receiver_datagrams,
+                                         toolbelt::InetAddress("localhost", 0));
+  ASSERT_TRUE(addr.ok()) << addr.status();
+  subspace::UDPBridgeTransmitter transmitter(transmitter_socket_);
+  ASSERT_TRUE(transmitter.Open(*addr).ok());
+  subspace::UDPBridgeReceiver receiver(receiver_datagrams, receiver_socket_);
+
+  // Two frames that only fit in a datagram each, with one between them
+  // that is too big for a datagram at all.
+  std::string first(40000, 'a');
+  std::string too_big(subspace::kMaxBridgeDatagramSize, 'b');
+  std::string second(40000, 'c');
+  std::string third(100, 'd');
+  BridgeFrames iovecs;
+  AddFrame(iovecs, first);
+  AddFrame(iovecs, too_big);
+  AddFrame(iovecs, second);
+  AddFrame(iovecs, third);
+  ASSERT_TRUE(transmitter.Send(iovecs, nullptr).ok());
+
+  std::vector<char> buffer(subspace::kMaxBridgeDatagramSize);
+  absl::StatusOr<size_t> n =
+      receiver.Receive(buffer.data(), buffer.size(), nullptr);
+  ASSERT_TRUE(n.ok()) << n.status();
+  ASSERT_EQ(Frame(first), std::string(buffer.data(), *n));
+  ASSERT_EQ(0, receiver.NumDropped());
+
+  // The frame that wasn't sent shows up as a gap in the sequence numbers.
+  n = receiver.Receive(buffer.data(), buffer.size(), nullptr);
+  ASSERT_TRUE(n.ok()) << n.status();
+  ASSERT_EQ(Frame(second) + Frame(third), std::string(buffer.data(), *n));
+  ASSERT_EQ(1, receiver.NumDropped());
+}
+
+TEST_F(BridgeTransportTest, UDPDroppedAndReordered) {
+  toolbelt::UDPSocket receiver_datagrams;
+  absl::StatusOr<toolbelt::InetAddress> addr =
+      subspace::BindBridgeDatagramSocket(receiver_datagrams,
+                                         toolbelt::InetAddress("localhost", 0));
+  ASSERT_TRUE(addr.ok()) << addr.status();
+  subspace::UDPBridgeReceiver receiver(receiver_datagrams, receiver_socket_);
+
+  // Send the datagrams by hand so that we can lose and reorder them.
+  toolbelt::UDPSocket sender;
+  auto send = [&](const std::string &datagram) {
+    ASSERT_TRUE(
+        sender.SendTo(*addr, datagram.data(), datagram.size(), nullptr).ok());
+  };
+  send(Datagram(0, 2, Frame("m0") + Frame("m1")));
+  // Datagram with messages 2 and 3 is lost, and the one with 4 arrives
+  // after the one with 5 and 6.
+  send(Datagram(5, 2, Frame("m5") + Frame("m6")));
+  send(Datagram(4, 1, Frame("m4")));
+  send(Datagram(7, 1, Frame("m7")));
+  // A runt that is too short for a header.
+  send(std::string("xx"));
+  send(Datagram(8, 1, Frame("m8")));
+
+  char buffer[256];
+  auto receive = [&]() -> std::string {
+    absl::StatusOr<size_t> n =
+        receiver.Receive(buffer, sizeof(buffer), nullptr);
+    EXPECT_TRUE(n.ok()) << n.status();
+    return n.ok() ? std::string(buffer, *n) : "";
+  };
+  ASSERT_EQ(Frame("m0") + Frame("m1"), receive());
+  ASSERT_EQ(0, receiver.NumDropped());
+
+  ASSERT_EQ(Frame("m5") + Frame("m6"), receive());
+  ASSERT_EQ(3, receiver.NumDropped());
+
+  // The late datagram is dropped without counting it again.
+  ASSERT_EQ(Frame("m7"), receive());
+  ASSERT_EQ(3, receiver.NumDropped());
+  ASSERT_EQ(Frame("m8"), receive());
+  ASSERT_EQ(3, receiver.NumDropped());
+}
+
+TEST_F(BridgeTransportTest, UDPReceiverSeesClose) {
+  toolbelt::UDPSocket receiver_datagrams;
+  absl::StatusOr<toolbelt::InetAddress> addr =
+      subspace::BindBridgeDatagramSocket(receiver_datagrams,
+                                         toolbelt::InetAddress("localhost", 0));
+  ASSERT_TRUE(addr.ok()) << addr.status();
+  subspace::UDPBridgeReceiver receiver(receiver_datagrams, receiver_socket_);
+
+  // The receiver waiting for a datagram sees the bridge close.
+  transmitter_socket_.Close();
+  char buffer[16];
+  ASSERT_FALSE(receiver.Receive(buffer, sizeof(buffer), nullptr).ok());
+}
+
+TEST_F(BridgeTransportTest, UDPTransmitterSeesClose) {
+  toolbelt::UDPSocket receiver_datagrams;
+  absl::StatusOr<toolbelt::InetAddress> addr =
+      subspace::BindBridgeDatagramSocket(receiver_datagrams,
+                                         toolbelt::InetAddress("localhost", 0));
+  ASSERT_TRUE(addr.ok()) << addr.status();
+  subspace::UDPBridgeTransmitter transmitter(transmitter_socket_);
+  ASSERT_TRUE(transmitter.Open(*addr).ok());
+
+  std::string data = "data";
+  BridgeFrames iovecs;
+  AddFrame(iovecs, data);
+  ASSERT_TRUE(transmitter.Send(iovecs, nullptr).ok());
+
+  receiver_socket_.Close();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  iovecs.clear();
+  AddFrame(iovecs, data);
+  ASSERT_FALSE(transmitter.Send(iovecs, nullptr).ok());
+}
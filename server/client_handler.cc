@@ -5,6 +5,8 @@
 #include "server/client_handler.h"
 #include "absl/strings/str_format.h"
 #include "server/server.h"
+#include "toolbelt/clock.h"
+#include <algorithm>
 
 namespace subspace {
 
@@ -57,10 +59,48 @@ void ClientHandler::Run(co::Coroutine *c) {
   }
 }
 
+bool ClientHandler::ClientHasDisconnected() const {
+  struct pollfd fd = {socket_.GetFileDescriptor().Fd(), POLLIN, 0};
+  return ::poll(&fd, 1, 0) == 1 && (fd.revents & (POLLHUP | POLLERR)) != 0;
+}
+
+// The channel a request is for, or nullptr if it isn't for a channel.
+static const std::string *RequestChannelName(const subspace::Request &req) {
+  switch (req.request_case()) {
+  case subspace::Request::kCreatePublisher:
+    return &req.create_publisher().channel_name();
+  case subspace::Request::kCreateSubscriber:
+    return &req.create_subscriber().channel_name();
+  case subspace::Request::kGetTriggers:
+    return &req.get_triggers().channel_name();
+  case subspace::Request::kRemovePublisher:
+    return &req.remove_publisher().channel_name();
+  case subspace::Request::kRemoveSubscriber:
+    return &req.remove_subscriber().channel_name();
+  case subspace::Request::kResize:
+    return &req.resize().channel_name();
+  case subspace::Request::kGetBuffers:
+    return &req.get_buffers().channel_name();
+  default:
+    return nullptr;
+  }
+}
+
 absl::Status
 ClientHandler::HandleMessage(const subspace::Request &req,
                              subspace::Response &resp,
                              std::vector<toolbelt::FileDescriptor> &fds) {
+  // Hold the lock for the channel's shard while handling the request.
+  // None of the handlers yield the coroutine.
+  std::unique_lock<std::mutex> lock;
+  if (req.request_case() == subspace::Request::kCreatePublisher ||
+      req.request_case() == subspace::Request::kCreateSubscriber) {
+    server_->RemoveDisconnectedClients(this);
+  }
+  if (const std::string *channel_name = RequestChannelName(req);
+      channel_name != nullptr) {
+    lock = server_->LockShard(*channel_name);
+  }
   switch (req.request_case()) {
   case subspace::Request::kInit:
     HandleInit(req.init(), resp.mutable_init(), fds);
@@ -115,10 +155,18 @@ void ClientHandler::HandleCreatePublisher(
     const subspace::CreatePublisherRequest &req,
     subspace::CreatePublisherResponse *response,
     std::vector<toolbelt::FileDescriptor> &fds) {
+  AllocationOptions options;
+  options.lock_free = req.is_lock_free();
+  options.huge_pages = req.use_huge_pages();
+  options.prefault = req.prefault();
+  options.numa_node = std::max(-1, req.numa_node());
+  options.size_classes = req.size_classes();
+
   ServerChannel *channel = server_->FindChannel(req.channel_name());
   if (channel == nullptr) {
-    absl::StatusOr<ServerChannel *> ch = server_->CreateChannel(
-        req.channel_name(), req.slot_size(), req.num_slots(), req.type());
+    absl::StatusOr<ServerChannel *> ch =
+        server_->CreateChannel(req.channel_name(), req.slot_size(),
+                               req.num_slots(), req.type(), options);
     if (!ch.ok()) {
       response->set_error(ch.status().ToString());
       return;
@@ -127,12 +175,18 @@ void ClientHandler::HandleCreatePublisher(
   } else if (channel->IsPlaceholder()) {
     // Channel exists, but it's just a placeholder.  Remap the memory now
     // that we know the slots.
-    absl::Status status =
-        server_->RemapChannel(channel, req.slot_size(), req.num_slots());
+    absl::Status status = server_->RemapChannel(channel, req.slot_size(),
+                                                req.num_slots(), options);
     if (!status.ok()) {
       response->set_error(status.ToString());
       return;
     }
+  } else if (req.num_slots() != channel->NumSlots()) {
+    // The publisher would map the channel with the wrong number of slots.
+    response->set_error(absl::StrFormat(
+        "Inconsistent number of slots for channel %s: it has %d, not %d",
+        req.channel_name(), channel->NumSlots(), req.num_slots()));
+    return;
   }
   // Check that the channel types match, if they are provided and
   // already set in the channel.
@@ -144,8 +198,12 @@ void ClientHandler::HandleCreatePublisher(
                         req.channel_name(), channel->Type(), req.type()));
     return;
   }
-  if (channel->Type().empty()) {
+  if (channel->Type().empty() && !req.type().empty()) {
     channel->SetType(req.type());
+    server_->SendChannelDirectory(req.channel_name());
+  }
+  if (channel->GetBridgeCodec() == BridgeCodec::kNone) {
+    channel->SetBridgeCodec(static_cast<BridgeCodec>(req.bridge_codec()));
   }
 
   // Check capacity of channel.
@@ -160,6 +218,21 @@ void ClientHandler::HandleCreatePublisher(
   int num_pubs, num_subs;
   channel->CountUsers(num_pubs, num_subs);
 
+  // The lock-free mode of a channel is fixed when its memory is allocated
+  // and a lock-free channel can only have one publisher.
+  if (channel->IsLockFree() != req.is_lock_free()) {
+    response->set_error(
+        absl::StrFormat("Inconsistent publisher parameters for channel %s: "
+                        "all publishers must be either lock-free or not",
+                        req.channel_name()));
+    return;
+  }
+  if (channel->IsLockFree() && num_pubs > 0) {
+    response->set_error(absl::StrFormat(
+        "Lock-free channel %s already has a publisher", req.channel_name()));
+    return;
+  }
+
   // Check consistency of publisher parameters.
   if (num_pubs > 0) {
     if (channel->SlotSize() != req.slot_size() ||
@@ -215,14 +288,14 @@ void ClientHandler::HandleCreatePublisher(
   fds.push_back(pub->GetTriggerFd());
 
   // Add subscriber trigger indexes.
-  std::vector<toolbelt::FileDescriptor> sub_fds =
-      channel->GetSubscriberTriggerFds();
-  for (auto &fd : sub_fds) {
-    response->add_sub_trigger_fd_indexes(fd_index++);
-    fds.push_back(fd);
+  for (auto &trigger : channel->GetSubscriberTriggerFds()) {
+    auto *info = response->add_sub_triggers();
+    info->set_serial(trigger.serial);
+    info->set_fd_index(fd_index++);
+    fds.push_back(trigger.fd);
   }
 
-  if (!req.is_bridge() && req.is_local()) {
+  if (!req.is_bridge() && !req.is_local()) {
     server_->SendAdvertise(req.channel_name(), req.is_reliable());
   }
   ChannelCounters &counters =
@@ -255,10 +328,15 @@ void ClientHandler::HandleCreateSubscriber(
                           req.channel_name(), channel->Type(), req.type()));
       return;
     }
-    if (channel->Type().empty()) {
+    if (channel->Type().empty() && !req.type().empty()) {
       channel->SetType(req.type());
+      server_->SendChannelDirectory(req.channel_name());
     }
   }
+  if (!req.is_bridge() && !channel->IsBridgeDecimated()) {
+    channel->SetBridgeDecimation(req.bridge_latest_only(),
+                                 req.bridge_max_rate());
+  }
 
   SubscriberUser *sub;
   if (req.subscriber_id() != -1) {
@@ -314,17 +392,21 @@ void ClientHandler::HandleCreateSubscriber(
   response->set_num_slots(channel->NumSlots());
 
   // Add publisher trigger indexes.
-  std::vector<toolbelt::FileDescriptor> pub_fds =
-      channel->GetReliablePublisherTriggerFds();
-  for (auto &fd : pub_fds) {
-    response->add_reliable_pub_trigger_fd_indexes(fd_index++);
-    fds.push_back(fd);
+  for (auto &trigger : channel->GetReliablePublisherTriggerFds()) {
+    auto *info = response->add_reliable_pub_triggers();
+    info->set_serial(trigger.serial);
+    info->set_fd_index(fd_index++);
+    fds.push_back(trigger.fd);
   }
 
-  if (!req.is_bridge()) {
+  if (!req.is_bridge() && !server_->SubscribeToKnownPublishers(channel)) {
     // Send Query to subscribe to public channels on other servers.
     server_->SendQuery(req.channel_name());
   }
+  if (req.channel_name() == Server::kChannelDirectoryName) {
+    // The new subscriber needs the whole directory to apply deltas to.
+    server_->SendChannelDirectorySnapshot();
+  }
   ChannelCounters &counters =
       channel->RecordUpdate(/*is_pub=*/false, /*add=*/true, req.is_reliable());
   response->set_num_pub_updates(counters.num_pub_updates);
@@ -341,18 +423,18 @@ void ClientHandler::HandleGetTriggers(
     return;
   }
   int index = 0;
-  std::vector<toolbelt::FileDescriptor> pub_fds =
-      channel->GetReliablePublisherTriggerFds();
-  for (auto &fd : pub_fds) {
-    response->add_reliable_pub_trigger_fd_indexes(index++);
-    fds.push_back(fd);
+  for (auto &trigger : channel->GetReliablePublisherTriggerFds()) {
+    auto *info = response->add_reliable_pub_triggers();
+    info->set_serial(trigger.serial);
+    info->set_fd_index(index++);
+    fds.push_back(trigger.fd);
   }
 
-  std::vector<toolbelt::FileDescriptor> sub_fds =
-      channel->GetSubscriberTriggerFds();
-  for (auto &fd : sub_fds) {
-    response->add_sub_trigger_fd_indexes(index++);
-    fds.push_back(fd);
+  for (auto &trigger : channel->GetSubscriberTriggerFds()) {
+    auto *info = response->add_sub_triggers();
+    info->set_serial(trigger.serial);
+    info->set_fd_index(index++);
+    fds.push_back(trigger.fd);
   }
 }
 
@@ -406,8 +488,11 @@ void ClientHandler::HandleResize(const subspace::ResizeRequest &req,
     return;
   }
   response->set_slot_size(channel->SlotSize());
+  server_->LockChannelBuffers(channel);
+  channel->ResetShrinkWindow(toolbelt::Now());
 
   channel->AddBuffer(req.new_slot_size(), std::move(*fd));
+  server_->SendChannelDirectory(req.channel_name());
   const SharedMemoryFds &channel_fds = channel->GetFds();
 
   int fd_index = 0;
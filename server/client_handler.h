@@ -27,7 +27,14 @@ public:
   // when the connection to the client is closed.
   void Run(co::Coroutine *c);
 
+  // Whether the client has closed its connection.  This is true as soon
+  // as the client has gone, which might be before Run sees it.  It can be
+  // called from any thread.
+  bool ClientHasDisconnected() const;
+
 private:
+  friend class Server;
+
   absl::Status HandleMessage(const subspace::Request &req,
                              subspace::Response &resp,
                              std::vector<toolbelt::FileDescriptor> &fds);
@@ -65,6 +72,9 @@ private:
   toolbelt::UnixSocket socket_;
   char buffer_[kMaxMessage];
   std::string client_name_;
+  // Set by Server::RemoveDisconnectedClients.  Protected by the server's
+  // handlers lock.
+  bool users_removed_ = false;
 };
 
 } // namespace subspace
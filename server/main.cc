@@ -4,9 +4,12 @@
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
 #include "server.h"
 #include <csignal>
 #include <string>
+#include <vector>
 #include <csignal>
 
 static co::CoroutineScheduler* g_scheduler;
@@ -24,6 +27,19 @@ ABSL_FLAG(int, peer_port, 6502, "Discovery peer UDP port");
 ABSL_FLAG(std::string, log_level, "info", "Log level");
 ABSL_FLAG(std::string, interface, "", "Discovery network interface");
 ABSL_FLAG(bool, local, false, "Use local computer only");
+ABSL_FLAG(int, buffer_shrink_secs, 0,
+          "Shrink the buffers of a resized channel after this many seconds "
+          "with no big messages (0 disables)");
+ABSL_FLAG(int, threads, 1,
+          "Number of threads for client handlers.  More than 1 also runs the "
+          "bridges on a thread of their own");
+ABSL_FLAG(bool, bridge_datagrams, false,
+          "Ask for unreliable channels bridged from other servers to be sent "
+          "over UDP");
+ABSL_FLAG(std::string, peers, "",
+          "Comma separated list of servers, as host[:port], to send discovery "
+          "messages to instead of broadcasting them.  The port defaults to "
+          "--peer_port");
 int main(int argc, char **argv) {
   absl::ParseCommandLine(argc, argv);
 
@@ -39,6 +55,27 @@ int main(int argc, char **argv) {
       absl::GetFlag(FLAGS_local));
   
   server.SetLogLevel(absl::GetFlag(FLAGS_log_level));
+  server.SetBufferShrinkWindow(
+      uint64_t(absl::GetFlag(FLAGS_buffer_shrink_secs)) * 1000000000ULL);
+  server.SetNumThreads(absl::GetFlag(FLAGS_threads));
+  server.SetBridgeDatagrams(absl::GetFlag(FLAGS_bridge_datagrams));
+
+  std::vector<toolbelt::InetAddress> peers;
+  for (absl::string_view peer :
+       absl::StrSplit(absl::GetFlag(FLAGS_peers), ',', absl::SkipEmpty())) {
+    std::string host(peer);
+    int port = absl::GetFlag(FLAGS_peer_port);
+    if (size_t colon = host.rfind(':'); colon != std::string::npos) {
+      if (!absl::SimpleAtoi(host.substr(colon + 1), &port)) {
+        fprintf(stderr, "Invalid port in peer %s\n", host.c_str());
+        exit(1);
+      }
+      host.resize(colon);
+    }
+    peers.emplace_back(host, port);
+  }
+  server.SetPeers(std::move(peers));
+
   absl::Status s = server.Run();
   if (!s.ok()) {
     fprintf(stderr, "Error running Subspace server: %s\n", s.ToString().c_str());
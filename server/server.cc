@@ -3,19 +3,28 @@
 // See LICENSE file for licensing information.
 
 #include "server/server.h"
+#include "absl/hash/hash.h"
 #include "absl/strings/str_format.h"
 #include "client/client.h"
+#include "common/trace.h"
 #include "proto/subspace.pb.h"
+#include "server/bridge_codec.h"
+#include "server/bridge_transport.h"
 #include "toolbelt/clock.h"
 #include "toolbelt/sockets.h"
+#include <algorithm>
 #include <cerrno>
+#include <cstring>
 #include <fcntl.h>
+#include <future>
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <setjmp.h>
 #include <stdio.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <vector>
 
@@ -25,7 +34,10 @@ namespace subspace {
 // for the given interface.  If the interface name is empty
 // choose the first interface that supports broadcast and
 // has an IP address assigned.
+// A server with static peers doesn't broadcast so it can use an interface
+// that doesn't support it, including loopback if it is asked for by name.
 static absl::Status FindIPAddresses(const std::string &interface,
+                                    bool need_broadcast,
                                     toolbelt::InetAddress &ipaddr,
                                     toolbelt::InetAddress &broadcast_addr,
                                     toolbelt::Logger &logger) {
@@ -52,10 +64,11 @@ static absl::Status FindIPAddresses(const std::string &interface,
     if (saddr == nullptr) {
       continue;
     }
-    if ((addr->ifa_flags & IFF_LOOPBACK) != 0) {
+    if ((addr->ifa_flags & IFF_LOOPBACK) != 0 &&
+        (need_broadcast || interface.empty())) {
       continue;
     }
-    if ((addr->ifa_flags & IFF_BROADCAST) == 0) {
+    if ((addr->ifa_flags & IFF_BROADCAST) == 0 && need_broadcast) {
       continue;
     }
     if (saddr->sa_family == AF_INET) {
@@ -93,7 +106,13 @@ Server::Server(co::CoroutineScheduler &scheduler,
                int disc_port, int peer_port, bool local, int notify_fd)
     : socket_name_(socket_name), interface_(interface),
       discovery_port_(disc_port), discovery_peer_port_(peer_port),
-      local_(local), notify_fd_(notify_fd), co_scheduler_(scheduler) {}
+      local_(local), notify_fd_(notify_fd), co_scheduler_(scheduler) {
+  for (int i = 0; i < kNumChannelShards; i++) {
+    shards_.push_back(std::make_unique<ChannelShard>());
+  }
+  threads_.push_back(std::make_unique<ServerThread>());
+  threads_[0]->scheduler = &co_scheduler_;
+}
 
 Server::~Server() {
   // Clear this before other data members get destroyed.
@@ -102,7 +121,115 @@ Server::~Server() {
 
 void Server::Stop() { co_scheduler_.Stop(); }
 
+ChannelShard &Server::ShardFor(const std::string &channel_name) {
+  return *shards_[absl::Hash<std::string>()(channel_name) % shards_.size()];
+}
+
+void Server::ForEachChannel(const std::function<void(ServerChannel *)> &fn) {
+  for (auto &shard : shards_) {
+    std::unique_lock<std::mutex> lock(shard->lock);
+    for (auto &[name, channel] : shard->channels) {
+      fn(channel.get());
+    }
+  }
+}
+
+void Server::Spawn(ServerThread &thread,
+                   std::function<void(co::Coroutine *)> fn, std::string name) {
+  if (std::this_thread::get_id() == thread.thread_id) {
+    thread.coroutines.insert(std::make_unique<co::Coroutine>(
+        *thread.scheduler, std::move(fn), name.c_str()));
+    return;
+  }
+  // Coroutines can only be created by the thread running the scheduler.
+  // Queue it for the thread's spawner coroutine.
+  {
+    std::unique_lock<std::mutex> lock(thread.lock);
+    thread.pending.emplace_back(std::move(name), std::move(fn));
+  }
+  thread.wakeup.Trigger();
+}
+
+void Server::SpawnerCoroutine(ServerThread &thread, co::Coroutine *c) {
+  std::vector<std::pair<std::string, std::function<void(co::Coroutine *)>>>
+      pending;
+  for (;;) {
+    c->Wait(thread.wakeup.GetPollFd().Fd(), POLLIN);
+    thread.wakeup.Clear();
+    {
+      std::unique_lock<std::mutex> lock(thread.lock);
+      pending.swap(thread.pending);
+    }
+    for (auto &[name, fn] : pending) {
+      thread.coroutines.insert(std::make_unique<co::Coroutine>(
+          *thread.scheduler, std::move(fn), name.c_str()));
+    }
+    pending.clear();
+  }
+}
+
+absl::Status Server::StartThreads() {
+  ServerThread &main = MainThread();
+  main.thread_id = std::this_thread::get_id();
+  // A multi-threaded server has num_threads_ - 1 more threads for the client
+  // handlers and one for the bridges.
+  int num_extra = num_threads_ == 1 ? 0 : num_threads_;
+  for (int i = 0; i < num_extra; i++) {
+    auto thread = std::make_unique<ServerThread>();
+    thread->owned_scheduler = std::make_unique<co::CoroutineScheduler>();
+    thread->scheduler = thread->owned_scheduler.get();
+    threads_.push_back(std::move(thread));
+  }
+  for (auto &thread : threads_) {
+    if (absl::Status s = thread->wakeup.Open(); !s.ok()) {
+      return absl::InternalError(absl::StrFormat(
+          "Failed to create thread wakeup trigger: %s", s.ToString()));
+    }
+    // Register a callback to be called when a coroutine completes.  The
+    // server keeps track of all coroutines created.
+    // This deletes them when they are done.
+    ServerThread *t = thread.get();
+    t->scheduler->SetCompletionCallback(
+        [t](co::Coroutine *c) { t->coroutines.erase(c); });
+    t->coroutines.insert(std::make_unique<co::Coroutine>(
+        *t->scheduler, [this, t](co::Coroutine *c) { SpawnerCoroutine(*t, c); },
+        "Spawner"));
+  }
+  // Each thread sets its own id and then waits until all the ids are set
+  // before running its scheduler.  Spawn reads the ids from any thread, so
+  // they can't be changing once any coroutines run.
+  std::promise<void> ids_set;
+  std::shared_future<void> all_ids_set = ids_set.get_future().share();
+  std::vector<std::future<void>> id_set;
+  for (size_t i = 1; i < threads_.size(); i++) {
+    ServerThread *t = threads_[i].get();
+    std::promise<void> started;
+    id_set.push_back(started.get_future());
+    t->thread = std::thread(
+        [t, all_ids_set](std::promise<void> started) {
+          t->thread_id = std::this_thread::get_id();
+          started.set_value();
+          all_ids_set.wait();
+          t->scheduler->Run();
+        },
+        std::move(started));
+  }
+  for (auto &f : id_set) {
+    f.wait();
+  }
+  ids_set.set_value();
+  return absl::OkStatus();
+}
+
+void Server::StopThreads() {
+  for (size_t i = 1; i < threads_.size(); i++) {
+    threads_[i]->scheduler->Stop();
+    threads_[i]->thread.join();
+  }
+}
+
 void Server::CloseHandler(ClientHandler *handler) {
+  std::unique_lock<std::mutex> lock(handlers_lock_);
   for (auto it = client_handlers_.begin(); it != client_handlers_.end(); it++) {
     if (it->get() == handler) {
       client_handlers_.erase(it);
@@ -172,8 +299,10 @@ absl::Status Server::Run() {
     hostname_ = hostname;
   }
 
-  // Make a unique server id to identify this server.
-  server_id_ = absl::StrFormat("%s.%d", hostname, getpid());
+  // Make a unique server id to identify this server.  Servers on the same
+  // host, even in the same process, have different discovery ports.
+  server_id_ =
+      absl::StrFormat("%s.%d.%d", hostname, getpid(), discovery_port_);
 
   if (!local_) {
     // Find the IP and broadcast IPv4 addresses based on the interface supplied
@@ -182,7 +311,8 @@ absl::Status Server::Run() {
     toolbelt::InetAddress ip_addr;
     toolbelt::InetAddress bcast_addr;
     if (absl::Status s =
-            FindIPAddresses(interface_, ip_addr, bcast_addr, logger_);
+            FindIPAddresses(interface_, peers_.empty(), ip_addr, bcast_addr,
+                            logger_);
         !s.ok()) {
       return s;
     }
@@ -210,47 +340,57 @@ absl::Status Server::Run() {
     }
   }
 
-  // Register a callback to be called when a coroutine completes.  The
-  // server keeps track of all coroutines created.
-  // This deletes them when they are done.
-  co_scheduler_.SetCompletionCallback(
-      [this](co::Coroutine *c) { coroutines_.erase(c); });
+  // Set up the schedulers and start the threads for a multi-threaded
+  // server.
+  if (absl::Status s = StartThreads(); !s.ok()) {
+    return s;
+  }
+  ServerThread &main = MainThread();
 
   // Start the listener coroutine.
-  coroutines_.insert(std::make_unique<co::Coroutine>(
-      co_scheduler_,
+  Spawn(
+      main,
       [this, &listen_socket](co::Coroutine *c) {
         ListenerCoroutine(listen_socket, c);
       },
-      "Listener UDS"));
+      "Listener UDS");
 
   // Start the channel directory coroutine.
-  coroutines_.insert(std::make_unique<co::Coroutine>(
-      co_scheduler_, [this](co::Coroutine *c) { ChannelDirectoryCoroutine(c); },
-      "Channel directory"));
+  Spawn(
+      main, [this](co::Coroutine *c) { ChannelDirectoryCoroutine(c); },
+      "Channel directory");
 
   // Start the channel stats coroutine.
-  coroutines_.insert(std::make_unique<co::Coroutine>(
-      co_scheduler_, [this](co::Coroutine *c) { StatisticsCoroutine(c); },
-      "Channel stats"));
+  Spawn(
+      main, [this](co::Coroutine *c) { StatisticsCoroutine(c); },
+      "Channel stats");
+
+  if (buffer_shrink_window_ > 0) {
+    // Start the coroutine that shrinks the buffers of idle resized channels.
+    Spawn(
+        main, [this](co::Coroutine *c) { BufferShrinkCoroutine(c); },
+        "Buffer shrinker");
+  }
 
   if (!local_) {
     // Start the discovery receiver coroutine.
-    coroutines_.insert(std::make_unique<co::Coroutine>(
-        co_scheduler_,
-        [this](co::Coroutine *c) { DiscoveryReceiverCoroutine(c); }));
+    Spawn(
+        main, [this](co::Coroutine *c) { DiscoveryReceiverCoroutine(c); },
+        "Discovery receiver");
 
     // Start the gratuitous Advertiser coroutine.  This sends Advertise messages
     // every 5 seconds.
-    coroutines_.insert(std::make_unique<co::Coroutine>(
-        co_scheduler_,
-        [this](co::Coroutine *c) { GratuitousAdvertiseCoroutine(c); },
-        "Gratuitous advertiser"));
+    Spawn(
+        main, [this](co::Coroutine *c) { GratuitousAdvertiseCoroutine(c); },
+        "Gratuitous advertiser");
   }
 
   // Run the coroutine main loop.
   co_scheduler_.Run();
 
+  // The other threads are stopped when the main scheduler stops.
+  StopThreads();
+
   // Notify listener that we're stopped.
   if (notify_fd_.Valid()) {
     int64_t val = kServerStopped;
@@ -266,21 +406,34 @@ Server::HandleIncomingConnection(toolbelt::UnixSocket &listen_socket,
   if (!s.ok()) {
     return s.status();
   }
-  client_handlers_.push_back(
-      std::make_unique<ClientHandler>(this, std::move(*s)));
-  ClientHandler *handler_ptr = client_handlers_.back().get();
+  ClientHandler *handler_ptr;
+  {
+    std::unique_lock<std::mutex> lock(handlers_lock_);
+    client_handlers_.push_back(
+        std::make_unique<ClientHandler>(this, std::move(*s)));
+    handler_ptr = client_handlers_.back().get();
+  }
 
-  coroutines_.insert(std::make_unique<co::Coroutine>(
-      co_scheduler_, [handler_ptr](co::Coroutine *c) { handler_ptr->Run(c); },
-      "Client handler"));
+  // The client handlers are spread over the scheduler threads.  The bridge
+  // thread (if any) is not used for them.
+  ServerThread &thread = *threads_[next_handler_thread_];
+  next_handler_thread_ = (next_handler_thread_ + 1) % num_threads_;
+  Spawn(
+      thread, [handler_ptr](co::Coroutine *c) { handler_ptr->Run(c); },
+      "Client handler");
 
   return absl::OkStatus();
 }
 
 absl::StatusOr<ServerChannel *>
 Server::CreateChannel(const std::string &channel_name, int slot_size,
-                      int num_slots, std::string type) {
-  absl::StatusOr<int> channel_id = channel_ids_.Allocate("channel");
+                      int num_slots, std::string type,
+                      const AllocationOptions &options) {
+  absl::StatusOr<int> channel_id;
+  {
+    std::unique_lock<std::mutex> lock(channel_ids_lock_);
+    channel_id = channel_ids_.Allocate("channel");
+  }
   if (!channel_id.ok()) {
     return channel_id.status();
   }
@@ -289,54 +442,95 @@ Server::CreateChannel(const std::string &channel_name, int slot_size,
   channel->SetDebug(logger_.GetLogLevel() <= toolbelt::LogLevel::kVerboseDebug);
 
   absl::StatusOr<SharedMemoryFds> fds =
-      channel->Allocate(scb_fd_, slot_size, num_slots);
+      channel->Allocate(scb_fd_, slot_size, num_slots, options);
   if (!fds.ok()) {
+    // This is expected if huge pages are asked for and none are
+    // configured, so don't leak the channel or its id.
+    delete channel;
+    std::unique_lock<std::mutex> lock(channel_ids_lock_);
+    channel_ids_.Clear(*channel_id);
     return fds.status();
   }
   channel->SetSharedMemoryFds(std::move(*fds));
-  channels_.emplace(std::make_pair(channel_name, channel));
+  LockChannelBuffers(channel);
+  ShardFor(channel_name).channels.emplace(channel_name, channel);
 
-  SendChannelDirectory();
+  SendChannelDirectory(channel_name);
   return channel;
 }
 
 absl::Status Server::RemapChannel(ServerChannel *channel, int slot_size,
-                                  int num_slots) {
+                                  int num_slots,
+                                  const AllocationOptions &options) {
   absl::StatusOr<SharedMemoryFds> fds =
-      channel->Allocate(scb_fd_, slot_size, num_slots);
+      channel->Allocate(scb_fd_, slot_size, num_slots, options);
   if (!fds.ok()) {
     return fds.status();
   }
   channel->SetSharedMemoryFds(std::move(*fds));
+  channel->RebuildTriggerTable();
+  LockChannelBuffers(channel);
+  SendChannelDirectory(channel->Name());
   return absl::OkStatus();
 }
 
+void Server::LockChannelBuffers(ServerChannel *channel) {
+  if (!channel->IsPrefaulted()) {
+    return;
+  }
+  // Failing to lock the buffers isn't fatal.  They have been faulted in
+  // but might be paged out.
+  if (absl::Status status = channel->LockBuffers(); !status.ok()) {
+    logger_.Log(toolbelt::LogLevel::kError, "%s", status.ToString().c_str());
+  }
+}
+
 ServerChannel *Server::FindChannel(const std::string &channel_name) {
-  auto it = channels_.find(channel_name);
-  if (it == channels_.end()) {
+  ChannelShard &shard = ShardFor(channel_name);
+  auto it = shard.channels.find(channel_name);
+  if (it == shard.channels.end()) {
     return nullptr;
   }
   return it->second.get();
 }
 
 void Server::RemoveChannel(ServerChannel *channel) {
-  channel_ids_.Clear(channel->GetChannelId());
-  auto it = channels_.find(channel->Name());
-  channels_.erase(it);
-  SendChannelDirectory();
+  {
+    std::unique_lock<std::mutex> lock(channel_ids_lock_);
+    channel_ids_.Clear(channel->GetChannelId());
+  }
+  SendChannelDirectory(channel->Name());
+  ChannelShard &shard = ShardFor(channel->Name());
+  auto it = shard.channels.find(channel->Name());
+  shard.channels.erase(it);
 }
 
 void Server::RemoveAllUsersFor(ClientHandler *handler) {
-  std::vector<ServerChannel *> empty_channels;
-  for (auto &channel : channels_) {
-    channel.second->RemoveAllUsersFor(handler);
-    if (channel.second->IsEmpty()) {
-      empty_channels.push_back(channel.second.get());
+  for (auto &shard : shards_) {
+    std::unique_lock<std::mutex> lock(shard->lock);
+    std::vector<ServerChannel *> empty_channels;
+    for (auto &channel : shard->channels) {
+      channel.second->RemoveAllUsersFor(handler);
+      if (channel.second->IsEmpty()) {
+        empty_channels.push_back(channel.second.get());
+      }
+    }
+    // toolbelt::Now remove all empty channels.
+    for (auto *channel : empty_channels) {
+      RemoveChannel(channel);
     }
   }
-  // toolbelt::Now remove all empty channels.
-  for (auto *channel : empty_channels) {
-    RemoveChannel(channel);
+}
+
+void Server::RemoveDisconnectedClients(ClientHandler *requester) {
+  std::unique_lock<std::mutex> lock(handlers_lock_);
+  for (auto &handler : client_handlers_) {
+    if (handler.get() == requester || handler->users_removed_ ||
+        !handler->ClientHasDisconnected()) {
+      continue;
+    }
+    RemoveAllUsersFor(handler.get());
+    handler->users_removed_ = true;
   }
 }
 
@@ -354,36 +548,80 @@ void Server::ChannelDirectoryCoroutine(co::Coroutine *c) {
   constexpr int kDirectoryNumSlots = 32;
 
   absl::StatusOr<Publisher> channel_directory = client.CreatePublisher(
-      "/subspace/ChannelDirectory", kDirectorySlotSize, kDirectoryNumSlots,
+      kChannelDirectoryName, kDirectorySlotSize, kDirectoryNumSlots,
       PublisherOptions().SetType("subspace.ChannelDirectory"));
   if (!channel_directory.ok()) {
     logger_.Log(toolbelt::LogLevel::kFatal,
                 "Failed to create channel directory channel: %s",
                 channel_directory.status().ToString().c_str());
   }
+  // Each directory message has the next generation number.  Most are
+  // deltas holding only the channels that have changed since the previous
+  // message.  A full snapshot is sent first, periodically so that
+  // subscribers that have missed a delta can catch up, and when a new
+  // subscriber to the directory asks for it.
+  constexpr uint64_t kSnapshotPeriodNs = 10000000000ULL;
+  uint64_t generation = 0;
+  uint64_t next_snapshot = 0;
   for (;;) {
-    c->Wait(channel_directory_trigger_fd_.GetPollFd().Fd(), POLLIN);
+    uint64_t now = toolbelt::Now();
+    if (now < next_snapshot) {
+      c->Wait(channel_directory_trigger_fd_.GetPollFd().Fd(), POLLIN,
+              next_snapshot - now);
+    }
     channel_directory_trigger_fd_.Clear();
 
+    absl::flat_hash_set<std::string> changes;
+    bool snapshot;
+    {
+      std::unique_lock<std::mutex> lock(directory_lock_);
+      changes.swap(directory_changes_);
+      snapshot = directory_snapshot_requested_;
+      directory_snapshot_requested_ = false;
+    }
+    now = toolbelt::Now();
+    if (now >= next_snapshot) {
+      snapshot = true;
+    }
+    if (!snapshot && changes.empty()) {
+      continue;
+    }
+
     ChannelDirectory directory;
     directory.set_server_id(server_id_);
-    for (auto &channel : channels_) {
-      auto info = directory.add_channels();
-      channel.second->GetChannelInfo(info);
+    directory.set_generation(++generation);
+    if (snapshot) {
+      ForEachChannel([&directory](ServerChannel *channel) {
+        channel->GetChannelInfo(directory.add_channels());
+      });
+      next_snapshot = now + kSnapshotPeriodNs;
+    } else {
+      directory.set_is_delta(true);
+      for (const std::string &name : changes) {
+        std::unique_lock<std::mutex> lock = LockShard(name);
+        if (ServerChannel *channel = FindChannel(name); channel != nullptr) {
+          channel->GetChannelInfo(directory.add_channels());
+        } else {
+          directory.add_removed_channels(name);
+        }
+      }
     }
-    absl::StatusOr<void *> buffer = channel_directory->GetMessageBuffer();
+
+    // The channel is resized if the directory doesn't fit in a slot.
+    int64_t length = directory.ByteSizeLong();
+    absl::StatusOr<void *> buffer =
+        channel_directory->GetMessageBuffer(static_cast<int32_t>(length));
     if (!buffer.ok()) {
       logger_.Log(toolbelt::LogLevel::kFatal,
                   "Failed to get channel directory buffer: %s",
                   buffer.status().ToString().c_str());
     }
-    bool ok = directory.SerializeToArray(*buffer, kDirectorySlotSize);
+    bool ok = directory.SerializeToArray(*buffer, length);
     if (!ok) {
       logger_.Log(toolbelt::LogLevel::kError,
                   "Failed to serialize channel directory");
       continue;
     }
-    int64_t length = directory.ByteSizeLong();
     absl::StatusOr<const Message> s = channel_directory->PublishMessage(length);
     if (!s.ok()) {
       logger_.Log(toolbelt::LogLevel::kError,
@@ -393,7 +631,21 @@ void Server::ChannelDirectoryCoroutine(co::Coroutine *c) {
   }
 }
 
-void Server::SendChannelDirectory() { channel_directory_trigger_fd_.Trigger(); }
+void Server::SendChannelDirectory(const std::string &channel_name) {
+  {
+    std::unique_lock<std::mutex> lock(directory_lock_);
+    directory_changes_.insert(channel_name);
+  }
+  channel_directory_trigger_fd_.Trigger();
+}
+
+void Server::SendChannelDirectorySnapshot() {
+  {
+    std::unique_lock<std::mutex> lock(directory_lock_);
+    directory_snapshot_requested_ = true;
+  }
+  channel_directory_trigger_fd_.Trigger();
+}
 
 void Server::StatisticsCoroutine(co::Coroutine *c) {
   Client client(c);
@@ -421,23 +673,24 @@ void Server::StatisticsCoroutine(co::Coroutine *c) {
     Statistics stats;
     stats.set_timestamp(toolbelt::Now());
     stats.set_server_id(server_id_);
-    for (auto &channel : channels_) {
-      auto s = stats.add_channels();
-      channel.second->GetChannelStats(s);
-    }
-    absl::StatusOr<void *> buffer = pub->GetMessageBuffer();
+    ForEachChannel([&stats](ServerChannel *channel) {
+      channel->GetChannelStats(stats.add_channels());
+    });
+    // The channel is resized if the stats don't fit in a slot.
+    int64_t length = stats.ByteSizeLong();
+    absl::StatusOr<void *> buffer =
+        pub->GetMessageBuffer(static_cast<int32_t>(length));
     if (!buffer.ok()) {
       logger_.Log(toolbelt::LogLevel::kFatal,
                   "Failed to get channel stats buffer: %s",
                   buffer.status().ToString().c_str());
     }
-    bool ok = stats.SerializeToArray(*buffer, kStatsSlotSize);
+    bool ok = stats.SerializeToArray(*buffer, length);
     if (!ok) {
       logger_.Log(toolbelt::LogLevel::kError,
                   "Failed to serialize channel stats");
       continue;
     }
-    int64_t length = stats.ByteSizeLong();
     absl::StatusOr<const Message> s = pub->PublishMessage(length);
     if (!s.ok()) {
       logger_.Log(toolbelt::LogLevel::kError,
@@ -447,78 +700,101 @@ void Server::StatisticsCoroutine(co::Coroutine *c) {
   }
 }
 
-// Send a query discovery message for the given channel.  This
-// is sent on the IPv4 broadcast address over UDP.
-void Server::SendQuery(const std::string &channel_name) {
-  if (local_) {
-    return;
-  }
-  // Spawn a coroutine to send the Query message.
-  coroutines_.insert(std::make_unique<co::Coroutine>(
-      co_scheduler_,
-      [this, channel_name](co::Coroutine *c) {
-        logger_.Log(toolbelt::LogLevel::kDebug, "Sending Query %s",
-                    channel_name.c_str());
-        char buffer[kDiscoveryBufferSize];
-        Discovery disc;
-        disc.set_server_id(server_id_);
-        disc.set_port(discovery_port_);
-
-        auto *query = disc.mutable_query();
-        query->set_channel_name(channel_name);
-
-        bool ok = disc.SerializeToArray(buffer, sizeof(buffer));
-        if (!ok) {
+void Server::BufferShrinkCoroutine(co::Coroutine *c) {
+  // Look a few times in each window so that a channel is shrunk soon
+  // after its window ends.
+  constexpr uint64_t kChecksPerWindow = 4;
+  for (;;) {
+    c->Nanosleep(buffer_shrink_window_ / kChecksPerWindow);
+    uint64_t now = toolbelt::Now();
+    ForEachChannel([this, now](ServerChannel *channel) {
+      int32_t slot_size = channel->ShrinkSlotSize(now, buffer_shrink_window_);
+      if (slot_size > 0) {
+        logger_.Log(toolbelt::LogLevel::kDebug,
+                    "Shrinking channel %s from slot size %d to %d",
+                    channel->Name().c_str(), channel->SlotSize(), slot_size);
+        absl::StatusOr<toolbelt::FileDescriptor> fd =
+            channel->ExtendBuffers(slot_size);
+        if (!fd.ok()) {
           logger_.Log(toolbelt::LogLevel::kError,
-                      "Failed to serialize Query message");
-          return;
-        }
-        int64_t length = disc.ByteSizeLong();
-        absl::Status s =
-            discovery_transmitter_.SendTo(discovery_addr_, buffer, length, c);
-        if (!s.ok()) {
-          logger_.Log(toolbelt::LogLevel::kError, "Failed to send Query: %s",
-                      s.ToString().c_str());
+                      "Failed to shrink channel %s: %s",
+                      channel->Name().c_str(), fd.status().ToString().c_str());
           return;
         }
-      },
-      "discovery query"));
+        LockChannelBuffers(channel);
+        channel->AddBuffer(slot_size, std::move(*fd));
+        SendChannelDirectory(channel->Name());
+      }
+      // The server only maps the buffers of a prefaulted channel.
+      channel->UnmapUnusedBuffers();
+    });
+  }
 }
 
-// Send an advertise discovery message over UDP.
-void Server::SendAdvertise(const std::string &channel_name, bool reliable) {
+// Send a discovery message to the given server or, if there isn't one, to
+// all the other servers.  These are the static peers if there are any,
+// otherwise the IPv4 broadcast address.
+void Server::SendDiscovery(Discovery disc,
+                           std::optional<toolbelt::InetAddress> to,
+                           std::string what) {
   if (local_) {
     return;
   }
-  // Spawn a coroutine to send the Publish message.
-  coroutines_.insert(std::make_unique<co::Coroutine>(
-      co_scheduler_,
-      [this, channel_name, reliable](co::Coroutine *c) {
-        logger_.Log(toolbelt::LogLevel::kDebug, "Sending Advertise %s",
-                    channel_name.c_str());
+  disc.set_server_id(server_id_);
+  disc.set_port(discovery_port_);
+  // Spawn a coroutine to send the message.
+  Spawn(
+      MainThread(),
+      [this, disc = std::move(disc), to, what](co::Coroutine *c) {
         char buffer[kDiscoveryBufferSize];
-        Discovery disc;
-        disc.set_server_id(server_id_);
-        disc.set_port(discovery_port_);
-        auto *advertise = disc.mutable_advertise();
-        advertise->set_channel_name(channel_name);
-        advertise->set_reliable(reliable);
         bool ok = disc.SerializeToArray(buffer, sizeof(buffer));
         if (!ok) {
           logger_.Log(toolbelt::LogLevel::kError,
-                      "Failed to serialize Advertise message");
+                      "Failed to serialize %s message", what.c_str());
           return;
         }
         int64_t length = disc.ByteSizeLong();
-        absl::Status s =
-            discovery_transmitter_.SendTo(discovery_addr_, buffer, length, c);
-        if (!s.ok()) {
-          logger_.Log(toolbelt::LogLevel::kError,
-                      "Failed to send Advertise: %s", s.ToString().c_str());
-          return;
+        std::vector<toolbelt::InetAddress> addrs;
+        if (to.has_value()) {
+          addrs.push_back(*to);
+        } else if (!peers_.empty()) {
+          addrs = peers_;
+        } else {
+          addrs.push_back(discovery_addr_);
+        }
+        for (const toolbelt::InetAddress &addr : addrs) {
+          absl::Status s =
+              discovery_transmitter_.SendTo(addr, buffer, length, c);
+          if (!s.ok()) {
+            logger_.Log(toolbelt::LogLevel::kError,
+                        "Failed to send %s to %s: %s", what.c_str(),
+                        addr.ToString().c_str(), s.ToString().c_str());
+          }
         }
       },
-      "discovery advertiser"));
+      absl::StrFormat("discovery %s", what));
+}
+
+// Send a query discovery message for the given channel.
+void Server::SendQuery(const std::string &channel_name) {
+  logger_.Log(toolbelt::LogLevel::kDebug, "Sending Query %s",
+              channel_name.c_str());
+  Discovery disc;
+  auto *query = disc.mutable_query();
+  query->set_channel_name(channel_name);
+  SendDiscovery(std::move(disc), std::nullopt, "Query");
+}
+
+// Send an advertise discovery message over UDP.
+void Server::SendAdvertise(const std::string &channel_name, bool reliable,
+                           std::optional<toolbelt::InetAddress> to) {
+  logger_.Log(toolbelt::LogLevel::kDebug, "Sending Advertise %s",
+              channel_name.c_str());
+  Discovery disc;
+  auto *advertise = disc.mutable_advertise();
+  advertise->set_channel_name(channel_name);
+  advertise->set_reliable(reliable);
+  SendDiscovery(std::move(disc), std::move(to), "Advertise");
 }
 
 // This coroutine receives discovery messages over UDP.
@@ -541,7 +817,8 @@ void Server::DiscoveryReceiverCoroutine(co::Coroutine *c) {
       continue;
     }
     if (disc.server_id() == server_id_) {
-      return;
+      // Our own broadcast, or we are one of our peers.
+      continue;
     }
     sender.SetPort(disc.port());
     logger_.Log(toolbelt::LogLevel::kDebug, "Discovery message from %s\n%s",
@@ -556,34 +833,75 @@ void Server::DiscoveryReceiverCoroutine(co::Coroutine *c) {
     case Discovery::kSubscribe:
       IncomingSubscribe(disc.subscribe(), sender);
       break;
+    case Discovery::kAdvertiseBatch:
+      for (const Discovery::Advertise &advertise :
+           disc.advertise_batch().channels()) {
+        IncomingAdvertise(advertise, sender);
+      }
+      break;
     default:
       break;
     }
   }
 }
 
-void Server::BridgeTransmitterCoroutine(ServerChannel *channel,
-                                        bool pub_reliable, bool sub_reliable,
-                                        toolbelt::InetAddress subscriber,
-                                        co::Coroutine *c) {
-  logger_.Log(toolbelt::LogLevel::kDebug, "BridgeTransmitterCoroutine running");
-  toolbelt::TCPSocket bridge;
-  if (absl::Status status = bridge.Connect(subscriber); !status.ok()) {
-    logger_.Log(toolbelt::LogLevel::kError,
-                "Failed to connect to bridge subscriber: %s",
-                status.ToString().c_str());
-    return;
+// The connection to a remote server for a bridged channel.
+struct BridgeConnection {
+  BridgeDestination destination;
+  toolbelt::TCPSocket socket;
+  std::unique_ptr<BridgeTransmitter> transmitter;
+  // For a decimated subscription, when the last message was sent and
+  // whether a newer one has been held back since because of the rate.
+  uint64_t last_send_time = 0;
+  bool deferred = false;
+};
+
+// Connect to the bridge receiver of a remote server and send it the
+// Subscribed message.
+absl::StatusOr<std::unique_ptr<BridgeConnection>>
+Server::OpenBridgeConnection(const BridgeDestination &destination,
+                             const std::string &channel_name, int slot_size,
+                             int num_slots, bool pub_reliable,
+                             bool sub_reliable, BridgeCodec codec,
+                             co::Coroutine *c) {
+  auto conn = std::make_unique<BridgeConnection>();
+  conn->destination = destination;
+  toolbelt::TCPSocket &bridge = conn->socket;
+  if (absl::Status status = bridge.Connect(destination.receiver);
+      !status.ok()) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to connect to bridge subscriber: %s",
+                        status.ToString()));
   }
   if (absl::Status status = bridge.SetNonBlocking(); !status.ok()) {
-    logger_.Log(toolbelt::LogLevel::kError, "%s", status.ToString().c_str());
-    return;
+    return status;
   }
 
-  const std::string &channel_name = channel->Name();
+  // The receiver can take the messages of an unreliable channel over UDP
+  // if they fit in a datagram.  Otherwise they go over the TCP connection.
+  if (destination.datagram_receiver.has_value() && !pub_reliable &&
+      !sub_reliable &&
+      kBridgeDatagramHeaderSize + sizeof(int32_t) + sizeof(MessagePrefix) +
+              slot_size <=
+          kMaxBridgeDatagramSize) {
+    auto udp = std::make_unique<UDPBridgeTransmitter>(bridge);
+    if (absl::Status status = udp->Open(*destination.datagram_receiver);
+        status.ok()) {
+      conn->transmitter = std::move(udp);
+    } else {
+      logger_.Log(toolbelt::LogLevel::kError,
+                  "Sending %s over the TCP bridge: %s", channel_name.c_str(),
+                  status.ToString().c_str());
+    }
+  }
+  bool datagrams = conn->transmitter != nullptr;
+  if (!datagrams) {
+    conn->transmitter = std::make_unique<TCPBridgeTransmitter>(bridge);
+  }
 
-  // Send a Subscribed message to the transmitter.
+  // Send a Subscribed message to the receiver.
   logger_.Log(toolbelt::LogLevel::kDebug, "Sending subscribed to %s",
-              subscriber.ToString().c_str());
+              destination.receiver.ToString().c_str());
   char buffer[kDiscoveryBufferSize];
 
   // SendMessage needs 4 bytes below the buffer.
@@ -592,133 +910,370 @@ void Server::BridgeTransmitterCoroutine(ServerChannel *channel,
 
   Subscribed subscribed;
   subscribed.set_channel_name(channel_name);
-  subscribed.set_slot_size(channel->SlotSize());
-  subscribed.set_num_slots(channel->NumSlots());
+  subscribed.set_slot_size(slot_size);
+  subscribed.set_num_slots(num_slots);
   subscribed.set_reliable(pub_reliable);
+  subscribed.set_datagrams(datagrams);
+  subscribed.set_codec(static_cast<int32_t>(codec));
 
   bool ok = subscribed.SerializeToArray(databuf, buflen);
   if (!ok) {
-    logger_.Log(toolbelt::LogLevel::kError,
-                "Failed to serialize subscribed message");
-    return;
+    return absl::InternalError("Failed to serialize subscribed message");
   }
   int64_t length = subscribed.ByteSizeLong();
   absl::StatusOr<ssize_t> n = bridge.SendMessage(databuf, length, c);
   if (!n.ok()) {
-    logger_.Log(toolbelt::LogLevel::kError,
-                "Failed to send subscribed for %s: %s", channel_name.c_str(),
-                n.status().ToString().c_str());
-    return;
+    return absl::InternalError(absl::StrFormat(
+        "Failed to send subscribed for %s: %s", channel_name,
+        n.status().ToString()));
   }
+  return conn;
+}
+
+// There is one transmitter for each channel and subscriber reliability.
+// It reads each message from the channel once and sends it to all the
+// remote servers that have subscribed to the channel.
+void Server::BridgeTransmitterCoroutine(std::string channel_name,
+                                        int slot_size, int num_slots,
+                                        bool pub_reliable, bool sub_reliable,
+                                        BridgeCodec codec,
+                                        std::shared_ptr<BridgeFanout> fanout,
+                                        co::Coroutine *c) {
+  logger_.Log(toolbelt::LogLevel::kDebug, "BridgeTransmitterCoroutine running");
+
+  std::vector<std::unique_ptr<BridgeConnection>> connections;
+  // The remote servers we are no longer sending to.
+  std::vector<BridgeDestination> closed;
 
   Client client(c);
+  absl::StatusOr<Subscriber> sub;
   if (absl::Status s = client.Init(socket_name_); !s.ok()) {
     logger_.Log(toolbelt::LogLevel::kError,
                 "Failed to connect to Subspace server: %s",
                 s.ToString().c_str());
-    return;
-  }
-  absl::StatusOr<Subscriber> sub = client.CreateSubscriber(
-      channel_name,
-      SubscriberOptions().SetReliable(sub_reliable).SetBridge(true));
-  if (!sub.ok()) {
-    logger_.Log(toolbelt::LogLevel::kError,
-                "Failed to create bridge subscriber for %s: %s",
-                channel_name.c_str(), sub.status().ToString().c_str());
-    return;
+    sub = s;
+  } else {
+    sub = client.CreateSubscriber(
+        channel_name,
+        SubscriberOptions().SetReliable(sub_reliable).SetBridge(true));
+    if (!sub.ok()) {
+      logger_.Log(toolbelt::LogLevel::kError,
+                  "Failed to create bridge subscriber for %s: %s",
+                  channel_name.c_str(), sub.status().ToString().c_str());
+    }
   }
-  // Read messages from subscriber and send to bridge socket.
-  bool done = false;
+
+  // Read messages from subscriber and send to bridge sockets.  The messages
+  // are read in batches and sent straight from the slot buffers with a
+  // single sendmsg call per batch for each remote server.  The subscriber
+  // holds references to the slots in the batch until the next read so they
+  // can't be reused by a publisher while they are being sent.
+  std::vector<Message> msgs;
+  msgs.reserve(kMaxBridgeBatch);
+  // Each message is sent as a 4 byte length in network byte order
+  // followed by the data, which is what Socket::ReceiveMessage expects.
+  std::vector<int32_t> lengths(kMaxBridgeBatch);
+  std::vector<struct iovec> iovecs;
+  iovecs.reserve(kMaxBridgeBatch * 2);
+  // The transmitters modify the iovecs they are given.
+  std::vector<struct iovec> send_iovecs;
+  send_iovecs.reserve(kMaxBridgeBatch * 2);
+  // A compressed message is sent from a buffer holding a copy of its
+  // prefix, flagged as compressed, followed by the compressed data.  Each
+  // batch is compressed once for all the remote servers.
+  BridgeCompressor compressor(codec);
+  std::vector<std::vector<char>> compressed(kMaxBridgeBatch);
+  constexpr size_t kAdjustedPrefixLength =
+      sizeof(MessagePrefix) - sizeof(int32_t);
+
+  // The ordinals of the last message read and the last one put in a frame.
+  int64_t last_ordinal = -1;
+  int64_t last_frame_ordinal = -1;
+
+  // Add the frame for a message to the iovecs.
+  auto add_frame = [&](const Message &msg) {
+    // We want to send the MessagePrefix along with the message.
+    const char *prefix_addr =
+        reinterpret_cast<const char *>(msg.buffer) - sizeof(MessagePrefix);
+    const MessagePrefix *prefix =
+        reinterpret_cast<const MessagePrefix *>(prefix_addr);
+    // NOTE: there's a question here about whether we want to send an
+    // activation message across the bridge.  Currently we do send
+    // it but the receiver will disregard it.  I don't think we need
+    // to actually send it but there's no harm.
+    if ((prefix->flags & kMessageBridged) != 0) {
+      // This message came from bridge.  We don't forward them again.
+      return;
+    }
+    last_frame_ordinal = msg.ordinal;
+    SUBSPACE_TRACE(kBridgeSend, sub->ChannelId(), msg.ordinal,
+                   prefix->timestamp);
+    // The MessagePrefix struct starts with a padding member that was
+    // used for the length by SendMessage.  The length is now sent
+    // from the lengths vector so the shared memory isn't written, but
+    // the padding is still not sent in order to keep the wire format
+    // the same.
+    size_t msglen = msg.length + kAdjustedPrefixLength;
+    int32_t &length = lengths[iovecs.size() / 2];
+    std::vector<char> &buffer = compressed[iovecs.size() / 2];
+    buffer.resize(kAdjustedPrefixLength);
+    if (compressor.Compress(msg.buffer, msg.length, buffer)) {
+      MessagePrefix copy = *prefix;
+      copy.flags |= kMessageCompressed;
+      memcpy(buffer.data(), reinterpret_cast<char *>(&copy) + sizeof(int32_t),
+             kAdjustedPrefixLength);
+      length = htonl(static_cast<int32_t>(buffer.size()));
+      iovecs.push_back({&length, sizeof(length)});
+      iovecs.push_back({buffer.data(), buffer.size()});
+      return;
+    }
+    length = htonl(static_cast<int32_t>(msglen));
+    iovecs.push_back({&length, sizeof(length)});
+    iovecs.push_back(
+        {const_cast<char *>(prefix_addr) + sizeof(int32_t), msglen});
+  };
+
+  // Send the frames from the first iovec onwards to a remote server.  If
+  // that fails the connection is moved to closed and erased.
+  auto send_frames =
+      [&](std::vector<std::unique_ptr<BridgeConnection>>::iterator &it,
+          size_t first) {
+        BridgeConnection &conn = **it;
+        send_iovecs.assign(iovecs.begin() + first, iovecs.end());
+        if (absl::Status status = conn.transmitter->Send(send_iovecs, c);
+            !status.ok()) {
+          logger_.Log(toolbelt::LogLevel::kError,
+                      "Failed to send bridge messages for %s to %s: %s",
+                      channel_name.c_str(),
+                      conn.destination.receiver.ToString().c_str(),
+                      status.ToString().c_str());
+          closed.push_back(conn.destination);
+          it = connections.erase(it);
+          return;
+        }
+        ++it;
+      };
+
+  bool done = !sub.ok();
   while (!done) {
-    if (absl::Status status = sub->Wait(); !status.ok()) {
-      logger_.Log(toolbelt::LogLevel::kError,
-                  "Failed to wait for subscriber: %s",
-                  status.ToString().c_str());
-      break;
+    // Connect to the remote servers that have subscribed since we last
+    // looked.
+    std::vector<BridgeDestination> pending;
+    {
+      std::lock_guard<std::mutex> lock(bridges_lock_);
+      pending.swap(fanout->pending);
+      fanout->trigger.Clear();
+      if (pending.empty() && connections.empty()) {
+        // Nowhere to send the messages.  New subscriptions will need a
+        // new transmitter.
+        break;
+      }
+    }
+    for (const BridgeDestination &destination : pending) {
+      absl::StatusOr<std::unique_ptr<BridgeConnection>> conn =
+          OpenBridgeConnection(destination, channel_name, slot_size, num_slots,
+                               pub_reliable, sub_reliable, codec, c);
+      if (!conn.ok()) {
+        logger_.Log(toolbelt::LogLevel::kError, "%s",
+                    conn.status().ToString().c_str());
+        closed.push_back(destination);
+        continue;
+      }
+      connections.push_back(std::move(*conn));
     }
-    // Read all available messages and send to transmitter.
+
+    // If none of the remote servers wants anything but the newest message
+    // there's no need to read the others.
+    bool newest_only =
+        !connections.empty() &&
+        std::all_of(connections.begin(), connections.end(),
+                    [](const std::unique_ptr<BridgeConnection> &conn) {
+                      return conn->destination.IsDecimated();
+                    });
+
+    // Read all available messages and send to the bridges.
     for (;;) {
-      absl::StatusOr<Message> msg = sub->ReadMessageInternal(
-          ReadMode::kReadNext, /*pass_activation=*/true,
-          /*clear_trigger=*/true);
-      if (!msg.ok()) {
+      if (newest_only) {
+        absl::StatusOr<const Message> msg =
+            sub->ReadMessage(ReadMode::kReadNewest);
+        if (!msg.ok()) {
+          done = true;
+          logger_.Log(toolbelt::LogLevel::kError,
+                      "Failed to read message from bridge subscriber for %s: "
+                      "%s",
+                      channel_name.c_str(), msg.status().ToString().c_str());
+          break;
+        }
+        msgs.clear();
+        // Reading the newest message again gives the one we already have.
+        if (msg->length > 0 && msg->ordinal > last_ordinal) {
+          msgs.push_back(*msg);
+        }
+      } else if (absl::Status status = sub->ReadMessagesInternal(
+                     kMaxBridgeBatch, /*pass_activation=*/true, msgs);
+                 !status.ok()) {
         done = true;
         logger_.Log(toolbelt::LogLevel::kError,
                     "Failed to read message from bridge subscriber for %s: %s",
-                    channel_name.c_str(), msg.status().ToString().c_str());
+                    channel_name.c_str(), status.ToString().c_str());
         break;
       }
-      if (msg->length == 0) {
-        // End of messages, wait for more.w
+      if (msgs.empty()) {
+        // End of messages, wait for more.
         break;
       }
-      // We want to send the MessagePrefix along with the message.
-      const char *prefix_addr =
-          reinterpret_cast<const char *>(msg->buffer) - sizeof(MessagePrefix);
-      const MessagePrefix *prefix =
-          reinterpret_cast<const MessagePrefix *>(prefix_addr);
-      // NOTE: there's a question here about whether we want to send an
-      // activation message across the bridge.  Currently we do send
-      // it but the receiver will disregard it.  I don't think we need
-      // to actually send it but there's no harm.
-      if ((prefix->flags & kMessageBridged) != 0) {
-        // This message came from bridge.  We don't forward them again.
+      last_ordinal = msgs.back().ordinal;
+      iovecs.clear();
+      for (const Message &msg : msgs) {
+        add_frame(msg);
+      }
+      if (iovecs.empty()) {
         continue;
       }
-      // SendMessage uses the 4 bytes immediately below the buffer
-      // for the length of the messages.  The MessagePrefix struct
-      // contains a padding member for this purpose.  We don't
-      // count the padding in the length sent.
-      char *data_addr = const_cast<char *>(prefix_addr) + sizeof(int32_t);
-      size_t msglen = msg->length + sizeof(MessagePrefix) - sizeof(int32_t);
 
       // Note that for a reliable publisher where the subscriber is slower
       // we will get backpressure from the receiver because it won't
       // read from the socket.  We will keep transmitting until the TCP
       // buffers fill up, at which point we will stop sending until we
       // get a POLLOUT event.  We are using a nonblocking socket to write
-      // to network and the check for EAGAIN is in SendMessage in the
-      // socket.  Since we are using coroutines, the EAGAIN will yield
-      // this coroutine until POLLOUT says we can try again.
+      // to network and the check for EAGAIN is in the transmitter.  Since we
+      // are using coroutines, the EAGAIN will yield this coroutine until
+      // POLLOUT says we can try again.
       //
       // The backpressure received here will be applied upwards because
       // we will stop reading the messages from the channel and thus
       // backpressure any publishers writing to that channel.
-      if (absl::StatusOr<ssize_t> n = bridge.SendMessage(data_addr, msglen, c);
-          !n.ok()) {
-        done = true;
-        logger_.Log(toolbelt::LogLevel::kError,
-                    "Failed to send bridge message for %s: %s",
-                    channel_name.c_str(), n.status().ToString().c_str());
-
-        break;
+      //
+      // For an unreliable subscription one slow remote server doesn't hold
+      // up the others.  It misses the messages sent while it isn't ready.
+      // A remote server that asked for a decimated subscription is only
+      // sent the newest message of the batch, and none at all if it was
+      // sent one too recently for its rate.
+      uint64_t now = toolbelt::Now();
+      for (auto it = connections.begin(); it != connections.end();) {
+        BridgeConnection &conn = **it;
+        if (!sub_reliable && !conn.transmitter->Ready()) {
+          logger_.Log(toolbelt::LogLevel::kVerboseDebug,
+                      "Skipping %d messages for %s to %s",
+                      iovecs.size() / 2, channel_name.c_str(),
+                      conn.destination.receiver.ToString().c_str());
+          ++it;
+          continue;
+        }
+        if (!conn.destination.IsDecimated()) {
+          send_frames(it, 0);
+          continue;
+        }
+        if (now < conn.last_send_time + conn.destination.min_interval) {
+          conn.deferred = true;
+          ++it;
+          continue;
+        }
+        conn.last_send_time = now;
+        conn.deferred = false;
+        send_frames(it, iovecs.size() - 2);
       }
     }
+    if (done) {
+      break;
+    }
     const ChannelCounters &counters = sub->GetCounters();
     if (counters.num_pubs == 0) {
       // No publisher left to send anything.  We're done.
       break;
     }
+
+    // A rate limited remote server that was held back from the newest
+    // message is sent it when its rate allows, even if nothing newer is
+    // published by then.
+    int64_t timeout = -1;
+    uint64_t now = toolbelt::Now();
+    for (auto &conn : connections) {
+      if (!conn->deferred) {
+        continue;
+      }
+      uint64_t due = conn->last_send_time + conn->destination.min_interval;
+      int64_t wait = due > now ? static_cast<int64_t>(due - now) : 0;
+      timeout = timeout == -1 ? wait : std::min(timeout, wait);
+    }
+
+    // Wait for more messages or another remote server to subscribe.
+    if (c->Wait({sub->GetPollFd().fd, fanout->trigger.GetPollFd().Fd()},
+                POLLIN, timeout) != -1) {
+      continue;
+    }
+    // Timed out.  The newest message is the subscriber's current one so
+    // reading it again doesn't change which message it reads next.
+    if (last_frame_ordinal != last_ordinal) {
+      for (auto &conn : connections) {
+        conn->deferred = false;
+      }
+      continue;
+    }
+    absl::StatusOr<const Message> msg = sub->ReadMessageAt(last_ordinal);
+    if (!msg.ok() || msg->length == 0) {
+      continue;
+    }
+    iovecs.clear();
+    add_frame(*msg);
+    if (iovecs.empty()) {
+      continue;
+    }
+    now = toolbelt::Now();
+    for (auto it = connections.begin(); it != connections.end();) {
+      BridgeConnection &conn = **it;
+      if (!conn.deferred ||
+          now < conn.last_send_time + conn.destination.min_interval ||
+          !conn.transmitter->Ready()) {
+        ++it;
+        continue;
+      }
+      conn.last_send_time = now;
+      conn.deferred = false;
+      send_frames(it, 0);
+    }
   }
 
   logger_.Log(toolbelt::LogLevel::kDebug,
               "Bridge transmitter for %s terminating", channel_name.c_str());
-  // We're done reading messages from the channel, remove the
-  // bridge and subscriber.
-  channel->RemoveBridgedAddress(subscriber, sub_reliable);
+  {
+    std::lock_guard<std::mutex> lock(bridges_lock_);
+    auto it = bridges_.find(std::make_pair(channel_name, sub_reliable));
+    if (it != bridges_.end() && it->second == fanout) {
+      bridges_.erase(it);
+    }
+    for (BridgeDestination &destination : fanout->pending) {
+      closed.push_back(std::move(destination));
+    }
+    fanout->pending.clear();
+  }
+  for (auto &conn : connections) {
+    closed.push_back(conn->destination);
+  }
+  // We're done reading messages from the channel, remove the bridges.  The
+  // channel might have gone away while we were sending.
+  std::unique_lock<std::mutex> lock = LockShard(channel_name);
+  if (ServerChannel *channel = FindChannel(channel_name); channel != nullptr) {
+    for (const BridgeDestination &destination : closed) {
+      channel->RemoveBridgedAddress(destination.server, sub_reliable);
+    }
+  }
 }
 
 // Send a Subscribe message over UDP.
 absl::Status Server::SendSubscribeMessage(
     const std::string &channel_name, bool reliable,
     toolbelt::InetAddress publisher, toolbelt::TCPSocket &receiver_listener,
-    char *buffer, size_t buffer_size, co::Coroutine *c) {
+    const std::optional<toolbelt::InetAddress> &datagram_receiver,
+    bool latest_only, double max_rate, char *buffer, size_t buffer_size,
+    co::Coroutine *c) {
   const toolbelt::InetAddress &receiver_addr = receiver_listener.BoundAddress();
   logger_.Log(toolbelt::LogLevel::kDebug, "Bridge receiver socket: %s",
               receiver_addr.ToString().c_str());
   // Send a subscribe request to the publisher.
   Discovery disc;
   disc.set_server_id(server_id_);
+  disc.set_port(discovery_port_);
   auto *sub = disc.mutable_subscribe();
   sub->set_channel_name(channel_name);
   sub->set_reliable(reliable);
@@ -726,6 +1281,14 @@ absl::Status Server::SendSubscribeMessage(
   in_addr ip_addr = receiver_addr.IpAddress();
   sub_addr->set_ip_address(&ip_addr, sizeof(ip_addr));
   sub_addr->set_port(receiver_addr.Port());
+  if (datagram_receiver.has_value()) {
+    auto *datagram_addr = sub->mutable_datagram_receiver();
+    in_addr datagram_ip = datagram_receiver->IpAddress();
+    datagram_addr->set_ip_address(&datagram_ip, sizeof(datagram_ip));
+    datagram_addr->set_port(datagram_receiver->Port());
+  }
+  sub->set_latest_only(latest_only);
+  sub->set_max_rate(max_rate);
 
   bool ok = disc.SerializeToArray(buffer, buffer_size);
   if (!ok) {
@@ -748,6 +1311,7 @@ absl::Status Server::SendSubscribeMessage(
 void Server::BridgeReceiverCoroutine(std::string channel_name,
                                      bool sub_reliable,
                                      toolbelt::InetAddress publisher,
+                                     bool latest_only, double max_rate,
                                      co::Coroutine *c) {
   // Open a listening TCP socket on a free port.
   logger_.Log(toolbelt::LogLevel::kDebug, "BridgeReceiverCoroutine running");
@@ -766,8 +1330,26 @@ void Server::BridgeReceiverCoroutine(std::string channel_name,
   logger_.Log(toolbelt::LogLevel::kDebug, "Bridge receiver socket: %s",
               receiver_addr.ToString().c_str());
 
+  // For an unreliable subscription, offer to take the messages over UDP.
+  // The transmitter decides whether to send them that way.
+  toolbelt::UDPSocket datagram_socket;
+  std::optional<toolbelt::InetAddress> datagram_receiver;
+  if (bridge_datagrams_ && !sub_reliable) {
+    absl::StatusOr<toolbelt::InetAddress> addr =
+        BindBridgeDatagramSocket(datagram_socket, receiver_addr);
+    if (addr.ok()) {
+      datagram_receiver = *addr;
+    } else {
+      logger_.Log(toolbelt::LogLevel::kError,
+                  "Unable to bind datagram socket for bridge receiver for "
+                  "%s: %s",
+                  channel_name.c_str(), addr.status().ToString().c_str());
+    }
+  }
+
   s = SendSubscribeMessage(channel_name, sub_reliable, publisher,
-                           receiver_listener, buffer, sizeof(buffer), c);
+                           receiver_listener, datagram_receiver, latest_only,
+                           max_rate, buffer, sizeof(buffer), c);
   if (!s.ok()) {
     logger_.Log(toolbelt::LogLevel::kError,
                 "Failed to send Subscribe message for channel %s: %s",
@@ -798,6 +1380,14 @@ void Server::BridgeReceiverCoroutine(std::string channel_name,
     return;
   }
 
+  std::unique_ptr<BridgeReceiver> receiver;
+  if (subscribed.datagrams() && datagram_receiver.has_value()) {
+    receiver = std::make_unique<UDPBridgeReceiver>(datagram_socket, *bridge);
+  } else {
+    receiver = std::make_unique<TCPBridgeReceiver>(*bridge);
+  }
+  int64_t num_dropped = 0;
+
   // Build a publisher to publish incoming bridge messages to the channel.
   Client client(c);
   s = client.Init(socket_name_);
@@ -819,17 +1409,146 @@ void Server::BridgeReceiverCoroutine(std::string channel_name,
     return;
   }
 
-  // toolbelt::Now we receive messages from the bridge and send to the
-  // publisher.
-  for (;;) {
-    absl::StatusOr<void *> buf = pub->GetMessageBuffer();
-    if (!buf.ok()) {
+  // Now we receive messages from the bridge and send to the publisher.
+  //
+  // Rather than reading each message from the socket separately (a read
+  // for the length and another for the data), we read as much as is
+  // available into a staging buffer and split it into frames.  Each frame
+  // is a 4 byte length in network byte order followed by the
+  // MessagePrefix (less its padding) and the message.  The frames are
+  // copied into slots and published in batches.
+  //
+  // The MessagePrefix struct contains 4 bytes of padding at offset 0.
+  // This is not sent over the bridge so the frame data is copied to the
+  // address after the padding.  When the messages are published into the
+  // channel, we tell the client to omit the prefix so that it remains
+  // intact.  This means that the ordinal is carried intact over the
+  // bridge.
+  //
+  // A frame flagged as compressed holds the compressed message after the
+  // prefix.  It is decompressed straight into the slot and the prefix's
+  // message_size is the size of the message once it has been.
+  const BridgeCodec codec = static_cast<BridgeCodec>(subscribed.codec());
+  constexpr size_t kAdjustedPrefixLength =
+      sizeof(MessagePrefix) - sizeof(int32_t);
+  const size_t max_length = subscribed.slot_size() + kAdjustedPrefixLength;
+  std::vector<char> staging(
+      std::max(kBridgeStagingSize, sizeof(int32_t) + max_length));
+  size_t start = 0; // Offset of first frame not yet published.
+  size_t end = 0;   // Offset of end of received data.
+
+  struct Frame {
+    const char *data;
+    size_t length;
+    size_t next;          // Offset of the following frame.
+    int32_t message_size; // Size of the message in the slot.
+    bool compressed;
+  };
+  std::vector<Frame> frames;
+  frames.reserve(kMaxBridgeBatch);
+  std::vector<int64_t> sizes;
+  sizes.reserve(kMaxBridgeBatch);
+  const int max_batch = std::min(kMaxBridgeBatch, subscribed.num_slots());
+
+  bool done = false;
+  while (!done) {
+    // Find the complete frames in the staging buffer.
+    frames.clear();
+    size_t offset = start;
+    while (frames.size() < static_cast<size_t>(max_batch) &&
+           end - offset >= sizeof(int32_t)) {
+      int32_t length;
+      memcpy(&length, &staging[offset], sizeof(length));
+      length = ntohl(length);
+      if (length < static_cast<int32_t>(kAdjustedPrefixLength) ||
+          static_cast<size_t>(length) > max_length) {
+        logger_.Log(toolbelt::LogLevel::kError,
+                    "Invalid bridge message length %d for %s", length,
+                    channel_name.c_str());
+        done = true;
+        break;
+      }
+      if (end - offset - sizeof(int32_t) < static_cast<size_t>(length)) {
+        // Incomplete frame.
+        break;
+      }
+      const char *data = &staging[offset + sizeof(int32_t)];
+      offset += sizeof(int32_t) + length;
+
+      // The staging buffer isn't aligned for a MessagePrefix so copy it
+      // out to look at the flags.
+      MessagePrefix prefix;
+      memcpy(reinterpret_cast<char *>(&prefix) + sizeof(int32_t), data,
+             kAdjustedPrefixLength);
+      if ((prefix.flags & kMessageActivate) != 0) {
+        // Since we have created a reliable publisher and it has sent an
+        // activation message through, we don't send another one.
+        if (frames.empty()) {
+          start = offset;
+        }
+        continue;
+      }
+      bool compressed = (prefix.flags & kMessageCompressed) != 0;
+      absl::StatusOr<int32_t> message_size = BridgeMessageSize(
+          compressed, prefix.message_size, length - kAdjustedPrefixLength,
+          subscribed.slot_size());
+      if (!message_size.ok()) {
+        logger_.Log(toolbelt::LogLevel::kError, "%s for %s",
+                    message_size.status().ToString().c_str(),
+                    channel_name.c_str());
+        done = true;
+        break;
+      }
+      frames.push_back({data, static_cast<size_t>(length), offset,
+                        *message_size, compressed});
+    }
+    if (done) {
+      break;
+    }
+
+    if (frames.empty()) {
+      // Need more data.  Move any partial frame to the start of the
+      // staging buffer and receive into the rest of it.
+      if (start > 0) {
+        memmove(staging.data(), &staging[start], end - start);
+        end -= start;
+        start = 0;
+      }
+      absl::StatusOr<size_t> n =
+          receiver->Receive(&staging[end], staging.size() - end, c);
+      if (!n.ok()) {
+        // This will happen when the bridge transmitter on the other
+        // side of the bridge terminates.
+        logger_.Log(toolbelt::LogLevel::kError,
+                    "Failed to read bridge message for %s: %s",
+                    channel_name.c_str(), n.status().ToString().c_str());
+        break;
+      }
+      end += *n;
+      if (receiver->NumDropped() != num_dropped) {
+        logger_.Log(toolbelt::LogLevel::kWarning,
+                    "Lost %d messages on bridge for %s",
+                    receiver->NumDropped() - num_dropped, channel_name.c_str());
+        num_dropped = receiver->NumDropped();
+      }
+      continue;
+    }
+
+    // The local channel might have been shrunk so ask for buffers big
+    // enough for the biggest frame.
+    int32_t max_size = 0;
+    for (const auto &frame : frames) {
+      max_size = std::max(max_size, frame.message_size);
+    }
+    absl::StatusOr<std::vector<void *>> buffers =
+        pub->GetMessageBuffers(frames.size(), max_size);
+    if (!buffers.ok()) {
       logger_.Log(toolbelt::LogLevel::kError,
-                  "Failed to get buffer for bridge subscriber %s: %s",
-                  channel_name.c_str(), buf.status().ToString().c_str());
+                  "Failed to get buffers for bridge subscriber %s: %s",
+                  channel_name.c_str(), buffers.status().ToString().c_str());
       break;
     }
-    if (*buf == nullptr) {
+    if (buffers->empty()) {
       // Can only happen if publisher is reliable.
       if (!pub->IsReliable()) {
         logger_.Log(toolbelt::LogLevel::kError,
@@ -839,11 +1558,11 @@ void Server::BridgeReceiverCoroutine(std::string channel_name,
       // Wait for a buffer to become available and try again.
       //
       // Since we don't read the network until we have a place to
-      // put the message, we will apply backpressure to the transmitter
-      // through buffering in the TCP stack.  When the transmitter's
-      // buffers fill up, it will stop sending until we can read the
-      // message.  The backpressure is thus propagated up the
-      // chain.
+      // put the messages we have already received, we will apply
+      // backpressure to the transmitter through buffering in the TCP
+      // stack.  When the transmitter's buffers fill up, it will stop
+      // sending until we can read the message.  The backpressure is
+      // thus propagated up the chain.
       if (absl::Status status = pub->Wait(); !status.ok()) {
         logger_.Log(toolbelt::LogLevel::kError,
                     "Failed to wait for reliable publisher: %s",
@@ -853,47 +1572,49 @@ void Server::BridgeReceiverCoroutine(std::string channel_name,
       continue;
     }
 
-    // Read the received message into the prefix that is located just
-    // before the message buffer.  When the message is published into
-    // the channel, we tell the client to omit the prefix so that it
-    // remains intact.  This means that the ordinal is carried intact
-    // over the bridge.
-    //
-    // The MessagePrefix struct contains 4 bytes of padding at offset 0.
-    // This is to allow SendMessage to use it for the length to avoid
-    // 2 sends to the network.  We need to receive into the address
-    // after the padding.
-    constexpr size_t kAdjustedPrefixLength =
-        sizeof(MessagePrefix) - sizeof(int32_t);
-    char *prefix_addr = reinterpret_cast<char *>(*buf) - sizeof(MessagePrefix);
-    char *after_padding = prefix_addr + sizeof(int32_t);
-
-    absl::StatusOr<ssize_t> n = bridge->ReceiveMessage(
-        after_padding, subscribed.slot_size() + kAdjustedPrefixLength, c);
-    if (!n.ok()) {
-      // This will happen when the bridge transmitter on the other
-      // side of the bridge terminates.
-      logger_.Log(toolbelt::LogLevel::kError,
-                  "Failed to read bridge message for %s: %s",
-                  channel_name.c_str(), n.status().ToString().c_str());
-      break;
-    }
+    // A reliable publisher might get fewer buffers than we asked for.  The
+    // rest of the frames stay in the staging buffer.
+    sizes.clear();
+    for (size_t i = 0; i < buffers->size(); i++) {
+      const Frame &frame = frames[i];
+      char *prefix_addr =
+          reinterpret_cast<char *>((*buffers)[i]) - sizeof(MessagePrefix);
+      if (frame.compressed) {
+        memcpy(prefix_addr + sizeof(int32_t), frame.data,
+               kAdjustedPrefixLength);
+        if (absl::Status status = BridgeDecompress(
+                codec, frame.data + kAdjustedPrefixLength,
+                frame.length - kAdjustedPrefixLength, (*buffers)[i],
+                frame.message_size);
+            !status.ok()) {
+          logger_.Log(toolbelt::LogLevel::kError, "%s for %s",
+                      status.ToString().c_str(), channel_name.c_str());
+          done = true;
+          break;
+        }
+      } else {
+        memcpy(prefix_addr + sizeof(int32_t), frame.data, frame.length);
+      }
 
-    // Set the kMessageBridged flag in the prefix so that this message isn't
-    // forwarded again over a bridge.
-    MessagePrefix *prefix = reinterpret_cast<MessagePrefix *>(prefix_addr);
-    if ((prefix->flags & kMessageActivate) != 0) {
-      // Since we have created a reliable publisher and it has sent an
-      // activation message through, we don't send another one.
-      continue;
+      // Set the kMessageBridged flag in the prefix so that this message
+      // isn't forwarded again over a bridge.
+      MessagePrefix *prefix = reinterpret_cast<MessagePrefix *>(prefix_addr);
+      prefix->flags = (prefix->flags & ~kMessageCompressed) | kMessageBridged;
+      // The ordinal is the one on the sending server.
+      SUBSPACE_TRACE(kBridgeReceive, pub->ChannelId(), prefix->ordinal,
+                     prefix->timestamp);
+      sizes.push_back(frame.message_size);
+    }
+    if (done) {
+      break;
     }
-    prefix->flags |= kMessageBridged;
+    start = frames[buffers->size() - 1].next;
 
-    absl::StatusOr<const Message> s =
-        pub->PublishMessageInternal(*n, /*omit_prefix=*/true);
+    absl::StatusOr<std::vector<Message>> s =
+        pub->PublishMessagesInternal(sizes, /*omit_prefix=*/true);
     if (!s.ok()) {
       logger_.Log(toolbelt::LogLevel::kError,
-                  "Failed to publish bridge message for %s: %s",
+                  "Failed to publish bridge messages for %s: %s",
                   channel_name.c_str(), s.status().ToString().c_str());
     }
   }
@@ -903,65 +1624,144 @@ void Server::BridgeReceiverCoroutine(std::string channel_name,
   // Socket has been closed, we're done.
 }
 
-void Server::SubscribeOverBridge(ServerChannel *channel, bool reliable,
-                                 toolbelt::InetAddress publisher) {
-  coroutines_.insert(std::make_unique<co::Coroutine>(
-      co_scheduler_,
-      [this, publisher, channel, reliable](co::Coroutine *c) {
-        BridgeReceiverCoroutine(channel->Name(), reliable, publisher, c);
+void Server::SubscribeOverBridge(const std::string &channel_name,
+                                 bool reliable,
+                                 toolbelt::InetAddress publisher,
+                                 bool latest_only, double max_rate) {
+  Spawn(
+      BridgeThread(),
+      [this, publisher, channel_name, reliable, latest_only,
+       max_rate](co::Coroutine *c) {
+        BridgeReceiverCoroutine(channel_name, reliable, publisher, latest_only,
+                                max_rate, c);
       },
-      absl::StrFormat("Bridge receiver for %s", channel->Name()).c_str()));
+      absl::StrFormat("Bridge receiver for %s", channel_name));
 }
 
 void Server::IncomingQuery(const Discovery::Query &query,
                            const toolbelt::InetAddress &sender) {
   // Someone is asking who publishes a channel.  Do I publish it?  If so,
   // send an Advertise out.
-  auto channel = channels_.find(query.channel_name());
-  if (channel != channels_.end()) {
-    if (channel->second->IsLocal() || channel->second->IsBridgePublisher()) {
+  std::unique_lock<std::mutex> lock = LockShard(query.channel_name());
+  ServerChannel *channel = FindChannel(query.channel_name());
+  if (channel != nullptr) {
+    if (channel->IsLocal() || channel->IsBridgePublisher()) {
       return;
     }
-    SendAdvertise(query.channel_name(), channel->second->IsReliable());
+    // Only the server asking needs the answer.
+    SendAdvertise(query.channel_name(), channel->IsReliable(), sender);
   }
 }
 
 void Server::IncomingAdvertise(const Discovery::Advertise &advertise,
                                const toolbelt::InetAddress &sender) {
+  RecordRemotePublisher(advertise.channel_name(), sender,
+                        advertise.reliable());
+
   // Do I want to subscribe to this channel?
-  auto channel = channels_.find(advertise.channel_name());
-  if (channel != channels_.end()) {
-    if (channel->second->IsBridged(sender, advertise.reliable())) {
-      // Already bridged to this sender.
-      logger_.Log(toolbelt::LogLevel::kDebug,
-                  "Channel %s is already bridged to this address",
-                  advertise.channel_name().c_str());
+  std::unique_lock<std::mutex> lock = LockShard(advertise.channel_name());
+  ServerChannel *channel = FindChannel(advertise.channel_name());
+  if (channel == nullptr) {
+    return;
+  }
+  int num_pubs, num_subs;
+  channel->CountUsers(num_pubs, num_subs);
+  if (num_subs > 0) {
+    BridgeFromPublisher(channel, sender, advertise.reliable());
+  }
+}
+
+void Server::BridgeFromPublisher(ServerChannel *channel,
+                                 const toolbelt::InetAddress &sender,
+                                 bool reliable) {
+  if (channel->IsBridged(sender, reliable)) {
+    // Already bridged to this sender.
+    logger_.Log(toolbelt::LogLevel::kDebug,
+                "Channel %s is already bridged to this address",
+                channel->Name().c_str());
+    return;
+  }
+  if (channel->IsBridgeSubscriber()) {
+    // All the local subscribers are bridge subscribers.
+    return;
+  }
+  channel->AddBridgedAddress(sender, reliable);
+
+  // A reliable subscription gets every message so it can't be
+  // decimated.
+  bool decimate = !reliable;
+  SubscribeOverBridge(channel->Name(), reliable, sender,
+                      decimate && channel->IsBridgeLatestOnly(),
+                      decimate ? channel->BridgeMaxRate() : 0);
+}
+
+void Server::RecordRemotePublisher(const std::string &channel_name,
+                                   const toolbelt::InetAddress &sender,
+                                   bool reliable) {
+  uint64_t now = toolbelt::Now();
+  std::lock_guard<std::mutex> lock(remote_publishers_lock_);
+  std::vector<RemotePublisher> &publishers = remote_publishers_[channel_name];
+  for (RemotePublisher &publisher : publishers) {
+    if (publisher.server == sender && publisher.reliable == reliable) {
+      publisher.last_seen = now;
       return;
     }
-    if (channel->second->IsBridgeSubscriber()) {
-      // All the local subscribers are bridge subscribers.
-      return;
+  }
+  publishers.push_back({sender, reliable, now});
+}
+
+void Server::ExpireRemotePublishers() {
+  uint64_t now = toolbelt::Now();
+  std::lock_guard<std::mutex> lock(remote_publishers_lock_);
+  for (auto it = remote_publishers_.begin(); it != remote_publishers_.end();) {
+    std::vector<RemotePublisher> &publishers = it->second;
+    publishers.erase(std::remove_if(publishers.begin(), publishers.end(),
+                                    [now](const RemotePublisher &publisher) {
+                                      return now - publisher.last_seen >
+                                             kRemotePublisherLifetime;
+                                    }),
+                     publishers.end());
+    if (publishers.empty()) {
+      remote_publishers_.erase(it++);
+    } else {
+      ++it;
     }
-    channel->second->AddBridgedAddress(sender, advertise.reliable());
+  }
+}
 
-    int num_pubs, num_subs;
-    channel->second->CountUsers(num_pubs, num_subs);
-    if (num_subs > 0) {
-      SubscribeOverBridge(channel->second.get(), advertise.reliable(), sender);
+bool Server::SubscribeToKnownPublishers(ServerChannel *channel) {
+  std::vector<RemotePublisher> publishers;
+  {
+    std::lock_guard<std::mutex> lock(remote_publishers_lock_);
+    auto it = remote_publishers_.find(channel->Name());
+    if (it == remote_publishers_.end()) {
+      return false;
     }
+    publishers = it->second;
   }
+  uint64_t now = toolbelt::Now();
+  bool found = false;
+  for (const RemotePublisher &publisher : publishers) {
+    if (now - publisher.last_seen > kRemotePublisherLifetime) {
+      continue;
+    }
+    BridgeFromPublisher(channel, publisher.server, publisher.reliable);
+    found = true;
+  }
+  return found;
 }
 
 void Server::IncomingSubscribe(const Discovery::Subscribe &subscribe,
                                const toolbelt::InetAddress &sender) {
   bool sub_reliable = subscribe.reliable();
 
-  auto channel = channels_.find(subscribe.channel_name());
-  if (channel != channels_.end()) {
-    if (channel->second->IsLocal()) {
+  std::unique_lock<std::mutex> lock = LockShard(subscribe.channel_name());
+  ServerChannel *channel = FindChannel(subscribe.channel_name());
+  if (channel != nullptr) {
+    if (channel->IsLocal()) {
       return;
     }
-    if (channel->second->IsBridged(sender, sub_reliable)) {
+    if (channel->IsBridged(sender, sub_reliable)) {
       // Already bridged to this sender.
       logger_.Log(toolbelt::LogLevel::kDebug,
                   "Channel %s is already bridged to this address",
@@ -969,10 +1769,9 @@ void Server::IncomingSubscribe(const Discovery::Subscribe &subscribe,
       return;
     }
     // We've been asked who publishes a public channel and we do.
-    ServerChannel *ch = channel->second.get();
-    bool pub_reliable = ch->IsReliable();
+    bool pub_reliable = channel->IsReliable();
 
-    channel->second->AddBridgedAddress(sender, sub_reliable);
+    channel->AddBridgedAddress(sender, sub_reliable);
 
     // The subscribe message contains the IP address and port of the TCP
     // socket listening for our connection for the channel.  Extract it.
@@ -982,28 +1781,91 @@ void Server::IncomingSubscribe(const Discovery::Subscribe &subscribe,
            sizeof(subscriber_ip));
     toolbelt::InetAddress subscriber_addr(subscriber_ip,
                                           subscribe.receiver().port());
-    coroutines_.insert(std::make_unique<co::Coroutine>(
-        co_scheduler_,
-        [this, pub_reliable, sub_reliable, subscriber_addr,
-         ch](co::Coroutine *c) {
-          BridgeTransmitterCoroutine(ch, pub_reliable, sub_reliable,
-                                     subscriber_addr, c);
+    std::optional<toolbelt::InetAddress> datagram_receiver;
+    if (subscribe.has_datagram_receiver()) {
+      in_addr datagram_ip;
+      memcpy(&datagram_ip, subscribe.datagram_receiver().ip_address().data(),
+             sizeof(datagram_ip));
+      datagram_receiver = toolbelt::InetAddress(
+          datagram_ip, subscribe.datagram_receiver().port());
+    }
+    BridgeDestination destination = {sender, subscriber_addr,
+                                     datagram_receiver};
+    if (!sub_reliable) {
+      destination.latest_only = subscribe.latest_only();
+      if (subscribe.max_rate() > 0) {
+        destination.min_interval =
+            static_cast<uint64_t>(1e9 / subscribe.max_rate());
+      }
+    }
+
+    // If there is already a transmitter for the channel, it sends to the
+    // new remote server too.
+    std::lock_guard<std::mutex> bridges_lock(bridges_lock_);
+    std::shared_ptr<BridgeFanout> &fanout =
+        bridges_[std::make_pair(channel->Name(), sub_reliable)];
+    if (fanout != nullptr) {
+      fanout->pending.push_back(std::move(destination));
+      fanout->trigger.Trigger();
+      return;
+    }
+    fanout = std::make_shared<BridgeFanout>();
+    if (absl::Status status = fanout->trigger.Open(); !status.ok()) {
+      logger_.Log(toolbelt::LogLevel::kError,
+                  "Failed to open bridge trigger for %s: %s",
+                  channel->Name().c_str(), status.ToString().c_str());
+      bridges_.erase(std::make_pair(channel->Name(), sub_reliable));
+      channel->RemoveBridgedAddress(sender, sub_reliable);
+      return;
+    }
+    fanout->pending.push_back(std::move(destination));
+
+    // The transmitter runs on another thread so it gets a copy of what it
+    // needs from the channel rather than the channel itself.
+    Spawn(
+        BridgeThread(),
+        [this, channel_name = channel->Name(), slot_size = channel->SlotSize(),
+         num_slots = channel->NumSlots(), pub_reliable, sub_reliable,
+         codec = channel->GetBridgeCodec(), fanout](co::Coroutine *c) {
+          BridgeTransmitterCoroutine(channel_name, slot_size, num_slots,
+                                     pub_reliable, sub_reliable, codec, fanout,
+                                     c);
         },
-        absl::StrFormat("Bridge transmitter for %s", channel->first).c_str()));
+        absl::StrFormat("Bridge transmitter for %s", channel->Name()));
   } else {
     logger_.Log(toolbelt::LogLevel::kDebug, "I don't publish channel %s",
                 subscribe.channel_name().c_str());
   }
 }
 
+// Advertise all the channels we publish every so often.  As many channels
+// as will fit are advertised in each message.
 void Server::GratuitousAdvertiseCoroutine(co::Coroutine *c) {
-  constexpr int kPeriodSecs = 5;
   for (;;) {
-    c->Sleep(kPeriodSecs);
-    for (auto &channel : channels_) {
-      if (!channel.second->IsLocal() && !channel.second->IsBridgePublisher()) {
-        SendAdvertise(channel.first, channel.second->IsReliable());
+    c->Sleep(kGratuitousAdvertisePeriodSecs);
+    ExpireRemotePublishers();
+
+    Discovery disc;
+    auto *batch = disc.mutable_advertise_batch();
+    ForEachChannel([this, &disc, batch](ServerChannel *channel) {
+      if (channel->IsLocal() || channel->IsBridgePublisher()) {
+        return;
+      }
+      auto *advertise = batch->add_channels();
+      advertise->set_channel_name(channel->Name());
+      advertise->set_reliable(channel->IsReliable());
+      // Leave room for the server id and port.
+      if (disc.ByteSizeLong() + server_id_.size() + 16 >
+          kDiscoveryBufferSize) {
+        Discovery::Advertise last = *advertise;
+        batch->mutable_channels()->RemoveLast();
+        SendDiscovery(disc, std::nullopt, "Advertise");
+        batch->clear_channels();
+        *batch->add_channels() = std::move(last);
       }
+    });
+    if (batch->channels_size() > 0) {
+      SendDiscovery(std::move(disc), std::nullopt, "Advertise");
     }
   }
 }
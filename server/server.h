@@ -16,7 +16,11 @@
 #include "toolbelt/bitset.h"
 #include "toolbelt/fd.h"
 #include "toolbelt/logging.h"
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <vector>
 
 namespace subspace {
@@ -26,10 +30,79 @@ namespace subspace {
 constexpr int64_t kServerReady = 1;
 constexpr int64_t kServerStopped = 2;
 
+// The channels are kept in shards selected by a hash of the channel name.
+// Each shard has a lock that is held while its channels are used so that
+// requests for channels in different shards can be handled in parallel
+// by a multi-threaded server.  The lock is never held across a coroutine
+// context switch.
+struct ChannelShard {
+  std::mutex lock;
+  absl::flat_hash_map<std::string, std::unique_ptr<ServerChannel>> channels;
+};
+
+// A coroutine scheduler and the thread running it.  Coroutines for the
+// scheduler can be started from other threads.  They are queued in
+// pending and created by the scheduler's spawner coroutine.
+struct ServerThread {
+  co::CoroutineScheduler *scheduler;
+  std::unique_ptr<co::CoroutineScheduler> owned_scheduler;
+  std::thread thread;
+  std::thread::id thread_id;
+
+  // All coroutines on the scheduler are owned by this set.  It's only used
+  // by the thread running the scheduler.
+  absl::flat_hash_set<std::unique_ptr<co::Coroutine>> coroutines;
+
+  std::mutex lock;
+  std::vector<std::pair<std::string, std::function<void(co::Coroutine *)>>>
+      pending;
+  TriggerFd wakeup;
+};
+
+// A remote server that subscribes to a channel over a bridge.
+struct BridgeDestination {
+  // The server's discovery address, which the channel records as bridged.
+  toolbelt::InetAddress server;
+  // Where it listens for the bridge connection.
+  toolbelt::InetAddress receiver;
+  // Where it can receive the messages as datagrams, if it can.
+  std::optional<toolbelt::InetAddress> datagram_receiver;
+  // For an unreliable subscription, the server can ask for only the newest
+  // message available to be sent and for no more than one message every
+  // min_interval nanoseconds.
+  bool latest_only = false;
+  uint64_t min_interval = 0;
+
+  bool IsDecimated() const { return latest_only || min_interval > 0; }
+};
+
+// The remote servers a channel is bridged to with the same subscriber
+// reliability.  One transmitter reads each message from the channel and
+// sends it to all of them.  Servers that subscribe while it is running are
+// added to pending, protected by the server's bridges_lock_, and the
+// trigger wakes the transmitter up to connect to them.
+struct BridgeFanout {
+  std::vector<BridgeDestination> pending;
+  TriggerFd trigger;
+};
+
+struct BridgeConnection;
+
+// A remote server that publishes a channel, as learned from its
+// advertisements.
+struct RemotePublisher {
+  toolbelt::InetAddress server;
+  bool reliable;
+  uint64_t last_seen; // When it last advertised the channel.
+};
+
 // The Subspace server.
-// This is a single-threaded, coroutine-based server that maintains shared
-// memory IPC channels and communicates with other servers to allow for
-// cross-computer IPC.
+// This is a coroutine-based server that maintains shared memory IPC
+// channels and communicates with other servers to allow for
+// cross-computer IPC.  By default it is single-threaded and everything
+// runs on the scheduler passed to the constructor.  It can also run the
+// client handlers on a number of scheduler threads and the bridges on a
+// thread of their own (see SetNumThreads).
 class Server {
 public:
   // The notify_fd is a file descriptor that the server will write to
@@ -42,6 +115,39 @@ public:
          int notify_fd = -1);
   ~Server();
   void SetLogLevel(const std::string &level) { logger_.SetLogLevel(level); }
+
+  // If a resized channel has had no messages too big for a smaller slot
+  // size for this many nanoseconds, the server shrinks its buffers.  Slots
+  // move to the smaller buffers as publishers reuse them and the bigger
+  // buffers are unmapped when no slots use them.  Publishers that don't
+  // pass a size to GetMessageBuffer must not rely on the slot size staying
+  // the same.  Zero (the default) disables shrinking.  Set this before
+  // calling Run.
+  void SetBufferShrinkWindow(uint64_t window_ns) {
+    buffer_shrink_window_ = window_ns;
+  }
+
+  // Run the client handlers on num_threads scheduler threads (including
+  // the one calling Run) and the bridge transmitters and receivers on
+  // a thread of their own.  The default is 1, which runs everything on
+  // the thread calling Run.  Set this before calling Run.
+  void SetNumThreads(int num_threads) {
+    num_threads_ = std::max(1, num_threads);
+  }
+  // Ask the servers that publish channels this server subscribes to over
+  // a bridge to send the messages of unreliable channels as UDP datagrams
+  // rather than over the TCP bridge connection.  Lost datagrams drop
+  // messages instead of holding up the ones after them.  Set this before
+  // calling Run.
+  void SetBridgeDatagrams(bool enable) { bridge_datagrams_ = enable; }
+
+  // Send discovery messages to these servers, at their discovery ports,
+  // rather than broadcasting them.  The interface then needn't support
+  // broadcast and can be loopback.  Set this before calling Run.
+  void SetPeers(std::vector<toolbelt::InetAddress> peers) {
+    peers_ = std::move(peers);
+  }
+
   absl::Status Run();
   void Stop();
 
@@ -49,39 +155,114 @@ private:
   friend class ClientHandler;
   friend class ServerChannel;
   static constexpr size_t kDiscoveryBufferSize = 1024;
+  // Maximum number of messages sent across a bridge in one system call.
+  static constexpr int kMaxBridgeBatch = 64;
+  // Minimum size of the buffer used to receive messages from a bridge.
+  static constexpr size_t kBridgeStagingSize = 64 * 1024;
+  // Number of channel shards.
+  static constexpr int kNumChannelShards = 16;
+  static constexpr char kChannelDirectoryName[] = "/subspace/ChannelDirectory";
+  // Servers advertise their channels this often.
+  static constexpr int kGratuitousAdvertisePeriodSecs = 5;
+  // A remote publisher is forgotten if it hasn't advertised a channel for
+  // this long.
+  static constexpr uint64_t kRemotePublisherLifetime =
+      3ULL * kGratuitousAdvertisePeriodSecs * 1000000000ULL;
 
   absl::Status HandleIncomingConnection(toolbelt::UnixSocket &listen_socket,
                                         co::Coroutine *c);
 
+  // Start a coroutine on the given thread.  This can be called from any
+  // thread.
+  void Spawn(ServerThread &thread, std::function<void(co::Coroutine *)> fn,
+             std::string name);
+  void SpawnerCoroutine(ServerThread &thread, co::Coroutine *c);
+  ServerThread &MainThread() { return *threads_[0]; }
+  // Thread for the bridge transmitters and receivers.
+  ServerThread &BridgeThread() { return *threads_.back(); }
+  absl::Status StartThreads();
+  void StopThreads();
+
+  // The shard holding a channel.  The shard lock must be held while
+  // using the channels in it.  FindChannel, CreateChannel and
+  // RemoveChannel expect the caller to hold the lock.
+  ChannelShard &ShardFor(const std::string &channel_name);
+  std::unique_lock<std::mutex> LockShard(const std::string &channel_name) {
+    return std::unique_lock<std::mutex>(ShardFor(channel_name).lock);
+  }
+  // Call fn for every channel, holding the lock for each shard in turn.
+  void ForEachChannel(const std::function<void(ServerChannel *)> &fn);
+
   // Create a channel in both process and shared memory.  For a placeholder
   // subscriber, the channel parameters are not known, so slot_size and
-  // num_slots will be zero.
-  absl::StatusOr<ServerChannel *> CreateChannel(const std::string &channel_name,
-                                                int slot_size, int num_slots,
-                                                std::string type);
+  // num_slots will be zero.  A lock-free channel can only have one
+  // publisher.
+  absl::StatusOr<ServerChannel *>
+  CreateChannel(const std::string &channel_name, int slot_size, int num_slots,
+                std::string type, const AllocationOptions &options = {});
   absl::Status RemapChannel(ServerChannel *channel, int slot_size,
-                            int num_slots);
+                            int num_slots,
+                            const AllocationOptions &options = {});
+  // Lock the buffers of a prefaulted channel into memory.
+  void LockChannelBuffers(ServerChannel *channel);
   ServerChannel *FindChannel(const std::string &channel_name);
   void RemoveChannel(ServerChannel *channel);
   void RemoveAllUsersFor(ClientHandler *handler);
+  // With several threads a client's disconnection can be handled after
+  // the requests of a client that connected later, such as a process that
+  // restarted and creates its channels again.  This is called before a
+  // publisher or subscriber is created and removes the users of the
+  // clients that have disconnected, and their channels if that leaves
+  // them empty, so that the requester doesn't see them.  The requester's
+  // own shard lock must not be held.
+  void RemoveDisconnectedClients(ClientHandler *requester);
   void CloseHandler(ClientHandler *handler);
   void ListenerCoroutine(toolbelt::UnixSocket& listen_socket, co::Coroutine *c);
   void ChannelDirectoryCoroutine(co::Coroutine *c);
-  void SendChannelDirectory();
+  // Record that a channel has been added, changed or removed so that it
+  // is sent in the next channel directory delta.
+  void SendChannelDirectory(const std::string &channel_name);
+  // Send a full channel directory next.
+  void SendChannelDirectorySnapshot();
   void StatisticsCoroutine(co::Coroutine *c);
+  void BufferShrinkCoroutine(co::Coroutine *c);
   void DiscoveryReceiverCoroutine(co::Coroutine *c);
   void PublisherCoroutine(co::Coroutine *c);
   void SendQuery(const std::string &channel_name);
-  void SendAdvertise(const std::string &channel_name, bool reliable);
-  void BridgeTransmitterCoroutine(ServerChannel *channel, bool pub_reliable,
-                                  bool sub_reliable,
-                                  toolbelt::InetAddress subscriber,
+  // Send an Advertise to the given server or, if there isn't one, to all
+  // of them.
+  void SendAdvertise(const std::string &channel_name, bool reliable,
+                     std::optional<toolbelt::InetAddress> to = std::nullopt);
+  void SendDiscovery(Discovery disc, std::optional<toolbelt::InetAddress> to,
+                     std::string what);
+  // Remember that sender publishes the channel.
+  void RecordRemotePublisher(const std::string &channel_name,
+                             const toolbelt::InetAddress &sender,
+                             bool reliable);
+  void ExpireRemotePublishers();
+  // Subscribe over bridges to the remote servers known to publish the
+  // channel.  Returns false if none are.  The caller must hold the
+  // channel's shard lock.
+  bool SubscribeToKnownPublishers(ServerChannel *channel);
+  void BridgeFromPublisher(ServerChannel *channel,
+                           const toolbelt::InetAddress &sender, bool reliable);
+  void BridgeTransmitterCoroutine(std::string channel_name, int slot_size,
+                                  int num_slots, bool pub_reliable,
+                                  bool sub_reliable, BridgeCodec codec,
+                                  std::shared_ptr<BridgeFanout> fanout,
                                   co::Coroutine *c);
+  absl::StatusOr<std::unique_ptr<BridgeConnection>>
+  OpenBridgeConnection(const BridgeDestination &destination,
+                       const std::string &channel_name, int slot_size,
+                       int num_slots, bool pub_reliable, bool sub_reliable,
+                       BridgeCodec codec, co::Coroutine *c);
   void BridgeReceiverCoroutine(std::string channel_name, bool sub_reliable,
                                toolbelt::InetAddress publisher,
+                               bool latest_only, double max_rate,
                                co::Coroutine *c);
-  void SubscribeOverBridge(ServerChannel *channel, bool reliable,
-                           toolbelt::InetAddress publisher);
+  void SubscribeOverBridge(const std::string &channel_name, bool reliable,
+                           toolbelt::InetAddress publisher, bool latest_only,
+                           double max_rate);
   void IncomingQuery(const Discovery::Query &query,
                      const toolbelt::InetAddress &sender);
   void IncomingAdvertise(const Discovery::Advertise &advertise,
@@ -93,6 +274,9 @@ private:
                                     bool reliable,
                                     toolbelt::InetAddress publisher,
                                     toolbelt::TCPSocket &receiver_listener,
+                                    const std::optional<toolbelt::InetAddress>
+                                        &datagram_receiver,
+                                    bool latest_only, double max_rate,
                                     char *buffer, size_t buffer_size,
                                     co::Coroutine *c);
   std::string socket_name_;
@@ -105,18 +289,45 @@ private:
   int discovery_peer_port_;
   bool local_;
   toolbelt::FileDescriptor notify_fd_;
+  uint64_t buffer_shrink_window_ = 0;
+  bool bridge_datagrams_ = false;
+  std::vector<toolbelt::InetAddress> peers_;
+
+  int num_threads_ = 1;
 
-  absl::flat_hash_map<std::string, std::unique_ptr<ServerChannel>> channels_;
+  std::vector<std::unique_ptr<ChannelShard>> shards_;
 
   SystemControlBlock *scb_;
   toolbelt::FileDescriptor scb_fd_;
+  std::mutex channel_ids_lock_;
   toolbelt::BitSet<kMaxChannels> channel_ids_;
   co::CoroutineScheduler &co_scheduler_;
 
-  // All coroutines are owned by this set.
-  absl::flat_hash_set<std::unique_ptr<co::Coroutine>> coroutines_;
+  // The first is the thread calling Run.  In a multi-threaded server
+  // there are num_threads_ threads for the client handlers followed by
+  // the bridge thread.
+  std::vector<std::unique_ptr<ServerThread>> threads_;
+  int next_handler_thread_ = 0;
+
+  // Protects client_handlers_.
+  std::mutex handlers_lock_;
 
   TriggerFd channel_directory_trigger_fd_;
+  // Protects the directory changes.
+  std::mutex directory_lock_;
+  absl::flat_hash_set<std::string> directory_changes_;
+  bool directory_snapshot_requested_ = false;
+
+  // The bridge transmitters, by channel name and subscriber reliability.
+  std::mutex bridges_lock_;
+  absl::flat_hash_map<std::pair<std::string, bool>,
+                      std::shared_ptr<BridgeFanout>>
+      bridges_;
+  // The remote servers publishing each channel.  Never lock a channel
+  // shard while holding this lock.
+  std::mutex remote_publishers_lock_;
+  absl::flat_hash_map<std::string, std::vector<RemotePublisher>>
+      remote_publishers_;
   toolbelt::InetAddress discovery_addr_;
   toolbelt::UDPSocket discovery_transmitter_;
   toolbelt::UDPSocket discovery_receiver_;
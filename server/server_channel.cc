@@ -5,42 +5,68 @@
 #include "server/server_channel.h"
 #include "absl/strings/str_format.h"
 #include "server/server.h"
+#include <algorithm>
 
 namespace subspace {
 
 ServerChannel::~ServerChannel() {
+  if (GetScb() == nullptr) {
+    // Never allocated, or the allocation failed.
+    return;
+  }
   // Clear the channel counters in the SCB.
   memset(&GetScb()->counters[GetChannelId()], 0, sizeof(ChannelCounters));
 }
 
-std::vector<toolbelt::FileDescriptor>
-ServerChannel::GetSubscriberTriggerFds() const {
-  std::vector<toolbelt::FileDescriptor> r;
+std::vector<UserTriggerFd> ServerChannel::GetSubscriberTriggerFds() const {
+  std::vector<UserTriggerFd> r;
   for (auto &user : users_) {
     if (user == nullptr) {
       continue;
     }
     if (user->IsSubscriber()) {
-      r.push_back(user->GetTriggerFd());
+      r.push_back({user->GetSerial(), user->GetTriggerFd()});
     }
   }
   return r;
 }
 
-std::vector<toolbelt::FileDescriptor>
+std::vector<UserTriggerFd>
 ServerChannel::GetReliablePublisherTriggerFds() const {
-  std::vector<toolbelt::FileDescriptor> r;
+  std::vector<UserTriggerFd> r;
   for (auto &user : users_) {
     if (user == nullptr) {
       continue;
     }
     if (user->IsPublisher() && user->IsReliable()) {
-      r.push_back(user->GetTriggerFd());
+      r.push_back({user->GetSerial(), user->GetTriggerFd()});
     }
   }
   return r;
 }
 
+void ServerChannel::AddToTriggerTable(User &user) {
+  uint32_t flags = 0;
+  if (user.IsSubscriber()) {
+    flags = kTriggerSubscriber;
+  } else if (user.IsReliable()) {
+    flags = kTriggerReliablePublisher;
+  } else {
+    // Unreliable publishers are never triggered.
+    return;
+  }
+  SetTriggerTableEntry(user.GetId(), user.GetTriggerFd().Fd(), flags,
+                       user.GetSerial());
+}
+
+void ServerChannel::RebuildTriggerTable() {
+  for (auto &user : users_) {
+    if (user != nullptr) {
+      AddToTriggerTable(*user);
+    }
+  }
+}
+
 absl::StatusOr<PublisherUser *>
 ServerChannel::AddPublisher(ClientHandler *handler, bool is_reliable,
                             bool is_local, bool is_bridge) {
@@ -55,6 +81,8 @@ ServerChannel::AddPublisher(ClientHandler *handler, bool is_reliable,
     return status;
   }
   PublisherUser *result = pub.get();
+  result->SetSerial(next_user_serial_++);
+  AddToTriggerTable(*result);
   if (*user_id >= users_.size()) {
     users_.resize(*user_id + 1);
   }
@@ -76,6 +104,8 @@ ServerChannel::AddSubscriber(ClientHandler *handler, bool is_reliable,
     return status;
   }
   SubscriberUser *result = sub.get();
+  result->SetSerial(next_user_serial_++);
+  AddToTriggerTable(*result);
   if (*user_id >= users_.size()) {
     users_.resize(*user_id + 1);
   }
@@ -101,7 +131,9 @@ void ServerChannel::RemoveUser(int user_id) {
       continue;
     }
     if (user->GetId() == user_id) {
-      CleanupSlots(user->GetId(), user->IsReliable());
+      CleanupSlots(user->GetId(), user->IsReliable(), user->IsPublisher());
+      // Clear the trigger table entry before the trigger fd is closed.
+      ClearTriggerTableEntry(user->GetId());
       user_ids_.Clear(user->GetId());
       RecordUpdate(user->IsPublisher(), /*add=*/false, user->IsReliable());
       if (user->IsPublisher()) {
@@ -119,7 +151,9 @@ void ServerChannel::RemoveAllUsersFor(ClientHandler *handler) {
       continue;
     }
     if (user->GetHandler() == handler) {
-      CleanupSlots(user->GetId(), user->IsReliable());
+      CleanupSlots(user->GetId(), user->IsReliable(), user->IsPublisher());
+      // Clear the trigger table entry before the trigger fd is closed.
+      ClearTriggerTableEntry(user->GetId());
       user_ids_.Clear(user->GetId());
       RecordUpdate(user->IsPublisher(), /*add=*/false, user->IsReliable());
       if (user->IsPublisher()) {
@@ -231,6 +265,15 @@ absl::Status ServerChannel::HasSufficientCapacity() const {
       max_shared_ptrs += sub->MaxSharedPtrs();
     }
   }
+  // Users of a placeholder channel might have IDs that don't fit in
+  // the slot owners table now that we know the number of slots.
+  for (auto &user : users_) {
+    if (user != nullptr && user->GetId() >= MaxSlotOwners()) {
+      return absl::InternalError(absl::StrFormat(
+          "user ID %d is too big for a channel with %d slots", user->GetId(),
+          NumSlots()));
+    }
+  }
   if ((num_pubs + num_subs + max_shared_ptrs + 1) <= (NumSlots() - 1)) {
     return absl::OkStatus();
   }
@@ -247,14 +290,52 @@ void ServerChannel::GetChannelInfo(subspace::ChannelInfo *info) {
   info->set_slot_size(SlotSize());
   info->set_num_slots(NumSlots());
   info->set_type(Type());
+  info->set_numa_node(NumaNode());
+}
+
+// Get the latency below which the given fraction of the counts in the
+// histogram lie.  This is the upper bound of the bucket it is in.
+static int64_t LatencyPercentile(const int64_t *buckets, int64_t total,
+                                 double fraction) {
+  int64_t rank = static_cast<int64_t>(fraction * total);
+  int64_t count = 0;
+  for (int i = 0; i < kNumLatencyBuckets; i++) {
+    count += buckets[i];
+    if (count > rank) {
+      return i == 0 ? 0 : int64_t(1) << i;
+    }
+  }
+  return int64_t(1) << (kNumLatencyBuckets - 1);
 }
 
 void ServerChannel::GetChannelStats(subspace::ChannelStats *stats) {
   stats->set_channel_name(Name());
-  int64_t total_bytes, total_messages;
-  GetStatsCounters(total_bytes, total_messages);
-  stats->set_total_bytes(total_bytes);
-  stats->set_total_messages(total_messages);
+  ChannelStatsSnapshot counters;
+  GetStatsCounters(counters);
+  stats->set_total_bytes(counters.total_bytes);
+  stats->set_total_messages(counters.total_messages);
+  stats->set_num_drops(counters.num_drops);
+  stats->set_num_reliable_stalls(counters.num_reliable_stalls);
+  stats->set_num_reliable_wakeups(counters.num_reliable_wakeups);
+  stats->set_num_slot_scans(counters.num_slot_scans);
+  stats->set_num_slots_scanned(counters.num_slots_scanned);
+  stats->set_num_triggers(counters.num_triggers);
+
+  // The percentiles are for the messages read since last time.
+  int64_t period[kNumLatencyBuckets];
+  int64_t total = 0;
+  for (int i = 0; i < kNumLatencyBuckets; i++) {
+    stats->add_latency_buckets(counters.latency_buckets[i]);
+    period[i] = counters.latency_buckets[i] - last_latency_buckets_[i];
+    last_latency_buckets_[i] = counters.latency_buckets[i];
+    total += period[i];
+  }
+  if (total > 0) {
+    stats->set_latency_p50_ns(LatencyPercentile(period, total, 0.5));
+    stats->set_latency_p90_ns(LatencyPercentile(period, total, 0.9));
+    stats->set_latency_p99_ns(LatencyPercentile(period, total, 0.99));
+    stats->set_latency_p999_ns(LatencyPercentile(period, total, 0.999));
+  }
 }
 
 ChannelCounters &ServerChannel::RecordUpdate(bool is_pub, bool add,
@@ -283,4 +364,33 @@ void ServerChannel::AddBuffer(int slot_size, toolbelt::FileDescriptor fd) {
   shared_memory_fds_.buffers.push_back({slot_size, std::move(fd)});
 }
 
+int32_t ServerChannel::ShrinkSlotSize(uint64_t now, uint64_t idle_window) {
+  // With size classes the smaller buffers are already in use.
+  if (HasSizeClasses() || shared_memory_fds_.buffers.empty()) {
+    return 0;
+  }
+  int32_t max_size = TakeMaxMessageSize();
+  if (shrink_window_start_ == 0) {
+    ResetShrinkWindow(now);
+  }
+  shrink_window_max_size_ = std::max(shrink_window_max_size_, max_size);
+  if (now - shrink_window_start_ < idle_window) {
+    return 0;
+  }
+  int32_t largest = shrink_window_max_size_;
+  ResetShrinkWindow(now);
+
+  // A resize doubles the slot size from the initial one until the message
+  // fits.  Find the smallest of those sizes that is big enough for all
+  // the messages in the window.
+  int32_t slot_size = shared_memory_fds_.buffers.front().slot_size;
+  if (slot_size <= 0) {
+    return 0;
+  }
+  while (slot_size < largest) {
+    slot_size *= 2;
+  }
+  return slot_size < SlotSize() ? slot_size : 0;
+}
+
 } // namespace subspace
\ No newline at end of file
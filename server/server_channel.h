@@ -8,12 +8,14 @@
 #include "absl/container/flat_hash_set.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "client/options.h"
 #include "common/channel.h"
 #include "common/triggerfd.h"
 #include "proto/subspace.pb.h"
 #include "toolbelt/bitset.h"
 #include "toolbelt/fd.h"
 #include "toolbelt/sockets.h"
+#include <array>
 #include <memory>
 #include <vector>
 
@@ -37,6 +39,10 @@ public:
   absl::Status Init() { return trigger_fd_.Open(); }
 
   int GetId() const { return id_; }
+  // Unique (per channel) serial number for the user.  Unlike the id this
+  // is never reused.
+  uint64_t GetSerial() const { return serial_; }
+  void SetSerial(uint64_t serial) { serial_ = serial; }
   toolbelt::FileDescriptor &GetPollFd() { return trigger_fd_.GetPollFd(); }
   toolbelt::FileDescriptor &GetTriggerFd() {
     return trigger_fd_.GetTriggerFd();
@@ -51,6 +57,7 @@ public:
 private:
   ClientHandler *handler_;
   int id_;
+  uint64_t serial_ = 0;
   TriggerFd trigger_fd_;
   bool is_reliable_;
   bool is_bridge_; // This is used to send or receive over a bridge.
@@ -110,6 +117,12 @@ template <typename H> inline H AbslHashValue(H h, const ChannelTransmitter &a) {
   return H::combine(std::move(addr_hash), a.reliable_);
 }
 
+// The trigger fd of a user and its serial number.
+struct UserTriggerFd {
+  uint64_t serial;
+  toolbelt::FileDescriptor fd;
+};
+
 // This is a channel maintained by the server.  The server creates the shared
 // memory for the channel and distributes the file descriptor associated with
 // it.
@@ -130,10 +143,14 @@ public:
                                                  int max_shared_ptrs);
 
   // Get the file descriptors for all subscriber triggers.
-  std::vector<toolbelt::FileDescriptor> GetSubscriberTriggerFds() const;
+  std::vector<UserTriggerFd> GetSubscriberTriggerFds() const;
 
   // Get the file descriptors for all reliable publisher triggers.
-  std::vector<toolbelt::FileDescriptor> GetReliablePublisherTriggerFds() const;
+  std::vector<UserTriggerFd> GetReliablePublisherTriggerFds() const;
+
+  // Write the trigger table entries for all the users, for when the CCB
+  // has been reallocated.
+  void RebuildTriggerTable();
 
   // Translate a user id into a User pointer.  The pointer ownership
   // is kept by the ServerChannel.
@@ -181,6 +198,21 @@ public:
   bool IsLocal() const;
   bool IsReliable() const;
 
+  BridgeCodec GetBridgeCodec() const { return bridge_codec_; }
+  void SetBridgeCodec(BridgeCodec codec) { bridge_codec_ = codec; }
+
+  // How the channel's subscribers want it decimated when it is bridged
+  // from another server.
+  bool IsBridgeLatestOnly() const { return bridge_latest_only_; }
+  double BridgeMaxRate() const { return bridge_max_rate_; }
+  bool IsBridgeDecimated() const {
+    return bridge_latest_only_ || bridge_max_rate_ > 0;
+  }
+  void SetBridgeDecimation(bool latest_only, double max_rate) {
+    bridge_latest_only_ = latest_only;
+    bridge_max_rate_ = max_rate;
+  }
+
   void SetSharedMemoryFds(SharedMemoryFds fds) {
     shared_memory_fds_ = std::move(fds);
   }
@@ -190,11 +222,34 @@ public:
   // Add a buffer (slot size and memory fd) to the shared_memory_fds.
   void AddBuffer(int slot_size, toolbelt::FileDescriptor fd);
 
+  // Called periodically by the server to see if the buffers of a resized
+  // channel can be made smaller again.  If an idle_window (in nanoseconds)
+  // has passed with no messages too big for a smaller slot size, returns
+  // that slot size.  Otherwise returns 0.
+  int32_t ShrinkSlotSize(uint64_t now, uint64_t idle_window);
+
+  // Start a new idle window.  Called when the channel is resized.
+  void ResetShrinkWindow(uint64_t now) {
+    shrink_window_start_ = now;
+    shrink_window_max_size_ = 0;
+  }
+
 private:
+  void AddToTriggerTable(User &user);
+
   std::vector<std::unique_ptr<User>> users_;
   toolbelt::BitSet<kMaxUsers> user_ids_;
   absl::flat_hash_set<ChannelTransmitter> bridged_publishers_;
   SharedMemoryFds shared_memory_fds_;
+  uint64_t next_user_serial_ = 1;
+  // Latency histogram at the last call to GetChannelStats.
+  std::array<int64_t, kNumLatencyBuckets> last_latency_buckets_ = {};
+  // Start of the current idle window and the biggest message seen in it.
+  uint64_t shrink_window_start_ = 0;
+  int32_t shrink_window_max_size_ = 0;
+  BridgeCodec bridge_codec_ = BridgeCodec::kNone;
+  bool bridge_latest_only_ = false;
+  double bridge_max_rate_ = 0;
 };
 } // namespace subspace
 #endif // __SERVER_SERVER_CHANNEL_H